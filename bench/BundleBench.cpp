@@ -0,0 +1,273 @@
+// Bundles a synthetic app, with thousands of dylibs, versioned symlinks, frameworks and a Qt
+// plugins layout, then verifies it, and reports the time, the external tool runs and the peak
+// memory of each step. Runs on MemoryFileSystem and on the host filesystem. With --micro, times
+// the path helpers and the otool parser on the paths and otool listings of that app instead.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <stdlib.h>
+
+#include "BundleContext.h"
+#include "DylibBundler.h"
+#include "FileSystem.h"
+#include "MachO.h"
+#include "Settings.h"
+#include "Synthetic.h"
+#include "Utils.h"
+#include "Verify.h"
+
+namespace {
+
+struct Options {
+    BundleShape shape;
+    bool memory = true;
+    bool posix = true;
+    bool micro = false;
+    // where the host filesystem run writes its tree, a new temporary directory by default
+    std::string posix_dir;
+    std::string tool_dir;
+};
+
+void showHelp()
+{
+    std::cout << "Usage: dylibbundler_bench [options]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --libraries <n>     Number of synthetic dylibs (default: 2000)" << std::endl;
+    std::cout << "  --frameworks <n>    Number of synthetic frameworks (default: 20)" << std::endl;
+    std::cout << "  --no-qt             Leave out the Qt frameworks and plugins" << std::endl;
+    std::cout << "  --memory-only       Only run on MemoryFileSystem" << std::endl;
+    std::cout << "  --posix-only        Only run on the host filesystem" << std::endl;
+    std::cout << "  --posix-dir <path>  Directory the host filesystem run writes to (default: a new one in $TMPDIR)" << std::endl;
+    std::cout << "  --tool-dir <path>   Run otool, install_name_tool and PlistBuddy from here on the host filesystem" << std::endl;
+    std::cout << "  --micro             Time filePrefix, stripPrefix, nextToken and the otool parser instead" << std::endl;
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Generate, bundle and verify the synthetic app on |file_system| under |root|, returns false if
+// bundling failed or the bundle has issues.
+bool run(const std::string& name, std::shared_ptr<FileSystem> file_system, const std::string& root, const Options& options)
+{
+    BundleContext context;
+    context.file_system = std::move(file_system);
+    BundleContext::Scope scope(context);
+
+    auto start = std::chrono::steady_clock::now();
+    std::string app = writeSyntheticBundle(*context.file_system, root, options.shape);
+    double generate_time = secondsSince(start);
+
+    Settings::quietOutput(true);
+    Settings::canPrompt(false);
+    Settings::canCreateDir(true);
+    Settings::bundleFrameworks(true);
+    if (context.file_system->IsHost())
+        Settings::toolDirectory(options.tool_dir);
+    Settings::appBundle(app);
+
+    // the progress lines of every file would drown the numbers
+    std::ostringstream log;
+    std::streambuf* stdout_buffer = std::cout.rdbuf(log.rdbuf());
+    start = std::chrono::steady_clock::now();
+    try {
+        bundle();
+    }
+    catch (const BundleError& error) {
+        std::cout.rdbuf(stdout_buffer);
+        std::cerr << name << ": bundling failed: " << error.what() << std::endl;
+        return false;
+    }
+    double bundle_time = secondsSince(start);
+    size_t bundle_processes = context.bundler.processes_spawned;
+    uint64_t bundle_memory = peakMemoryUsage();
+
+    // the JSON report is only shown when something is wrong
+    std::ostringstream report;
+    std::cout.rdbuf(report.rdbuf());
+    start = std::chrono::steady_clock::now();
+    bool verified = verifyBundle();
+    double verify_time = secondsSince(start);
+    std::cout.rdbuf(stdout_buffer);
+    if (!verified)
+        std::cerr << name << ": the bundle has issues:\n" << report.str();
+
+    std::cout << name << ": " << options.shape.libraries << " dylibs, " << options.shape.frameworks << " frameworks"
+              << (options.shape.qt ? ", Qt plugins" : "") << "\n"
+              << "  generate " << generate_time << " s\n"
+              << "  bundle   " << bundle_time << " s, " << bundle_processes << " external tool runs, peak memory "
+              << bundle_memory / (1024 * 1024) << " MB\n"
+              << "  verify   " << verify_time << " s, " << context.bundler.processes_spawned - bundle_processes
+              << " external tool runs, peak memory " << peakMemoryUsage() / (1024 * 1024) << " MB\n";
+    return verified;
+}
+
+// Time |task| over |rounds| passes of |count| calls, prints and returns the nanoseconds per call.
+double timeCalls(const char* name, size_t count, size_t rounds, const std::function<size_t()>& task)
+{
+    size_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t round=0; round<rounds; ++round)
+        checksum += task();
+    double ns = secondsSince(start) * 1e9 / double(count * rounds);
+    // the checksum keeps the calls from being optimized away
+    std::cout << "  " << name << " " << ns << " ns/call" << (checksum == 0 ? " (no work)" : "") << "\n";
+    return ns;
+}
+
+// The paths and otool -l listings dylibbundler handles for the synthetic app: every Mach-O file,
+// its install name, the install names it links and its rpaths. Returns false if parsing a listing
+// doesn't give back what the native reader found.
+bool micro(const Options& options)
+{
+    BundleContext context;
+    context.file_system = std::make_shared<MemoryFileSystem>();
+    BundleContext::Scope scope(context);
+    writeSyntheticBundle(*context.file_system, "/bench/", options.shape);
+
+    std::vector<std::string> files;
+    listFilesRecursive("/bench/", files);
+    std::vector<std::string> paths;
+    std::vector<std::string> listings;
+    std::vector<MachOSlice> expected;
+    for (const auto& file : files) {
+        std::vector<MachOSlice> slices;
+        if (!readMachO(file, slices) || slices.empty())
+            continue;
+        paths.push_back(file);
+        if (!slices[0].id.empty())
+            paths.push_back(slices[0].id);
+        for (const auto& dylib : slices[0].dylibs)
+            paths.push_back(dylib.name);
+        paths.insert(paths.end(), slices[0].rpaths.begin(), slices[0].rpaths.end());
+        listings.push_back(otoolListing(file, slices));
+        expected.push_back(std::move(slices[0]));
+    }
+    size_t listing_bytes = 0;
+    for (const auto& listing : listings)
+        listing_bytes += listing.size();
+
+    for (size_t n=0; n<listings.size(); ++n) {
+        MachOSlice parsed;
+        bool same = parseOtoolOutput(listings[n], parsed) && parsed.id == expected[n].id && parsed.rpaths == expected[n].rpaths
+            && parsed.dylibs.size() == expected[n].dylibs.size()
+            && std::equal(parsed.dylibs.begin(), parsed.dylibs.end(), expected[n].dylibs.begin(),
+                          [](const MachODylib& a, const MachODylib& b) { return a.cmd == b.cmd && a.name == b.name; });
+        if (!same) {
+            std::cerr << "micro: the otool parser disagrees with the native reader on:\n" << listings[n];
+            return false;
+        }
+    }
+
+    std::cout << "micro: " << paths.size() << " paths, " << listings.size() << " otool listings of "
+              << listing_bytes / listings.size() << " bytes on average\n";
+    const size_t rounds = 200;
+    timeCalls("filePrefix ", paths.size(), rounds, [&] {
+        size_t sum = 0;
+        for (const auto& path : paths)
+            sum += filePrefix(path).size();
+        return sum;
+    });
+    timeCalls("stripPrefix", paths.size(), rounds, [&] {
+        size_t sum = 0;
+        for (const auto& path : paths)
+            sum += stripPrefix(path).size();
+        return sum;
+    });
+    // per path, splitting it into all of its components
+    timeCalls("nextToken  ", paths.size(), rounds, [&] {
+        size_t sum = 0;
+        for (const auto& path : paths) {
+            std::string_view text = path;
+            std::string_view token;
+            while (nextToken(text, "/", token))
+                sum += token.size();
+        }
+        return sum;
+    });
+    const size_t listing_rounds = 20;
+    double ns = timeCalls("otool parse", listings.size(), listing_rounds, [&] {
+        size_t sum = 0;
+        for (const auto& listing : listings) {
+            MachOSlice parsed;
+            parseOtoolOutput(listing, parsed);
+            sum += parsed.dylibs.size();
+        }
+        return sum;
+    });
+    std::cout << "  otool listings parsed at " << double(listing_bytes) / listings.size() / ns * 1e3 << " MB/s\n";
+    return true;
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    Options options;
+    for (int i=1; i<argc; i++) {
+        const auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                std::cerr << argv[i] << " needs a value" << std::endl;
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (strcmp(argv[i], "--libraries") == 0)
+            options.shape.libraries = strtoul(value(), nullptr, 10);
+        else if (strcmp(argv[i], "--frameworks") == 0)
+            options.shape.frameworks = strtoul(value(), nullptr, 10);
+        else if (strcmp(argv[i], "--no-qt") == 0)
+            options.shape.qt = false;
+        else if (strcmp(argv[i], "--memory-only") == 0)
+            options.posix = false;
+        else if (strcmp(argv[i], "--posix-only") == 0)
+            options.memory = false;
+        else if (strcmp(argv[i], "--posix-dir") == 0)
+            options.posix_dir = value();
+        else if (strcmp(argv[i], "--tool-dir") == 0)
+            options.tool_dir = value();
+        else if (strcmp(argv[i], "--micro") == 0)
+            options.micro = true;
+        else {
+            showHelp();
+            return strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+
+    if (options.micro)
+        return micro(options) ? 0 : 1;
+
+    bool succeeded = true;
+    if (options.memory)
+        succeeded &= run("memory", std::make_shared<MemoryFileSystem>(), "/bench/", options);
+    if (options.posix) {
+        std::string root = options.posix_dir;
+        bool temporary = root.empty();
+        if (temporary) {
+            const char* tmpdir = getenv("TMPDIR");
+            std::string pattern = std::string(tmpdir != nullptr && *tmpdir != '\0' ? tmpdir : "/tmp") + "/dylibbundler_bench.XXXXXX";
+            if (mkdtemp(pattern.data()) == nullptr) {
+                std::cerr << "Cannot create a directory in " << pattern << std::endl;
+                return 1;
+            }
+            root = pattern;
+        }
+        if (root[root.size()-1] != '/')
+            root += "/";
+        std::shared_ptr<FileSystem> host = hostFileSystem();
+        succeeded &= run("posix", host, host->RealPath(root.substr(0, root.size()-1)) + "/", options);
+        if (temporary)
+            host->RemoveAll(root);
+    }
+    return succeeded ? 0 : 1;
+}
@@ -0,0 +1,350 @@
+#include "Synthetic.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "FileSystem.h"
+#include "MachO.h"
+
+namespace {
+
+constexpr uint32_t CPU_TYPE_X86_64 = 0x01000007;
+constexpr uint32_t CPU_TYPE_ARM64 = 0x0100000c;
+constexpr uint32_t CPU_SUBTYPE_X86_64_ALL = 3;
+
+// the load commands may grow up to the first section, like with -headerpad_max_install_names
+constexpr uint32_t kTextOffset = 0x1000;
+constexpr uint32_t kLinkeditOffset = 0x2000;
+constexpr uint32_t kFatAlignment = 14;
+
+class Writer {
+public:
+    explicit Writer(std::vector<unsigned char>& out) : out(out) {}
+
+    void U32(uint32_t value)
+    {
+        size_t pos = out.size();
+        out.resize(pos + 4);
+        write32(out.data() + pos, value, false);
+    }
+    void U64(uint64_t value)
+    {
+        size_t pos = out.size();
+        out.resize(pos + 8);
+        write64(out.data() + pos, value, false);
+    }
+    // a fixed size name field of a segment or section
+    void Name(const char* name)
+    {
+        size_t pos = out.size();
+        out.resize(pos + 16, 0);
+        memcpy(out.data() + pos, name, strlen(name));
+    }
+    // a path string of a load command, with its terminator and padded to 8 bytes
+    void Path(const std::string& path)
+    {
+        out.insert(out.end(), path.begin(), path.end());
+        out.resize(out.size() + 8 - path.size() % 8, 0);
+    }
+
+private:
+    std::vector<unsigned char>& out;
+};
+
+uint32_t pathCommandSize(size_t fixed_size, const std::string& path)
+{
+    return static_cast<uint32_t>(fixed_size + ((path.size() + 8) & ~size_t(7)));
+}
+
+std::vector<unsigned char> thinMachO(const SyntheticSlice& slice, uint32_t cputype, uint32_t cpusubtype)
+{
+    std::vector<unsigned char> commands;
+    Writer writer(commands);
+    uint32_t ncmds = 0;
+
+    writer.U32(LC_SEGMENT_64);
+    writer.U32(72 + 80);
+    writer.Name("__TEXT");
+    writer.U64(0);
+    writer.U64(kTextOffset + 16);
+    writer.U64(0);
+    writer.U64(kTextOffset + 16);
+    writer.U32(5);
+    writer.U32(5);
+    writer.U32(1);
+    writer.U32(0);
+    writer.Name("__text");
+    writer.Name("__TEXT");
+    writer.U64(kTextOffset);
+    writer.U64(16);
+    writer.U32(kTextOffset);
+    writer.U32(4);
+    for (uint32_t value : {0u, 0u, 0x80000400u, 0u, 0u, 0u})
+        writer.U32(value);
+    ++ncmds;
+
+    const auto dylib = [&](uint32_t cmd, const std::string& name) {
+        writer.U32(cmd);
+        writer.U32(pathCommandSize(24, name));
+        writer.U32(24);
+        writer.U32(2);
+        writer.U32(0x10000);
+        writer.U32(0x10000);
+        writer.Path(name);
+        ++ncmds;
+    };
+    if (!slice.id.empty())
+        dylib(LC_ID_DYLIB, slice.id);
+    for (const auto& name : slice.dylibs)
+        dylib(LC_LOAD_DYLIB, name);
+    for (const auto& rpath : slice.rpaths) {
+        writer.U32(LC_RPATH);
+        writer.U32(pathCommandSize(12, rpath));
+        writer.U32(12);
+        writer.Path(rpath);
+        ++ncmds;
+    }
+
+    writer.U32(LC_SEGMENT_64);
+    writer.U32(72);
+    writer.Name("__LINKEDIT");
+    writer.U64(0x100000);
+    writer.U64(0x4000);
+    writer.U64(kLinkeditOffset);
+    writer.U64(8);
+    writer.U32(1);
+    writer.U32(1);
+    writer.U32(0);
+    writer.U32(0);
+    writer.U32(LC_SYMTAB);
+    writer.U32(24);
+    writer.U32(kLinkeditOffset);
+    writer.U32(0);
+    writer.U32(kLinkeditOffset);
+    writer.U32(8);
+    ncmds += 2;
+
+    std::vector<unsigned char> out;
+    Writer header(out);
+    header.U32(MH_MAGIC_64);
+    header.U32(cputype);
+    header.U32(cpusubtype);
+    header.U32(slice.filetype);
+    header.U32(ncmds);
+    header.U32(static_cast<uint32_t>(commands.size()));
+    // MH_NOUNDEFS | MH_DYLDLINK | MH_TWOLEVEL
+    header.U32(0x85);
+    header.U32(0);
+    out.insert(out.end(), commands.begin(), commands.end());
+    out.resize(kTextOffset, 0);
+    // ret, int3...
+    out.push_back(0xc3);
+    out.resize(kTextOffset + 16, 0xcc);
+    out.resize(kLinkeditOffset + 8, 0);
+    return out;
+}
+
+void writeFile(FileSystem& file_system, const std::string& path, const std::vector<unsigned char>& data, uint32_t mode = 0755)
+{
+    file_system.CreateDirectories(path.substr(0, path.rfind('/')));
+    file_system.WriteFile(path, data.data(), data.size(), mode);
+}
+
+void writeText(FileSystem& file_system, const std::string& path, const std::string& text)
+{
+    writeFile(file_system, path, std::vector<unsigned char>(text.begin(), text.end()), 0644);
+}
+
+std::string infoPlist(const std::string& executable)
+{
+    return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+           "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+           "<plist version=\"1.0\">\n<dict>\n"
+           "    <key>CFBundleExecutable</key>\n    <string>" + executable + "</string>\n"
+           "</dict>\n</plist>\n";
+}
+
+// |directory|/|name|.framework with a single version, returns the install name of its binary
+std::string writeFramework(FileSystem& file_system, const std::string& directory, const std::string& name,
+                           const std::string& version, std::vector<std::string> dylibs, bool universal)
+{
+    std::string root = directory + name + ".framework/";
+    std::string binary = root + "Versions/" + version + "/" + name;
+    SyntheticSlice slice;
+    slice.filetype = MH_DYLIB;
+    slice.id = binary;
+    slice.dylibs = std::move(dylibs);
+    writeFile(file_system, binary, syntheticMachO(slice, universal));
+    writeText(file_system, root + "Versions/" + version + "/Resources/Info.plist", infoPlist(name));
+    file_system.CreateSymlink(version, root + "Versions/Current");
+    file_system.CreateSymlink("Versions/Current/" + name, root + name);
+    file_system.CreateSymlink("Versions/Current/Resources", root + "Resources");
+    return binary;
+}
+
+} // namespace
+
+std::vector<unsigned char> syntheticMachO(const SyntheticSlice& slice, bool universal)
+{
+    if (!universal)
+        return thinMachO(slice, CPU_TYPE_ARM64, 0);
+
+    std::vector<std::vector<unsigned char>> slices;
+    slices.push_back(thinMachO(slice, CPU_TYPE_X86_64, CPU_SUBTYPE_X86_64_ALL));
+    slices.push_back(thinMachO(slice, CPU_TYPE_ARM64, 0));
+    std::vector<unsigned char> out;
+    const auto big32 = [&](uint32_t value) {
+        size_t pos = out.size();
+        out.resize(pos + 4);
+        write32(out.data() + pos, value, !(__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__));
+    };
+    big32(FAT_MAGIC);
+    big32(static_cast<uint32_t>(slices.size()));
+    uint32_t offset = 1u << kFatAlignment;
+    for (const auto& data : slices) {
+        big32(read32(data.data() + 4, false));
+        big32(read32(data.data() + 8, false));
+        big32(offset);
+        big32(static_cast<uint32_t>(data.size()));
+        big32(kFatAlignment);
+        offset += (static_cast<uint32_t>(data.size()) + (1u << kFatAlignment) - 1) & ~((1u << kFatAlignment) - 1);
+    }
+    for (const auto& data : slices) {
+        out.resize((out.size() + (1u << kFatAlignment) - 1) & ~size_t((1u << kFatAlignment) - 1), 0);
+        out.insert(out.end(), data.begin(), data.end());
+    }
+    return out;
+}
+
+std::string otoolListing(const std::string& path, const std::vector<MachOSlice>& slices)
+{
+    std::string out;
+    char line[128];
+    for (const auto& slice : slices) {
+        if (slices.size() > 1)
+            out += path + " (architecture " + archName(slice.cputype, slice.cpusubtype) + "):\n";
+        else
+            out += path + ":\n";
+        size_t n = 0;
+        const auto command = [&](const char* cmd, uint32_t size) {
+            snprintf(line, sizeof(line), "Load command %zu\n      cmd %s\n  cmdsize %u\n", n++, cmd, size);
+            out += line;
+        };
+        const auto segment = [&](const char* name, uint64_t vmaddr, uint64_t vmsize, uint64_t fileoff, uint64_t filesize,
+                                 uint32_t prot, uint32_t nsects) {
+            command("LC_SEGMENT_64", 72 + 80 * nsects);
+            snprintf(line, sizeof(line), "  segname %s\n   vmaddr 0x%016llx\n   vmsize 0x%016llx\n", name,
+                     static_cast<unsigned long long>(vmaddr), static_cast<unsigned long long>(vmsize));
+            out += line;
+            snprintf(line, sizeof(line), "  fileoff %llu\n filesize %llu\n  maxprot 0x%08x\n initprot 0x%08x\n",
+                     static_cast<unsigned long long>(fileoff), static_cast<unsigned long long>(filesize), prot, prot);
+            out += line;
+            snprintf(line, sizeof(line), "   nsects %u\n    flags 0x0\n", nsects);
+            out += line;
+        };
+        const auto dylib = [&](const char* cmd, const std::string& name) {
+            command(cmd, pathCommandSize(24, name));
+            out += "         name " + name + " (offset 24)\n"
+                   "   time stamp 2 Thu Jan  1 00:00:02 1970\n"
+                   "      current version 1.0.0\n"
+                   "compatibility version 1.0.0\n";
+        };
+
+        segment("__TEXT", 0, kTextOffset + 16, 0, kTextOffset + 16, 5, 1);
+        snprintf(line, sizeof(line), "Section\n  sectname __text\n   segname __TEXT\n      addr 0x%016x\n      size 0x%016x\n",
+                 kTextOffset, 16);
+        out += line;
+        snprintf(line, sizeof(line), "    offset %u\n     align 2^2 (4)\n    reloff 0\n    nreloc 0\n     flags 0x80000400\n"
+                 " reserved1 0\n reserved2 0\n", kTextOffset);
+        out += line;
+        if (!slice.id.empty())
+            dylib("LC_ID_DYLIB", slice.id);
+        for (const auto& entry : slice.dylibs) {
+            switch (entry.cmd) {
+            case LC_LOAD_WEAK_DYLIB: dylib("LC_LOAD_WEAK_DYLIB", entry.name); break;
+            case LC_REEXPORT_DYLIB: dylib("LC_REEXPORT_DYLIB", entry.name); break;
+            case LC_LOAD_UPWARD_DYLIB: dylib("LC_LOAD_UPWARD_DYLIB", entry.name); break;
+            default: dylib("LC_LOAD_DYLIB", entry.name); break;
+            }
+        }
+        for (const auto& rpath : slice.rpaths) {
+            command("LC_RPATH", pathCommandSize(12, rpath));
+            out += "         path " + rpath + " (offset 12)\n";
+        }
+        segment("__LINKEDIT", 0x100000, 0x4000, kLinkeditOffset, 8, 1, 0);
+        command("LC_SYMTAB", 24);
+        snprintf(line, sizeof(line), "     symoff %u\n      nsyms 0\n     stroff %u\n    strsize 8\n", kLinkeditOffset, kLinkeditOffset);
+        out += line;
+    }
+    return out;
+}
+
+std::string writeSyntheticBundle(FileSystem& file_system, const std::string& root, const BundleShape& shape)
+{
+    const std::string system = "/usr/lib/libSystem.B.dylib";
+    std::string lib_dir = root + "deps/lib/";
+    const auto library_name = [&](size_t n) {
+        return "libbench" + std::to_string(n) + ".dylib";
+    };
+
+    // the odd ones are linked through @rpath, found with the rpath of their dependent
+    const auto install_name = [&](size_t n) {
+        return n % 2 == 1 ? "@rpath/" + library_name(n) : lib_dir + library_name(n);
+    };
+    for (size_t n=0; n<shape.libraries; ++n) {
+        SyntheticSlice slice;
+        slice.filetype = MH_DYLIB;
+        slice.id = install_name(n);
+        slice.dylibs.push_back(system);
+        for (size_t child : {2 * n + 1, 2 * n + 2}) {
+            if (child < shape.libraries)
+                slice.dylibs.push_back(install_name(child));
+        }
+        slice.rpaths.push_back(lib_dir);
+        std::string name = library_name(n);
+        if (n % 10 != 0) {
+            writeFile(file_system, lib_dir + name, syntheticMachO(slice));
+            continue;
+        }
+        std::string versioned = "libbench" + std::to_string(n) + ".1.0.dylib";
+        writeFile(file_system, lib_dir + versioned, syntheticMachO(slice));
+        file_system.CreateSymlink(versioned, lib_dir + name);
+    }
+
+    SyntheticSlice app;
+    app.filetype = MH_EXECUTE;
+    app.dylibs.push_back(system);
+    if (shape.libraries > 0)
+        app.dylibs.push_back(install_name(0));
+    app.rpaths.push_back(lib_dir);
+    for (size_t n=0; n<shape.frameworks; ++n) {
+        std::vector<std::string> dylibs{system};
+        if (n < shape.libraries)
+            dylibs.push_back(lib_dir + library_name(n));
+        app.dylibs.push_back(writeFramework(file_system, root + "deps/Frameworks/", "Bench" + std::to_string(n), "A", dylibs, false));
+    }
+
+    if (shape.qt) {
+        std::string qt_lib = root + "qt/lib/";
+        std::string qt_core = writeFramework(file_system, qt_lib, "QtCore", "5", {system}, true);
+        std::string qt_gui = writeFramework(file_system, qt_lib, "QtGui", "5", {system, qt_core}, true);
+        app.dylibs.push_back(qt_core);
+        app.dylibs.push_back(qt_gui);
+        for (const char* plugin : {"platforms/libqcocoa.dylib", "styles/libqmacstyle.dylib", "imageformats/libqgif.dylib",
+                                   "imageformats/libqjpeg.dylib", "iconengines/libqsvgicon.dylib",
+                                   "printsupport/libcocoaprintersupport.dylib", "platforminputcontexts/libqtvirtualkeyboardplugin.dylib"}) {
+            SyntheticSlice slice;
+            slice.filetype = MH_DYLIB;
+            slice.id = strchr(plugin, '/') + 1;
+            slice.dylibs = {system, qt_core, qt_gui};
+            writeFile(file_system, root + "qt/plugins/" + plugin, syntheticMachO(slice, true));
+        }
+    }
+
+    std::string bundle = root + "Bench.app/";
+    writeFile(file_system, bundle + "Contents/MacOS/Bench", syntheticMachO(app));
+    writeText(file_system, bundle + "Contents/Info.plist", infoPlist("Bench"));
+    file_system.CreateDirectories(bundle + "Contents/Resources");
+    file_system.CreateDirectories(bundle + "Contents/PlugIns");
+    return bundle;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_BENCH_SYNTHETIC_H
+#define DYLIBBUNDLER_BENCH_SYNTHETIC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class FileSystem;
+struct MachOSlice;
+
+// one architecture of a synthetic Mach-O file: a header, a __TEXT segment with room for the load
+// commands to grow, and an empty __LINKEDIT
+struct SyntheticSlice {
+    uint32_t filetype = 0;
+    std::string id;
+    std::vector<std::string> dylibs;
+    std::vector<std::string> rpaths;
+};
+
+// a thin arm64 file, or a universal arm64 and x86_64 one if |universal|
+std::vector<unsigned char> syntheticMachO(const SyntheticSlice& slice, bool universal = false);
+
+// What otool -l prints for a synthetic file at |path| read into |slices|: every load command in
+// file order, with the segment, section and version lines the real tool shows.
+std::string otoolListing(const std::string& path, const std::vector<MachOSlice>& slices);
+
+// What the synthetic bundle holds. Every library links two others, so they form a tree rooted at
+// the app, and one in ten is reached through a versioned symlink. Qt is universal, the rest is
+// arm64 only.
+struct BundleShape {
+    size_t libraries = 2000;
+    size_t frameworks = 20;
+    // QtCore and QtGui frameworks with a plugins directory next to their lib directory
+    bool qt = true;
+};
+
+// Write an app bundle and the dependencies it links under |root|, returns the app bundle path.
+std::string writeSyntheticBundle(FileSystem& file_system, const std::string& root, const BundleShape& shape);
+
+#endif
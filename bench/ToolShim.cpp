@@ -0,0 +1,105 @@
+// Stand-ins for otool, install_name_tool and PlistBuddy, run under those names from the
+// directory given to --tool-dir. They answer the commands dylibbundler runs with its own native
+// readers and writers, so the external tool code paths can be exercised on synthetic Mach-O
+// files where the real tools don't exist.
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "FileSystem.h"
+#include "MachO.h"
+#include "MachOEdit.h"
+#include "Plist.h"
+#include "Synthetic.h"
+#include "Utils.h"
+
+namespace {
+
+// otool -l <file>
+int otool(int argc, const char* argv[])
+{
+    if (argc != 3 || strcmp(argv[1], "-l") != 0) {
+        std::cerr << "usage: otool -l <file>\n";
+        return 1;
+    }
+    std::string path = argv[2];
+    std::vector<MachOSlice> slices;
+    if (!readMachO(path, slices) || slices.empty()) {
+        std::cerr << "otool: can't open file: " << path << "\n";
+        return 1;
+    }
+
+    std::cout << otoolListing(path, slices);
+    return 0;
+}
+
+// install_name_tool [-id name] [-change old new] [-add_rpath path] [-delete_rpath path] [-rpath old new] <file>
+int installNameTool(int argc, const char* argv[])
+{
+    LoadCommandEdits edits;
+    int n = 1;
+    for (; n < argc - 1; ++n) {
+        std::string option = argv[n];
+        if (option == "-id")
+            edits.id = argv[++n];
+        else if (option == "-change" && n + 2 < argc - 1) {
+            edits.install_names.emplace_back(argv[n+1], argv[n+2]);
+            n += 2;
+        }
+        else if (option == "-add_rpath")
+            edits.rpaths.emplace_back("", argv[++n]);
+        else if (option == "-delete_rpath")
+            edits.rpaths.emplace_back(argv[++n], "");
+        else if (option == "-rpath" && n + 2 < argc - 1) {
+            edits.rpaths.emplace_back(argv[n+1], argv[n+2]);
+            n += 2;
+        }
+        else
+            break;
+    }
+    if (n != argc - 1) {
+        std::cerr << "usage: install_name_tool [-id name] [-change old new] [-add_rpath path] [-delete_rpath path] [-rpath old new] <file>\n";
+        return 1;
+    }
+    if (editLoadCommands(argv[n], edits) == EditResult::Unsupported) {
+        std::cerr << "install_name_tool: changing the load commands of " << argv[n] << " needs more header padding\n";
+        return 1;
+    }
+    return 0;
+}
+
+// PlistBuddy -c 'Print :Key' <file>
+int plistBuddy(int argc, const char* argv[])
+{
+    if (argc != 4 || strcmp(argv[1], "-c") != 0 || strncmp(argv[2], "Print :", 7) != 0) {
+        std::cerr << "usage: PlistBuddy -c 'Print :Key' <file>\n";
+        return 1;
+    }
+    std::vector<unsigned char> data;
+    std::string value;
+    if (fileSystem().ReadFile(argv[3], data))
+        value = plistString(data, argv[2] + 7);
+    if (value.empty()) {
+        std::cerr << "Print: Entry, \"" << (argv[2] + 7) << "\", Does Not Exist\n";
+        return 1;
+    }
+    std::cout << value << "\n";
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, const char* argv[])
+{
+    std::string name(stripPrefix(argv[0]));
+    if (name == "otool")
+        return otool(argc, argv);
+    if (name == "install_name_tool")
+        return installNameTool(argc, argv);
+    if (name == "PlistBuddy")
+        return plistBuddy(argc, argv);
+    std::cerr << name << ": run this as otool, install_name_tool or PlistBuddy\n";
+    return 1;
+}
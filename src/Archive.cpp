@@ -0,0 +1,587 @@
+#include "Archive.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <vector>
+
+#include "BundleContext.h"
+#include "FileSystem.h"
+#include "Settings.h"
+
+namespace {
+
+constexpr size_t kBufferSize = 256 * 1024;
+
+struct ArchiveEntry {
+    std::string path;
+    // name inside the archive, directories end with '/'
+    std::string name;
+    FileInfo info;
+    std::string link_target;
+};
+
+// |path| and everything below it, directories before their contents and sorted by name
+void collectEntries(const std::string& path, const std::string& name, std::vector<ArchiveEntry>& entries)
+{
+    FileSystem& file_system = fileSystem();
+    ArchiveEntry entry;
+    entry.path = path;
+    entry.name = name;
+    entry.info = file_system.LinkStatus(path);
+    if (entry.info.type == FileType::Missing)
+        throw BundleError("Cannot read " + path + " to archive it");
+
+    if (entry.info.type == FileType::Symlink) {
+        if (!file_system.ReadLink(path, entry.link_target))
+            throw BundleError("Cannot read symlink " + path);
+        entries.push_back(entry);
+        return;
+    }
+    if (entry.info.type != FileType::Directory) {
+        if (entry.info.type == FileType::Regular)
+            entries.push_back(entry);
+        return;
+    }
+
+    entry.name += "/";
+    entries.push_back(entry);
+    std::vector<std::string> children;
+    if (!file_system.ListDirectory(path, children))
+        throw BundleError("Cannot list " + path + " to archive it");
+    std::sort(children.begin(), children.end());
+    for (const auto& child : children)
+        collectEntries(path + "/" + child, name + "/" + child, entries);
+}
+
+// st_mode of |info|, with the file type bits archives expect
+uint32_t unixMode(const FileInfo& info)
+{
+    uint32_t type = info.type == FileType::Directory ? 0040000 : info.type == FileType::Symlink ? 0120000 : 0100000;
+    return type | info.mode;
+}
+
+uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> result{};
+        for (uint32_t n=0; n<256; ++n) {
+            uint32_t c = n;
+            for (int k=0; k<8; ++k)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            result[n] = c;
+        }
+        return result;
+    }();
+    crc = ~crc;
+    for (size_t n=0; n<size; ++n)
+        crc = table[(crc ^ data[n]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void put16(std::vector<unsigned char>& out, uint32_t value)
+{
+    out.push_back(value & 0xff);
+    out.push_back((value >> 8) & 0xff);
+}
+
+void put32(std::vector<unsigned char>& out, uint32_t value)
+{
+    put16(out, value & 0xffff);
+    put16(out, value >> 16);
+}
+
+// Raw deflate (RFC 1951) with the fixed Huffman codes and greedy matching on a single hash chain
+// entry, like the fastest zlib levels: a lot faster than a full encoder, and binaries still shrink
+// by a third or more.
+class Deflater {
+public:
+    static void Compress(const unsigned char* data, size_t size, std::vector<unsigned char>& out)
+    {
+        static const Tables tables;
+        Deflater deflater(out);
+        // a single final block with the fixed codes (BTYPE 01)
+        deflater.Bits(1, 1);
+        deflater.Bits(1, 2);
+
+        std::vector<uint32_t> head(kHashSize, UINT32_MAX);
+        size_t position = 0;
+        while (position < size) {
+            size_t length = 0;
+            size_t distance = 0;
+            if (position + kMinMatch <= size) {
+                uint32_t hash = Hash(data + position);
+                uint32_t candidate = head[hash];
+                head[hash] = static_cast<uint32_t>(position);
+                if (candidate != UINT32_MAX && position - candidate <= kWindowSize) {
+                    size_t limit = std::min<size_t>(kMaxMatch, size - position);
+                    while (length < limit && data[candidate + length] == data[position + length])
+                        ++length;
+                    distance = position - candidate;
+                }
+            }
+            if (length < kMinMatch) {
+                deflater.Symbol(tables, data[position]);
+                ++position;
+                continue;
+            }
+
+            uint32_t length_symbol = tables.length_symbol[length];
+            deflater.Symbol(tables, length_symbol);
+            deflater.Bits(static_cast<uint32_t>(length - kLengthBase[length_symbol - 257]), kLengthExtra[length_symbol - 257]);
+            uint32_t distance_code = distance <= 256 ? tables.distance_code[distance - 1] : tables.distance_code[256 + ((distance - 1) >> 7)];
+            deflater.Bits(tables.distance_reversed[distance_code], 5);
+            deflater.Bits(static_cast<uint32_t>(distance - kDistanceBase[distance_code]), kDistanceExtra[distance_code]);
+
+            // the positions inside the match are only hashed near its end, to keep up the speed
+            size_t end = position + length;
+            for (size_t n = std::max(position + 1, end - std::min<size_t>(end - position - 1, 3)); n < end && n + kMinMatch <= size; ++n)
+                head[Hash(data + n)] = static_cast<uint32_t>(n);
+            position = end;
+        }
+        deflater.Symbol(tables, 256);
+        deflater.Flush();
+    }
+
+private:
+    static constexpr size_t kMinMatch = 4;
+    static constexpr size_t kMaxMatch = 258;
+    static constexpr size_t kWindowSize = 32768;
+    static constexpr uint32_t kHashBits = 15;
+    static constexpr uint32_t kHashSize = 1u << kHashBits;
+    static constexpr uint16_t kLengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+                                                 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static constexpr uint8_t kLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static constexpr uint16_t kDistanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+                                                   1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+    static constexpr uint8_t kDistanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+                                                   11, 11, 12, 12, 13, 13};
+
+    // the fixed codes, bit reversed since deflate writes Huffman codes from their top bit
+    struct Tables {
+        uint16_t code[288];
+        uint8_t code_bits[288];
+        uint16_t length_symbol[kMaxMatch + 1];
+        uint8_t distance_code[512];
+        uint8_t distance_reversed[30];
+
+        Tables()
+        {
+            for (uint32_t symbol=0; symbol<288; ++symbol) {
+                uint32_t value;
+                uint8_t bits;
+                if (symbol < 144) { value = 0x30 + symbol; bits = 8; }
+                else if (symbol < 256) { value = 0x190 + symbol - 144; bits = 9; }
+                else if (symbol < 280) { value = symbol - 256; bits = 7; }
+                else { value = 0xc0 + symbol - 280; bits = 8; }
+                code[symbol] = static_cast<uint16_t>(Reverse(value, bits));
+                code_bits[symbol] = bits;
+            }
+            for (uint32_t n=0; n<29; ++n) {
+                uint32_t last = n + 1 < 29 ? kLengthBase[n+1] : kMaxMatch + 1;
+                for (uint32_t length=kLengthBase[n]; length<last && length<=kMaxMatch; ++length)
+                    length_symbol[length] = static_cast<uint16_t>(257 + n);
+            }
+            // the same table as zlib: distances up to 256 directly, larger ones by 128
+            for (uint8_t n=0; n<30; ++n) {
+                uint32_t last = n + 1 < 30 ? kDistanceBase[n+1] : 32769;
+                for (uint32_t distance=kDistanceBase[n]; distance<last; ++distance) {
+                    if (distance <= 256)
+                        distance_code[distance - 1] = n;
+                    else
+                        distance_code[256 + ((distance - 1) >> 7)] = n;
+                }
+                distance_reversed[n] = static_cast<uint8_t>(Reverse(n, 5));
+            }
+        }
+
+        static uint32_t Reverse(uint32_t value, uint32_t bits)
+        {
+            uint32_t reversed = 0;
+            for (uint32_t n=0; n<bits; ++n)
+                reversed |= ((value >> n) & 1) << (bits - 1 - n);
+            return reversed;
+        }
+    };
+
+    explicit Deflater(std::vector<unsigned char>& out) : out(out) {}
+
+    static uint32_t Hash(const unsigned char* p)
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return (value * 2654435761u) >> (32 - kHashBits);
+    }
+
+    void Symbol(const Tables& tables, uint32_t symbol) { Bits(tables.code[symbol], tables.code_bits[symbol]); }
+
+    void Bits(uint32_t value, uint32_t count)
+    {
+        bit_buffer |= uint64_t(value) << bit_count;
+        bit_count += count;
+        while (bit_count >= 8) {
+            out.push_back(static_cast<unsigned char>(bit_buffer));
+            bit_buffer >>= 8;
+            bit_count -= 8;
+        }
+    }
+
+    void Flush()
+    {
+        if (bit_count > 0)
+            out.push_back(static_cast<unsigned char>(bit_buffer));
+        bit_buffer = 0;
+        bit_count = 0;
+    }
+
+    std::vector<unsigned char>& out;
+    uint64_t bit_buffer = 0;
+    uint32_t bit_count = 0;
+};
+
+class ArchiveWriter {
+public:
+    explicit ArchiveWriter(const std::string& path) : path(path), file(fileSystem().Open(path, OpenMode::Create))
+    {
+        if (!file)
+            throw BundleError("Cannot create archive " + path);
+        pending.reserve(kBufferSize);
+    }
+    virtual ~ArchiveWriter() = default;
+    ArchiveWriter(const ArchiveWriter&) = delete;
+    ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+
+    virtual void Add(const ArchiveEntry& entry) = 0;
+    virtual void Finish() = 0;
+
+    void Close()
+    {
+        Flush();
+        file.reset();
+    }
+
+protected:
+    // small writes are gathered in |pending|, large ones go straight to the file
+    void Write(const void* data, size_t size)
+    {
+        if (pending.size() + size > kBufferSize)
+            Flush();
+        if (size >= kBufferSize) {
+            if (!file->Write(data, size, offset))
+                throw BundleError("An error occured while writing archive " + path);
+        }
+        else {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            pending.insert(pending.end(), bytes, bytes + size);
+        }
+        offset += size;
+    }
+    void Write(const std::vector<unsigned char>& data) { Write(data.data(), data.size()); }
+
+    // copy the contents of |entry| into the archive in chunks
+    void WriteContents(const ArchiveEntry& entry)
+    {
+        std::unique_ptr<File> in = fileSystem().Open(entry.path, OpenMode::Read);
+        if (!in)
+            throw BundleError("Cannot open " + entry.path + " to archive it");
+        uint64_t size = in->Size();
+        if (size != entry.info.size)
+            throw BundleError("An error occured while reading " + entry.path + " (was it modified while archiving?)");
+        for (uint64_t position=0; position<size; position+=buffer.size()) {
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(size - position, buffer.size()));
+            if (!in->Read(buffer.data(), chunk, position))
+                throw BundleError("An error occured while reading " + entry.path + " (was it modified while archiving?)");
+            Write(buffer.data(), chunk);
+        }
+    }
+
+    std::string path;
+    std::unique_ptr<File> file;
+    uint64_t offset = 0;
+    std::vector<unsigned char> buffer = std::vector<unsigned char>(kBufferSize);
+
+private:
+    void Flush()
+    {
+        if (!pending.empty() && !file->Write(pending.data(), pending.size(), offset - pending.size()))
+            throw BundleError("An error occured while writing archive " + path);
+        pending.clear();
+    }
+
+    std::vector<unsigned char> pending;
+};
+
+class TarWriter : public ArchiveWriter {
+public:
+    using ArchiveWriter::ArchiveWriter;
+
+    void Add(const ArchiveEntry& entry) override
+    {
+        char type = entry.info.type == FileType::Symlink ? '2' : entry.info.type == FileType::Directory ? '5' : '0';
+        uint64_t size = type == '0' ? entry.info.size : 0;
+
+        // names and sizes that don't fit the ustar header go into a pax extended header first
+        std::string name;
+        std::string prefix;
+        std::string records;
+        if (!SplitName(entry.name, prefix, name)) {
+            records += PaxRecord("path", entry.name);
+            name = entry.name.substr(0, 99);
+            prefix.clear();
+        }
+        if (entry.link_target.size() > 100)
+            records += PaxRecord("linkpath", entry.link_target);
+        if (size > 077777777777ULL)
+            records += PaxRecord("size", std::to_string(size));
+        if (!records.empty()) {
+            WriteHeader("PaxHeader/" + name.substr(0, 90), "", 'x', 0644, records.size(), entry.info.mtime_sec, "");
+            Write(records.data(), records.size());
+            Pad(records.size());
+        }
+
+        WriteHeader(name, prefix, type, entry.info.mode, size, entry.info.mtime_sec, entry.link_target.substr(0, 100));
+        if (type == '0') {
+            WriteContents(entry);
+            Pad(size);
+        }
+    }
+
+    void Finish() override
+    {
+        std::vector<unsigned char> end(1024, 0);
+        Write(end);
+    }
+
+private:
+    // split |full_name| into the 155 byte prefix and 100 byte name fields of a ustar header
+    static bool SplitName(const std::string& full_name, std::string& prefix, std::string& name)
+    {
+        if (full_name.size() <= 100) {
+            name = full_name;
+            return true;
+        }
+        // the first slash leaving at most 100 bytes, a trailing slash stays in the name
+        size_t slash = full_name.find('/');
+        while (slash != std::string::npos && slash + 1 < full_name.size()) {
+            if (full_name.size() - slash - 1 <= 100) {
+                if (slash > 155)
+                    return false;
+                prefix = full_name.substr(0, slash);
+                name = full_name.substr(slash + 1);
+                return true;
+            }
+            slash = full_name.find('/', slash + 1);
+        }
+        return false;
+    }
+
+    static std::string PaxRecord(const std::string& key, const std::string& value)
+    {
+        // the length prefix counts its own digits
+        size_t length = key.size() + value.size() + 3;
+        size_t total = length + 1;
+        while (length + std::to_string(total).size() != total)
+            total = length + std::to_string(total).size();
+        return std::to_string(total) + " " + key + "=" + value + "\n";
+    }
+
+    static void Octal(unsigned char* field, size_t width, uint64_t value)
+    {
+        // width - 1 digits followed by a NUL, values too large are carried by pax headers
+        std::vector<char> text(width + 1);
+        snprintf(text.data(), text.size(), "%0*llo", static_cast<int>(width - 1),
+                 static_cast<unsigned long long>(std::min<uint64_t>(value, (uint64_t(1) << (3 * (width - 1))) - 1)));
+        memcpy(field, text.data(), width);
+    }
+
+    void WriteHeader(const std::string& name, const std::string& prefix, char type, uint32_t mode,
+                     uint64_t size, int64_t mtime, const std::string& link_target)
+    {
+        std::vector<unsigned char> header(512, 0);
+        memcpy(header.data(), name.data(), std::min<size_t>(name.size(), 100));
+        Octal(header.data() + 100, 8, mode);
+        Octal(header.data() + 108, 8, 0);
+        Octal(header.data() + 116, 8, 0);
+        Octal(header.data() + 124, 12, size);
+        Octal(header.data() + 136, 12, mtime < 0 ? 0 : static_cast<uint64_t>(mtime));
+        header[156] = static_cast<unsigned char>(type);
+        memcpy(header.data() + 157, link_target.data(), std::min<size_t>(link_target.size(), 100));
+        memcpy(header.data() + 257, "ustar", 6);
+        memcpy(header.data() + 263, "00", 2);
+        memcpy(header.data() + 345, prefix.data(), std::min<size_t>(prefix.size(), 155));
+
+        memset(header.data() + 148, ' ', 8);
+        uint32_t checksum = 0;
+        for (unsigned char c : header)
+            checksum += c;
+        snprintf(reinterpret_cast<char*>(header.data() + 148), 8, "%06o", checksum);
+        header[155] = ' ';
+        Write(header);
+    }
+
+    void Pad(uint64_t size)
+    {
+        static const unsigned char zeros[512] = {};
+        Write(zeros, (512 - size % 512) % 512);
+    }
+};
+
+class ZipWriter : public ArchiveWriter {
+public:
+    using ArchiveWriter::ArchiveWriter;
+
+    void Add(const ArchiveEntry& entry) override
+    {
+        if (central_directory_count == 0xffff)
+            throw BundleError("Too many files for a zip archive, use a .tar archive instead");
+        if (entry.info.size >= 0xffffffff)
+            throw BundleError("Bundle too large for a zip archive, use a .tar archive instead");
+
+        uint32_t dos_time;
+        uint32_t dos_date;
+        DosTime(static_cast<time_t>(entry.info.mtime_sec), dos_time, dos_date);
+        uint64_t header_offset = offset;
+
+        // symlinks are stored as their target, files are compressed when that makes them smaller
+        std::vector<unsigned char> contents;
+        if (entry.info.type == FileType::Symlink) {
+            contents.assign(entry.link_target.begin(), entry.link_target.end());
+        }
+        else if (entry.info.type == FileType::Regular) {
+            if (!fileSystem().ReadFile(entry.path, contents) || contents.size() != entry.info.size)
+                throw BundleError("An error occured while reading " + entry.path + " (was it modified while archiving?)");
+        }
+        uint32_t crc = crc32(0, contents.data(), contents.size());
+        uint32_t size = static_cast<uint32_t>(contents.size());
+        uint32_t method = 0;
+        if (entry.info.type == FileType::Regular && !Settings::archiveStore() && !contents.empty()) {
+            std::vector<unsigned char> compressed;
+            Deflater::Compress(contents.data(), contents.size(), compressed);
+            if (compressed.size() < contents.size()) {
+                contents = std::move(compressed);
+                method = 8;
+            }
+        }
+        // version needed to extract: 1.0 for stored entries, 2.0 for deflated ones
+        uint32_t version = method == 8 ? 20 : 10;
+
+        std::vector<unsigned char> fields;
+        put16(fields, 0x0800);  // utf-8 names
+        put16(fields, method);
+        put16(fields, dos_time);
+        put16(fields, dos_date);
+        put32(fields, crc);
+        put32(fields, static_cast<uint32_t>(contents.size()));
+        put32(fields, size);
+        put16(fields, static_cast<uint32_t>(entry.name.size()));
+        put16(fields, 0);       // extra field
+
+        std::vector<unsigned char> header;
+        put32(header, 0x04034b50);
+        put16(header, version);
+        header.insert(header.end(), fields.begin(), fields.end());
+        Write(header);
+        Write(entry.name.data(), entry.name.size());
+        Write(contents);
+        if (offset >= 0xffffffff)
+            throw BundleError("Bundle too large for a zip archive, use a .tar archive instead");
+
+        put32(central_directory, 0x02014b50);
+        put16(central_directory, (3 << 8) | 20);  // made by unix, zip 2.0
+        put16(central_directory, version);
+        central_directory.insert(central_directory.end(), fields.begin(), fields.end());
+        put16(central_directory, 0);  // comment, disk number, internal attributes
+        put16(central_directory, 0);
+        put16(central_directory, 0);
+        put32(central_directory, (unixMode(entry.info) << 16) | (entry.info.type == FileType::Directory ? 0x10 : 0));
+        put32(central_directory, static_cast<uint32_t>(header_offset));
+        central_directory.insert(central_directory.end(), entry.name.begin(), entry.name.end());
+        central_directory_count++;
+    }
+
+    void Finish() override
+    {
+        uint64_t directory_offset = offset;
+        Write(central_directory);
+        if (offset >= 0xffffffff)
+            throw BundleError("Bundle too large for a zip archive, use a .tar archive instead");
+
+        std::vector<unsigned char> end;
+        put32(end, 0x06054b50);
+        put16(end, 0);
+        put16(end, 0);
+        put16(end, central_directory_count);
+        put16(end, central_directory_count);
+        put32(end, static_cast<uint32_t>(central_directory.size()));
+        put32(end, static_cast<uint32_t>(directory_offset));
+        put16(end, 0);
+        Write(end);
+    }
+
+private:
+    static void DosTime(time_t mtime, uint32_t& dos_time, uint32_t& dos_date)
+    {
+        // zip times have no time zone, reproducible archives store them in UTC to read the same anywhere
+        struct tm tm {};
+        if (Settings::reproducible())
+            gmtime_r(&mtime, &tm);
+        else
+            localtime_r(&mtime, &tm);
+        if (tm.tm_year < 80) {
+            dos_time = 0;
+            dos_date = (1 << 5) | 1;
+            return;
+        }
+        dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+        dos_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    }
+
+    std::vector<unsigned char> central_directory;
+    uint32_t central_directory_count = 0;
+};
+
+bool hasExtension(const std::string& path, const std::string& extension)
+{
+    return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+} // namespace
+
+size_t writeArchive(const std::string& root, const std::string& archive_path)
+{
+    std::string root_path = root;
+    while (root_path.size() > 1 && root_path[root_path.size()-1] == '/')
+        root_path.erase(root_path.size()-1);
+    std::string root_name = root_path.substr(root_path.rfind('/') + 1);
+
+    std::vector<ArchiveEntry> entries;
+    collectEntries(root_path, root_name, entries);
+
+    std::unique_ptr<ArchiveWriter> writer;
+    if (hasExtension(archive_path, ".zip"))
+        writer = std::make_unique<ZipWriter>(archive_path);
+    else if (hasExtension(archive_path, ".tar"))
+        writer = std::make_unique<TarWriter>(archive_path);
+    else
+        throw BundleError("Unknown archive type " + archive_path + ", expected a .zip or .tar file");
+
+    size_t count = 0;
+    try {
+        for (const auto& entry : entries) {
+            writer->Add(entry);
+            count++;
+        }
+        writer->Finish();
+        writer->Close();
+    }
+    catch (const BundleError&) {
+        writer.reset();
+        fileSystem().Remove(archive_path);
+        throw;
+    }
+    return count;
+}
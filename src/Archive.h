@@ -0,0 +1,16 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_ARCHIVE_H
+#define DYLIBBUNDLER_ARCHIVE_H
+
+#include <cstddef>
+#include <string>
+
+// Stream the tree at |root| into the archive |archive_path|, a .tar (ustar with pax headers for
+// long names) or a .zip depending on its extension. Entries are named after the last component of
+// |root| and keep their permission modes and symlinks. Zip entries are deflated unless that doesn't
+// make them smaller or Settings::archiveStore() is set, tar entries are never compressed.
+// Returns the number of entries written, throws BundleError on failure.
+size_t writeArchive(const std::string& root, const std::string& archive_path);
+
+#endif
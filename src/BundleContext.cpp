@@ -0,0 +1,25 @@
+#include "BundleContext.h"
+
+namespace {
+
+thread_local BundleContext* current_context = nullptr;
+
+} // namespace
+
+BundleContext::Scope::Scope(BundleContext& context) : previous(current_context)
+{
+    current_context = &context;
+}
+
+BundleContext::Scope::~Scope()
+{
+    current_context = previous;
+}
+
+BundleContext& BundleContext::Current()
+{
+    if (current_context != nullptr)
+        return *current_context;
+    static BundleContext default_context;
+    return default_context;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_BUNDLECONTEXT_H
+#define DYLIBBUNDLER_BUNDLECONTEXT_H
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "DylibBundler.h"
+#include "FileSystem.h"
+#include "PathTable.h"
+#include "Settings.h"
+
+// Raised instead of exiting the process when bundling can't go on.
+class BundleError : public std::runtime_error {
+public:
+    explicit BundleError(const std::string& message) : std::runtime_error(message) {}
+};
+
+// Everything one bundle needs: its settings, the collected dependencies and the interned paths.
+// The Settings and bundler functions act on the context bound to the calling thread, so separate
+// contexts can be bundled concurrently from different threads. Threads that never bind a context
+// share a default one. Files are read and written through |file_system|, the host's by default;
+// replace it before configuring the settings to bundle an in-memory tree.
+class BundleContext {
+public:
+    BundleContext() = default;
+    BundleContext(const BundleContext&) = delete;
+    BundleContext& operator=(const BundleContext&) = delete;
+
+    // binds |context| to the calling thread until the scope ends
+    class Scope {
+    public:
+        explicit Scope(BundleContext& context);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        BundleContext* previous;
+    };
+
+    static BundleContext& Current();
+
+    Settings::State settings;
+    BundlerState bundler;
+    PathTable paths;
+    std::shared_ptr<FileSystem> file_system = hostFileSystem();
+};
+
+#endif
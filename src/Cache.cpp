@@ -0,0 +1,110 @@
+#include "Cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+#include "BundleContext.h"
+#include "FileSystem.h"
+#include "Settings.h"
+#include "Sha256.h"
+
+namespace {
+
+// bump when the patching code changes in a way that alters its output
+constexpr const char* kCacheFormat = "dylibbundler-cache-1";
+
+std::string entryPath(const std::string& key)
+{
+    return Settings::cacheDir() + key.substr(0, 2) + "/" + key;
+}
+
+int64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+std::string cacheKey(const std::string& original_file, const std::string& edit_plan)
+{
+    Sha256 content;
+    if (!sha256File(fileSystem(), original_file, content))
+        return "";
+    Sha256::Digest content_digest = content.Finish();
+
+    Sha256 sha;
+    sha.Update(kCacheFormat, strlen(kCacheFormat) + 1);
+    sha.Update(content_digest.data(), content_digest.size());
+    sha.Update(edit_plan.data(), edit_plan.size());
+    return Sha256::Hex(sha.Finish());
+}
+
+bool restoreFromCache(const std::string& key, const std::string& dest)
+{
+    FileSystem& file_system = fileSystem();
+    std::string entry = entryPath(key);
+    FileInfo info = file_system.Status(entry);
+    if (info.type != FileType::Regular)
+        return false;
+    if (!file_system.CloneFile(entry, dest) && !file_system.Copy(entry, dest, false))
+        return false;
+    if (!file_system.MakeWritable(dest))
+        throw BundleError("An error occured while trying to set write permissions on file " + dest);
+    // entries are evicted by modification time
+    file_system.SetTimes(entry, now(), 0);
+    return true;
+}
+
+void storeInCache(const std::string& key, const std::string& file)
+{
+    FileSystem& file_system = fileSystem();
+    std::string entry = entryPath(key);
+    if (file_system.Exists(entry) || !file_system.CreateDirectories(entry.substr(0, entry.rfind('/'))))
+        return;
+    // entries appear complete or not at all, even with several builds sharing the cache
+    std::string temporary = entry + ".tmp" + std::to_string(getpid());
+    if (!file_system.Copy(file, temporary, true) || !file_system.Rename(temporary, entry))
+        file_system.Remove(temporary);
+}
+
+void trimCache(uint64_t size_limit)
+{
+    FileSystem& file_system = fileSystem();
+    std::string cache_dir = Settings::cacheDir();
+    struct Entry {
+        std::string path;
+        FileInfo info;
+    };
+    std::vector<Entry> entries;
+    uint64_t total_size = 0;
+    std::vector<std::string> buckets;
+    file_system.ListDirectory(cache_dir, buckets);
+    for (const auto& bucket : buckets) {
+        std::vector<std::string> names;
+        if (!file_system.ListDirectory(cache_dir + bucket, names))
+            continue;
+        for (const auto& name : names) {
+            Entry entry{cache_dir + bucket + "/" + name, file_system.LinkStatus(cache_dir + bucket + "/" + name)};
+            if (entry.info.type != FileType::Regular)
+                continue;
+            total_size += entry.info.size;
+            entries.push_back(entry);
+        }
+    }
+    if (total_size <= size_limit)
+        return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.info.mtime_sec != b.info.mtime_sec ? a.info.mtime_sec < b.info.mtime_sec : a.path < b.path;
+    });
+    for (const auto& entry : entries) {
+        if (total_size <= size_limit)
+            break;
+        if (file_system.Remove(entry.path))
+            total_size -= entry.info.size;
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_CACHE_H
+#define DYLIBBUNDLER_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+// Patched dependencies are kept in the --cache-dir directory, named after the SHA-256 of the
+// original file and of a description of every change made to it, so later builds bundling the same
+// library the same way reuse the result instead of copying and patching it again.
+
+// key of |original_file| patched according to |edit_plan|, empty if the file can't be read
+std::string cacheKey(const std::string& original_file, const std::string& edit_plan);
+// Create |dest| from the entry |key| as a reflink, or a copy where reflinks aren't supported, and
+// mark the entry as recently used. Returns false if there is no such entry.
+bool restoreFromCache(const std::string& key, const std::string& dest);
+// add |file| as the entry |key|, failures are ignored since the cache is only an optimization
+void storeInCache(const std::string& key, const std::string& file);
+// delete the least recently used entries until the cache holds at most |size_limit| bytes
+void trimCache(uint64_t size_limit);
+
+#endif
@@ -0,0 +1,160 @@
+#include "CodeSignature.h"
+
+#include <algorithm>
+
+#include "MachO.h"
+#include "Sha256.h"
+
+namespace {
+
+// code signature blobs, always big endian
+constexpr uint32_t CSMAGIC_EMBEDDED_SIGNATURE = 0xfade0cc0;
+constexpr uint32_t CSMAGIC_CODEDIRECTORY = 0xfade0c02;
+constexpr uint32_t CS_SUPPORTSSCATTER = 0x20100;
+constexpr uint32_t CS_SUPPORTSCODELIMIT64 = 0x20300;
+constexpr uint32_t CS_ADHOC = 0x2;
+constexpr uint8_t CS_HASHTYPE_SHA256 = 2;
+constexpr uint8_t CS_HASHTYPE_SHA256_TRUNCATED = 3;
+
+uint32_t readBig32(const unsigned char* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+void writeBig32(unsigned char* p, uint32_t value)
+{
+    p[0] = static_cast<unsigned char>(value >> 24);
+    p[1] = static_cast<unsigned char>(value >> 16);
+    p[2] = static_cast<unsigned char>(value >> 8);
+    p[3] = static_cast<unsigned char>(value);
+}
+
+// the code directory at |blob_offset|, false if its hashes can't be refreshed
+bool readCodeDirectory(const unsigned char* signature, size_t size, uint32_t blob_offset, CodeDirectory& directory)
+{
+    if (uint64_t(blob_offset) + 44 > size)
+        return false;
+    const unsigned char* blob = signature + blob_offset;
+    uint32_t length = readBig32(blob + 4);
+    uint32_t version = readBig32(blob + 8);
+    uint32_t flags = readBig32(blob + 12);
+    uint32_t hash_offset = readBig32(blob + 16);
+    directory.slot_count = readBig32(blob + 28);
+    directory.code_limit = readBig32(blob + 32);
+    directory.hash_size = blob[36];
+    uint8_t hash_type = blob[37];
+    uint8_t page_shift = blob[39];
+    if (uint64_t(blob_offset) + length > size || (flags & CS_ADHOC) == 0)
+        return false;
+    if (hash_type != CS_HASHTYPE_SHA256 && hash_type != CS_HASHTYPE_SHA256_TRUNCATED)
+        return false;
+    if (directory.hash_size == 0 || directory.hash_size > 32 || page_shift < 9 || page_shift > 24)
+        return false;
+    if (version >= CS_SUPPORTSSCATTER && (length < 48 || readBig32(blob + 44) != 0))
+        return false;
+    if (version >= CS_SUPPORTSCODELIMIT64 && (length < 64 || read64(blob + 56, false) != 0))
+        return false;
+    if (uint64_t(hash_offset) + uint64_t(directory.slot_count) * directory.hash_size > length)
+        return false;
+    directory.page_size = 1u << page_shift;
+    directory.slots_offset = uint64_t(blob_offset) + hash_offset;
+    return true;
+}
+
+// index of the signature blobs, false if it is malformed
+bool readBlobOffsets(const unsigned char* signature, size_t size, std::vector<uint32_t>& offsets)
+{
+    if (size < 12 || readBig32(signature) != CSMAGIC_EMBEDDED_SIGNATURE)
+        return false;
+    uint32_t count = readBig32(signature + 8);
+    if (12 + uint64_t(count) * 8 > size)
+        return false;
+    for (uint32_t n=0; n<count; ++n) {
+        uint32_t blob_offset = readBig32(signature + 12 + n * 8 + 4);
+        if (uint64_t(blob_offset) + 8 > size)
+            return false;
+        offsets.push_back(blob_offset);
+    }
+    return true;
+}
+
+} // namespace
+
+bool readCodeDirectories(const unsigned char* signature, size_t size, std::vector<CodeDirectory>& directories)
+{
+    std::vector<uint32_t> offsets;
+    if (!readBlobOffsets(signature, size, offsets))
+        return false;
+    for (uint32_t blob_offset : offsets) {
+        if (readBig32(signature + blob_offset) != CSMAGIC_CODEDIRECTORY)
+            continue;
+        CodeDirectory directory;
+        if (!readCodeDirectory(signature, size, blob_offset, directory))
+            return false;
+        directories.push_back(directory);
+    }
+    return true;
+}
+
+bool resizeSignature(const unsigned char* signature, size_t size, uint64_t code_limit, std::vector<unsigned char>& out)
+{
+    std::vector<uint32_t> offsets;
+    if (!readBlobOffsets(signature, size, offsets) || code_limit > UINT32_MAX)
+        return false;
+
+    // the blobs are laid out again after the index, in index order
+    out.assign(signature, signature + 12 + offsets.size() * 8);
+    for (size_t n=0; n<offsets.size(); ++n) {
+        const unsigned char* blob = signature + offsets[n];
+        uint32_t length = readBig32(blob + 4);
+        if (uint64_t(offsets[n]) + length > size)
+            return false;
+        writeBig32(out.data() + 12 + n * 8 + 4, static_cast<uint32_t>(out.size()));
+        if (readBig32(blob) != CSMAGIC_CODEDIRECTORY) {
+            out.insert(out.end(), blob, blob + length);
+            continue;
+        }
+
+        CodeDirectory directory;
+        if (!readCodeDirectory(signature, size, offsets[n], directory))
+            return false;
+        uint64_t hash_offset = directory.slots_offset - offsets[n];
+        if (hash_offset + uint64_t(directory.slot_count) * directory.hash_size != length)
+            return false;
+        uint64_t slot_count = (code_limit + directory.page_size - 1) / directory.page_size;
+        uint64_t new_length = hash_offset + slot_count * directory.hash_size;
+        if (new_length > UINT32_MAX)
+            return false;
+
+        size_t pos = out.size();
+        out.insert(out.end(), blob, blob + hash_offset);
+        out.resize(pos + new_length, 0);
+        writeBig32(out.data() + pos + 4, static_cast<uint32_t>(new_length));
+        writeBig32(out.data() + pos + 28, static_cast<uint32_t>(slot_count));
+        writeBig32(out.data() + pos + 32, static_cast<uint32_t>(code_limit));
+    }
+    if (out.size() > UINT32_MAX)
+        return false;
+    writeBig32(out.data() + 4, static_cast<uint32_t>(out.size()));
+    return true;
+}
+
+bool hashCodePages(const unsigned char* image, uint64_t image_size, unsigned char* signature, size_t size)
+{
+    std::vector<CodeDirectory> directories;
+    if (!readCodeDirectories(signature, size, directories))
+        return false;
+    for (const auto& directory : directories) {
+        if (directory.code_limit > image_size)
+            return false;
+        for (uint64_t page=0; page<directory.slot_count; ++page) {
+            uint64_t begin = page * directory.page_size;
+            uint64_t end = std::min<uint64_t>(begin + directory.page_size, directory.code_limit);
+            if (begin >= end)
+                break;
+            Sha256::Digest digest = Sha256::Hash(image + begin, end - begin);
+            std::copy(digest.begin(), digest.begin() + directory.hash_size, signature + directory.slots_offset + page * directory.hash_size);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_CODESIGNATURE_H
+#define DYLIBBUNDLER_CODESIGNATURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// hash slots of one code directory of an embedded signature (LC_CODE_SIGNATURE)
+struct CodeDirectory {
+    // offset of the first code slot, relative to the start of the signature
+    uint64_t slots_offset = 0;
+    uint32_t slot_count = 0;
+    uint32_t hash_size = 0;
+    uint32_t page_size = 0;
+    uint64_t code_limit = 0;
+};
+
+// Find the code directories of the embedded signature |signature|. Returns false if their page
+// hashes can't be refreshed: the signature isn't ad-hoc (new hashes would break its CMS signature),
+// or a code directory uses an unsupported hash or layout.
+bool readCodeDirectories(const unsigned char* signature, size_t size, std::vector<CodeDirectory>& directories);
+
+// Copy |signature| with code directories covering the code up to |code_limit|, one hash slot per
+// page, for an image whose __LINKEDIT moved. The code slots are left zeroed for hashCodePages().
+// Returns false if readCodeDirectories() rejects it, or a code directory has data after its slots.
+bool resizeSignature(const unsigned char* signature, size_t size, uint64_t code_limit, std::vector<unsigned char>& out);
+
+// hash every page of |image| covered by the code directories of |signature| into their slots
+bool hashCodePages(const unsigned char* image, uint64_t image_size, unsigned char* signature, size_t size);
+
+#endif
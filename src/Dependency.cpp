@@ -4,31 +4,89 @@
 #include <cstdlib>
 #include <functional>
 #include <iostream>
+#include <vector>
 
-#include <sys/param.h>
-#ifndef __clang__
-#include <sys/types.h>
-#endif
-
+#include "BundleContext.h"
+#include "Elf.h"
+#include "FileSystem.h"
 #include "Settings.h"
+#include "Thin.h"
 #include "Utils.h"
 
-Dependency::Dependency(std::string path, const std::string& dependent_file) : is_framework(false)
+namespace {
+
+// Copy only what a framework needs at runtime: the version |binary_path| belongs to, with its
+// Resources/Info.plist and the user's extra resources, and the Current and top-level symlinks.
+// Frameworks without a Versions directory are copied whole. Returns false if nothing was written.
+bool copyFrameworkVersion(const std::string& framework_root, const std::string& binary_path, const std::string& dest_root)
+{
+    FileSystem& file_system = fileSystem();
+    std::string binary = file_system.RealPath(binary_path);
+    if (binary.empty())
+        binary = binary_path;
+    std::string binary_in_root(getFrameworkPath(binary));
+    size_t version_end = binary_in_root.find('/', 9);
+    if (binary_in_root.compare(0, 9, "Versions/") != 0 || version_end == std::string::npos)
+        return copyFile(framework_root, dest_root);
+    std::string version = binary_in_root.substr(9, version_end - 9);
+    std::string version_dir = "Versions/" + version + "/";
+
+    bool copied = false;
+    std::vector<std::string> files{binary_in_root, version_dir + "Resources/Info.plist"};
+    for (const auto& resource : Settings::frameworkResources())
+        files.push_back(version_dir + resource);
+    for (const auto& file : files) {
+        std::string from = framework_root + "/" + file;
+        std::string to = dest_root + "/" + file;
+        if (!fileExists(from))
+            continue;
+        std::string to_dir(filePrefix(to));
+        if (!fileExists(to_dir) && !mkdir(to_dir))
+            throw BundleError("An error occured while creating " + to_dir);
+        copied = copyFile(from, to) || copied;
+    }
+
+    // the copied version becomes the current one, top-level links are kept when they still resolve
+    copied = createSymlink(version, dest_root + "/Versions/Current") || copied;
+    std::vector<std::string> names;
+    file_system.ListDirectory(framework_root, names);
+    std::sort(names.begin(), names.end());
+    for (const auto& name : names) {
+        std::string target;
+        if (!file_system.ReadLink(framework_root + "/" + name, target))
+            continue;
+        if (target.compare(0, 17, "Versions/Current/") == 0 && fileExists(dest_root + "/" + version_dir + target.substr(17)))
+            copied = createSymlink(target, dest_root + "/" + name) || copied;
+    }
+    return copied;
+}
+
+} // namespace
+
+Dependency::Dependency(std::string path, const std::string& dependent_file) : is_framework(false), is_bundled(false), is_elf(isElf(dependent_file)), is_missing(false)
 {
-    char buffer[PATH_MAX];
     rtrim_in_place(path);
     std::string original_file;
     std::string warning_msg;
 
-    if (isRpath(path)) {
-        original_file = searchFilenameInRpaths(path, dependent_file);
+    if (is_elf) {
+        original_file = searchElfLibrary(path, dependent_file);
+        if (original_file.empty()) {
+            warning_msg = "\n/!\\ WARNING: Cannot find library '" + path + "' in the search path of " + dependent_file + "\n";
+            original_file = path;
+        }
     }
-    else if (realpath(path.c_str(), buffer)) {
-        original_file = buffer;
+    else if (isRpath(path)) {
+        original_file = searchFilenameInRpaths(path, dependent_file);
+        if (original_file.empty())
+            original_file = path;
     }
     else {
-        warning_msg = "\n/!\\ WARNING: Cannot resolve path '" + path + "'\n";
-        original_file = path;
+        original_file = fileSystem().RealPath(path);
+        if (original_file.empty()) {
+            warning_msg = "\n/!\\ WARNING: Cannot resolve path '" + path + "'\n";
+            original_file = path;
+        }
     }
 
     if (Settings::verboseOutput()) {
@@ -43,23 +101,25 @@ Dependency::Dependency(std::string path, const std::string& dependent_file) : is
     if (original_file != path)
         AddSymlink(path);
 
-    prefix = filePrefix(original_file);
-    filename = stripPrefix(original_file);
+    std::string prefix(filePrefix(original_file));
+    std::string filename(stripPrefix(original_file));
 
     if (!prefix.empty() && prefix[prefix.size()-1] != '/')
         prefix += "/";
 
     // check if this dependency is in /usr/lib, /System/Library, or in ignored list
-    if (!Settings::isPrefixBundled(prefix))
+    if (!Settings::isPrefixBundled(prefix)) {
+        SetOrigin(prefix, filename);
         return;
+    }
 
     if (original_file.find(".framework") != std::string::npos) {
         is_framework = true;
-        std::string framework_root = getFrameworkRoot(original_file);
-        std::string framework_path = getFrameworkPath(original_file);
-        std::string framework_name = stripPrefix(framework_root);
+        std::string_view framework_root = getFrameworkRoot(original_file);
+        std::string_view framework_path = getFrameworkPath(original_file);
+        std::string_view framework_name = stripPrefix(framework_root);
         prefix = filePrefix(framework_root);
-        filename = framework_name + "/" + framework_path;
+        filename.assign(framework_name).append("/").append(framework_path);
         if (Settings::verboseOutput()) {
             std::cout << "  framework root: " << framework_root << std::endl;
             std::cout << "  framework path: " << framework_path << std::endl;
@@ -69,16 +129,20 @@ Dependency::Dependency(std::string path, const std::string& dependent_file) : is
 
     // check if the lib is in a known location
     if (prefix.empty() || !fileExists(prefix+filename)) {
-        std::vector<std::string> search_paths = Settings::searchPaths();
-        if (search_paths.empty())
+        if (Settings::searchPaths().empty())
             initSearchPaths();
         // check if file is contained in one of the paths
-        for (const auto& search_path : search_paths) {
-            if (fileExists(search_path+filename)) {
-                warning_msg += "FOUND " + filename + " in " + search_path + "\n";
-                prefix = search_path;
-                Settings::missingPrefixes(true);
-                break;
+        std::string search_path = Settings::findInSearchPaths(filename);
+        if (!search_path.empty()) {
+            warning_msg += "FOUND " + filename + " in " + search_path + "\n";
+            prefix = search_path;
+            Settings::missingPrefixes(true);
+            // bundle the file itself, like for paths that resolve
+            std::string real_path = fileSystem().RealPath(prefix + filename);
+            if (!is_framework && !real_path.empty() && real_path != prefix + filename) {
+                AddSymlink(prefix + filename);
+                prefix = filePrefix(real_path);
+                filename = stripPrefix(real_path);
             }
         }
     }
@@ -86,38 +150,93 @@ Dependency::Dependency(std::string path, const std::string& dependent_file) : is
     if (!Settings::quietOutput())
         std::cout << warning_msg;
 
-    // if the location is still unknown, ask the user for search path
+    // if the location is still unknown, it is looked for once everything else is collected
     if (!Settings::isPrefixIgnored(prefix) && (prefix.empty() || !fileExists(prefix+filename))) {
         if (!Settings::quietOutput())
             std::cerr << "\n/!\\ WARNING: Dependency " << filename << " of " << dependent_file << " not found\n";
         if (Settings::verboseOutput())
             std::cout << "     path: " << (prefix+filename) << std::endl;
         Settings::missingPrefixes(true);
-        Settings::addSearchPath(getUserInputDirForFile(filename, dependent_file));
+        is_missing = true;
     }
 
-    new_name = filename;
+    SetOrigin(prefix, filename);
+    new_name = this->filename;
+    is_bundled = Settings::isPrefixBundled(prefix);
+
+    // ld.so looks the library up by the name in DT_NEEDED, which is its DT_SONAME
+    if (is_elf) {
+        ElfInfo library;
+        if (readElf(prefix + filename, library) && !library.soname.empty())
+            new_name = pathTable().Intern(library.soname);
+        else
+            new_name = pathTable().Intern(stripPrefix(path));
+    }
+}
+
+void Dependency::SetOrigin(const std::string& file_prefix, const std::string& file_name)
+{
+    PathTable& paths = pathTable();
+    prefix = paths.Intern(file_prefix);
+    filename = paths.Intern(file_name);
+    original_path = paths.Intern(file_prefix + file_name);
 }
 
 std::string Dependency::InnerPath() const
 {
-    return Settings::insideLibPath() + new_name;
+    return Settings::insideLibPath() + std::string(pathTable().View(new_name));
 }
 
 std::string Dependency::InstallPath() const
 {
-    return Settings::destFolder() + new_name;
+    return Settings::destFolder() + std::string(pathTable().View(new_name));
+}
+
+std::string Dependency::InstallName() const
+{
+    if (is_elf)
+        return std::string(pathTable().View(new_name));
+    return "@rpath/" + std::string(pathTable().View(new_name));
+}
+
+std::string Dependency::InnerPathFor(const std::string& dependent_file) const
+{
+    // ELF files name their dependencies, the RUNPATH leads to them
+    if (is_elf)
+        return std::string(pathTable().View(new_name));
+    // libraries sitting next to each other in the destination folder can load each other
+    // directly, without going through the rpath stack
+    if (Settings::optimizeRpaths() && !is_framework && filePrefix(dependent_file) == Settings::destFolder())
+        return "@loader_path/" + std::string(pathTable().View(new_name));
+    return InnerPath();
+}
+
+bool Dependency::HasInstallName(const std::string& install_name) const
+{
+    PathId id = pathTable().Find(install_name);
+    if (id == kInvalidPathId)
+        return false;
+    if (id == original_path)
+        return true;
+    if (std::find(symlinks.begin(), symlinks.end(), id) != symlinks.end())
+        return true;
+    return Settings::missingPrefixes() && id == filename;
+}
+
+void Dependency::AddSymlink(std::string_view path)
+{
+    AddSymlink(pathTable().Intern(path));
 }
 
-void Dependency::AddSymlink(const std::string& path)
+void Dependency::AddSymlink(PathId symlink)
 {
-    if (std::find(symlinks.begin(), symlinks.end(), path) == symlinks.end())
-        symlinks.push_back(path);
+    if (std::find(symlinks.begin(), symlinks.end(), symlink) == symlinks.end())
+        symlinks.push_back(symlink);
 }
 
 bool Dependency::MergeIfIdentical(Dependency& dependency)
 {
-    if (dependency.OriginalFilename() == filename) {
+    if (dependency.filename == filename) {
         for (const auto& symlink : symlinks)
             dependency.AddSymlink(symlink);
         return true;
@@ -125,15 +244,19 @@ bool Dependency::MergeIfIdentical(Dependency& dependency)
     return false;
 }
 
-void Dependency::CopyToBundle() const
+std::string Dependency::BundlePath() const
 {
-    std::string original_path = OriginalPath();
-    std::string dest_path = InstallPath();
+    if (!is_framework)
+        return InstallPath();
+    return Settings::destFolder() + std::string(stripPrefix(getFrameworkRoot(OriginalPath())));
+}
 
-    if (is_framework) {
-        original_path = getFrameworkRoot(original_path);
-        dest_path = Settings::destFolder() + stripPrefix(original_path);
-    }
+bool Dependency::CopyToBundle() const
+{
+    std::string original_path(OriginalPath());
+    std::string dest_path = BundlePath();
+    if (is_framework)
+        original_path.resize(getFrameworkRoot(original_path).size());
 
     if (Settings::verboseOutput()) {
         std::string inner_path = InnerPath();
@@ -143,36 +266,55 @@ void Dependency::CopyToBundle() const
         std::cout << "  - install path:  " << InstallPath() << std::endl;
     }
 
-    copyFile(original_path, dest_path);
+    bool minimal = is_framework && Settings::minimalFrameworks();
+    bool copied = minimal ? copyFrameworkVersion(original_path, std::string(OriginalPath()), dest_path)
+                          : copyFile(original_path, dest_path);
 
-    if (is_framework) {
-        std::string headers_path = dest_path + std::string("/Headers");
-        char buffer[PATH_MAX];
-        if (realpath(rtrim(headers_path).c_str(), buffer))
-            headers_path = buffer;
+    if (is_framework && copied && !minimal) {
+        if (!Settings::targetArchs().empty())
+            thinMachO(InstallPath(), InstallPath(), Settings::targetArchs());
+        FileSystem& file_system = fileSystem();
+        std::string headers_path = file_system.RealPath(dest_path + "/Headers");
+        if (headers_path.empty())
+            headers_path = dest_path + "/Headers";
         deleteFile(headers_path, true);
-        deleteFile(dest_path + "/*.prl");
+        // qmake link files are only used when building against the framework
+        std::vector<std::string> names;
+        file_system.ListDirectory(dest_path, names);
+        for (const auto& name : names) {
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".prl") == 0)
+                deleteFile(dest_path + "/" + name, true);
+        }
     }
 
-    changeId(InstallPath(), "@rpath/" + new_name);
+    bool renamed = changeId(InstallPath(), InstallName());
+    return copied || renamed;
 }
 
-void Dependency::FixDependentFile(const std::string& dependent_file) const
+void Dependency::AddInstallNameEdits(const std::string& dependent_file, LoadCommandEdits& edits) const
 {
-    changeInstallName(dependent_file, OriginalPath(), InnerPath());
+    const PathTable& paths = pathTable();
+    std::string inner_path = InnerPathFor(dependent_file);
+    edits.install_names.emplace_back(OriginalPath(), inner_path);
     for (const auto& symlink : symlinks)
-        changeInstallName(dependent_file, symlink, InnerPath());
+        edits.install_names.emplace_back(paths.View(symlink), inner_path);
 
     if (!Settings::missingPrefixes()) return;
 
-    changeInstallName(dependent_file, filename, InnerPath());
-    for (const auto& symlink : symlinks)
-        changeInstallName(dependent_file, symlink, InnerPath());
+    edits.install_names.emplace_back(paths.View(filename), inner_path);
+}
+
+void Dependency::FixDependentFile(const std::string& dependent_file) const
+{
+    LoadCommandEdits edits;
+    AddInstallNameEdits(dependent_file, edits);
+    changeLoadCommands(dependent_file, edits);
 }
 
 void Dependency::Print() const
 {
-    std::cout << "\n* " << filename << " from " << prefix << std::endl;
+    const PathTable& paths = pathTable();
+    std::cout << "\n* " << paths.View(filename) << " from " << paths.View(prefix) << std::endl;
     for (const auto& symlink : symlinks)
-        std::cout << "    symlink --> " << symlink << std::endl;
+        std::cout << "    symlink --> " << paths.View(symlink) << std::endl;
 }
@@ -4,42 +4,74 @@
 #define DYLIBBUNDLER_DEPENDENCY_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "MachOEdit.h"
+#include "PathTable.h"
+
 class Dependency {
 public:
     Dependency(std::string path, const std::string& dependent_file);
 
     [[nodiscard]] bool IsFramework() const { return is_framework; }
+    // false if this dependency is in /usr/lib, /System/Library, or in the ignored list
+    [[nodiscard]] bool IsBundled() const { return is_bundled; }
+    // a DT_NEEDED entry of an ELF file, bundled under its DT_SONAME
+    [[nodiscard]] bool IsElf() const { return is_elf; }
+    // not found while dependencies were collected, see resolveMissingDependencies()
+    [[nodiscard]] bool IsMissing() const { return is_missing; }
 
-    [[nodiscard]] std::string Prefix() const { return prefix; }
-    [[nodiscard]] std::string OriginalFilename() const { return filename; }
-    [[nodiscard]] std::string OriginalPath() const { return prefix + filename; }
+    [[nodiscard]] std::string_view Prefix() const { return pathTable().View(prefix); }
+    [[nodiscard]] std::string_view OriginalFilename() const { return pathTable().View(filename); }
+    [[nodiscard]] std::string_view OriginalPath() const { return pathTable().View(original_path); }
+    [[nodiscard]] PathId OriginalPathId() const { return original_path; }
+    // what MergeIfIdentical() compares
+    [[nodiscard]] PathId OriginalFilenameId() const { return filename; }
 
     [[nodiscard]] std::string InnerPath() const;
     [[nodiscard]] std::string InstallPath() const;
+    // LC_ID_DYLIB, or DT_SONAME, of the bundled copy
+    [[nodiscard]] std::string InstallName() const;
+    // inner path used by |dependent_file| to load this dependency
+    [[nodiscard]] std::string InnerPathFor(const std::string& dependent_file) const;
+
+    // true if |install_name| is one of the names FixDependentFile() rewrites
+    [[nodiscard]] bool HasInstallName(const std::string& install_name) const;
 
-    void AddSymlink(const std::string& path);
+    void AddSymlink(std::string_view path);
 
     // Compare the given dependency with this one. If both refer to the same file,
     // merge both entries into one and return true.
     bool MergeIfIdentical(Dependency& dependency);
 
-    void CopyToBundle() const;
+    // what CopyToBundle() creates: InstallPath(), or the root of the bundled framework
+    [[nodiscard]] std::string BundlePath() const;
+    // returns false if the bundled copy was already in place with the right id
+    bool CopyToBundle() const;
+    // queue the install name changes FixDependentFile() makes to |dependent_file|
+    void AddInstallNameEdits(const std::string& dependent_file, LoadCommandEdits& edits) const;
     void FixDependentFile(const std::string& dependent_file) const;
 
     void Print() const;
 
 private:
     bool is_framework;
+    bool is_bundled;
+    bool is_elf;
+    bool is_missing;
+
+    void AddSymlink(PathId symlink);
+    void SetOrigin(const std::string& file_prefix, const std::string& file_name);
 
-    // origin
-    std::string filename;
-    std::string prefix;
-    std::vector<std::string> symlinks;
+    // origin, as ids of the global path table
+    PathId filename;
+    PathId prefix;
+    PathId original_path;
+    std::vector<PathId> symlinks;
 
     // installation
-    std::string new_name;
+    PathId new_name;
 };
 
 #endif
@@ -0,0 +1,126 @@
+#include "DependencyGraph.h"
+
+#include <algorithm>
+#include <set>
+#include <utility>
+
+bool DependencyGraph::AddEdge(PathId file, uint32_t dependency)
+{
+    auto node = node_index.emplace(file, static_cast<uint32_t>(node_files.size()));
+    if (node.second)
+        node_files.push_back(file);
+
+    uint64_t key = (static_cast<uint64_t>(node.first->second) << 32) | dependency;
+    if (!edge_keys.insert(key).second)
+        return false;
+    edges.emplace_back(node.first->second, dependency);
+    dirty.store(true, std::memory_order_relaxed);
+    return true;
+}
+
+void DependencyGraph::Build() const
+{
+    if (!dirty.load(std::memory_order_acquire))
+        return;
+    std::lock_guard<std::mutex> lock(build_mutex);
+    if (!dirty.load(std::memory_order_relaxed))
+        return;
+
+    uint32_t dependency_count = 0;
+    for (const auto& edge : edges)
+        dependency_count = std::max(dependency_count, edge.second + 1);
+
+    // counting sort of the edge list, which keeps the insertion order of each row
+    offsets.assign(node_files.size() + 1, 0);
+    reverse_offsets.assign(dependency_count + 1, 0);
+    for (const auto& edge : edges) {
+        offsets[edge.first + 1]++;
+        reverse_offsets[edge.second + 1]++;
+    }
+    for (size_t n=1; n<offsets.size(); ++n)
+        offsets[n] += offsets[n-1];
+    for (size_t n=1; n<reverse_offsets.size(); ++n)
+        reverse_offsets[n] += reverse_offsets[n-1];
+
+    targets.resize(edges.size());
+    reverse_sources.resize(edges.size());
+    std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+    std::vector<uint32_t> reverse_next(reverse_offsets.begin(), reverse_offsets.end() - 1);
+    for (const auto& edge : edges) {
+        targets[next[edge.first]++] = edge.second;
+        reverse_sources[reverse_next[edge.second]++] = node_files[edge.first];
+    }
+    dirty.store(false, std::memory_order_release);
+}
+
+DependencyGraph::Range DependencyGraph::Dependencies(PathId file) const
+{
+    auto node = node_index.find(file);
+    if (node == node_index.end())
+        return Range(nullptr, nullptr);
+    Build();
+    const uint32_t* data = targets.data();
+    return Range(data + offsets[node->second], data + offsets[node->second + 1]);
+}
+
+DependencyGraph::Range DependencyGraph::Dependents(uint32_t dependency) const
+{
+    Build();
+    if (dependency + 1 >= reverse_offsets.size())
+        return Range(nullptr, nullptr);
+    const uint32_t* data = reverse_sources.data();
+    return Range(data + reverse_offsets[dependency], data + reverse_offsets[dependency + 1]);
+}
+
+std::vector<uint32_t> DependencyGraph::TopologicalOrder(const std::vector<PathId>& dependency_files,
+                                                        const std::vector<uint32_t>& rank) const
+{
+    std::unordered_map<PathId, uint32_t> dependency_of_file;
+    for (uint32_t n=0; n<dependency_files.size(); ++n)
+        dependency_of_file.emplace(dependency_files[n], n);
+
+    // ready dependencies leave in |rank| order, or in the order they became ready without one
+    uint32_t sequence = 0;
+    std::set<std::pair<uint32_t, uint32_t>> ready;
+    const auto push = [&](uint32_t dependency) {
+        ready.emplace(rank.empty() ? sequence++ : rank[dependency], dependency);
+    };
+
+    // number of dependencies each dependency still waits for
+    std::vector<uint32_t> pending(dependency_files.size(), 0);
+    for (uint32_t n=0; n<dependency_files.size(); ++n) {
+        for (uint32_t dependency : Dependencies(dependency_files[n])) {
+            if (dependency != n)
+                pending[n]++;
+        }
+        if (pending[n] == 0)
+            push(n);
+    }
+
+    std::vector<uint32_t> order;
+    std::vector<bool> emitted(dependency_files.size(), false);
+    while (!ready.empty()) {
+        uint32_t dependency = ready.begin()->second;
+        ready.erase(ready.begin());
+        order.push_back(dependency);
+        emitted[dependency] = true;
+        for (PathId file : Dependents(dependency)) {
+            auto dependent = dependency_of_file.find(file);
+            if (dependent == dependency_of_file.end() || dependent->second == dependency)
+                continue;
+            if (--pending[dependent->second] == 0)
+                push(dependent->second);
+        }
+    }
+
+    // dependencies that are part of a cycle keep their discovery or |rank| order
+    std::vector<uint32_t> cycles;
+    for (uint32_t n=0; n<dependency_files.size(); ++n) {
+        if (!emitted[n])
+            cycles.push_back(n);
+    }
+    if (!rank.empty())
+        std::sort(cycles.begin(), cycles.end(), [&](uint32_t a, uint32_t b) { return rank[a] < rank[b]; });
+    order.insert(order.end(), cycles.begin(), cycles.end());
+    return order;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_DEPENDENCYGRAPH_H
+#define DYLIBBUNDLER_DEPENDENCYGRAPH_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "PathTable.h"
+
+// Edges from files to the dependencies they load (indices into the dependency list).
+// Edges are appended while collecting, and laid out as compressed adjacency arrays (CSR)
+// in both directions the first time the graph is queried after a change. Queries may run
+// from several threads at once, but not while edges are added.
+class DependencyGraph {
+public:
+    class Range {
+    public:
+        Range(const uint32_t* first, const uint32_t* last) : first(first), last(last) {}
+        [[nodiscard]] const uint32_t* begin() const { return first; }
+        [[nodiscard]] const uint32_t* end() const { return last; }
+        [[nodiscard]] size_t size() const { return last - first; }
+        [[nodiscard]] bool empty() const { return first == last; }
+    private:
+        const uint32_t* first;
+        const uint32_t* last;
+    };
+
+    // returns false if |file| already had an edge to |dependency|
+    bool AddEdge(PathId file, uint32_t dependency);
+
+    [[nodiscard]] size_t EdgeCount() const { return edges.size(); }
+
+    // dependencies of |file|, in the order they were added
+    [[nodiscard]] Range Dependencies(PathId file) const;
+    // path ids of the files loading |dependency|
+    [[nodiscard]] Range Dependents(uint32_t dependency) const;
+
+    // Order the dependencies so that each one comes after the dependencies it loads itself.
+    // |dependency_files| maps each dependency to the file its own edges were collected for. Ties are
+    // broken by the lowest |rank| when given, by discovery order otherwise.
+    [[nodiscard]] std::vector<uint32_t> TopologicalOrder(const std::vector<PathId>& dependency_files,
+                                                         const std::vector<uint32_t>& rank = {}) const;
+
+private:
+    // lay out the arrays if edges were added since they were last built
+    void Build() const;
+
+    std::unordered_map<PathId, uint32_t> node_index;
+    std::vector<PathId> node_files;
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+    std::unordered_set<uint64_t> edge_keys;
+
+    mutable std::mutex build_mutex;
+    mutable std::atomic<bool> dirty{false};
+    mutable std::vector<uint32_t> offsets;
+    mutable std::vector<uint32_t> targets;
+    mutable std::vector<uint32_t> reverse_offsets;
+    mutable std::vector<uint32_t> reverse_sources;
+};
+
+#endif
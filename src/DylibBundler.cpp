@@ -1,10 +1,16 @@
 #include "DylibBundler.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <numeric>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 
 #ifdef __linux
@@ -14,176 +20,801 @@
 #include <sys/types.h>
 #endif
 
-#include "Dependency.h"
+#include "Archive.h"
+#include "BundleContext.h"
+#include "Cache.h"
+#include "Elf.h"
+#include "Reproducible.h"
+#include "Resolve.h"
 #include "Settings.h"
+#include "Strip.h"
+#include "Thin.h"
 #include "Utils.h"
 
-std::vector<Dependency> deps;
-std::map<std::string, std::vector<Dependency>> deps_per_file;
-std::map<std::string, bool> deps_collected;
-std::set<std::string> frameworks;
-std::set<std::string> rpaths;
-std::map<std::string, bool> rpaths_collected;
-bool qt_plugins_called = false;
+namespace {
 
-void addDependency(const std::string& path, const std::string& dependent_file)
+BundlerState& state() { return BundleContext::Current().bundler; }
+
+// make |found| the dependency |index|, which couldn't be found under the names it is loaded with
+void replaceMissingDependency(uint32_t index, Dependency found)
 {
-    Dependency dependency(path, dependent_file);
+    BundlerState& bundler = state();
+    Dependency& missing = bundler.deps[index];
+    missing.MergeIfIdentical(found);
+    // it is now found under the name of |found|, the first dependency with a name wins
+    auto old_name = bundler.deps_by_filename.find(missing.OriginalFilenameId());
+    if (old_name != bundler.deps_by_filename.end() && old_name->second == index)
+        bundler.deps_by_filename.erase(old_name);
+    auto new_name = bundler.deps_by_filename.emplace(found.OriginalFilenameId(), index).first;
+    new_name->second = std::min(new_name->second, index);
+    if (found.OriginalPath() != missing.OriginalPath())
+        found.AddSymlink(missing.OriginalPath());
+    if (found.IsFramework())
+        bundler.frameworks.insert(std::string(found.OriginalPath()));
+    missing = std::move(found);
+    // its install path may have changed with its name
+    bundler.install_paths.clear();
+    bundler.install_paths_indexed = 0;
+}
 
-    // check if this library was already added to |deps| to avoid duplicates
-    bool in_deps = false;
-    for (auto& dep : deps) {
-        if (dependency.MergeIfIdentical(dep))
-            in_deps = true;
+// builds the bundle on a copy-on-write layer over the filesystem, for as long as it lives
+class MemoryBundle {
+public:
+    explicit MemoryBundle(const std::string& root)
+        : context(BundleContext::Current()), lower(context.file_system)
+    {
+        overlay = std::make_shared<OverlayFileSystem>(lower, root);
+        context.file_system = overlay;
     }
+    ~MemoryBundle() { context.file_system = lower; }
+    MemoryBundle(const MemoryBundle&) = delete;
+    MemoryBundle& operator=(const MemoryBundle&) = delete;
 
-    // check if this library was already added to |deps_per_file[dependent_file]| to avoid duplicates
-    bool in_deps_per_file = false;
-    for (auto& dep : deps_per_file[dependent_file]) {
-        if (dependency.MergeIfIdentical(dep))
-            in_deps_per_file = true;
-    }
+    [[nodiscard]] bool InMemory(const std::string& path) const { return overlay->InMemory(path); }
+
+private:
+    BundleContext& context;
+    std::shared_ptr<FileSystem> lower;
+    std::shared_ptr<OverlayFileSystem> overlay;
+};
+
+} // namespace
+
+void addDependency(const std::string& path, const std::string& dependent_file, bool weak)
+{
+    BundlerState& bundler = state();
+    Dependency dependency(path, dependent_file);
+
+    // check if this library was already added to |deps| to avoid duplicates
+    size_t index = bundler.deps.size();
+    auto known = bundler.deps_by_filename.find(dependency.OriginalFilenameId());
+    if (known != bundler.deps_by_filename.end() && dependency.MergeIfIdentical(bundler.deps[known->second]))
+        index = known->second;
 
     // check if this library is in /usr/lib, /System/Library, or in ignored list
-    if (!Settings::isPrefixBundled(dependency.Prefix()))
+    if (!dependency.IsBundled())
         return;
 
-    if (!in_deps && dependency.IsFramework())
-        frameworks.insert(dependency.OriginalPath());
-    if (!in_deps)
-        deps.push_back(dependency);
-    if (!in_deps_per_file)
-        deps_per_file[dependent_file].push_back(dependency);
+    // dyld loads the files without weak libraries that can't be found
+    if (weak && dependency.IsMissing() && index == bundler.deps.size()) {
+        if (!Settings::quietOutput())
+            std::cerr << "  " << path << " is weakly linked by " << dependent_file << ", it won't be bundled\n";
+        return;
+    }
+
+    if (index == bundler.deps.size()) {
+        if (dependency.IsFramework() && !dependency.IsMissing())
+            bundler.frameworks.insert(std::string(dependency.OriginalPath()));
+        bundler.deps_by_filename.emplace(dependency.OriginalFilenameId(), static_cast<uint32_t>(index));
+        bundler.deps.push_back(dependency);
+    }
+    else if (bundler.deps[index].IsMissing() && !dependency.IsMissing()) {
+        // found through another path
+        replaceMissingDependency(static_cast<uint32_t>(index), dependency);
+    }
+    // duplicate edges of |dependent_file| are ignored by the graph
+    bundler.deps_per_file.AddEdge(pathTable().Intern(dependent_file), static_cast<uint32_t>(index));
 }
 
 void collectDependenciesRpaths(const std::string& dependent_file)
 {
-    if (deps_collected.find(dependent_file) != deps_collected.end() && Settings::fileHasRpath(dependent_file))
+    BundlerState& bundler = state();
+    PathId dependent_id = pathTable().Intern(dependent_file);
+    if (bundler.deps_collected.count(dependent_id) != 0 && Settings::fileHasRpath(dependent_file))
         return;
 
-    std::map<std::string,std::string> cmds_values;
-    std::string dylib = "LC_LOAD_DYLIB";
-    std::string rpath = "LC_RPATH";
-    cmds_values[dylib] = "name";
-    cmds_values[rpath] = "path";
-    std::map<std::string,std::vector<std::string>> cmds_results;
+    MachOSlice commands;
+    readLoadCommands(dependent_file, commands);
 
-    parseLoadCommands(dependent_file, cmds_values, cmds_results);
-
-    if (rpaths_collected.find(dependent_file) == rpaths_collected.end()) {
-        auto rpath_results = cmds_results[rpath];
-        for (const auto& rpath_result : rpath_results) {
-            rpaths.insert(rpath_result);
-            Settings::addRpathForFile(dependent_file, rpath_result);
+    if (bundler.rpaths_collected.count(dependent_id) == 0) {
+        for (const auto& rpath : commands.rpaths) {
+            bundler.rpaths.insert(rpath);
+            Settings::addRpathForFile(dependent_file, rpath);
             if (Settings::verboseOutput())
-                std::cout << "  rpath: " << rpath_result << std::endl;
+                std::cout << "  rpath: " << rpath << std::endl;
         }
-        rpaths_collected[dependent_file] = true;
+        bundler.rpaths_collected.insert(dependent_id);
     }
 
-    if (deps_collected.find(dependent_file) == deps_collected.end()) {
-        auto dylib_results = cmds_results[dylib];
-        for (const auto& dylib_result : dylib_results) {
+    if (bundler.deps_collected.count(dependent_id) == 0) {
+        std::vector<std::string>& dylibs = bundler.dylibs_per_file[dependent_id];
+        dylibs.clear();
+        for (const auto& dylib : commands.dylibs) {
+            dylibs.push_back(dylib.name);
             // skip system/ignored prefixes
-            if (Settings::isPrefixBundled(dylib_result))
-                addDependency(dylib_result, dependent_file);
+            if (Settings::isPrefixBundled(dylib.name))
+                addDependency(dylib.name, dependent_file, dylib.cmd == LC_LOAD_WEAK_DYLIB);
         }
-        deps_collected[dependent_file] = true;
+        bundler.deps_collected.insert(dependent_id);
+    }
+}
+
+// files loading dependency |index|, from one of the files to fix down to the dependency itself
+std::vector<std::string> dependencyChain(uint32_t index)
+{
+    BundlerState& bundler = state();
+    std::unordered_map<PathId, uint32_t> dependency_of_file;
+    for (uint32_t n=0; n<bundler.deps.size(); ++n)
+        dependency_of_file.emplace(bundler.deps[n].OriginalPathId(), n);
+
+    std::vector<std::string> chain{std::string(bundler.deps[index].OriginalPath())};
+    std::unordered_set<uint32_t> visited{index};
+    while (true) {
+        const DependencyGraph::Range dependents = bundler.deps_per_file.Dependents(index);
+        if (dependents.empty())
+            break;
+        PathId file = *dependents.begin();
+        chain.emplace_back(pathTable().View(file));
+        auto dependency = dependency_of_file.find(file);
+        if (dependency == dependency_of_file.end() || !visited.insert(dependency->second).second)
+            break;
+        index = dependency->second;
     }
+    std::reverse(chain.begin(), chain.end());
+    return chain;
+}
+
+// fail before anything is copied if dependency |index|, found at |path|, can't be thinned to the target architectures
+void checkArchitectures(uint32_t index, const std::string& path)
+{
+    const std::vector<std::string> archs = machOArchs(path);
+    std::vector<std::string> missing;
+    for (const auto& arch : Settings::targetArchs()) {
+        if (std::find(archs.begin(), archs.end(), arch) == archs.end())
+            missing.push_back(arch);
+    }
+    if (missing.empty())
+        return;
+
+    std::string message = path + " lacks architecture";
+    for (const auto& arch : missing)
+        message += " " + arch;
+    message += " (it has";
+    for (const auto& arch : archs)
+        message += " " + arch;
+    message += "), loaded through:";
+    const std::vector<std::string> chain = dependencyChain(index);
+    for (size_t n=0; n<chain.size(); ++n)
+        message += "\n  " + std::string(n == 0 ? "" : "-> ") + chain[n];
+    throw BundleError(message);
 }
 
 void collectSubDependencies()
 {
-    size_t dep_counter = deps.size();
+    BundlerState& bundler = state();
+    // earlier passes may have copied files into the search directories
+    Settings::refreshSearchPaths();
+    size_t dep_counter = bundler.deps.size();
     if (Settings::verboseOutput()) {
         std::cout << "(pre sub) # OF FILES: " << Settings::filesToFixCount() << std::endl;
-        std::cout << "(pre sub) # OF DEPS: " << deps.size() << std::endl;
+        std::cout << "(pre sub) # OF DEPS: " << bundler.deps.size() << std::endl;
     }
 
-    size_t deps_size = deps.size();
+    size_t deps_size = bundler.deps.size();
     while (true) {
-        deps_size = deps.size();
+        deps_size = bundler.deps.size();
         for (size_t n=0; n<deps_size; ++n) {
-            std::string original_path = deps[n].OriginalPath();
+            if (bundler.deps[n].IsMissing())
+                continue;
+            std::string original_path(bundler.deps[n].OriginalPath());
             if (Settings::verboseOutput())
                 std::cout << "  (collect sub deps) original path: " << original_path << std::endl;
             if (isRpath(original_path))
                 original_path = searchFilenameInRpaths(original_path);
+            if (!Settings::targetArchs().empty() && bundler.deps_collected.count(pathTable().Intern(original_path)) == 0
+                && !isElf(original_path))
+                checkArchitectures(static_cast<uint32_t>(n), original_path);
             collectDependenciesRpaths(original_path);
         }
         // if no more dependencies were added on this iteration, stop searching
-        if (deps.size() == deps_size)
+        if (bundler.deps.size() == deps_size)
             break;
     }
 
     if (Settings::verboseOutput()) {
         std::cout << "(post sub) # OF FILES: " << Settings::filesToFixCount() << std::endl;
-        std::cout << "(post sub) # OF DEPS: " << deps.size() << std::endl;
+        std::cout << "(post sub) # OF DEPS: " << bundler.deps.size() << std::endl;
     }
     if (Settings::bundleLibs() && Settings::bundleFrameworks()) {
-        if (!qt_plugins_called || (deps.size() != dep_counter))
+        if (!bundler.qt_plugins_called || (bundler.deps.size() != dep_counter))
             bundleQtPlugins();
     }
 }
 
-void changeLibPathsOnFile(const std::string& file_to_fix)
+bool resolveMissingDependencies()
 {
-    if (deps_collected.find(file_to_fix) == deps_collected.end() || rpaths_collected.find(file_to_fix) == rpaths_collected.end())
-        collectDependenciesRpaths(file_to_fix);
+    BundlerState& bundler = state();
+    std::vector<uint32_t> indices;
+    std::vector<MissingDependency> missing;
+    // the libraries that were found are often next to the missing ones
+    std::vector<std::string> candidates = Settings::userSearchPaths();
+    for (const auto& file : Settings::filesToFix())
+        candidates.emplace_back(filePrefix(file));
+    for (uint32_t n=0; n<bundler.deps.size(); ++n) {
+        const Dependency& dep = bundler.deps[n];
+        if (!dep.IsMissing()) {
+            candidates.emplace_back(dep.Prefix());
+            continue;
+        }
+        indices.push_back(n);
+        MissingDependency& dependency = missing.emplace_back();
+        dependency.filename = dep.OriginalFilename();
+        dependency.install_name = dep.OriginalPath();
+        for (PathId dependent : bundler.deps_per_file.Dependents(n))
+            dependency.dependents.emplace_back(pathTable().View(dependent));
+    }
+    if (missing.empty())
+        return false;
+
+    std::map<std::string, std::string> directories = resolveMissing(missing, candidates);
+    for (size_t n=0; n<missing.size(); ++n) {
+        const std::string& directory = directories[missing[n].filename];
+        Settings::addSearchPath(directory);
+        if (isRpath(missing[n].install_name))
+            Settings::rpathToFullPath(missing[n].install_name, directory + missing[n].filename);
+
+        Dependency resolved(missing[n].install_name, missing[n].dependents.front());
+        if (resolved.IsMissing())
+            throw BundleError("Dependency " + missing[n].install_name + " not found in " + directory);
+        replaceMissingDependency(indices[n], resolved);
+    }
+    return true;
+}
 
+// the install name changes changeLibPathsOnFile() makes to |file_to_fix|
+LoadCommandEdits installNameEdits(const std::string& original_file, const std::string& file_to_fix)
+{
+    BundlerState& bundler = state();
+    PathId original_id = pathTable().Intern(original_file);
+    if (bundler.deps_collected.count(original_id) == 0 || bundler.rpaths_collected.count(original_id) == 0)
+        collectDependenciesRpaths(original_file);
+
+    LoadCommandEdits edits;
+    for (uint32_t dependency : bundler.deps_per_file.Dependencies(original_id))
+        bundler.deps[dependency].AddInstallNameEdits(file_to_fix, edits);
+    return edits;
+}
+
+// The rpath leading |file_to_fix|, a copy of |original_file|, to the bundled dependencies. ELF files
+// have no @executable_path, their RUNPATH is relative to their own directory.
+std::string bundleRpathFor(const std::string& original_file, const std::string& file_to_fix)
+{
+    if (!isElf(original_file))
+        return Settings::insideLibPath();
+    std::string relative = relativePath(std::string(filePrefix(file_to_fix)), Settings::destFolder());
+    if (relative.empty())
+        return "$ORIGIN";
+    return "$ORIGIN/" + relative.substr(0, relative.size()-1);
+}
+
+// the rpath changes fixRpathsOnFile() makes to |file_to_fix|, a copy of |original_file|
+LoadCommandEdits rpathEdits(const std::string& original_file, const std::string& file_to_fix)
+{
+    LoadCommandEdits edits;
+    std::string bundle_rpath = bundleRpathFor(original_file, file_to_fix);
+    if (!Settings::fileHasRpath(original_file)) {
+        // ELF files load their bundled dependencies by name, only a RUNPATH leads to them
+        PathId original_id = pathTable().Intern(original_file);
+        if (isElf(original_file) && !state().deps_per_file.Dependencies(original_id).empty())
+            edits.rpaths.emplace_back("", bundle_rpath);
+        return edits;
+    }
+    for (const auto& rpath_to_fix : Settings::getRpathsForFile(original_file))
+        edits.rpaths.emplace_back(rpath_to_fix, bundle_rpath);
+    return edits;
+}
+
+bool changeLibPathsOnFile(const std::string& original_file, const std::string& file_to_fix)
+{
+    LoadCommandEdits edits = installNameEdits(original_file, file_to_fix);
     std::cout << "* Fixing dependencies on " << file_to_fix << "\n";
+    return changeLoadCommands(file_to_fix, edits);
+}
+
+bool fixRpathsOnFile(const std::string& original_file, const std::string& file_to_fix)
+{
+    return changeLoadCommands(file_to_fix, rpathEdits(original_file, file_to_fix));
+}
+
+bool isBundled(const std::string& install_path)
+{
+    BundlerState& bundler = state();
+    // the install paths are interned once, a probe is then a lookup without building strings
+    for (; bundler.install_paths_indexed < bundler.deps.size(); ++bundler.install_paths_indexed)
+        bundler.install_paths.insert(pathTable().Intern(bundler.deps[bundler.install_paths_indexed].InstallPath()));
+    PathId id = pathTable().Find(install_path);
+    return id != kInvalidPathId && bundler.install_paths.count(id) != 0;
+}
+
+bool rpathDirHasFile(const std::string& rpath_dir, const std::string& file)
+{
+    if (rpath_dir.empty())
+        return false;
+    return fileExists(rpath_dir + file) || isBundled(rpath_dir + file);
+}
+
+// the part of |install_name| looked up in each rpath directory: what follows @rpath/, or a whole
+// DT_NEEDED name without a slash. Empty if the name isn't searched for.
+std::string rpathRelativeName(const std::string& install_name)
+{
+    if (install_name.compare(0, 7, "@rpath/") == 0)
+        return install_name.substr(7);
+    return install_name.find('/') == std::string::npos ? install_name : "";
+}
+
+// estimate the number of paths dyld tries when loading |install_names| with the given resolved rpath stack
+size_t countRpathProbes(const std::vector<std::string>& install_names, const std::vector<std::string>& rpath_dirs)
+{
+    size_t probes = 0;
+    for (const auto& install_name : install_names) {
+        std::string suffix = rpathRelativeName(install_name);
+        if (suffix.empty()) {
+            probes += 1;
+            continue;
+        }
+        size_t n = 0;
+        while (n < rpath_dirs.size() && !rpathDirHasFile(rpath_dirs[n], suffix))
+            ++n;
+        probes += std::min(n + 1, rpath_dirs.size());
+    }
+    return probes;
+}
+
+RpathPlan planOptimizedRpaths(const std::string& original_file, const std::string& file_to_fix)
+{
+    BundlerState& bundler = state();
+    const std::vector<std::string> original_rpaths = Settings::getRpathsForFile(original_file);
+    PathId original_id = pathTable().Intern(original_file);
+    static const std::vector<std::string> no_install_names;
+    auto dylibs = bundler.dylibs_per_file.find(original_id);
+    const std::vector<std::string>& install_names = dylibs != bundler.dylibs_per_file.end() ? dylibs->second : no_install_names;
+    const DependencyGraph::Range dependencies = bundler.deps_per_file.Dependencies(original_id);
+    std::string bundle_root = Settings::appBundleProvided() ? Settings::appBundle() : Settings::destFolder();
+
+    // install names as they are after changeLibPathsOnFile()
+    std::vector<std::string> fixed_names;
+    for (const auto& install_name : install_names) {
+        std::string fixed_name = install_name;
+        for (uint32_t dependency : dependencies) {
+            if (bundler.deps[dependency].HasInstallName(install_name)) {
+                fixed_name = bundler.deps[dependency].InnerPathFor(file_to_fix);
+                break;
+            }
+        }
+        fixed_names.push_back(fixed_name);
+    }
+
+    std::vector<std::string> original_dirs;
+    for (const auto& rpath : original_rpaths)
+        original_dirs.push_back(resolveRpath(rpath, original_file));
+    size_t probes_before = countRpathProbes(install_names, original_dirs);
+
+    // candidate rpaths: the inner path first, then the original ones resolving inside the bundle
+    std::vector<std::pair<std::string,std::string>> candidates;
+    const std::string bundle_rpath = bundleRpathFor(original_file, file_to_fix);
+    candidates.emplace_back(bundle_rpath, Settings::destFolder());
+    for (const auto& rpath : original_rpaths) {
+        std::string rpath_dir = resolveRpath(rpath, file_to_fix);
+        if (rpath_dir.empty() || rpath_dir.find(bundle_root) != 0)
+            continue;
+        bool duplicate = std::any_of(candidates.begin(), candidates.end(), [&](const auto& candidate) {
+            return candidate.first == rpath || candidate.second == rpath_dir;
+        });
+        if (!duplicate)
+            candidates.emplace_back(rpath, rpath_dir);
+    }
+
+    // keep only the candidates that are the first match of some @rpath/ load command
+    std::vector<bool> used(candidates.size(), false);
+    for (const auto& fixed_name : fixed_names) {
+        std::string suffix = rpathRelativeName(fixed_name);
+        if (suffix.empty())
+            continue;
+        for (size_t n=0; n<candidates.size(); ++n) {
+            if (rpathDirHasFile(candidates[n].second, suffix)) {
+                used[n] = true;
+                break;
+            }
+        }
+    }
+    std::vector<std::string> needed;
+    std::vector<std::string> to_add;
+    for (size_t n=0; n<candidates.size(); ++n) {
+        if (!used[n])
+            continue;
+        needed.push_back(candidates[n].first);
+        if (std::find(original_rpaths.begin(), original_rpaths.end(), candidates[n].first) == original_rpaths.end())
+            to_add.push_back(candidates[n].first);
+    }
+
+    // reuse the slots of unneeded rpaths before adding new ones, and delete whatever is left over
+    LoadCommandEdits edits;
+    std::vector<std::string> final_rpaths;
+    size_t next_add = 0;
+    for (const auto& rpath : original_rpaths) {
+        bool keep = std::find(needed.begin(), needed.end(), rpath) != needed.end()
+                 && std::find(final_rpaths.begin(), final_rpaths.end(), rpath) == final_rpaths.end();
+        if (keep) {
+            final_rpaths.push_back(rpath);
+        }
+        else if (next_add < to_add.size()) {
+            edits.rpaths.emplace_back(rpath, to_add[next_add]);
+            final_rpaths.push_back(to_add[next_add++]);
+        }
+        else {
+            edits.rpaths.emplace_back(rpath, "");
+        }
+    }
+    for (; next_add < to_add.size(); ++next_add) {
+        edits.rpaths.emplace_back("", to_add[next_add]);
+        final_rpaths.push_back(to_add[next_add]);
+    }
 
-    std::vector<Dependency> dependencies = deps_per_file[file_to_fix];
-    for (auto& dependency : dependencies)
-        dependency.FixDependentFile(file_to_fix);
+    std::vector<std::string> final_dirs;
+    for (const auto& rpath : final_rpaths)
+        final_dirs.push_back(rpath == bundle_rpath ? Settings::destFolder() : resolveRpath(rpath, file_to_fix));
+
+    RpathPlan plan;
+    plan.edits = std::move(edits);
+    plan.probes_before = probes_before;
+    plan.probes_after = countRpathProbes(fixed_names, final_dirs);
+    plan.rpaths_before = original_rpaths.size();
+    plan.rpaths_kept = final_rpaths.size();
+    return plan;
 }
 
-void fixRpathsOnFile(const std::string& original_file, const std::string& file_to_fix)
+void recordRpathPlan(const RpathPlan& plan)
 {
-    std::vector<std::string> rpaths_to_fix;
-    if (!Settings::fileHasRpath(original_file))
+    BundlerState& bundler = state();
+    bundler.rpath_probes_before += plan.probes_before;
+    bundler.rpath_probes_after += plan.probes_after;
+    if (!Settings::quietOutput()) {
+        std::cout << "  rpath probes: " << plan.probes_before << " -> " << plan.probes_after
+                  << " (" << plan.rpaths_kept << " of " << plan.rpaths_before << " rpaths kept)\n";
+    }
+}
+
+bool optimizeRpathsOnFile(const std::string& original_file, const std::string& file_to_fix)
+{
+    RpathPlan plan = planOptimizedRpaths(original_file, file_to_fix);
+    bool changed = changeLoadCommands(file_to_fix, plan.edits);
+    recordRpathPlan(plan);
+    return changed;
+}
+
+void stripDependency(const std::string& install_path)
+{
+    uint64_t bytes_saved = 0;
+    if (!stripMachO(install_path, bytes_saved)) {
+        if (Settings::verboseOutput())
+            std::cout << "  not stripped: " << install_path << std::endl;
         return;
+    }
+    state().strip_bytes_saved += bytes_saved;
+    if (!Settings::quietOutput())
+        std::cout << "  stripped " << bytes_saved << " bytes from " << install_path << "\n";
+}
 
-    rpaths_to_fix = Settings::getRpathsForFile(original_file);
-    for (const auto& rpath_to_fix : rpaths_to_fix) {
-        std::string command = std::string("install_name_tool -rpath ") + rpath_to_fix + " " + Settings::insideLibPath() + " " + file_to_fix;
-        if (systemp(command) != 0) {
-            std::cerr << "\n\n/!\\ ERROR: An error occured while trying to fix rpath " << rpath_to_fix << " of " << file_to_fix << std::endl;
-            exit(1);
+// Plan the load command changes of every binary before modifying any of them, and refuse to go
+// on if one of them lacks the header padding to take its new, usually longer, paths, or is an
+// ELF file that can't take a new DT_RUNPATH.
+void checkHeaderPadding(const std::vector<std::string>& original_paths)
+{
+    BundlerState& bundler = state();
+    std::vector<std::string> failures;
+    bool elf_failures = false;
+    bool macho_failures = false;
+    const auto check = [&](const std::string& original_file, const std::string& file_to_fix, LoadCommandEdits edits) {
+        bool elf = isElf(original_file);
+        edits.install_names = installNameEdits(original_file, file_to_fix).install_names;
+        // rpath optimization never grows the rpaths by more than the inner path, but the entries of
+        // an ELF RUNPATH share one string and only the plan tells how long it gets
+        if (Settings::optimizeRpaths() && elf)
+            edits.rpaths = planOptimizedRpaths(original_file, file_to_fix).edits.rpaths;
+        else if (Settings::optimizeRpaths())
+            edits.rpaths.emplace_back("", Settings::insideLibPath());
+        else
+            edits.rpaths = rpathEdits(original_file, file_to_fix).rpaths;
+        if (elf) {
+            std::string problem = elfEditProblem(original_file, edits);
+            if (!problem.empty()) {
+                failures.push_back(file_to_fix + " (" + problem + ")");
+                elf_failures = true;
+            }
+            return;
+        }
+        uint64_t missing = missingHeaderPadding(original_file, edits);
+        if (missing > 0) {
+            failures.push_back(file_to_fix + " (" + std::to_string(missing) + " more bytes needed)");
+            macho_failures = true;
         }
+    };
+
+    for (size_t n=0; n<original_paths.size(); ++n) {
+        LoadCommandEdits edits;
+        edits.id = bundler.deps[n].InstallName();
+        check(original_paths[n], bundler.deps[n].InstallPath(), edits);
     }
+    for (const auto& file : Settings::filesToFix())
+        check(file, file, LoadCommandEdits());
+
+    if (failures.empty())
+        return;
+    std::string message = macho_failures ? "Not enough header padding to rewrite the load commands of:\n"
+                                         : "Can't rewrite the dynamic section of:\n";
+    for (const auto& failure : failures)
+        message += "  " + failure + "\n";
+    // the ELF strings grow into a new segment, only a missing dynamic entry for DT_RUNPATH is fatal
+    const std::string macho_fix = "with -headerpad_max_install_names";
+    const std::string elf_fix = "with an rpath (-Wl,-rpath,...) to edit";
+    if (macho_failures && elf_failures)
+        message += "Relink the Mach-O files " + macho_fix + " and the ELF files " + elf_fix;
+    else
+        message += "Relink them " + (elf_failures ? elf_fix : macho_fix);
+    message += ", nothing was changed";
+    throw BundleError(message);
+}
+
+// everything besides the original file that decides the contents of the bundled copy of |dep|
+std::string dependencyEditPlan(const Dependency& dep, const std::string& original_path, RpathPlan& rpath_plan)
+{
+    LoadCommandEdits edits = installNameEdits(original_path, dep.InstallPath());
+    edits.id = dep.InstallName();
+    if (Settings::optimizeRpaths()) {
+        rpath_plan = planOptimizedRpaths(original_path, dep.InstallPath());
+        edits.rpaths = rpath_plan.edits.rpaths;
+    }
+    else {
+        edits.rpaths = rpathEdits(original_path, dep.InstallPath()).rpaths;
+    }
+    std::string plan = edits.InstallNameToolArgs();
+    if (Settings::stripSymbols())
+        plan += " strip";
+    for (const auto& arch : Settings::targetArchs())
+        plan += " arch " + arch;
+    return plan;
+}
+
+// what a resumed run must share with the interrupted one for the journal to apply
+std::string journalPlan(const std::vector<std::string>& original_paths)
+{
+    BundlerState& bundler = state();
+    FileSystem& file_system = fileSystem();
+    std::string plan;
+    // a rebuilt original replaces the copy the interrupted run made
+    auto add_file = [&](const std::string& path) {
+        FileInfo info = file_system.Status(path);
+        plan += path + " " + std::to_string(info.size) + " " + std::to_string(info.mtime_sec) + "." + std::to_string(info.mtime_nsec);
+    };
+    for (size_t n=0; n<original_paths.size(); ++n) {
+        add_file(original_paths[n]);
+        plan += " -> " + bundler.deps[n].InnerPath() + " " + bundler.deps[n].InstallName() + "\n";
+    }
+    // the files to fix are changed in place, by the interrupted run too
+    for (const auto& file : Settings::filesToFix())
+        plan += file + "\n";
+    plan += Settings::insideLibPath();
+    if (Settings::stripSymbols())
+        plan += " strip";
+    if (Settings::optimizeRpaths())
+        plan += " optimize-rpaths";
+    if (Settings::minimalFrameworks())
+        plan += " minimal-frameworks";
+    for (const auto& resource : Settings::frameworkResources())
+        plan += " resource " + resource;
+    for (const auto& arch : Settings::targetArchs())
+        plan += " arch " + arch;
+    return plan;
 }
 
 void bundleDependencies()
 {
-    for (const auto& dep : deps)
+    BundlerState& bundler = state();
+    for (const auto& dep : bundler.deps)
         dep.Print();
     std::cout << "\n";
     if (Settings::verboseOutput()) {
         std::cout << "rpaths:" << std::endl;
-        for (const auto& rpath : rpaths)
+        for (const auto& rpath : bundler.rpaths)
             std::cout << "* " << rpath << std::endl;
     }
 
+    const auto fixRpaths = Settings::optimizeRpaths() ? optimizeRpathsOnFile : fixRpathsOnFile;
+
+    // the copies have the same load commands as the files their dependencies were collected from
+    std::vector<std::string> original_paths;
+    std::vector<PathId> original_ids;
+    if (Settings::bundleLibs()) {
+        for (const auto& dep : bundler.deps) {
+            std::string original_path(dep.OriginalPath());
+            if (isRpath(original_path))
+                original_path = searchFilenameInRpaths(original_path);
+            original_paths.push_back(original_path);
+            original_ids.push_back(pathTable().Intern(original_path));
+        }
+    }
+    checkHeaderPadding(original_paths);
+
     // copy & fix up dependencies
     if (Settings::bundleLibs()) {
         createDestDir();
-        for (const auto& dep : deps) {
-            dep.CopyToBundle();
-            changeLibPathsOnFile(dep.InstallPath());
-            fixRpathsOnFile(dep.OriginalPath(), dep.InstallPath());
+        bundler.journal.Open(Settings::destFolder(), journalPlan(original_paths), Settings::resume());
+        if (Settings::resume() && !bundler.journal.Resumed())
+            std::cout << "No journal of an interrupted run with the same files and options, starting over\n\n";
+        bool staged = !Settings::stagingFolder().empty();
+
+        // reproducible bundles don't depend on the order the dependencies were discovered in
+        std::vector<uint32_t> rank;
+        if (Settings::reproducible()) {
+            std::vector<uint32_t> by_path(bundler.deps.size());
+            std::iota(by_path.begin(), by_path.end(), 0);
+            std::sort(by_path.begin(), by_path.end(), [&](uint32_t a, uint32_t b) {
+                return bundler.deps[a].InstallPath() < bundler.deps[b].InstallPath();
+            });
+            rank.resize(by_path.size());
+            for (uint32_t n=0; n<by_path.size(); ++n)
+                rank[by_path[n]] = n;
+        }
+
+        for (uint32_t index : bundler.deps_per_file.TopologicalOrder(original_ids, rank)) {
+            const Dependency& dep = bundler.deps[index];
+            if (bundler.journal.Done("fix", dep.InstallPath())) {
+                ++bundler.operations_resumed;
+                continue;
+            }
+            // plain libraries patched the same way by an earlier build are taken from the cache
+            std::string cache_key;
+            if (!Settings::cacheDir().empty() && !dep.IsFramework() && !fileExists(dep.InstallPath())) {
+                RpathPlan rpath_plan;
+                cache_key = cacheKey(original_paths[index], dependencyEditPlan(dep, original_paths[index], rpath_plan));
+                if (!cache_key.empty() && restoreFromCache(cache_key, dep.InstallPath())) {
+                    std::cout << "* Reused " << dep.InstallPath() << " from the cache\n";
+                    if (Settings::optimizeRpaths())
+                        recordRpathPlan(rpath_plan);
+                    ++bundler.cache_hits;
+                    bundler.journal.Record("fix", dep.InstallPath());
+                    continue;
+                }
+            }
+
+            bool changed = false;
+            if (bundler.journal.Done("copy", dep.BundlePath())) {
+                ++bundler.operations_resumed;
+            }
+            else {
+                // whatever an interrupted run left there is copied again
+                if (staged)
+                    deleteFile(dep.BundlePath(), true);
+                changed = dep.CopyToBundle();
+                if (Settings::stripSymbols() && changed)
+                    stripDependency(dep.InstallPath());
+                bundler.journal.Record("copy", dep.BundlePath());
+            }
+            changed = changeLibPathsOnFile(original_paths[index], dep.InstallPath()) || changed;
+            changed = fixRpaths(original_paths[index], dep.InstallPath()) || changed;
+            if (!changed)
+                ++bundler.files_up_to_date;
+            bundler.journal.Record("fix", dep.InstallPath());
+            if (!cache_key.empty())
+                storeInCache(cache_key, dep.InstallPath());
+        }
+        commitDestDir();
+        if (!Settings::cacheDir().empty()) {
+            trimCache(Settings::cacheSizeLimit());
+            if (!Settings::quietOutput())
+                std::cout << "\nReused " << bundler.cache_hits << " of " << bundler.deps.size() << " dependencies from the cache\n";
         }
     }
     // fix up selected files
-    const auto files = Settings::filesToFix();
+    auto files = Settings::filesToFix();
+    if (Settings::reproducible())
+        std::sort(files.begin(), files.end());
     for (const auto& file : files) {
-        changeLibPathsOnFile(file);
-        fixRpathsOnFile(file, file);
+        if (bundler.journal.Done("fix", file)) {
+            ++bundler.operations_resumed;
+            continue;
+        }
+        bool changed = changeLibPathsOnFile(file, file);
+        changed = fixRpaths(file, file) || changed;
+        if (!changed)
+            ++bundler.files_up_to_date;
+        bundler.journal.Record("fix", file);
+    }
+    bundler.journal.Remove(Settings::destFolder());
+
+    if (bundler.journal.Resumed() && !Settings::quietOutput())
+        std::cout << "\nResumed an interrupted run: " << bundler.operations_resumed << " completed operations skipped\n";
+
+    if (bundler.files_up_to_date > 0 && !Settings::quietOutput()) {
+        std::cout << "\nSkipped " << bundler.files_up_to_date << " of " << original_paths.size() + files.size()
+                  << " files already up to date\n";
+    }
+
+    if (Settings::stripSymbols() && !Settings::quietOutput())
+        std::cout << "\nStripped symbols: " << bundler.strip_bytes_saved << " bytes saved\n";
+    if (Settings::optimizeRpaths() && !Settings::quietOutput())
+        std::cout << "\nEstimated dyld rpath probes: " << bundler.rpath_probes_before << " before, " << bundler.rpath_probes_after << " after\n";
+}
+
+void bundle()
+{
+    auto start = std::chrono::steady_clock::now();
+
+    // only the archive reaches the disk, the bundle itself is built in memory
+    std::unique_ptr<MemoryBundle> memory_bundle;
+    if (!Settings::outputArchive().empty()) {
+        if (Settings::resume())
+            throw BundleError("Cannot resume a bundle written to an archive, it is only kept in memory");
+        memory_bundle = std::make_unique<MemoryBundle>(Settings::appBundleProvided() ? Settings::appBundle()
+                                                                                      : Settings::finalDestFolder());
+        if (memory_bundle->InMemory(Settings::outputArchive()))
+            throw BundleError("The archive " + Settings::outputArchive() + " cannot be written inside the bundle");
+    }
+
+    std::cout << "Collecting dependencies...\n";
+
+    const std::vector<std::string> files_to_fix = Settings::filesToFix();
+    for (const auto& file_to_fix : files_to_fix)
+        collectDependenciesRpaths(file_to_fix);
+    collectSubDependencies();
+    while (resolveMissingDependencies())
+        collectSubDependencies();
+    try {
+        bundleDependencies();
+    }
+    catch (const BundleError&) {
+        discardDestDir();
+        throw;
+    }
+
+    std::string root = Settings::appBundleProvided() ? Settings::appBundle() : Settings::destFolder();
+    bool reproducible = Settings::reproducible() && fileExists(root);
+    if (reproducible)
+        normalizeTree(root);
+
+    if (!Settings::outputArchive().empty()) {
+        size_t entries = writeArchive(root, Settings::outputArchive());
+        if (!Settings::quietOutput())
+            std::cout << "\nArchived " << entries << " entries of " << root << " into " << Settings::outputArchive() << "\n";
+        if (reproducible)
+            normalizeTree(Settings::outputArchive());
+    }
+
+    if (reproducible)
+        std::cout << "\nBundle digest: sha256:" << treeDigest(root) << "\n";
+
+    waitForOldDestDir();
+    if (!Settings::quietOutput()) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "\nBundled " << state().deps.size() << " dependencies in " << std::fixed << std::setprecision(2)
+                  << elapsed.count() << " s, " << state().processes_spawned << " external tool runs, peak memory "
+                  << peakMemoryUsage() / (1024 * 1024) << " MB\n";
     }
 }
 
 void bundleQtPlugins()
 {
+    BundlerState& bundler = state();
     bool qtCoreFound = false;
     bool qtGuiFound = false;
     bool qtNetworkFound = false;
@@ -198,7 +829,7 @@ void bundleQtPlugins()
     bool qtWebViewFound = false;
     std::string original_file;
 
-    for (const auto& framework : frameworks) {
+    for (const auto& framework : bundler.frameworks) {
         if (framework.find("QtCore") != std::string::npos) {
             qtCoreFound = true;
             original_file = framework;
@@ -229,34 +860,30 @@ void bundleQtPlugins()
 
     if (!qtCoreFound)
         return;
-    if (!qt_plugins_called)
+    if (!bundler.qt_plugins_called)
         createQtConf(Settings::resourcesFolder());
-    qt_plugins_called = true;
-
-    const auto fixupPlugin = [original_file](const std::string& plugin) {
-        std::string dest = Settings::pluginsFolder();
-        std::string framework_root = getFrameworkRoot(original_file);
-        std::string prefix = filePrefix(framework_root);
-        std::string qt_prefix = filePrefix(prefix.substr(0, prefix.size()-1));
-        std::string qt_plugins_prefix = qt_prefix + "plugins/";
+    bundler.qt_plugins_called = true;
+
+    // Qt's plugins directory is next to its lib directory holding the frameworks
+    std::string_view prefix = filePrefix(getFrameworkRoot(original_file));
+    std::string qt_plugins_prefix(filePrefix(prefix.substr(0, prefix.size()-1)));
+    qt_plugins_prefix += "plugins/";
+    std::string dest = Settings::pluginsFolder();
+
+    const auto fixupPlugin = [&qt_plugins_prefix, &dest](const std::string& plugin) {
         if (fileExists(qt_plugins_prefix + plugin)) {
-            mkdir(dest + plugin);
             copyFile(qt_plugins_prefix + plugin, dest);
-            std::vector<std::string> files = lsDir(dest + plugin+"/");
+            std::string plugin_dir = dest + plugin + "/";
+            std::vector<std::string> files = lsDir(plugin_dir);
             for (const auto& file : files) {
-                Settings::addFileToFix(dest + plugin+"/"+file);
-                collectDependenciesRpaths(dest + plugin + "/" + file);
-                changeId(dest + plugin+"/"+file, "@rpath/" + plugin+"/"+file);
+                std::string path = plugin_dir + file;
+                Settings::addFileToFix(path);
+                collectDependenciesRpaths(path);
+                changeId(path, "@rpath/" + plugin + "/" + file);
             }
         }
     };
 
-    std::string framework_root = getFrameworkRoot(original_file);
-    std::string prefix = filePrefix(framework_root);
-    std::string qt_prefix = filePrefix(prefix.substr(0, prefix.size()-1));
-    std::string qt_plugins_prefix = qt_prefix + "plugins/";
-
-    std::string dest = Settings::pluginsFolder();
     mkdir(dest + "platforms");
     copyFile(qt_plugins_prefix + "platforms/libqcocoa.dylib", dest + "platforms");
     Settings::addFileToFix(dest + "platforms/libqcocoa.dylib");
@@ -267,7 +894,7 @@ void bundleQtPlugins()
     fixupPlugin("imageformats");
     fixupPlugin("iconengines");
     if (!qtSvgFound)
-        systemp(std::string("rm -f ") + dest + "imageformats/libqsvg.dylib");
+        deleteFile(dest + "imageformats/libqsvg.dylib", true);
     if (qtGuiFound) {
         fixupPlugin("platforminputcontexts");
         fixupPlugin("virtualkeyboard");
@@ -3,15 +3,85 @@
 #ifndef DYLIBBUNDLER_DYLIBBUNDLER_H
 #define DYLIBBUNDLER_DYLIBBUNDLER_H
 
+#include <cstdint>
+#include <future>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-void addDependency(const std::string& path, const std::string& dependent_file);
+#include "Dependency.h"
+#include "DependencyGraph.h"
+#include "Journal.h"
+#include "MachOEdit.h"
+#include "PathTable.h"
+
+// Dependencies collected for one bundle, owned by its BundleContext.
+struct BundlerState {
+    std::vector<Dependency> deps;
+    // index in |deps| of each original filename, the files MergeIfIdentical() considers the same
+    std::unordered_map<PathId, uint32_t> deps_by_filename;
+    // per-file state is keyed by the id of the file in the path table
+    DependencyGraph deps_per_file;
+    std::unordered_set<PathId> deps_collected;
+    std::set<std::string> frameworks;
+    std::set<std::string> rpaths;
+    std::unordered_set<PathId> rpaths_collected;
+    std::unordered_map<PathId, std::vector<std::string>> dylibs_per_file;
+    // ids of the InstallPath() of |deps| up to |install_paths_indexed|, see isBundled()
+    std::unordered_set<PathId> install_paths;
+    size_t install_paths_indexed = 0;
+    size_t rpath_probes_before = 0;
+    size_t rpath_probes_after = 0;
+    uint64_t strip_bytes_saved = 0;
+    // binaries left untouched because their load commands were already correct
+    size_t files_up_to_date = 0;
+    // dependencies taken from --cache-dir instead of being copied and patched
+    size_t cache_hits = 0;
+    // copies and fixes of the output directory, see --resume
+    Journal journal;
+    // operations an interrupted run had completed
+    size_t operations_resumed = 0;
+    // otool, install_name_tool and PlistBuddy runs
+    size_t processes_spawned = 0;
+    bool qt_plugins_called = false;
+    // deletion of the output directory replaced by the staged one
+    std::future<bool> old_dest_removal;
+};
+
+// rpath changes of optimizeRpathsOnFile() and the dyld probes they are estimated to save
+struct RpathPlan {
+    LoadCommandEdits edits;
+    size_t probes_before = 0;
+    size_t probes_after = 0;
+    size_t rpaths_before = 0;
+    size_t rpaths_kept = 0;
+};
+
+// |weak| dependencies (LC_LOAD_WEAK_DYLIB) are left out when they can't be found
+void addDependency(const std::string& path, const std::string& dependent_file, bool weak = false);
 void collectDependenciesRpaths(const std::string& dependent_file);
 void collectSubDependencies();
-void changeLibPathsOnFile(const std::string& file_to_fix);
-void fixRpathsOnFile(const std::string& original_file, const std::string& file_to_fix);
+// Find the dependencies collectSubDependencies() couldn't, all at once, and collect them again.
+// Returns false if there were none, throws BundleError if some can't be found.
+bool resolveMissingDependencies();
+// estimate the number of paths dyld tries when loading |install_names| with the given resolved rpath stack
+size_t countRpathProbes(const std::vector<std::string>& install_names, const std::vector<std::string>& rpath_dirs);
+// the fix-up functions return false if |file_to_fix| already had the right load commands
+bool changeLibPathsOnFile(const std::string& original_file, const std::string& file_to_fix);
+bool fixRpathsOnFile(const std::string& original_file, const std::string& file_to_fix);
+bool optimizeRpathsOnFile(const std::string& original_file, const std::string& file_to_fix);
+RpathPlan planOptimizedRpaths(const std::string& original_file, const std::string& file_to_fix);
+// add the probes of |plan| to the totals and print them
+void recordRpathPlan(const RpathPlan& plan);
+// throws BundleError, before anything is modified, if some binary can't take its new load commands
+void checkHeaderPadding(const std::vector<std::string>& original_paths);
+void stripDependency(const std::string& install_path);
 void bundleDependencies();
 void bundleQtPlugins();
 
+// collect the dependencies of the files to fix and bundle them, throws BundleError on failure
+void bundle();
+
 #endif
@@ -0,0 +1,725 @@
+#include "Elf.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <fnmatch.h>
+
+#include "FileSystem.h"
+#include "MachO.h"
+#include "Utils.h"
+
+namespace {
+
+constexpr unsigned char ELFCLASS32 = 1;
+constexpr unsigned char ELFCLASS64 = 2;
+constexpr unsigned char ELFDATA2LSB = 1;
+constexpr unsigned char ELFDATA2MSB = 2;
+
+constexpr uint32_t PT_LOAD = 1;
+constexpr uint32_t PT_DYNAMIC = 2;
+constexpr uint32_t PT_PHDR = 6;
+constexpr uint32_t PF_R = 4;
+constexpr uint32_t SHT_STRTAB = 3;
+constexpr uint32_t SHT_DYNSYM = 11;
+// e_phnum value saying the real count is elsewhere
+constexpr uint32_t PN_XNUM = 0xffff;
+
+// dynamic section tags, the ones from DT_NEEDED on hold string table offsets
+constexpr uint64_t DT_NULL = 0;
+constexpr uint64_t DT_NEEDED = 1;
+constexpr uint64_t DT_STRTAB = 5;
+constexpr uint64_t DT_STRSZ = 10;
+constexpr uint64_t DT_SONAME = 14;
+constexpr uint64_t DT_RPATH = 15;
+constexpr uint64_t DT_DEBUG = 21;
+constexpr uint64_t DT_RUNPATH = 29;
+constexpr uint64_t DT_CONFIG = 0x6ffffefa;
+constexpr uint64_t DT_DEPAUDIT = 0x6ffffefb;
+constexpr uint64_t DT_AUDIT = 0x6ffffefc;
+constexpr uint64_t DT_AUXILIARY = 0x7ffffffd;
+constexpr uint64_t DT_FILTER = 0x7fffffff;
+constexpr uint64_t DT_VERDEF = 0x6ffffffc;
+constexpr uint64_t DT_VERDEFNUM = 0x6ffffffd;
+constexpr uint64_t DT_VERNEED = 0x6ffffffe;
+constexpr uint64_t DT_VERNEEDNUM = 0x6fffffff;
+
+// no dynamic entry can take a new DT_RUNPATH
+constexpr size_t kNoEntry = SIZE_MAX;
+
+// read32() and read64() swap relative to the host byte order
+constexpr bool kHostBigEndian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+
+uint16_t read16(const unsigned char* p, bool swap)
+{
+    uint16_t value;
+    memcpy(&value, p, sizeof(value));
+    return swap ? __builtin_bswap16(value) : value;
+}
+
+void write16(unsigned char* p, uint16_t value, bool swap)
+{
+    if (swap)
+        value = __builtin_bswap16(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+uint64_t roundUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+struct DynamicEntry {
+    uint64_t tag;
+    uint64_t value;
+};
+
+struct DynamicSection {
+    bool is64 = false;
+    bool swap = false;
+    uint16_t machine = 0;
+    // the entries up to the first DT_NULL, entries[n] is in slot n of the section
+    std::vector<DynamicEntry> entries;
+    uint64_t dynamic_offset = 0;
+    size_t slot_count = 0;
+    // a spare DT_NULL slot, or else the DT_DEBUG entry, kNoEntry if there is neither
+    size_t spare_entry = kNoEntry;
+    // address, file offset and contents of the dynamic string table
+    uint64_t strtab_address = 0;
+    uint64_t strtab_offset = 0;
+    std::vector<char> strtab;
+    // string table offsets of the dynamic symbol and version names, only read for editing
+    std::vector<uint32_t> name_references;
+
+    // what a moved string table is laid out from
+    uint64_t file_size = 0;
+    std::vector<unsigned char> header;
+    std::vector<unsigned char> phdrs;
+    uint16_t phentsize = 0;
+    uint64_t shoff = 0;
+    uint16_t shentsize = 0;
+    uint16_t shnum = 0;
+    // vaddr - offset of the first PT_LOAD, the end of the last one in memory and their largest alignment
+    uint64_t load_base = 0;
+    uint64_t load_end = 0;
+    uint64_t load_alignment = 1;
+};
+
+// a string overwritten in the string table, |size| bytes from |offset| are written
+struct StringWrite {
+    uint64_t offset;
+    size_t size;
+    std::string value;
+};
+
+// The strings making a set of edits: overwritten in place where they fit, else appended to a copy
+// of the string table that moves to a new segment.
+struct StringPlan {
+    std::vector<StringWrite> writes;
+    // dynamic entries pointed at appended strings, by index, kNoEntry adds a DT_RUNPATH
+    std::vector<std::pair<size_t, std::string>> appends;
+};
+
+// bytes written at |offset| of the file
+struct Patch {
+    uint64_t offset;
+    std::vector<unsigned char> data;
+};
+
+bool isStringTag(uint64_t tag)
+{
+    switch (tag) {
+    case DT_NEEDED: case DT_SONAME: case DT_RPATH: case DT_RUNPATH:
+    case DT_CONFIG: case DT_DEPAUDIT: case DT_AUDIT: case DT_AUXILIARY: case DT_FILTER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Add the string table offsets used by the |count| Elf_Verdef (|definitions|) or Elf_Verneed
+// entries from |offset| to |names|.
+bool readVersionNames(const File& file, uint64_t offset, uint64_t count, bool definitions, bool swap, std::vector<uint32_t>& names)
+{
+    for (uint64_t n=0; n<count && offset != 0; ++n) {
+        // Elf_Verdef: vd_cnt at 6, vd_aux at 12, vd_next at 16
+        // Elf_Verneed: vn_cnt at 2, vn_file at 4, vn_aux at 8, vn_next at 12
+        unsigned char entry[20];
+        if (!file.Read(entry, definitions ? 20 : 16, offset))
+            return false;
+        if (!definitions)
+            names.push_back(read32(entry + 4, swap));
+        uint16_t aux_count = read16(entry + (definitions ? 6 : 2), swap);
+        uint64_t aux_offset = offset + read32(entry + (definitions ? 12 : 8), swap);
+        for (uint16_t a=0; a<aux_count; ++a) {
+            // Elf_Verdaux: vda_name at 0, vda_next at 4; Elf_Vernaux: vna_name at 8, vna_next at 12
+            unsigned char aux[16];
+            if (!file.Read(aux, definitions ? 8 : 16, aux_offset))
+                return false;
+            names.push_back(read32(aux + (definitions ? 0 : 8), swap));
+            uint32_t next = read32(aux + (definitions ? 4 : 12), swap);
+            if (next == 0)
+                break;
+            aux_offset += next;
+        }
+        uint32_t next = read32(entry + (definitions ? 16 : 12), swap);
+        offset = next == 0 ? 0 : offset + next;
+    }
+    return true;
+}
+
+// the names of the dynamic symbols and versions may share the tail of other strings, |with_symbols| reads them
+bool readDynamicSection(const File& file, DynamicSection& dynamic, bool with_symbols)
+{
+    uint64_t file_size = file.Size();
+    unsigned char header[64];
+    if (file_size < 52 || !file.Read(header, 16, 0) || memcmp(header, "\x7f" "ELF", 4) != 0)
+        return false;
+    if ((header[4] != ELFCLASS32 && header[4] != ELFCLASS64) || (header[5] != ELFDATA2LSB && header[5] != ELFDATA2MSB))
+        return false;
+    bool is64 = header[4] == ELFCLASS64;
+    bool swap = (header[5] == ELFDATA2MSB) != kHostBigEndian;
+    if (!file.Read(header, is64 ? 64 : 52, 0))
+        return false;
+    dynamic.is64 = is64;
+    dynamic.swap = swap;
+    dynamic.machine = read16(header + 18, swap);
+    uint64_t phoff = is64 ? read64(header + 32, swap) : read32(header + 28, swap);
+    uint64_t shoff = is64 ? read64(header + 40, swap) : read32(header + 32, swap);
+    uint16_t phentsize = read16(header + (is64 ? 54 : 42), swap);
+    uint16_t phnum = read16(header + (is64 ? 56 : 44), swap);
+    uint16_t shentsize = read16(header + (is64 ? 58 : 46), swap);
+    uint16_t shnum = read16(header + (is64 ? 60 : 48), swap);
+    dynamic.shoff = shoff;
+    dynamic.shentsize = shentsize;
+    dynamic.shnum = shnum;
+    if (phnum == 0 || phentsize < (is64 ? 56 : 32) || phoff + uint64_t(phnum) * phentsize > file_size)
+        return false;
+
+    std::vector<unsigned char> phdrs(size_t(phnum) * phentsize);
+    if (!file.Read(phdrs.data(), phdrs.size(), phoff))
+        return false;
+
+    // loadable segments map the addresses in the dynamic section to file offsets
+    struct Segment {
+        uint64_t address;
+        uint64_t offset;
+        uint64_t size;
+    };
+    std::vector<Segment> segments;
+    uint64_t dynamic_offset = 0;
+    uint64_t dynamic_size = 0;
+    for (uint16_t n=0; n<phnum; ++n) {
+        const unsigned char* phdr = phdrs.data() + size_t(n) * phentsize;
+        uint32_t type = read32(phdr, swap);
+        uint64_t offset = is64 ? read64(phdr + 8, swap) : read32(phdr + 4, swap);
+        uint64_t address = is64 ? read64(phdr + 16, swap) : read32(phdr + 8, swap);
+        uint64_t size = is64 ? read64(phdr + 32, swap) : read32(phdr + 16, swap);
+        uint64_t memory_size = is64 ? read64(phdr + 40, swap) : read32(phdr + 20, swap);
+        uint64_t alignment = is64 ? read64(phdr + 48, swap) : read32(phdr + 28, swap);
+        if (type == PT_LOAD) {
+            if (segments.empty())
+                dynamic.load_base = address - offset;
+            segments.push_back({address, offset, size});
+            dynamic.load_end = std::max(dynamic.load_end, address + memory_size);
+            dynamic.load_alignment = std::max(dynamic.load_alignment, alignment);
+        }
+        else if (type == PT_DYNAMIC) {
+            dynamic_offset = offset;
+            dynamic_size = size;
+        }
+    }
+    // statically linked files have nothing to bundle
+    if (dynamic_size == 0 || dynamic_offset + dynamic_size > file_size)
+        return false;
+    dynamic.file_size = file_size;
+    dynamic.header.assign(header, header + (is64 ? 64 : 52));
+    dynamic.phdrs = std::move(phdrs);
+    dynamic.phentsize = phentsize;
+    dynamic.dynamic_offset = dynamic_offset;
+
+    std::vector<unsigned char> entries(dynamic_size);
+    if (!file.Read(entries.data(), entries.size(), dynamic_offset))
+        return false;
+    size_t entry_size = is64 ? 16 : 8;
+    dynamic.slot_count = entries.size() / entry_size;
+    uint64_t strtab_size = 0;
+    for (size_t pos=0; pos + entry_size <= entries.size(); pos += entry_size) {
+        const unsigned char* entry = entries.data() + pos;
+        uint64_t tag = is64 ? read64(entry, swap) : read32(entry, swap);
+        uint64_t value = is64 ? read64(entry + 8, swap) : read32(entry + 4, swap);
+        if (tag == DT_NULL)
+            break;
+        if (tag == DT_STRTAB)
+            dynamic.strtab_address = value;
+        else if (tag == DT_STRSZ)
+            strtab_size = value;
+        else if (tag == DT_DEBUG && dynamic.spare_entry == kNoEntry)
+            dynamic.spare_entry = dynamic.entries.size();
+        dynamic.entries.push_back({tag, value});
+    }
+    // the DT_NULL ending the entries must stay, a second one is free
+    if (dynamic.entries.size() + 1 < dynamic.slot_count)
+        dynamic.spare_entry = dynamic.entries.size();
+
+    // file offset of the |size| bytes at |address|, 0 if no segment holds them
+    const auto file_offset = [&](uint64_t address, uint64_t size) -> uint64_t {
+        auto segment = std::find_if(segments.begin(), segments.end(), [&](const Segment& segment) {
+            return address >= segment.address && address + size <= segment.address + segment.size;
+        });
+        return segment == segments.end() ? 0 : segment->offset + (address - segment->address);
+    };
+    dynamic.strtab_offset = file_offset(dynamic.strtab_address, strtab_size);
+    if (strtab_size == 0 || dynamic.strtab_offset == 0 || dynamic.strtab_offset + strtab_size > file_size)
+        return false;
+    dynamic.strtab.resize(strtab_size);
+    if (!file.Read(dynamic.strtab.data(), dynamic.strtab.size(), dynamic.strtab_offset))
+        return false;
+    if (!with_symbols)
+        return true;
+
+    // the version needs and definitions name files and versions with strings of the table too
+    uint64_t verneed = 0, verneed_count = 0, verdef = 0, verdef_count = 0;
+    for (const auto& entry : dynamic.entries) {
+        if (entry.tag == DT_VERNEED)
+            verneed = file_offset(entry.value, 1);
+        else if (entry.tag == DT_VERNEEDNUM)
+            verneed_count = entry.value;
+        else if (entry.tag == DT_VERDEF)
+            verdef = file_offset(entry.value, 1);
+        else if (entry.tag == DT_VERDEFNUM)
+            verdef_count = entry.value;
+    }
+    if ((verneed_count > 0 && !readVersionNames(file, verneed, verneed_count, false, swap, dynamic.name_references)) ||
+        (verdef_count > 0 && !readVersionNames(file, verdef, verdef_count, true, swap, dynamic.name_references)))
+        return false;
+
+    // section headers are optional, without them no symbol is known to share a string
+    size_t section_size = is64 ? 64 : 40;
+    if (shoff == 0 || shentsize < section_size || shoff + uint64_t(shnum) * shentsize > file_size)
+        return true;
+    std::vector<unsigned char> shdrs(size_t(shnum) * shentsize);
+    if (!file.Read(shdrs.data(), shdrs.size(), shoff))
+        return false;
+    for (uint16_t n=0; n<shnum; ++n) {
+        const unsigned char* shdr = shdrs.data() + size_t(n) * shentsize;
+        if (read32(shdr + 4, swap) != SHT_DYNSYM)
+            continue;
+        uint64_t offset = is64 ? read64(shdr + 24, swap) : read32(shdr + 16, swap);
+        uint64_t size = is64 ? read64(shdr + 32, swap) : read32(shdr + 20, swap);
+        uint64_t symbol_size = is64 ? read64(shdr + 56, swap) : read32(shdr + 36, swap);
+        if (symbol_size < (is64 ? 24 : 16) || offset + size > file_size)
+            return false;
+        std::vector<unsigned char> symbols(size);
+        if (!file.Read(symbols.data(), symbols.size(), offset))
+            return false;
+        for (uint64_t pos=0; pos + symbol_size <= size; pos += symbol_size)
+            dynamic.name_references.push_back(read32(symbols.data() + pos, swap));
+    }
+    return true;
+}
+
+std::string tableString(const DynamicSection& dynamic, uint64_t offset)
+{
+    if (offset >= dynamic.strtab.size())
+        return "";
+    const char* begin = dynamic.strtab.data() + offset;
+    return std::string(begin, strnlen(begin, dynamic.strtab.size() - offset));
+}
+
+// the entry ld.so takes the search path of the file from
+const DynamicEntry* searchPathEntry(const DynamicSection& dynamic)
+{
+    const DynamicEntry* rpath = nullptr;
+    for (const auto& entry : dynamic.entries) {
+        if (entry.tag == DT_RUNPATH)
+            return &entry;
+        if (entry.tag == DT_RPATH && rpath == nullptr)
+            rpath = &entry;
+    }
+    return rpath;
+}
+
+// empty entries, which ld.so takes as the working directory, are dropped
+std::vector<std::string> splitSearchPath(const std::string& search_path)
+{
+    std::vector<std::string> rpaths;
+    std::string_view text = search_path;
+    std::string_view token;
+    while (nextToken(text, ":", token))
+        rpaths.emplace_back(token);
+    return rpaths;
+}
+
+// |rpaths| after |edits|, like rewriteCommands() in MachOEdit.cpp does with LC_RPATH commands,
+// returns false if an rpath to rename is missing
+bool applyRpathEdits(std::vector<std::string>& rpaths, const std::vector<std::pair<std::string,std::string>>& edits)
+{
+    std::vector<bool> done(edits.size(), false);
+    std::vector<std::string> result;
+    for (const auto& rpath : rpaths) {
+        size_t edit = 0;
+        while (edit < edits.size() && (done[edit] || edits[edit].first != rpath))
+            ++edit;
+        if (edit == edits.size()) {
+            result.push_back(rpath);
+            continue;
+        }
+        done[edit] = true;
+        if (!edits[edit].second.empty())
+            result.push_back(edits[edit].second);
+    }
+    for (size_t n=0; n<edits.size(); ++n) {
+        const std::string& new_path = edits[n].second;
+        if (done[n] || new_path.empty() || std::find(result.begin(), result.end(), new_path) != result.end())
+            continue;
+        if (!edits[n].first.empty())
+            return false;
+        result.push_back(new_path);
+    }
+
+    // renaming several rpaths to the same directory leaves it once, ld.so would only search it once anyway
+    rpaths.clear();
+    for (auto& rpath : result) {
+        if (std::find(rpaths.begin(), rpaths.end(), rpath) == rpaths.end())
+            rpaths.push_back(std::move(rpath));
+    }
+    return true;
+}
+
+// Plan the strings making |edits|, returns false if an rpath to rename is missing.
+bool planStrings(const DynamicSection& dynamic, const LoadCommandEdits& edits, StringPlan& plan)
+{
+    // Bytes of the string at |offset| that can be overwritten, with its terminator: the linker lets
+    // other strings share the tail of longer ones, which must stay in place.
+    const auto room = [&](uint64_t offset, size_t length) -> uint64_t {
+        uint64_t limit = std::min<uint64_t>(offset + length + 1, dynamic.strtab.size());
+        size_t at_offset = 0;
+        const auto add_reference = [&](uint64_t reference) {
+            if (reference == offset)
+                ++at_offset;
+            else if (reference > offset && reference < limit)
+                limit = reference;
+        };
+        for (const auto& entry : dynamic.entries) {
+            if (isStringTag(entry.tag))
+                add_reference(entry.value);
+        }
+        for (uint32_t name : dynamic.name_references)
+            add_reference(name);
+        return at_offset > 1 ? 0 : limit - offset;
+    };
+    const auto rewrite = [&](size_t entry, const std::string& value) {
+        uint64_t offset = dynamic.entries[entry].value;
+        std::string old_value = tableString(dynamic, offset);
+        if (value == old_value)
+            return;
+        uint64_t size = room(offset, old_value.size());
+        if (value.size() + 1 > size)
+            plan.appends.emplace_back(entry, value);
+        else
+            plan.writes.push_back({offset, static_cast<size_t>(size), value});
+    };
+
+    // libraries without a DT_SONAME are known by their file name, there is no id to change
+    for (size_t n=0; n<dynamic.entries.size(); ++n) {
+        const DynamicEntry& entry = dynamic.entries[n];
+        if (entry.tag == DT_SONAME && !edits.id.empty()) {
+            rewrite(n, edits.id);
+        }
+        else if (entry.tag == DT_NEEDED) {
+            std::string name = tableString(dynamic, entry.value);
+            auto change = std::find_if(edits.install_names.begin(), edits.install_names.end(),
+                                       [&](const auto& install_name) { return install_name.first == name; });
+            if (change != edits.install_names.end())
+                rewrite(n, change->second);
+        }
+    }
+
+    if (edits.rpaths.empty())
+        return true;
+    const DynamicEntry* search_path = searchPathEntry(dynamic);
+    std::vector<std::string> rpaths;
+    if (search_path != nullptr)
+        rpaths = splitSearchPath(tableString(dynamic, search_path->value));
+    if (!applyRpathEdits(rpaths, edits.rpaths))
+        return false;
+    std::string joined;
+    for (const auto& rpath : rpaths)
+        joined += (joined.empty() ? "" : ":") + rpath;
+    if (search_path != nullptr)
+        rewrite(static_cast<size_t>(search_path - dynamic.entries.data()), joined);
+    else if (!joined.empty())
+        plan.appends.emplace_back(kNoEntry, joined);
+    return true;
+}
+
+// Plan the file changes making |plan|. Strings that don't fit in place are appended to a copy of
+// the string table, which goes with a copy of the program headers to a new PT_LOAD segment at the
+// end of the file, like patchelf does. Returns false and why if that can't be done.
+bool planPatches(const File& file, const DynamicSection& dynamic, const StringPlan& plan, std::vector<Patch>& patches, std::string& problem)
+{
+    if (plan.appends.empty()) {
+        // the rest of the old string is cleared, nothing points into it
+        for (const auto& write : plan.writes) {
+            Patch& patch = patches.emplace_back(Patch{dynamic.strtab_offset + write.offset, std::vector<unsigned char>(write.size, 0)});
+            memcpy(patch.data.data(), write.value.data(), write.value.size());
+        }
+        return true;
+    }
+
+    // the old table stays as it is, so the offsets in the symbols and versions stay valid
+    std::vector<char> strtab = dynamic.strtab;
+    for (const auto& write : plan.writes) {
+        std::fill(strtab.begin() + write.offset, strtab.begin() + write.offset + write.size, '\0');
+        std::copy(write.value.begin(), write.value.end(), strtab.begin() + write.offset);
+    }
+    std::vector<DynamicEntry> entries = dynamic.entries;
+    for (const auto& append : plan.appends) {
+        uint64_t offset = strtab.size();
+        strtab.insert(strtab.end(), append.second.begin(), append.second.end());
+        strtab.push_back('\0');
+        if (append.first != kNoEntry) {
+            entries[append.first].value = offset;
+            continue;
+        }
+        // a DT_DEBUG entry only helps debuggers find the loaded libraries
+        if (dynamic.spare_entry == kNoEntry) {
+            problem = "no spare dynamic entry for a DT_RUNPATH";
+            return false;
+        }
+        if (dynamic.spare_entry == entries.size())
+            entries.push_back({DT_RUNPATH, offset});
+        else
+            entries[dynamic.spare_entry] = {DT_RUNPATH, offset};
+    }
+
+    // The new segment maps the file at the same distance from the first one, where the kernels
+    // that don't look for the PT_LOAD holding e_phoff expect the program headers to be.
+    bool is64 = dynamic.is64;
+    bool swap = dynamic.swap;
+    size_t phnum = dynamic.phdrs.size() / dynamic.phentsize;
+    if (phnum + 1 >= PN_XNUM) {
+        problem = "too many program headers";
+        return false;
+    }
+    uint64_t alignment = std::max<uint64_t>(dynamic.load_alignment, 4096);
+    uint64_t offset = roundUp(std::max(dynamic.file_size, dynamic.load_end - dynamic.load_base), alignment);
+    uint64_t address = dynamic.load_base + offset;
+    uint64_t strtab_start = roundUp((phnum + 1) * dynamic.phentsize, 8);
+    uint64_t size = strtab_start + strtab.size();
+    if (!is64 && address + size > UINT32_MAX) {
+        problem = "no address space left for a new segment";
+        return false;
+    }
+    const auto write_word = [&](unsigned char* p, uint64_t value) {
+        if (is64)
+            write64(p, value, swap);
+        else
+            write32(p, static_cast<uint32_t>(value), swap);
+    };
+
+    // the new PT_LOAD goes after the last one, they must be sorted by address
+    Patch segment{offset, std::vector<unsigned char>(size, 0)};
+    size_t insert_at = 0;
+    for (size_t n=0; n<phnum; ++n) {
+        if (read32(dynamic.phdrs.data() + n * dynamic.phentsize, swap) == PT_LOAD)
+            insert_at = n + 1;
+    }
+    for (size_t n=0, out=0; n<phnum; ++n, ++out) {
+        if (n == insert_at)
+            ++out;
+        unsigned char* phdr = segment.data.data() + out * dynamic.phentsize;
+        memcpy(phdr, dynamic.phdrs.data() + n * dynamic.phentsize, dynamic.phentsize);
+        if (read32(phdr, swap) != PT_PHDR)
+            continue;
+        write_word(phdr + (is64 ? 8 : 4), offset);
+        write_word(phdr + (is64 ? 16 : 8), address);
+        write_word(phdr + (is64 ? 24 : 12), address);
+        write_word(phdr + (is64 ? 32 : 16), (phnum + 1) * dynamic.phentsize);
+        write_word(phdr + (is64 ? 40 : 20), (phnum + 1) * dynamic.phentsize);
+    }
+    unsigned char* load = segment.data.data() + insert_at * dynamic.phentsize;
+    write32(load, PT_LOAD, swap);
+    write32(load + (is64 ? 4 : 24), PF_R, swap);
+    write_word(load + (is64 ? 8 : 4), offset);
+    write_word(load + (is64 ? 16 : 8), address);
+    write_word(load + (is64 ? 24 : 12), address);
+    write_word(load + (is64 ? 32 : 16), size);
+    write_word(load + (is64 ? 40 : 20), size);
+    write_word(load + (is64 ? 48 : 28), alignment);
+    std::copy(strtab.begin(), strtab.end(), segment.data.begin() + strtab_start);
+    patches.push_back(std::move(segment));
+
+    Patch header{0, dynamic.header};
+    write_word(header.data.data() + (is64 ? 32 : 28), offset);
+    write16(header.data.data() + (is64 ? 56 : 44), static_cast<uint16_t>(phnum + 1), swap);
+    patches.push_back(std::move(header));
+
+    // the whole dynamic section is written again, with DT_NULL after the entries
+    size_t entry_size = is64 ? 16 : 8;
+    Patch section{dynamic.dynamic_offset, std::vector<unsigned char>(dynamic.slot_count * entry_size, 0)};
+    for (size_t n=0; n<entries.size(); ++n) {
+        uint64_t value = entries[n].value;
+        if (entries[n].tag == DT_STRTAB)
+            value = address + strtab_start;
+        else if (entries[n].tag == DT_STRSZ)
+            value = strtab.size();
+        write_word(section.data.data() + n * entry_size, entries[n].tag);
+        write_word(section.data.data() + n * entry_size + entry_size / 2, value);
+    }
+    patches.push_back(std::move(section));
+
+    // tools reading the sections, like strip, find the new table through the .dynstr header
+    size_t section_size = is64 ? 64 : 40;
+    if (dynamic.shoff == 0 || dynamic.shentsize < section_size)
+        return true;
+    for (uint16_t n=0; n<dynamic.shnum; ++n) {
+        Patch shdr{dynamic.shoff + uint64_t(n) * dynamic.shentsize, std::vector<unsigned char>(section_size)};
+        if (!file.Read(shdr.data.data(), section_size, shdr.offset))
+            return true;
+        uint64_t section_address = is64 ? read64(shdr.data.data() + 16, swap) : read32(shdr.data.data() + 12, swap);
+        if (read32(shdr.data.data() + 4, swap) != SHT_STRTAB || section_address != dynamic.strtab_address)
+            continue;
+        write_word(shdr.data.data() + (is64 ? 16 : 12), address + strtab_start);
+        write_word(shdr.data.data() + (is64 ? 24 : 16), offset + strtab_start);
+        write_word(shdr.data.data() + (is64 ? 32 : 20), strtab.size());
+        patches.push_back(std::move(shdr));
+        break;
+    }
+    return true;
+}
+
+void readLdSoConf(const std::string& path, std::vector<std::string>& directories, int depth)
+{
+    std::vector<unsigned char> data;
+    if (depth > 8 || !fileSystem().ReadFile(path, data))
+        return;
+
+    const char* blanks = " \t\r";
+    std::string_view text(reinterpret_cast<const char*>(data.data()), data.size());
+    std::string_view line;
+    while (nextToken(text, "\n", line)) {
+        line = line.substr(0, line.find('#'));
+        size_t start = line.find_first_not_of(blanks);
+        if (start == std::string_view::npos)
+            continue;
+        line = line.substr(start, line.find_last_not_of(blanks) + 1 - start);
+
+        if (line.compare(0, 8, "include ") == 0 || line.compare(0, 8, "include\t") == 0) {
+            std::string_view pattern = line.substr(8);
+            pattern.remove_prefix(std::min(pattern.size(), pattern.find_first_not_of(blanks)));
+            std::string include(pattern);
+            // relative includes are relative to the including file
+            if (!include.empty() && include[0] != '/')
+                include = std::string(filePrefix(path)) + include;
+            std::string directory(filePrefix(include));
+            std::string name_pattern(stripPrefix(include));
+            std::vector<std::string> names;
+            fileSystem().ListDirectory(directory, names);
+            std::sort(names.begin(), names.end());
+            for (const auto& name : names) {
+                if (fnmatch(name_pattern.c_str(), name.c_str(), 0) == 0)
+                    readLdSoConf(directory + name, directories, depth + 1);
+            }
+            continue;
+        }
+        if (line.compare(0, 6, "hwcap ") == 0)
+            continue;
+
+        // several directories may share a line, old files append "=TYPE" to them
+        std::string_view token;
+        while (nextToken(line, " \t,:", token)) {
+            std::string directory(token.substr(0, token.find('=')));
+            if (directory.empty() || directory[0] != '/')
+                continue;
+            if (directory[directory.size()-1] != '/')
+                directory += "/";
+            directories.push_back(directory);
+        }
+    }
+}
+
+} // namespace
+
+bool isElf(const std::string& path)
+{
+    std::unique_ptr<File> file = fileSystem().Open(path, OpenMode::Read);
+    unsigned char magic[4];
+    return file && file->Read(magic, sizeof(magic), 0) && memcmp(magic, "\x7f" "ELF", 4) == 0;
+}
+
+bool readElf(const std::string& path, ElfInfo& info)
+{
+    std::unique_ptr<File> file = fileSystem().Open(path, OpenMode::Read);
+    DynamicSection dynamic;
+    if (!file || !readDynamicSection(*file, dynamic, false))
+        return false;
+
+    info.is64 = dynamic.is64;
+    info.machine = dynamic.machine;
+    for (const auto& entry : dynamic.entries) {
+        if (entry.tag == DT_NEEDED)
+            info.needed.push_back(tableString(dynamic, entry.value));
+        else if (entry.tag == DT_SONAME)
+            info.soname = tableString(dynamic, entry.value);
+    }
+    const DynamicEntry* search_path = searchPathEntry(dynamic);
+    if (search_path != nullptr) {
+        info.has_runpath = search_path->tag == DT_RUNPATH;
+        info.rpaths = splitSearchPath(tableString(dynamic, search_path->value));
+    }
+    return true;
+}
+
+EditResult editElf(const std::string& path, const LoadCommandEdits& edits)
+{
+    if (edits.Empty())
+        return EditResult::Unchanged;
+
+    // plan read-only so that files already in the requested state are never opened for writing
+    FileSystem& file_system = fileSystem();
+    std::vector<Patch> patches;
+    {
+        std::unique_ptr<File> file = file_system.Open(path, OpenMode::Read);
+        DynamicSection dynamic;
+        StringPlan plan;
+        std::string problem;
+        if (!file || !readDynamicSection(*file, dynamic, true) || !planStrings(dynamic, edits, plan) ||
+            !planPatches(*file, dynamic, plan, patches, problem))
+            return EditResult::Unsupported;
+    }
+    if (patches.empty())
+        return EditResult::Unchanged;
+
+    std::unique_ptr<File> file = file_system.Open(path, OpenMode::ReadWrite);
+    if (!file)
+        return EditResult::Unsupported;
+    for (const auto& patch : patches) {
+        if (!file->Write(patch.data.data(), patch.data.size(), patch.offset))
+            return EditResult::Unsupported;
+    }
+    return EditResult::Edited;
+}
+
+std::string elfEditProblem(const std::string& path, const LoadCommandEdits& edits)
+{
+    std::unique_ptr<File> file = fileSystem().Open(path, OpenMode::Read);
+    DynamicSection dynamic;
+    StringPlan plan;
+    std::vector<Patch> patches;
+    std::string problem;
+    if (edits.Empty() || !file || !readDynamicSection(*file, dynamic, true) || !planStrings(dynamic, edits, plan))
+        return "";
+    planPatches(*file, dynamic, plan, patches, problem);
+    return problem;
+}
+
+std::vector<std::string> ldSoConfDirectories(const std::string& conf_path)
+{
+    std::vector<std::string> directories;
+    readLdSoConf(conf_path, directories, 0);
+    return directories;
+}
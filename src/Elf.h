@@ -0,0 +1,42 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_ELF_H
+#define DYLIBBUNDLER_ELF_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "MachOEdit.h"
+
+// The dynamic section of an ELF shared library or executable.
+struct ElfInfo {
+    bool is64 = false;
+    uint16_t machine = 0;
+    std::string soname;
+    // DT_NEEDED entries, in load order
+    std::vector<std::string> needed;
+    // DT_RUNPATH entries, or the DT_RPATH ones if there is no DT_RUNPATH (ld.so ignores DT_RPATH then)
+    std::vector<std::string> rpaths;
+    bool has_runpath = false;
+};
+
+bool isElf(const std::string& path);
+// returns false if |path| isn't a readable, dynamically linked ELF file
+bool readElf(const std::string& path, ElfInfo& info);
+
+// Apply |edits| to the dynamic section of |path| in place, with the meaning they have for Mach-O
+// files: id renames DT_SONAME, install_names rename DT_NEEDED entries and rpaths edit the entries
+// of DT_RUNPATH (DT_RPATH without one), which are then written back as one ':' separated string.
+// Strings are overwritten in their slot of the dynamic string table when they fit, else the table
+// moves to a new segment where they are appended. A new DT_RUNPATH takes a spare DT_NULL entry or
+// the DT_DEBUG one, Unsupported is returned if there is neither.
+EditResult editElf(const std::string& path, const LoadCommandEdits& edits);
+
+// why editElf() can't make |edits| to |path|, empty if it can
+std::string elfEditProblem(const std::string& path, const LoadCommandEdits& edits);
+
+// directories listed in ld.so.conf and the files it includes, in order
+std::vector<std::string> ldSoConfDirectories(const std::string& conf_path = "/etc/ld.so.conf");
+
+#endif
@@ -0,0 +1,940 @@
+#include "FileSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "BundleContext.h"
+
+namespace {
+
+constexpr int kMaxSymlinks = 40;
+
+class PosixFile : public File {
+public:
+    explicit PosixFile(int fd) : fd(fd) {}
+    ~PosixFile() override { close(fd); }
+    PosixFile(const PosixFile&) = delete;
+    PosixFile& operator=(const PosixFile&) = delete;
+
+    [[nodiscard]] uint64_t Size() const override
+    {
+        struct stat st;
+        return fstat(fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+    }
+    bool Read(void* buffer, size_t size, uint64_t offset) const override
+    {
+        return pread(fd, buffer, size, static_cast<off_t>(offset)) == static_cast<ssize_t>(size);
+    }
+    bool Write(const void* buffer, size_t size, uint64_t offset) override
+    {
+        return pwrite(fd, buffer, size, static_cast<off_t>(offset)) == static_cast<ssize_t>(size);
+    }
+    bool Truncate(uint64_t size) override { return ftruncate(fd, static_cast<off_t>(size)) == 0; }
+    bool Sync() override { return fsync(fd) == 0; }
+
+private:
+    int fd;
+};
+
+FileInfo posixInfo(const struct stat& st)
+{
+    FileInfo info;
+    info.type = S_ISREG(st.st_mode) ? FileType::Regular
+              : S_ISDIR(st.st_mode) ? FileType::Directory
+              : S_ISLNK(st.st_mode) ? FileType::Symlink
+              : FileType::Other;
+    info.mode = st.st_mode & 07777;
+    info.size = static_cast<uint64_t>(st.st_size);
+#ifdef __APPLE__
+    info.mtime_sec = st.st_mtimespec.tv_sec;
+    info.mtime_nsec = st.st_mtimespec.tv_nsec;
+#else
+    info.mtime_sec = st.st_mtim.tv_sec;
+    info.mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+    info.device = static_cast<uint64_t>(st.st_dev);
+    info.inode = static_cast<uint64_t>(st.st_ino);
+    return info;
+}
+
+std::string joinPath(const std::string& directory, const std::string& name)
+{
+    if (!directory.empty() && directory[directory.size()-1] == '/')
+        return directory + name;
+    return directory + "/" + name;
+}
+
+// push the components of |path| on |pending| so that the first one is popped first
+void pushComponents(const std::string& path, std::vector<std::string>& pending)
+{
+    std::vector<std::string> components;
+    size_t begin = 0;
+    while (begin <= path.size()) {
+        size_t end = path.find('/', begin);
+        if (end == std::string::npos)
+            end = path.size();
+        std::string component = path.substr(begin, end - begin);
+        if (!component.empty() && component != ".")
+            components.push_back(component);
+        begin = end + 1;
+    }
+    pending.insert(pending.end(), components.rbegin(), components.rend());
+}
+
+} // namespace
+
+bool FileSystem::ReadFile(const std::string& path, std::vector<unsigned char>& data)
+{
+    std::unique_ptr<File> file = Open(path, OpenMode::Read);
+    if (!file)
+        return false;
+    data.resize(static_cast<size_t>(file->Size()));
+    return data.empty() || file->Read(data.data(), data.size(), 0);
+}
+
+bool FileSystem::WriteFile(const std::string& path, const void* data, size_t size, uint32_t mode)
+{
+    std::unique_ptr<File> file = Open(path, OpenMode::Create, mode);
+    return file && (size == 0 || file->Write(data, size, 0));
+}
+
+bool FileSystem::CreateDirectories(const std::string& path)
+{
+    size_t end = 0;
+    while (end != std::string::npos) {
+        end = path.find('/', end + 1);
+        std::string directory = path.substr(0, end);
+        if (directory.empty() || Status(directory).type == FileType::Directory)
+            continue;
+        if (!CreateDirectory(directory) && Status(directory).type != FileType::Directory)
+            return false;
+    }
+    return true;
+}
+
+bool FileSystem::RemoveAll(const std::string& path)
+{
+    if (LinkStatus(path).type == FileType::Directory) {
+        std::vector<std::string> names;
+        if (!ListDirectory(path, names))
+            return false;
+        for (const auto& name : names) {
+            if (!RemoveAll(joinPath(path, name)))
+                return false;
+        }
+    }
+    return Remove(path);
+}
+
+bool FileSystem::Copy(const std::string& from, const std::string& to, bool overwrite)
+{
+    std::string source = from;
+    while (source.size() > 1 && source[source.size()-1] == '/')
+        source.erase(source.size()-1);
+    if (Status(to).type == FileType::Directory && LinkStatus(source).type != FileType::Missing)
+        return CopyTree(source, joinPath(to, source.substr(source.rfind('/') + 1)), overwrite);
+    return CopyTree(source, to, overwrite);
+}
+
+bool FileSystem::CopyTree(const std::string& from, const std::string& to, bool overwrite)
+{
+    FileInfo source = LinkStatus(from);
+    FileInfo dest = LinkStatus(to);
+    if (source.type == FileType::Directory) {
+        if (dest.type == FileType::Missing && !CreateDirectory(to, source.mode | 0700))
+            return false;
+        if (Status(to).type != FileType::Directory)
+            return false;
+        std::vector<std::string> names;
+        if (!ListDirectory(from, names))
+            return false;
+        std::sort(names.begin(), names.end());
+        for (const auto& name : names) {
+            if (!CopyTree(joinPath(from, name), joinPath(to, name), overwrite))
+                return false;
+        }
+        return true;
+    }
+
+    // existing files are left alone without |overwrite|, like cp -n
+    if (dest.type != FileType::Missing && !overwrite)
+        return true;
+    if (dest.type == FileType::Directory)
+        return false;
+    if (source.type == FileType::Symlink) {
+        std::string target;
+        if (!ReadLink(from, target))
+            return false;
+        return (dest.type == FileType::Missing || Remove(to)) && CreateSymlink(target, to);
+    }
+    if (source.type != FileType::Regular)
+        return false;
+    if (dest.type == FileType::Symlink && !Remove(to))
+        return false;
+    if (CopyContents(from, to, source.mode))
+        return true;
+    // a read-only destination is replaced, like cp -f
+    return dest.type == FileType::Regular && Remove(to) && CopyContents(from, to, source.mode);
+}
+
+bool FileSystem::CopyContents(const std::string& from, const std::string& to, uint32_t mode)
+{
+    std::unique_ptr<File> in = Open(from, OpenMode::Read);
+    if (!in)
+        return false;
+    std::unique_ptr<File> out = Open(to, OpenMode::Create, mode);
+    if (!out)
+        return false;
+
+    std::vector<unsigned char> buffer(1 << 20);
+    uint64_t size = in->Size();
+    uint64_t offset = 0;
+    while (offset < size) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size - offset, buffer.size()));
+        if (!in->Read(buffer.data(), chunk, offset) || !out->Write(buffer.data(), chunk, offset))
+            return false;
+        offset += chunk;
+    }
+    return true;
+}
+
+bool FileSystem::MakeWritable(const std::string& path)
+{
+    FileInfo info = LinkStatus(path);
+    if (info.type == FileType::Missing)
+        return false;
+    if (info.type == FileType::Symlink)
+        return true;
+    if ((info.mode & 0200) == 0 && !SetMode(path, info.mode | 0200))
+        return false;
+    if (info.type != FileType::Directory)
+        return true;
+
+    std::vector<std::string> names;
+    if (!ListDirectory(path, names))
+        return false;
+    for (const auto& name : names) {
+        if (!MakeWritable(joinPath(path, name)))
+            return false;
+    }
+    return true;
+}
+
+std::unique_ptr<File> PosixFileSystem::Open(const std::string& path, OpenMode mode, uint32_t create_mode)
+{
+    int flags = mode == OpenMode::Read ? O_RDONLY : mode == OpenMode::ReadWrite ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC;
+    int fd = open(path.c_str(), flags, static_cast<mode_t>(create_mode));
+    if (fd < 0)
+        return nullptr;
+    return std::make_unique<PosixFile>(fd);
+}
+
+FileInfo PosixFileSystem::Status(const std::string& path) const
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? posixInfo(st) : FileInfo();
+}
+
+FileInfo PosixFileSystem::LinkStatus(const std::string& path) const
+{
+    struct stat st;
+    return lstat(path.c_str(), &st) == 0 ? posixInfo(st) : FileInfo();
+}
+
+bool PosixFileSystem::IsWritable(const std::string& path) const
+{
+    return access(path.c_str(), W_OK) == 0;
+}
+
+std::string PosixFileSystem::RealPath(const std::string& path) const
+{
+    char buffer[PATH_MAX];
+    return realpath(path.c_str(), buffer) ? std::string(buffer) : std::string();
+}
+
+bool PosixFileSystem::ReadLink(const std::string& path, std::string& target) const
+{
+    char buffer[PATH_MAX];
+    ssize_t size = readlink(path.c_str(), buffer, sizeof(buffer));
+    if (size < 0)
+        return false;
+    target.assign(buffer, static_cast<size_t>(size));
+    return true;
+}
+
+bool PosixFileSystem::ListDirectory(const std::string& path, std::vector<std::string>& names) const
+{
+    DIR* dir = opendir(path.c_str());
+    if (dir == nullptr)
+        return false;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            names.emplace_back(entry->d_name);
+    }
+    closedir(dir);
+    return true;
+}
+
+bool PosixFileSystem::CreateDirectory(const std::string& path, uint32_t mode)
+{
+    return ::mkdir(path.c_str(), static_cast<mode_t>(mode)) == 0;
+}
+
+bool PosixFileSystem::CreateSymlink(const std::string& target, const std::string& link)
+{
+    return symlink(target.c_str(), link.c_str()) == 0;
+}
+
+bool PosixFileSystem::Remove(const std::string& path)
+{
+    return ::remove(path.c_str()) == 0;
+}
+
+bool PosixFileSystem::Rename(const std::string& from, const std::string& to)
+{
+    return ::rename(from.c_str(), to.c_str()) == 0;
+}
+
+bool PosixFileSystem::CloneFile(const std::string& from, const std::string& to)
+{
+#if defined(__APPLE__)
+    return clonefile(from.c_str(), to.c_str(), CLONE_NOFOLLOW) == 0;
+#elif defined(__linux__) && defined(FICLONE)
+    int in = open(from.c_str(), O_RDONLY);
+    if (in < 0)
+        return false;
+    struct stat info {};
+    int out = fstat(in, &info) == 0 && S_ISREG(info.st_mode) ? open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, info.st_mode & 07777) : -1;
+    bool cloned = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    if (out >= 0)
+        close(out);
+    close(in);
+    if (out >= 0 && !cloned)
+        unlink(to.c_str());
+    return cloned;
+#else
+    (void)from;
+    (void)to;
+    return false;
+#endif
+}
+
+bool PosixFileSystem::Exchange(const std::string& a, const std::string& b)
+{
+#if defined(__APPLE__) && defined(RENAME_SWAP)
+    return renamex_np(a.c_str(), b.c_str(), RENAME_SWAP) == 0;
+#elif defined(__linux__) && defined(RENAME_EXCHANGE)
+    return renameat2(AT_FDCWD, a.c_str(), AT_FDCWD, b.c_str(), RENAME_EXCHANGE) == 0;
+#else
+    (void)a;
+    (void)b;
+    return false;
+#endif
+}
+
+bool PosixFileSystem::SetMode(const std::string& path, uint32_t mode)
+{
+    return chmod(path.c_str(), static_cast<mode_t>(mode)) == 0;
+}
+
+bool PosixFileSystem::SetTimes(const std::string& path, int64_t mtime_sec, int64_t mtime_nsec)
+{
+    struct timespec times[2];
+    times[0].tv_sec = static_cast<time_t>(mtime_sec);
+    times[0].tv_nsec = static_cast<long>(mtime_nsec);
+    times[1] = times[0];
+    return utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+class MemoryFileSystem::OpenFile : public File {
+public:
+    OpenFile(MemoryFileSystem& file_system, std::shared_ptr<Node> node, bool writable)
+        : file_system(file_system), node(std::move(node)), writable(writable) {}
+
+    [[nodiscard]] uint64_t Size() const override
+    {
+        std::lock_guard<std::mutex> lock(file_system.mutex);
+        return node->data.size();
+    }
+    bool Read(void* buffer, size_t size, uint64_t offset) const override
+    {
+        std::lock_guard<std::mutex> lock(file_system.mutex);
+        if (offset > node->data.size() || size > node->data.size() - offset)
+            return false;
+        if (size != 0)
+            memcpy(buffer, node->data.data() + offset, size);
+        return true;
+    }
+    bool Write(const void* buffer, size_t size, uint64_t offset) override
+    {
+        std::lock_guard<std::mutex> lock(file_system.mutex);
+        if (!writable)
+            return false;
+        if (offset + size > node->data.size())
+            node->data.resize(static_cast<size_t>(offset + size));
+        if (size != 0)
+            memcpy(node->data.data() + offset, buffer, size);
+        node->mtime = file_system.Now();
+        return true;
+    }
+    bool Truncate(uint64_t size) override
+    {
+        std::lock_guard<std::mutex> lock(file_system.mutex);
+        if (!writable)
+            return false;
+        node->data.resize(static_cast<size_t>(size));
+        node->mtime = file_system.Now();
+        return true;
+    }
+    bool Sync() override { return true; }
+
+private:
+    MemoryFileSystem& file_system;
+    // kept alive like an open file descriptor, even if the file is removed
+    std::shared_ptr<Node> node;
+    bool writable;
+};
+
+MemoryFileSystem::MemoryFileSystem() : root(std::make_shared<Node>())
+{
+    root->type = FileType::Directory;
+    root->mode = 0755;
+    root->inode = next_inode++;
+    root->mtime = Now();
+}
+
+int64_t MemoryFileSystem::Now()
+{
+    // strictly increasing, so that every change is seen by mtime checks
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    last_time = std::max<int64_t>(last_time + 1, std::chrono::duration_cast<std::chrono::nanoseconds>(now).count());
+    return last_time;
+}
+
+MemoryFileSystem::Location MemoryFileSystem::Lookup(const std::string& path, bool follow_last) const
+{
+    Location location;
+    if (path.empty())
+        return location;
+    // a trailing slash requires a directory, so the last symlink is followed
+    if (path[path.size()-1] == '/')
+        follow_last = true;
+
+    std::vector<std::pair<std::string, std::shared_ptr<Node>>> chain{{"", root}};
+    std::vector<std::string> pending;
+    pushComponents(path, pending);
+    int links = 0;
+    while (!pending.empty()) {
+        std::string name = pending.back();
+        pending.pop_back();
+        const std::shared_ptr<Node> directory = chain.back().second;
+        if (directory->type != FileType::Directory)
+            return location;
+        if (name == "..") {
+            if (chain.size() > 1)
+                chain.pop_back();
+            continue;
+        }
+
+        auto it = directory->children.find(name);
+        if (it == directory->children.end()) {
+            if (!pending.empty())
+                return location;
+            location.valid = true;
+            location.parent = directory;
+            location.name = name;
+            for (size_t n=1; n<chain.size(); ++n)
+                location.real_path += "/" + chain[n].first;
+            location.real_path += "/" + name;
+            return location;
+        }
+        if (it->second->type == FileType::Symlink && (!pending.empty() || follow_last)) {
+            if (++links > kMaxSymlinks)
+                return location;
+            const std::string& target = it->second->target;
+            if (!target.empty() && target[0] == '/')
+                chain.resize(1);
+            pushComponents(target, pending);
+            continue;
+        }
+        chain.emplace_back(name, it->second);
+    }
+
+    location.valid = true;
+    location.node = chain.back().second;
+    location.name = chain.back().first;
+    if (chain.size() > 1)
+        location.parent = chain[chain.size()-2].second;
+    for (size_t n=1; n<chain.size(); ++n)
+        location.real_path += "/" + chain[n].first;
+    if (location.real_path.empty())
+        location.real_path = "/";
+    return location;
+}
+
+std::shared_ptr<MemoryFileSystem::Node> MemoryFileSystem::AddNode(const Location& location, FileType type, uint32_t mode)
+{
+    auto node = std::make_shared<Node>();
+    node->type = type;
+    node->mode = mode & 07777;
+    node->inode = next_inode++;
+    node->mtime = Now();
+    location.parent->children[location.name] = node;
+    location.parent->mtime = node->mtime;
+    return node;
+}
+
+FileInfo MemoryFileSystem::Info(const Location& location) const
+{
+    FileInfo info;
+    if (!location.node)
+        return info;
+    const Node& node = *location.node;
+    info.type = node.type;
+    info.mode = node.mode;
+    info.size = node.type == FileType::Symlink ? node.target.size() : node.data.size();
+    info.mtime_sec = node.mtime / 1000000000;
+    info.mtime_nsec = node.mtime % 1000000000;
+    info.device = 1;
+    info.inode = node.inode;
+    return info;
+}
+
+std::unique_ptr<File> MemoryFileSystem::Open(const std::string& path, OpenMode mode, uint32_t create_mode)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(path, true);
+    if (!location.valid)
+        return nullptr;
+    std::shared_ptr<Node> node = location.node;
+    if (!node) {
+        if (mode != OpenMode::Create || location.parent->children.count(location.name) != 0)
+            return nullptr;
+        node = AddNode(location, FileType::Regular, create_mode);
+    }
+    else if (node->type != FileType::Regular) {
+        return nullptr;
+    }
+    else if (mode == OpenMode::Create) {
+        if ((node->mode & 0200) == 0)
+            return nullptr;
+        node->data.clear();
+        node->mtime = Now();
+    }
+    else if (mode == OpenMode::ReadWrite && (node->mode & 0200) == 0) {
+        return nullptr;
+    }
+    return std::make_unique<OpenFile>(*this, node, mode != OpenMode::Read);
+}
+
+FileInfo MemoryFileSystem::Status(const std::string& path) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return Info(Lookup(path, true));
+}
+
+FileInfo MemoryFileSystem::LinkStatus(const std::string& path) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return Info(Lookup(path, false));
+}
+
+bool MemoryFileSystem::IsWritable(const std::string& path) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(path, true);
+    return location.node && (location.node->mode & 0200) != 0;
+}
+
+std::string MemoryFileSystem::RealPath(const std::string& path) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(path, true);
+    return location.node ? location.real_path : std::string();
+}
+
+bool MemoryFileSystem::ReadLink(const std::string& path, std::string& target) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(path, false);
+    if (!location.node || location.node->type != FileType::Symlink)
+        return false;
+    target = location.node->target;
+    return true;
+}
+
+bool MemoryFileSystem::ListDirectory(const std::string& path, std::vector<std::string>& names) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(path, true);
+    if (!location.node || location.node->type != FileType::Directory)
+        return false;
+    for (const auto& child : location.node->children)
+        names.push_back(child.first);
+    return true;
+}
+
+bool MemoryFileSystem::CreateDirectory(const std::string& path, uint32_t mode)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(path, false);
+    if (!location.valid || location.node)
+        return false;
+    AddNode(location, FileType::Directory, mode);
+    return true;
+}
+
+bool MemoryFileSystem::CreateSymlink(const std::string& target, const std::string& link)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(link, false);
+    if (!location.valid || location.node || target.empty())
+        return false;
+    AddNode(location, FileType::Symlink, 0755)->target = target;
+    return true;
+}
+
+bool MemoryFileSystem::Remove(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(path, false);
+    if (!location.node || !location.parent)
+        return false;
+    if (location.node->type == FileType::Directory && !location.node->children.empty())
+        return false;
+    location.parent->children.erase(location.name);
+    location.parent->mtime = Now();
+    return true;
+}
+
+bool MemoryFileSystem::Rename(const std::string& from, const std::string& to)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location source = Lookup(from, false);
+    Location dest = Lookup(to, false);
+    if (!source.node || !source.parent || !dest.valid || !dest.parent)
+        return false;
+    if (source.node == dest.node)
+        return true;
+    // a directory can't move below itself
+    if (source.node->type == FileType::Directory && dest.real_path.compare(0, source.real_path.size() + 1, source.real_path + "/") == 0)
+        return false;
+    if (dest.node) {
+        bool source_is_directory = source.node->type == FileType::Directory;
+        bool dest_is_directory = dest.node->type == FileType::Directory;
+        if (source_is_directory != dest_is_directory || (dest_is_directory && !dest.node->children.empty()))
+            return false;
+    }
+    std::shared_ptr<Node> node = source.node;
+    source.parent->children.erase(source.name);
+    dest.parent->children[dest.name] = node;
+    source.parent->mtime = Now();
+    dest.parent->mtime = source.parent->mtime;
+    return true;
+}
+
+bool MemoryFileSystem::CloneFile(const std::string& from, const std::string& to)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location source = Lookup(from, true);
+    Location dest = Lookup(to, false);
+    if (!source.node || source.node->type != FileType::Regular || !dest.valid || dest.node)
+        return false;
+    AddNode(dest, FileType::Regular, source.node->mode)->data = source.node->data;
+    return true;
+}
+
+bool MemoryFileSystem::Exchange(const std::string& a, const std::string& b)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location first = Lookup(a, false);
+    Location second = Lookup(b, false);
+    if (!first.node || !first.parent || !second.node || !second.parent)
+        return false;
+    if (first.node == second.node)
+        return true;
+    // neither may end up below itself
+    if (first.real_path.compare(0, second.real_path.size() + 1, second.real_path + "/") == 0
+        || second.real_path.compare(0, first.real_path.size() + 1, first.real_path + "/") == 0)
+        return false;
+    first.parent->children[first.name] = second.node;
+    second.parent->children[second.name] = first.node;
+    first.parent->mtime = Now();
+    second.parent->mtime = first.parent->mtime;
+    return true;
+}
+
+bool MemoryFileSystem::SetMode(const std::string& path, uint32_t mode)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(path, true);
+    if (!location.node)
+        return false;
+    location.node->mode = mode & 07777;
+    return true;
+}
+
+bool MemoryFileSystem::SetTimes(const std::string& path, int64_t mtime_sec, int64_t mtime_nsec)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Location location = Lookup(path, false);
+    if (!location.node)
+        return false;
+    location.node->mtime = mtime_sec * 1000000000 + mtime_nsec;
+    return true;
+}
+
+namespace {
+
+// |path| without "." and ".." components or repeated slashes, absolute if |base| is
+std::string normalizePath(const std::string& base, const std::string& path)
+{
+    std::vector<std::string> components;
+    std::vector<std::string> pending;
+    pushComponents(path, pending);
+    if (path.empty() || path[0] != '/')
+        pushComponents(base, pending);
+    while (!pending.empty()) {
+        if (pending.back() != "..")
+            components.push_back(pending.back());
+        else if (!components.empty())
+            components.pop_back();
+        pending.pop_back();
+    }
+    std::string normalized;
+    for (const auto& component : components)
+        normalized += "/" + component;
+    return normalized.empty() ? "/" : normalized;
+}
+
+bool isPathBelow(const std::string& path, const std::string& directory)
+{
+    return path.compare(0, directory.size(), directory) == 0
+        && (path.size() == directory.size() || path[directory.size()] == '/' || directory == "/");
+}
+
+} // namespace
+
+OverlayFileSystem::OverlayFileSystem(std::shared_ptr<FileSystem> lower, const std::string& root) : lower(std::move(lower))
+{
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) != nullptr)
+        working_directory = cwd;
+    this->root = normalizePath(working_directory, root);
+
+    // the same tree may be reached through a symlinked parent
+    std::string existing = this->root;
+    std::string rest;
+    while (existing != "/" && this->lower->Status(existing).type == FileType::Missing) {
+        rest = existing.substr(existing.rfind('/')) + rest;
+        existing.erase(existing.rfind('/'));
+        if (existing.empty())
+            existing = "/";
+    }
+    std::string real_existing = this->lower->RealPath(existing);
+    real_root = normalizePath("/", (real_existing.empty() ? existing : real_existing) + rest);
+
+    upper.CreateDirectories(this->root);
+    if (this->lower->LinkStatus(this->root).type != FileType::Missing) {
+        upper.Remove(this->root);
+        Import(this->root);
+    }
+}
+
+void OverlayFileSystem::Import(const std::string& path)
+{
+    FileInfo info = lower->LinkStatus(path);
+    if (info.type == FileType::Directory) {
+        upper.CreateDirectory(path, info.mode | 0700);
+        std::vector<std::string> names;
+        lower->ListDirectory(path, names);
+        for (const auto& name : names)
+            Import(joinPath(path, name));
+        upper.SetMode(path, info.mode);
+    }
+    else if (info.type == FileType::Symlink) {
+        std::string target;
+        if (lower->ReadLink(path, target))
+            upper.CreateSymlink(target, path);
+    }
+    else if (info.type == FileType::Regular) {
+        std::vector<unsigned char> data;
+        if (!lower->ReadFile(path, data) || !upper.WriteFile(path, data.data(), data.size(), info.mode))
+            return;
+    }
+    else {
+        return;
+    }
+    upper.SetTimes(path, info.mtime_sec, info.mtime_nsec);
+}
+
+bool OverlayFileSystem::Route(const std::string& path, std::string& normalized) const
+{
+    normalized = normalizePath(working_directory, path);
+    bool in_memory = isPathBelow(normalized, root);
+    if (!in_memory && isPathBelow(normalized, real_root)) {
+        normalized = root + normalized.substr(real_root.size());
+        in_memory = true;
+    }
+    // a trailing slash still asks for a directory
+    if (!path.empty() && path[path.size()-1] == '/' && normalized != "/")
+        normalized += "/";
+    return in_memory;
+}
+
+bool OverlayFileSystem::AboveRoot(const std::string& normalized) const
+{
+    std::string directory = normalized;
+    while (directory.size() > 1 && directory[directory.size()-1] == '/')
+        directory.erase(directory.size()-1);
+    return isPathBelow(root, directory) && directory != root;
+}
+
+bool OverlayFileSystem::InMemory(const std::string& path) const
+{
+    std::string normalized;
+    return Route(path, normalized);
+}
+
+std::unique_ptr<File> OverlayFileSystem::Open(const std::string& path, OpenMode mode, uint32_t create_mode)
+{
+    std::string normalized;
+    return Route(path, normalized) ? upper.Open(normalized, mode, create_mode) : lower->Open(path, mode, create_mode);
+}
+
+FileInfo OverlayFileSystem::Status(const std::string& path) const
+{
+    std::string normalized;
+    if (Route(path, normalized))
+        return upper.Status(normalized);
+    FileInfo info = lower->Status(path);
+    return info.type == FileType::Missing && AboveRoot(normalized) ? upper.Status(normalized) : info;
+}
+
+FileInfo OverlayFileSystem::LinkStatus(const std::string& path) const
+{
+    std::string normalized;
+    if (Route(path, normalized))
+        return upper.LinkStatus(normalized);
+    FileInfo info = lower->LinkStatus(path);
+    return info.type == FileType::Missing && AboveRoot(normalized) ? upper.LinkStatus(normalized) : info;
+}
+
+bool OverlayFileSystem::IsWritable(const std::string& path) const
+{
+    std::string normalized;
+    return Route(path, normalized) ? upper.IsWritable(normalized) : lower->IsWritable(path);
+}
+
+std::string OverlayFileSystem::RealPath(const std::string& path) const
+{
+    std::string normalized;
+    if (Route(path, normalized))
+        return upper.RealPath(normalized);
+    std::string real_path = lower->RealPath(path);
+    return real_path.empty() && AboveRoot(normalized) ? upper.RealPath(normalized) : real_path;
+}
+
+bool OverlayFileSystem::ReadLink(const std::string& path, std::string& target) const
+{
+    std::string normalized;
+    return Route(path, normalized) ? upper.ReadLink(normalized, target) : lower->ReadLink(path, target);
+}
+
+bool OverlayFileSystem::ListDirectory(const std::string& path, std::vector<std::string>& names) const
+{
+    std::string normalized;
+    return Route(path, normalized) ? upper.ListDirectory(normalized, names) : lower->ListDirectory(path, names);
+}
+
+bool OverlayFileSystem::CreateDirectory(const std::string& path, uint32_t mode)
+{
+    std::string normalized;
+    if (Route(path, normalized))
+        return upper.CreateDirectory(normalized, mode);
+    // nothing is created outside of memory on the way to |root|
+    if (AboveRoot(normalized) && lower->Status(path).type == FileType::Missing)
+        return true;
+    return lower->CreateDirectory(path, mode);
+}
+
+bool OverlayFileSystem::CreateSymlink(const std::string& target, const std::string& link)
+{
+    std::string normalized;
+    return Route(link, normalized) ? upper.CreateSymlink(target, normalized) : lower->CreateSymlink(target, link);
+}
+
+bool OverlayFileSystem::Remove(const std::string& path)
+{
+    std::string normalized;
+    return Route(path, normalized) ? upper.Remove(normalized) : lower->Remove(path);
+}
+
+bool OverlayFileSystem::Rename(const std::string& from, const std::string& to)
+{
+    std::string normalized_from;
+    std::string normalized_to;
+    bool from_memory = Route(from, normalized_from);
+    if (from_memory != Route(to, normalized_to))
+        return false;
+    return from_memory ? upper.Rename(normalized_from, normalized_to) : lower->Rename(from, to);
+}
+
+bool OverlayFileSystem::CloneFile(const std::string& from, const std::string& to)
+{
+    std::string normalized_from;
+    std::string normalized_to;
+    bool from_memory = Route(from, normalized_from);
+    if (from_memory != Route(to, normalized_to))
+        return false;
+    return from_memory ? upper.CloneFile(normalized_from, normalized_to) : lower->CloneFile(from, to);
+}
+
+bool OverlayFileSystem::Exchange(const std::string& a, const std::string& b)
+{
+    std::string normalized_a;
+    std::string normalized_b;
+    bool a_memory = Route(a, normalized_a);
+    if (a_memory != Route(b, normalized_b))
+        return false;
+    return a_memory ? upper.Exchange(normalized_a, normalized_b) : lower->Exchange(a, b);
+}
+
+bool OverlayFileSystem::SetMode(const std::string& path, uint32_t mode)
+{
+    std::string normalized;
+    return Route(path, normalized) ? upper.SetMode(normalized, mode) : lower->SetMode(path, mode);
+}
+
+bool OverlayFileSystem::SetTimes(const std::string& path, int64_t mtime_sec, int64_t mtime_nsec)
+{
+    std::string normalized;
+    return Route(path, normalized) ? upper.SetTimes(normalized, mtime_sec, mtime_nsec) : lower->SetTimes(path, mtime_sec, mtime_nsec);
+}
+
+std::shared_ptr<FileSystem> hostFileSystem()
+{
+    static std::shared_ptr<FileSystem> host = std::make_shared<PosixFileSystem>();
+    return host;
+}
+
+FileSystem& fileSystem()
+{
+    return *BundleContext::Current().file_system;
+}
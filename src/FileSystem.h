@@ -0,0 +1,216 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_FILESYSTEM_H
+#define DYLIBBUNDLER_FILESYSTEM_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class FileType { Missing, Regular, Directory, Symlink, Other };
+
+struct FileInfo {
+    FileType type = FileType::Missing;
+    // permission bits only
+    uint32_t mode = 0;
+    uint64_t size = 0;
+    int64_t mtime_sec = 0;
+    int64_t mtime_nsec = 0;
+    uint64_t device = 0;
+    uint64_t inode = 0;
+};
+
+// An open regular file, read and written at explicit offsets.
+class File {
+public:
+    virtual ~File() = default;
+
+    [[nodiscard]] virtual uint64_t Size() const = 0;
+    virtual bool Read(void* buffer, size_t size, uint64_t offset) const = 0;
+    virtual bool Write(const void* buffer, size_t size, uint64_t offset) = 0;
+    virtual bool Truncate(uint64_t size) = 0;
+    // flush what was written to stable storage
+    virtual bool Sync() = 0;
+};
+
+// Create makes the file if needed and truncates it, the other modes require an existing file.
+enum class OpenMode { Read, ReadWrite, Create };
+
+// Every file and directory the bundler touches goes through the FileSystem of the current
+// BundleContext. PosixFileSystem is the real one, MemoryFileSystem keeps a whole tree in memory so
+// the collect, copy and fix steps can run on synthetic bundles without any disk I/O.
+class FileSystem {
+public:
+    virtual ~FileSystem() = default;
+
+    // nullptr if |path| can't be opened in |mode|, |create_mode| is used for new files
+    virtual std::unique_ptr<File> Open(const std::string& path, OpenMode mode, uint32_t create_mode = 0644) = 0;
+    // FileType::Missing if |path| doesn't exist, LinkStatus doesn't follow a final symlink
+    [[nodiscard]] virtual FileInfo Status(const std::string& path) const = 0;
+    [[nodiscard]] virtual FileInfo LinkStatus(const std::string& path) const = 0;
+    [[nodiscard]] virtual bool IsWritable(const std::string& path) const = 0;
+    // absolute path of |path| with symlinks, "." and ".." resolved, empty if it doesn't exist
+    [[nodiscard]] virtual std::string RealPath(const std::string& path) const = 0;
+    virtual bool ReadLink(const std::string& path, std::string& target) const = 0;
+    // names in directory |path| without "." and "..", in no particular order
+    virtual bool ListDirectory(const std::string& path, std::vector<std::string>& names) const = 0;
+    virtual bool CreateDirectory(const std::string& path, uint32_t mode = 0755) = 0;
+    virtual bool CreateSymlink(const std::string& target, const std::string& link) = 0;
+    // remove a file, a symlink or an empty directory
+    virtual bool Remove(const std::string& path) = 0;
+    virtual bool Rename(const std::string& from, const std::string& to) = 0;
+    // Create |to| as a copy of the regular file |from| sharing its blocks until either is modified
+    // (a reflink), false if |to| exists or the filesystem can't do it.
+    virtual bool CloneFile(const std::string& from, const std::string& to) = 0;
+    // atomically swap the existing paths |a| and |b|, false if they can't be or the system can't do it
+    virtual bool Exchange(const std::string& a, const std::string& b) = 0;
+    virtual bool SetMode(const std::string& path, uint32_t mode) = 0;
+    // set the modification time of |path| itself, a final symlink is not followed
+    virtual bool SetTimes(const std::string& path, int64_t mtime_sec, int64_t mtime_nsec) = 0;
+    // external tools (otool, install_name_tool, PlistBuddy) only see the host filesystem
+    [[nodiscard]] virtual bool IsHost() const { return false; }
+
+    // helpers built on the operations above
+    [[nodiscard]] bool Exists(const std::string& path) const { return Status(path).type != FileType::Missing; }
+    bool ReadFile(const std::string& path, std::vector<unsigned char>& data);
+    bool WriteFile(const std::string& path, const void* data, size_t size, uint32_t mode = 0644);
+    // like mkdir -p
+    bool CreateDirectories(const std::string& path);
+    // like rm -r, symlinks are removed and never followed
+    bool RemoveAll(const std::string& path);
+    // Like cp -R: copy the file, symlink or directory tree |from| to |to|, or into |to| if it is a
+    // directory. Existing files are only replaced with |overwrite|.
+    bool Copy(const std::string& from, const std::string& to, bool overwrite);
+    // give the owner write permission on |path| and everything below it, like chmod -R u+w
+    bool MakeWritable(const std::string& path);
+
+private:
+    bool CopyTree(const std::string& from, const std::string& to, bool overwrite);
+    bool CopyContents(const std::string& from, const std::string& to, uint32_t mode);
+};
+
+class PosixFileSystem : public FileSystem {
+public:
+    std::unique_ptr<File> Open(const std::string& path, OpenMode mode, uint32_t create_mode = 0644) override;
+    [[nodiscard]] FileInfo Status(const std::string& path) const override;
+    [[nodiscard]] FileInfo LinkStatus(const std::string& path) const override;
+    [[nodiscard]] bool IsWritable(const std::string& path) const override;
+    [[nodiscard]] std::string RealPath(const std::string& path) const override;
+    bool ReadLink(const std::string& path, std::string& target) const override;
+    bool ListDirectory(const std::string& path, std::vector<std::string>& names) const override;
+    bool CreateDirectory(const std::string& path, uint32_t mode = 0755) override;
+    bool CreateSymlink(const std::string& target, const std::string& link) override;
+    bool Remove(const std::string& path) override;
+    bool Rename(const std::string& from, const std::string& to) override;
+    bool CloneFile(const std::string& from, const std::string& to) override;
+    bool Exchange(const std::string& a, const std::string& b) override;
+    bool SetMode(const std::string& path, uint32_t mode) override;
+    bool SetTimes(const std::string& path, int64_t mtime_sec, int64_t mtime_nsec) override;
+    [[nodiscard]] bool IsHost() const override { return true; }
+};
+
+// A tree of files held in memory. Relative paths start at the root. Safe to use from several threads.
+class MemoryFileSystem : public FileSystem {
+public:
+    MemoryFileSystem();
+
+    std::unique_ptr<File> Open(const std::string& path, OpenMode mode, uint32_t create_mode = 0644) override;
+    [[nodiscard]] FileInfo Status(const std::string& path) const override;
+    [[nodiscard]] FileInfo LinkStatus(const std::string& path) const override;
+    [[nodiscard]] bool IsWritable(const std::string& path) const override;
+    [[nodiscard]] std::string RealPath(const std::string& path) const override;
+    bool ReadLink(const std::string& path, std::string& target) const override;
+    bool ListDirectory(const std::string& path, std::vector<std::string>& names) const override;
+    bool CreateDirectory(const std::string& path, uint32_t mode = 0755) override;
+    bool CreateSymlink(const std::string& target, const std::string& link) override;
+    bool Remove(const std::string& path) override;
+    bool Rename(const std::string& from, const std::string& to) override;
+    bool CloneFile(const std::string& from, const std::string& to) override;
+    bool Exchange(const std::string& a, const std::string& b) override;
+    bool SetMode(const std::string& path, uint32_t mode) override;
+    bool SetTimes(const std::string& path, int64_t mtime_sec, int64_t mtime_nsec) override;
+
+private:
+    class OpenFile;
+
+    struct Node {
+        FileType type = FileType::Regular;
+        uint32_t mode = 0;
+        int64_t mtime = 0;
+        uint64_t inode = 0;
+        std::vector<unsigned char> data;
+        std::string target;
+        std::map<std::string, std::shared_ptr<Node>> children;
+    };
+
+    // where a path leads: the existing node, or the directory and name it would be created as
+    struct Location {
+        bool valid = false;
+        std::shared_ptr<Node> parent;
+        std::string name;
+        std::shared_ptr<Node> node;
+        std::string real_path;
+    };
+
+    [[nodiscard]] Location Lookup(const std::string& path, bool follow_last) const;
+    std::shared_ptr<Node> AddNode(const Location& location, FileType type, uint32_t mode);
+    [[nodiscard]] FileInfo Info(const Location& location) const;
+    int64_t Now();
+
+    mutable std::mutex mutex;
+    std::shared_ptr<Node> root;
+    uint64_t next_inode = 1;
+    int64_t last_time = 0;
+};
+
+// Copy-on-write view of |lower| that keeps |root| and everything below it in memory: the tree at
+// |root| is read once when the overlay is made, and every change to it afterwards only happens in
+// memory. Other paths are passed through to |lower|. Renames, exchanges and clones between the two
+// fail, copies work.
+class OverlayFileSystem : public FileSystem {
+public:
+    OverlayFileSystem(std::shared_ptr<FileSystem> lower, const std::string& root);
+
+    std::unique_ptr<File> Open(const std::string& path, OpenMode mode, uint32_t create_mode = 0644) override;
+    [[nodiscard]] FileInfo Status(const std::string& path) const override;
+    [[nodiscard]] FileInfo LinkStatus(const std::string& path) const override;
+    [[nodiscard]] bool IsWritable(const std::string& path) const override;
+    [[nodiscard]] std::string RealPath(const std::string& path) const override;
+    bool ReadLink(const std::string& path, std::string& target) const override;
+    bool ListDirectory(const std::string& path, std::vector<std::string>& names) const override;
+    bool CreateDirectory(const std::string& path, uint32_t mode = 0755) override;
+    bool CreateSymlink(const std::string& target, const std::string& link) override;
+    bool Remove(const std::string& path) override;
+    bool Rename(const std::string& from, const std::string& to) override;
+    bool CloneFile(const std::string& from, const std::string& to) override;
+    bool Exchange(const std::string& a, const std::string& b) override;
+    bool SetMode(const std::string& path, uint32_t mode) override;
+    bool SetTimes(const std::string& path, int64_t mtime_sec, int64_t mtime_nsec) override;
+
+    // whether |path| is |root| or below it, and so only exists in memory
+    [[nodiscard]] bool InMemory(const std::string& path) const;
+
+private:
+    // |path| made absolute without "." and ".." components, true if it is in memory
+    bool Route(const std::string& path, std::string& normalized) const;
+    // the directories leading to |root| also exist in memory, even if they don't in |lower|
+    [[nodiscard]] bool AboveRoot(const std::string& normalized) const;
+    void Import(const std::string& path);
+
+    std::shared_ptr<FileSystem> lower;
+    MemoryFileSystem upper;
+    std::string working_directory;
+    // |root| as given and with the symlinks of |lower| resolved, normalized and without a trailing slash
+    std::string root;
+    std::string real_root;
+};
+
+// the host filesystem, shared by every context that doesn't set its own
+std::shared_ptr<FileSystem> hostFileSystem();
+// the filesystem of the current BundleContext
+FileSystem& fileSystem();
+
+#endif
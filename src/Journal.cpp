@@ -0,0 +1,105 @@
+#include "Journal.h"
+
+#include <string_view>
+#include <vector>
+
+#include "BundleContext.h"
+#include "Reproducible.h"
+#include "Settings.h"
+#include "Sha256.h"
+
+namespace {
+
+// bump when the meaning of the records changes
+constexpr const char* kJournalFormat = "dylibbundler-journal-1";
+
+} // namespace
+
+std::string Journal::Key(const std::string& path)
+{
+    std::string dest_folder = Settings::destFolder();
+    if (path.compare(0, dest_folder.size(), dest_folder) == 0)
+        return path.substr(dest_folder.size());
+    return path;
+}
+
+void Journal::Open(const std::string& dest_folder, const std::string& plan, bool resume)
+{
+    std::string path = dest_folder + kFileName;
+    std::string header = std::string(kJournalFormat) + " " + Sha256::Hex(Sha256::Hash(plan.data(), plan.size())) + "\n";
+    FileSystem& file_system = fileSystem();
+    records.clear();
+    resumed = false;
+
+    if (resume) {
+        file = file_system.Open(path, OpenMode::ReadWrite);
+        if (file)
+            Load(header);
+    }
+    if (resumed)
+        return;
+
+    file = file_system.Open(path, OpenMode::Create);
+    if (!file)
+        throw BundleError("Cannot create the journal " + path);
+    records.clear();
+    size = 0;
+    Append(header);
+}
+
+void Journal::Load(const std::string& header)
+{
+    std::vector<char> data(static_cast<size_t>(file->Size()));
+    if (!file->Read(data.data(), data.size(), 0))
+        return;
+    std::string_view text(data.data(), data.size());
+    if (text.compare(0, header.size(), header) != 0)
+        return;
+
+    // "<digest> <operation> <path>" lines, a line without its newline was torn by a crash
+    size = header.size();
+    size_t end;
+    while ((end = text.find('\n', size)) != std::string_view::npos) {
+        std::string_view line = text.substr(size, end - size);
+        size_t space = line.find(' ');
+        if (space != 64 || line.find(' ', space + 1) == std::string_view::npos)
+            break;
+        records[std::string(line.substr(space + 1))] = std::string(line.substr(0, space));
+        size = end + 1;
+    }
+    resumed = true;
+}
+
+void Journal::Append(const std::string& line)
+{
+    if (!file->Write(line.data(), line.size(), size) || !file->Sync())
+        throw BundleError("An error occured while writing the journal of the output directory");
+    size += line.size();
+}
+
+bool Journal::Done(const std::string& operation, const std::string& path) const
+{
+    auto record = records.find(operation + " " + Key(path));
+    if (record == records.end() || fileSystem().LinkStatus(path).type == FileType::Missing)
+        return false;
+    return record->second == treeDigest(path);
+}
+
+void Journal::Record(const std::string& operation, const std::string& path)
+{
+    if (!file)
+        return;
+    std::string key = operation + " " + Key(path);
+    std::string digest = treeDigest(path);
+    Append(digest + " " + key + "\n");
+    records[key] = digest;
+}
+
+void Journal::Remove(const std::string& dest_folder)
+{
+    if (!file)
+        return;
+    file.reset();
+    records.clear();
+    fileSystem().Remove(dest_folder + kFileName);
+}
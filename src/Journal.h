@@ -0,0 +1,50 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_JOURNAL_H
+#define DYLIBBUNDLER_JOURNAL_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "FileSystem.h"
+
+// Append-only record of the operations of a bundling run, kept in the output directory so that an
+// interrupted run can be resumed (--resume). Every record holds the digest of the file or directory
+// as the operation left it, and is flushed to disk before the next operation starts. A record torn
+// by a crash is ignored, the operation is simply done again.
+class Journal {
+public:
+    static constexpr const char* kFileName = ".dylibbundler-journal";
+
+    // Start the journal of the output directory |dest_folder| for the run described by |plan|.
+    // With |resume|, the records of an earlier run of the same plan are kept. Throws BundleError.
+    void Open(const std::string& dest_folder, const std::string& plan, bool resume);
+    [[nodiscard]] bool IsOpen() const { return file != nullptr; }
+    // true if records of an interrupted run of the same plan were loaded
+    [[nodiscard]] bool Resumed() const { return resumed; }
+    [[nodiscard]] bool Empty() const { return records.empty(); }
+
+    // true if |operation| was recorded for |path| and left it as it is now
+    [[nodiscard]] bool Done(const std::string& operation, const std::string& path) const;
+    // record that |operation| completed on |path|, throws BundleError if it can't be written
+    void Record(const std::string& operation, const std::string& path);
+    // delete the journal once the run completed, |dest_folder| is where the output directory is now
+    void Remove(const std::string& dest_folder);
+
+private:
+    // paths inside the output directory are recorded relative to it, it moves when it is swapped in
+    [[nodiscard]] static std::string Key(const std::string& path);
+    // keep the records following |header|, if the journal starts with it
+    void Load(const std::string& header);
+    void Append(const std::string& line);
+
+    std::unique_ptr<File> file;
+    uint64_t size = 0;
+    bool resumed = false;
+    // "operation key" -> digest
+    std::map<std::string, std::string> records;
+};
+
+#endif
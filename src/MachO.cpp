@@ -0,0 +1,210 @@
+#include "MachO.h"
+
+#include <cstring>
+#include <memory>
+
+#include "FileSystem.h"
+
+namespace {
+
+// extract the lc_str at |str_offset| of the load command starting at |cmd|
+std::string loadCommandString(const unsigned char* cmd, uint32_t cmdsize, uint32_t str_offset)
+{
+    if (str_offset >= cmdsize)
+        return "";
+    const char* begin = reinterpret_cast<const char*>(cmd + str_offset);
+    return std::string(begin, strnlen(begin, cmdsize - str_offset));
+}
+
+// |size| bounds the slice, so a corrupt header can't ask for more than the file holds
+bool readSlice(const File& file, uint64_t offset, uint64_t size, MachOSlice& slice)
+{
+    unsigned char header[32];
+    if (!file.Read(header, sizeof(header), offset))
+        return false;
+
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+    bool swap = magic == MH_CIGAM || magic == MH_CIGAM_64;
+    bool is64 = magic == MH_MAGIC_64 || magic == MH_CIGAM_64;
+    if (!is64 && magic != MH_MAGIC && magic != MH_CIGAM)
+        return false;
+
+    slice.offset = offset;
+    slice.swap = swap;
+    slice.cputype = read32(header + 4, swap);
+    slice.cpusubtype = read32(header + 8, swap);
+    slice.filetype = read32(header + 12, swap);
+    uint32_t ncmds = read32(header + 16, swap);
+    uint32_t sizeofcmds = read32(header + 20, swap);
+    if ((is64 ? 32 : 28) + uint64_t(sizeofcmds) > size)
+        return false;
+
+    std::vector<unsigned char> cmds(sizeofcmds);
+    if (!file.Read(cmds.data(), cmds.size(), offset + (is64 ? 32 : 28)))
+        return false;
+
+    size_t pos = 0;
+    for (uint32_t n=0; n<ncmds; ++n) {
+        if (pos + 8 > cmds.size())
+            return false;
+        const unsigned char* cmd = cmds.data() + pos;
+        uint32_t type = read32(cmd, swap);
+        uint32_t cmdsize = read32(cmd + 4, swap);
+        if (cmdsize < 8 || pos + cmdsize > cmds.size())
+            return false;
+
+        switch (type) {
+        case LC_ID_DYLIB:
+            slice.id = loadCommandString(cmd, cmdsize, read32(cmd + 8, swap));
+            break;
+        case LC_LOAD_DYLIB:
+        case LC_LOAD_WEAK_DYLIB:
+        case LC_REEXPORT_DYLIB:
+        case LC_LOAD_UPWARD_DYLIB:
+            slice.dylibs.push_back({type, loadCommandString(cmd, cmdsize, read32(cmd + 8, swap))});
+            break;
+        case LC_RPATH:
+            slice.rpaths.push_back(loadCommandString(cmd, cmdsize, read32(cmd + 8, swap)));
+            break;
+        case LC_DYLD_INFO:
+        case LC_DYLD_INFO_ONLY:
+            if (cmdsize < 48)
+                return false;
+            slice.bind = {read32(cmd + 16, swap), read32(cmd + 20, swap)};
+            slice.lazy_bind = {read32(cmd + 32, swap), read32(cmd + 36, swap)};
+            slice.export_trie = {read32(cmd + 40, swap), read32(cmd + 44, swap)};
+            slice.has_export_trie = true;
+            break;
+        case LC_DYLD_EXPORTS_TRIE:
+        case LC_DYLD_CHAINED_FIXUPS:
+            if (cmdsize < 16)
+                return false;
+            (type == LC_DYLD_EXPORTS_TRIE ? slice.export_trie : slice.chained_fixups) = {read32(cmd + 8, swap), read32(cmd + 12, swap)};
+            slice.has_export_trie |= type == LC_DYLD_EXPORTS_TRIE;
+            break;
+        default:
+            break;
+        }
+        pos += cmdsize;
+    }
+    return true;
+}
+
+} // namespace
+
+uint32_t read32(const unsigned char* p, bool swap)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return swap ? __builtin_bswap32(value) : value;
+}
+
+uint64_t read64(const unsigned char* p, bool swap)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return swap ? __builtin_bswap64(value) : value;
+}
+
+void write32(unsigned char* p, uint32_t value, bool swap)
+{
+    if (swap)
+        value = __builtin_bswap32(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+void write64(unsigned char* p, uint64_t value, bool swap)
+{
+    if (swap)
+        value = __builtin_bswap64(value);
+    memcpy(p, &value, sizeof(value));
+}
+
+bool isMachO(const std::string& path)
+{
+    std::unique_ptr<File> file = fileSystem().Open(path, OpenMode::Read);
+    uint32_t magic;
+    if (!file || !file->Read(&magic, sizeof(magic), 0))
+        return false;
+    switch (magic) {
+    case MH_MAGIC: case MH_CIGAM: case MH_MAGIC_64: case MH_CIGAM_64:
+    case FAT_MAGIC: case FAT_CIGAM: case FAT_MAGIC_64: case FAT_CIGAM_64:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool readMachO(const std::string& path, std::vector<MachOSlice>& slices)
+{
+    std::unique_ptr<File> file = fileSystem().Open(path, OpenMode::Read);
+    unsigned char header[8];
+    if (!file || !file->Read(header, sizeof(header), 0))
+        return false;
+
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+    if (magic != FAT_MAGIC && magic != FAT_CIGAM && magic != FAT_MAGIC_64 && magic != FAT_CIGAM_64) {
+        MachOSlice slice;
+        if (!readSlice(*file, 0, file->Size(), slice))
+            return false;
+        slices.push_back(slice);
+        return true;
+    }
+
+    // fat headers are always big endian
+    bool swap = magic == FAT_CIGAM || magic == FAT_CIGAM_64;
+    bool is64 = magic == FAT_MAGIC_64 || magic == FAT_CIGAM_64;
+    uint32_t nfat_arch = read32(header + 4, swap);
+    if (nfat_arch == 0 || nfat_arch > MAX_FAT_ARCHS)
+        return false;
+
+    size_t arch_size = is64 ? 32 : 20;
+    uint64_t file_size = file->Size();
+    std::vector<unsigned char> archs(arch_size * nfat_arch);
+    if (!file->Read(archs.data(), archs.size(), sizeof(header)))
+        return false;
+
+    for (uint32_t n=0; n<nfat_arch; ++n) {
+        const unsigned char* arch = archs.data() + n * arch_size;
+        uint64_t offset = is64 ? read64(arch + 8, swap) : read32(arch + 8, swap);
+        uint64_t size = is64 ? read64(arch + 16, swap) : read32(arch + 12, swap);
+        if (offset > file_size || size > file_size - offset)
+            return false;
+        MachOSlice slice;
+        if (!readSlice(*file, offset, size, slice))
+            return false;
+        slices.push_back(slice);
+    }
+    return true;
+}
+
+std::string archName(uint32_t cputype, uint32_t cpusubtype)
+{
+    constexpr uint32_t CPU_ARCH_ABI64 = 0x01000000;
+    constexpr uint32_t CPU_ARCH_ABI64_32 = 0x02000000;
+    constexpr uint32_t CPU_TYPE_X86 = 7;
+    constexpr uint32_t CPU_TYPE_ARM = 12;
+    constexpr uint32_t CPU_TYPE_POWERPC = 18;
+    uint32_t subtype = cpusubtype & 0x00ffffff;
+
+    switch (cputype) {
+    case CPU_TYPE_X86:
+        return "i386";
+    case CPU_TYPE_X86 | CPU_ARCH_ABI64:
+        return subtype == 8 ? "x86_64h" : "x86_64";
+    case CPU_TYPE_ARM:
+        return subtype == 11 ? "armv7s" : subtype == 9 ? "armv7" : "arm";
+    case CPU_TYPE_ARM | CPU_ARCH_ABI64:
+        return subtype == 2 ? "arm64e" : "arm64";
+    case CPU_TYPE_ARM | CPU_ARCH_ABI64_32:
+        return "arm64_32";
+    case CPU_TYPE_POWERPC:
+        return "ppc";
+    case CPU_TYPE_POWERPC | CPU_ARCH_ABI64:
+        return "ppc64";
+    default:
+        return "cputype_" + std::to_string(cputype);
+    }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_MACHO_H
+#define DYLIBBUNDLER_MACHO_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+constexpr uint32_t MH_MAGIC = 0xfeedface;
+constexpr uint32_t MH_CIGAM = 0xcefaedfe;
+constexpr uint32_t MH_MAGIC_64 = 0xfeedfacf;
+constexpr uint32_t MH_CIGAM_64 = 0xcffaedfe;
+constexpr uint32_t FAT_MAGIC = 0xcafebabe;
+constexpr uint32_t FAT_CIGAM = 0xbebafeca;
+constexpr uint32_t FAT_MAGIC_64 = 0xcafebabf;
+constexpr uint32_t FAT_CIGAM_64 = 0xbfbafeca;
+
+// file types
+constexpr uint32_t MH_EXECUTE = 0x2;
+constexpr uint32_t MH_DYLIB = 0x6;
+
+// java class files share the fat magic, they are told apart by their (large) version number
+constexpr uint32_t MAX_FAT_ARCHS = 20;
+
+// load commands dylibbundler cares about
+constexpr uint32_t LC_REQ_DYLD = 0x80000000;
+constexpr uint32_t LC_SEGMENT = 0x1;
+constexpr uint32_t LC_SYMTAB = 0x2;
+constexpr uint32_t LC_DYSYMTAB = 0xb;
+constexpr uint32_t LC_LOAD_DYLIB = 0xc;
+constexpr uint32_t LC_ID_DYLIB = 0xd;
+constexpr uint32_t LC_TWOLEVEL_HINTS = 0x16;
+constexpr uint32_t LC_LOAD_WEAK_DYLIB = 0x18 | LC_REQ_DYLD;
+constexpr uint32_t LC_SEGMENT_64 = 0x19;
+constexpr uint32_t LC_RPATH = 0x1c | LC_REQ_DYLD;
+constexpr uint32_t LC_CODE_SIGNATURE = 0x1d;
+constexpr uint32_t LC_SEGMENT_SPLIT_INFO = 0x1e;
+constexpr uint32_t LC_REEXPORT_DYLIB = 0x1f | LC_REQ_DYLD;
+constexpr uint32_t LC_DYLD_INFO = 0x22;
+constexpr uint32_t LC_DYLD_INFO_ONLY = 0x22 | LC_REQ_DYLD;
+constexpr uint32_t LC_LOAD_UPWARD_DYLIB = 0x23 | LC_REQ_DYLD;
+constexpr uint32_t LC_FUNCTION_STARTS = 0x26;
+constexpr uint32_t LC_DATA_IN_CODE = 0x29;
+constexpr uint32_t LC_DYLIB_CODE_SIGN_DRS = 0x2b;
+constexpr uint32_t LC_LINKER_OPTIMIZATION_HINT = 0x2e;
+constexpr uint32_t LC_DYLD_EXPORTS_TRIE = 0x33 | LC_REQ_DYLD;
+constexpr uint32_t LC_DYLD_CHAINED_FIXUPS = 0x34 | LC_REQ_DYLD;
+constexpr uint32_t LC_ATOM_INFO = 0x36;
+
+// integers stored in a Mach-O file, |swap| if its byte order differs from the host's
+uint32_t read32(const unsigned char* p, bool swap);
+uint64_t read64(const unsigned char* p, bool swap);
+void write32(unsigned char* p, uint32_t value, bool swap);
+void write64(unsigned char* p, uint64_t value, bool swap);
+
+struct MachODylib {
+    uint32_t cmd;
+    std::string name;
+};
+
+// __LINKEDIT data of a slice, |offset| is relative to the start of the slice
+struct LinkeditRange {
+    uint32_t offset = 0;
+    uint32_t size = 0;
+};
+
+// one architecture of a (possibly universal) Mach-O file
+struct MachOSlice {
+    uint32_t cputype = 0;
+    uint32_t cpusubtype = 0;
+    uint32_t filetype = 0;
+    // where the slice starts in the file, and whether its byte order differs from the host's
+    uint64_t offset = 0;
+    bool swap = false;
+    std::string id;
+    std::vector<MachODylib> dylibs;
+    std::vector<std::string> rpaths;
+    // symbol information, see Symbols.h, files older than the export trie have none
+    bool has_export_trie = false;
+    LinkeditRange export_trie;
+    LinkeditRange bind;
+    LinkeditRange lazy_bind;
+    LinkeditRange chained_fixups;
+};
+
+bool isMachO(const std::string& path);
+// parse the load commands of every slice in |path|, returns false if it isn't a readable Mach-O file
+bool readMachO(const std::string& path, std::vector<MachOSlice>& slices);
+
+std::string archName(uint32_t cputype, uint32_t cpusubtype);
+
+#endif
@@ -0,0 +1,396 @@
+#include "MachOEdit.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "CodeSignature.h"
+#include "FileSystem.h"
+#include "MachO.h"
+#include "Sha256.h"
+
+namespace {
+
+// section types without contents in the file
+constexpr uint32_t S_ZEROFILL = 0x1;
+constexpr uint32_t S_GB_ZEROFILL = 0xc;
+constexpr uint32_t S_THREAD_LOCAL_ZEROFILL = 0x12;
+
+struct SlicePlan {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    bool swap = false;
+    uint32_t header_size = 0;
+    uint32_t old_sizeofcmds = 0;
+    // first byte of section contents, the load commands must end before it
+    uint64_t commands_limit = 0;
+    std::vector<unsigned char> cmds;
+    uint32_t ncmds = 0;
+    // every edit found the load command it applies to
+    bool complete = true;
+    bool changed = false;
+    uint64_t signature_offset = 0;
+    uint32_t signature_size = 0;
+    std::vector<CodeDirectory> code_directories;
+};
+
+void appendLoadCommand(std::vector<unsigned char>& out, const unsigned char* fixed, uint32_t fixed_size,
+                       const std::string& str, uint32_t alignment, bool swap)
+{
+    uint32_t cmdsize = fixed_size + static_cast<uint32_t>(str.size()) + 1;
+    cmdsize = (cmdsize + alignment - 1) & ~(alignment - 1);
+    size_t pos = out.size();
+    out.resize(pos + cmdsize, 0);
+    memcpy(out.data() + pos, fixed, fixed_size);
+    write32(out.data() + pos + 4, cmdsize, swap);
+    write32(out.data() + pos + 8, fixed_size, swap);
+    memcpy(out.data() + pos + fixed_size, str.data(), str.size());
+}
+
+void appendRpath(std::vector<unsigned char>& out, const std::string& path, uint32_t alignment, bool swap)
+{
+    unsigned char fixed[12] = {};
+    write32(fixed, LC_RPATH, swap);
+    appendLoadCommand(out, fixed, sizeof(fixed), path, alignment, swap);
+}
+
+std::string commandString(const unsigned char* cmd, uint32_t cmdsize, bool swap)
+{
+    uint32_t str_offset = read32(cmd + 8, swap);
+    if (str_offset >= cmdsize)
+        return "";
+    const char* begin = reinterpret_cast<const char*>(cmd + str_offset);
+    return std::string(begin, strnlen(begin, cmdsize - str_offset));
+}
+
+// lowest file offset of section or segment contents, where the room for load commands ends
+void updateCommandsLimit(const unsigned char* cmd, uint32_t cmdsize, bool is64, bool swap, uint64_t& limit)
+{
+    uint32_t segment_size = is64 ? 72 : 56;
+    uint32_t section_size = is64 ? 80 : 68;
+    if (cmdsize < segment_size)
+        return;
+    uint64_t fileoff = is64 ? read64(cmd + 40, swap) : read32(cmd + 32, swap);
+    uint64_t filesize = is64 ? read64(cmd + 48, swap) : read32(cmd + 36, swap);
+    if (fileoff != 0 && filesize != 0)
+        limit = std::min(limit, fileoff);
+
+    uint32_t nsects = read32(cmd + (is64 ? 64 : 48), swap);
+    for (uint32_t n=0; n<nsects && segment_size + (n + 1) * section_size <= cmdsize; ++n) {
+        const unsigned char* section = cmd + segment_size + n * section_size;
+        uint32_t offset = read32(section + (is64 ? 48 : 40), swap);
+        uint32_t type = read32(section + (is64 ? 64 : 56), swap) & 0xff;
+        if (offset != 0 && type != S_ZEROFILL && type != S_GB_ZEROFILL && type != S_THREAD_LOCAL_ZEROFILL)
+            limit = std::min<uint64_t>(limit, offset);
+    }
+}
+
+// apply |edits| to the load commands |cmds| of |plan|, returns false if they are malformed
+bool rewriteCommands(const std::vector<unsigned char>& cmds, uint32_t ncmds, bool is64,
+                     const LoadCommandEdits& edits, SlicePlan& plan)
+{
+    bool swap = plan.swap;
+    uint32_t alignment = is64 ? 8 : 4;
+    std::vector<bool> rpath_done(edits.rpaths.size(), false);
+    std::vector<std::string> rpaths;
+    bool id_found = false;
+
+    plan.ncmds = 0;
+    size_t pos = 0;
+    for (uint32_t n=0; n<ncmds; ++n) {
+        if (pos + 8 > cmds.size())
+            return false;
+        const unsigned char* cmd = cmds.data() + pos;
+        uint32_t type = read32(cmd, swap);
+        uint32_t cmdsize = read32(cmd + 4, swap);
+        if (cmdsize < 8 || pos + cmdsize > cmds.size())
+            return false;
+        pos += cmdsize;
+
+        switch (type) {
+        case LC_SEGMENT:
+        case LC_SEGMENT_64:
+            updateCommandsLimit(cmd, cmdsize, type == LC_SEGMENT_64, swap, plan.commands_limit);
+            break;
+        case LC_CODE_SIGNATURE:
+            if (cmdsize >= 16) {
+                plan.signature_offset = read32(cmd + 8, swap);
+                plan.signature_size = read32(cmd + 12, swap);
+            }
+            break;
+        case LC_ID_DYLIB:
+            if (!edits.id.empty() && cmdsize >= 24) {
+                id_found = true;
+                appendLoadCommand(plan.cmds, cmd, 24, edits.id, alignment, swap);
+                ++plan.ncmds;
+                continue;
+            }
+            break;
+        case LC_LOAD_DYLIB:
+        case LC_LOAD_WEAK_DYLIB:
+        case LC_REEXPORT_DYLIB:
+        case LC_LOAD_UPWARD_DYLIB: {
+            if (cmdsize < 24)
+                break;
+            std::string name = commandString(cmd, cmdsize, swap);
+            auto change = std::find_if(edits.install_names.begin(), edits.install_names.end(),
+                                       [&](const auto& install_name) { return install_name.first == name; });
+            if (change != edits.install_names.end()) {
+                appendLoadCommand(plan.cmds, cmd, 24, change->second, alignment, swap);
+                ++plan.ncmds;
+                continue;
+            }
+            break;
+        }
+        case LC_RPATH: {
+            std::string path = commandString(cmd, cmdsize, swap);
+            size_t edit = 0;
+            while (edit < edits.rpaths.size() && (rpath_done[edit] || edits.rpaths[edit].first != path))
+                ++edit;
+            if (edit < edits.rpaths.size()) {
+                rpath_done[edit] = true;
+                const std::string& new_path = edits.rpaths[edit].second;
+                if (!new_path.empty()) {
+                    appendRpath(plan.cmds, new_path, alignment, swap);
+                    rpaths.push_back(new_path);
+                    ++plan.ncmds;
+                }
+                continue;
+            }
+            rpaths.push_back(path);
+            break;
+        }
+        default:
+            break;
+        }
+        plan.cmds.insert(plan.cmds.end(), cmd, cmd + cmdsize);
+        ++plan.ncmds;
+    }
+
+    // rpaths that are already deleted or renamed need nothing more
+    for (size_t n=0; n<edits.rpaths.size(); ++n) {
+        const std::string& new_path = edits.rpaths[n].second;
+        if (rpath_done[n] || new_path.empty() || std::find(rpaths.begin(), rpaths.end(), new_path) != rpaths.end())
+            continue;
+        if (!edits.rpaths[n].first.empty()) {
+            plan.complete = false;
+            continue;
+        }
+        appendRpath(plan.cmds, edits.rpaths[n].second, alignment, swap);
+        rpaths.push_back(edits.rpaths[n].second);
+        ++plan.ncmds;
+    }
+
+    // like install_name_tool, refuse to leave the same rpath twice
+    std::sort(rpaths.begin(), rpaths.end());
+    if (!edits.rpaths.empty() && std::adjacent_find(rpaths.begin(), rpaths.end()) != rpaths.end())
+        plan.complete = false;
+    if (!edits.id.empty() && !id_found)
+        plan.complete = false;
+    plan.changed = plan.ncmds != ncmds || plan.cmds != cmds;
+    return true;
+}
+
+bool planSlice(const File& file, uint64_t offset, uint64_t size, const LoadCommandEdits& edits, SlicePlan& plan)
+{
+    unsigned char header[32];
+    if (size < sizeof(header) || !file.Read(header, sizeof(header), offset))
+        return false;
+
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+    plan.swap = magic == MH_CIGAM || magic == MH_CIGAM_64;
+    bool is64 = magic == MH_MAGIC_64 || magic == MH_CIGAM_64;
+    if (!is64 && magic != MH_MAGIC && magic != MH_CIGAM)
+        return false;
+
+    plan.offset = offset;
+    plan.size = size;
+    plan.header_size = is64 ? 32 : 28;
+    plan.commands_limit = size;
+    uint32_t ncmds = read32(header + 16, plan.swap);
+    plan.old_sizeofcmds = read32(header + 20, plan.swap);
+    if (plan.header_size + uint64_t(plan.old_sizeofcmds) > size)
+        return false;
+
+    std::vector<unsigned char> cmds(plan.old_sizeofcmds);
+    if (!file.Read(cmds.data(), cmds.size(), offset + plan.header_size))
+        return false;
+    return rewriteCommands(cmds, ncmds, is64, edits, plan);
+}
+
+// find the code directories of the slice signature, returns false if their hashes can't be updated
+bool readCodeDirectories(const File& file, SlicePlan& plan)
+{
+    if (plan.signature_size == 0)
+        return true;
+    if (plan.signature_offset + plan.signature_size > plan.size)
+        return false;
+
+    std::vector<unsigned char> signature(plan.signature_size);
+    if (!file.Read(signature.data(), signature.size(), plan.offset + plan.signature_offset))
+        return false;
+    if (!readCodeDirectories(signature.data(), signature.size(), plan.code_directories))
+        return false;
+    for (const auto& directory : plan.code_directories) {
+        if (directory.code_limit > plan.size)
+            return false;
+    }
+    return true;
+}
+
+bool planFile(const File& file, const LoadCommandEdits& edits, std::vector<SlicePlan>& plans)
+{
+    uint64_t file_size = file.Size();
+    unsigned char header[8];
+    if (!file.Read(header, sizeof(header), 0))
+        return false;
+
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+    if (magic != FAT_MAGIC && magic != FAT_CIGAM && magic != FAT_MAGIC_64 && magic != FAT_CIGAM_64) {
+        plans.emplace_back();
+        return planSlice(file, 0, file_size, edits, plans.back());
+    }
+
+    bool swap = magic == FAT_CIGAM || magic == FAT_CIGAM_64;
+    bool is64 = magic == FAT_MAGIC_64 || magic == FAT_CIGAM_64;
+    uint32_t nfat_arch = read32(header + 4, swap);
+    if (nfat_arch == 0 || nfat_arch > MAX_FAT_ARCHS)
+        return false;
+
+    size_t arch_size = is64 ? 32 : 20;
+    std::vector<unsigned char> archs(arch_size * nfat_arch);
+    if (!file.Read(archs.data(), archs.size(), sizeof(header)))
+        return false;
+
+    for (uint32_t n=0; n<nfat_arch; ++n) {
+        const unsigned char* arch = archs.data() + n * arch_size;
+        uint64_t offset = is64 ? read64(arch + 8, swap) : read32(arch + 8, swap);
+        uint64_t size = is64 ? read64(arch + 16, swap) : read32(arch + 12, swap);
+        if (offset + size > file_size)
+            return false;
+        plans.emplace_back();
+        if (!planSlice(file, offset, size, edits, plans.back()))
+            return false;
+    }
+    return true;
+}
+
+// write the new load commands of |plan|, then rehash the pages they touched
+bool applySlice(File& file, const SlicePlan& plan)
+{
+    uint64_t new_end = plan.header_size + plan.cmds.size();
+    uint64_t dirty_end = std::max<uint64_t>(new_end, plan.header_size + plan.old_sizeofcmds);
+    uint64_t read_end = dirty_end;
+    for (const auto& directory : plan.code_directories)
+        read_end = std::max<uint64_t>(read_end, (dirty_end + directory.page_size - 1) / directory.page_size * directory.page_size);
+    read_end = std::min(read_end, plan.size);
+
+    // the header pages are read into a buffer and edited there, then only the range of bytes that
+    // changed is written back
+    std::vector<unsigned char> slice(static_cast<size_t>(read_end));
+    if (!file.Read(slice.data(), slice.size(), plan.offset))
+        return false;
+    const std::vector<unsigned char> original(slice.data(), slice.data() + dirty_end);
+    memcpy(slice.data() + plan.header_size, plan.cmds.data(), plan.cmds.size());
+    if (new_end < dirty_end)
+        memset(slice.data() + new_end, 0, dirty_end - new_end);
+    write32(slice.data() + 16, plan.ncmds, plan.swap);
+    write32(slice.data() + 20, static_cast<uint32_t>(plan.cmds.size()), plan.swap);
+
+    size_t first = 0;
+    while (first < original.size() && original[first] == slice[first])
+        ++first;
+    size_t last = original.size();
+    while (last > first && original[last - 1] == slice[last - 1])
+        --last;
+    bool ok = first == last || file.Write(slice.data() + first, last - first, plan.offset + first);
+    for (const auto& directory : plan.code_directories) {
+        uint64_t pages = (dirty_end + directory.page_size - 1) / directory.page_size;
+        for (uint64_t page=0; ok && page<pages && page<directory.slot_count; ++page) {
+            uint64_t begin = page * directory.page_size;
+            uint64_t end = std::min<uint64_t>({begin + directory.page_size, directory.code_limit, read_end});
+            if (begin >= end)
+                break;
+            Sha256::Digest digest = Sha256::Hash(slice.data() + begin, end - begin);
+            ok = file.Write(digest.data(), directory.hash_size, plan.offset + plan.signature_offset + directory.slots_offset + page * directory.hash_size);
+        }
+    }
+    return ok;
+}
+
+} // namespace
+
+std::string LoadCommandEdits::InstallNameToolArgs() const
+{
+    std::string args;
+    if (!id.empty())
+        args += " -id \"" + id + "\"";
+    for (const auto& install_name : install_names)
+        args += " -change \"" + install_name.first + "\" \"" + install_name.second + "\"";
+    for (const auto& rpath : rpaths) {
+        if (rpath.first.empty())
+            args += " -add_rpath \"" + rpath.second + "\"";
+        else if (rpath.second.empty())
+            args += " -delete_rpath \"" + rpath.first + "\"";
+        else
+            args += " -rpath \"" + rpath.first + "\" \"" + rpath.second + "\"";
+    }
+    return args;
+}
+
+EditResult editLoadCommands(const std::string& path, const LoadCommandEdits& edits)
+{
+    if (edits.Empty())
+        return EditResult::Unchanged;
+
+    // plan read-only so that files already in the requested state are never opened for writing
+    std::vector<SlicePlan> plans;
+    FileSystem& file_system = fileSystem();
+    {
+        std::unique_ptr<File> file = file_system.Open(path, OpenMode::Read);
+        if (!file || !planFile(*file, edits, plans))
+            return EditResult::Unsupported;
+    }
+    bool changed = false;
+    for (const auto& plan : plans) {
+        if (!plan.complete)
+            return EditResult::Unsupported;
+        changed = changed || plan.changed;
+    }
+    if (!changed)
+        return EditResult::Unchanged;
+
+    // check every slice before touching any of them
+    std::unique_ptr<File> file = file_system.Open(path, OpenMode::ReadWrite);
+    if (!file)
+        return EditResult::Unsupported;
+    for (auto& plan : plans) {
+        if (plan.header_size + plan.cmds.size() > plan.commands_limit)
+            return EditResult::Unsupported;
+        if (plan.changed && !readCodeDirectories(*file, plan))
+            return EditResult::Unsupported;
+    }
+    for (const auto& plan : plans) {
+        if (plan.changed && !applySlice(*file, plan))
+            return EditResult::Unsupported;
+    }
+    return EditResult::Edited;
+}
+
+uint64_t missingHeaderPadding(const std::string& path, const LoadCommandEdits& edits)
+{
+    std::unique_ptr<File> file = fileSystem().Open(path, OpenMode::Read);
+    std::vector<SlicePlan> plans;
+    if (edits.Empty() || !file || !planFile(*file, edits, plans))
+        return 0;
+
+    uint64_t missing = 0;
+    for (const auto& plan : plans) {
+        uint64_t needed = plan.header_size + plan.cmds.size();
+        if (needed > plan.commands_limit)
+            missing = std::max(missing, needed - plan.commands_limit);
+    }
+    return missing;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_MACHOEDIT_H
+#define DYLIBBUNDLER_MACHOEDIT_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// a batch of load command changes, with the semantics of the matching install_name_tool options
+struct LoadCommandEdits {
+    // new LC_ID_DYLIB name (-id), empty to keep the current one
+    std::string id;
+    // old -> new names of LC_LOAD_DYLIB and friends (-change), the first match wins
+    std::vector<std::pair<std::string,std::string>> install_names;
+    // old -> new LC_RPATH paths (-rpath), an empty new path deletes the old one (-delete_rpath)
+    // and an empty old path adds the new one (-add_rpath)
+    std::vector<std::pair<std::string,std::string>> rpaths;
+
+    [[nodiscard]] bool Empty() const { return id.empty() && install_names.empty() && rpaths.empty(); }
+    // the install_name_tool options doing the same changes
+    [[nodiscard]] std::string InstallNameToolArgs() const;
+};
+
+enum class EditResult {
+    // the load commands were already in the requested state, the file wasn't written
+    Unchanged,
+    Edited,
+    // the file was left untouched because the edits can't be made natively
+    Unsupported,
+};
+
+// Rewrite the load commands of every slice of |path| in place, reading and writing back the header
+// pages only, and refresh the page hashes of an ad-hoc code signature. Edits describe the
+// target state: renaming an rpath to one already there or deleting a missing one is a no-op.
+// Returns Unsupported if they can't be made natively: an edit doesn't fit in the header padding,
+// an rpath to rename is missing, or the signature isn't ad-hoc or uses an unsupported hash.
+EditResult editLoadCommands(const std::string& path, const LoadCommandEdits& edits);
+
+// Number of bytes of header padding the slice of |path| with the largest deficit lacks for
+// |edits| to fit between its load commands and its first section, 0 if they fit everywhere.
+uint64_t missingHeaderPadding(const std::string& path, const LoadCommandEdits& edits);
+
+#endif
@@ -0,0 +1,46 @@
+#include "PathTable.h"
+
+#include <cstring>
+
+#include "BundleContext.h"
+
+PathId PathTable::Intern(std::string_view path)
+{
+    auto it = ids.find(path);
+    if (it != ids.end())
+        return it->second;
+
+    size_t size = path.size() + 1;
+    char* storage;
+    if (size > kChunkSize) {
+        // oversized strings get a chunk of their own so the current chunk stays in use
+        large_chunks.push_back(std::make_unique<char[]>(size));
+        storage = large_chunks.back().get();
+    }
+    else {
+        if (chunk_used + size > kChunkSize) {
+            chunks.push_back(std::make_unique<char[]>(kChunkSize));
+            chunk_used = 0;
+        }
+        storage = chunks.back().get() + chunk_used;
+        chunk_used += size;
+    }
+    memcpy(storage, path.data(), path.size());
+    storage[path.size()] = '\0';
+
+    PathId id = static_cast<PathId>(views.size());
+    views.emplace_back(storage, path.size());
+    ids.emplace(views.back(), id);
+    return id;
+}
+
+PathId PathTable::Find(std::string_view path) const
+{
+    auto it = ids.find(path);
+    return it == ids.end() ? kInvalidPathId : it->second;
+}
+
+PathTable& pathTable()
+{
+    return BundleContext::Current().paths;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_PATHTABLE_H
+#define DYLIBBUNDLER_PATHTABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using PathId = uint32_t;
+constexpr PathId kInvalidPathId = UINT32_MAX;
+
+// Interned path strings. Every distinct path is stored once in an arena and keeps the same id
+// (and address) for the lifetime of the table, so paths can be compared as integers.
+class PathTable {
+public:
+    PathId Intern(std::string_view path);
+    // id of |path| if it was interned before, kInvalidPathId otherwise
+    [[nodiscard]] PathId Find(std::string_view path) const;
+
+    [[nodiscard]] std::string_view View(PathId id) const { return views[id]; }
+    // views are always followed by a '\0' so they can be handed to the C library
+    [[nodiscard]] const char* CStr(PathId id) const { return views[id].data(); }
+
+    [[nodiscard]] size_t Size() const { return views.size(); }
+
+private:
+    static constexpr size_t kChunkSize = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    std::vector<std::unique_ptr<char[]>> large_chunks;
+    size_t chunk_used = kChunkSize;
+    std::vector<std::string_view> views;
+    std::unordered_map<std::string_view, PathId> ids;
+};
+
+// path table of the current BundleContext
+PathTable& pathTable();
+
+#endif
@@ -0,0 +1,221 @@
+#include "Plist.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+void appendUtf8(uint32_t code_point, std::string& out)
+{
+    if (code_point < 0x80) {
+        out += static_cast<char>(code_point);
+    }
+    else if (code_point < 0x800) {
+        out += static_cast<char>(0xc0 | (code_point >> 6));
+        out += static_cast<char>(0x80 | (code_point & 0x3f));
+    }
+    else if (code_point < 0x10000) {
+        out += static_cast<char>(0xe0 | (code_point >> 12));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code_point & 0x3f));
+    }
+    else {
+        out += static_cast<char>(0xf0 | (code_point >> 18));
+        out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code_point & 0x3f));
+    }
+}
+
+// character data of an XML element, with its entities decoded
+std::string xmlText(const std::string& text)
+{
+    std::string out;
+    for (size_t n=0; n<text.size(); ++n) {
+        size_t end = text[n] == '&' ? text.find(';', n) : std::string::npos;
+        if (end == std::string::npos) {
+            out += text[n];
+            continue;
+        }
+        std::string entity = text.substr(n + 1, end - n - 1);
+        if (entity == "amp")
+            out += '&';
+        else if (entity == "lt")
+            out += '<';
+        else if (entity == "gt")
+            out += '>';
+        else if (entity == "quot")
+            out += '"';
+        else if (entity == "apos")
+            out += '\'';
+        else if (entity.size() > 1 && entity[0] == '#')
+            appendUtf8(static_cast<uint32_t>(entity[1] == 'x' ? strtoul(entity.c_str() + 2, nullptr, 16)
+                                                               : strtoul(entity.c_str() + 1, nullptr, 10)), out);
+        else
+            out += text.substr(n, end - n + 1);
+        n = end;
+    }
+    return out;
+}
+
+std::string xmlPlistString(const std::string& xml, const std::string& key)
+{
+    // walk the elements, tracking the depth so that only keys of the top-level dict match
+    int depth = 0;
+    bool key_matched = false;
+    size_t pos = 0;
+    while ((pos = xml.find('<', pos)) != std::string::npos) {
+        size_t end = xml.find('>', pos);
+        if (end == std::string::npos)
+            return "";
+        std::string tag = xml.substr(pos + 1, end - pos - 1);
+        pos = end + 1;
+        if (tag.empty() || tag[0] == '?' || tag[0] == '!')
+            continue;
+
+        bool closing = tag[0] == '/';
+        bool empty = tag[tag.size()-1] == '/';
+        std::string name = tag.substr(closing ? 1 : 0, tag.find_first_of(" /", closing ? 1 : 0) - (closing ? 1 : 0));
+        if (name == "plist")
+            continue;
+        if (closing) {
+            depth--;
+            continue;
+        }
+        if (depth == 1 && (name == "key" || name == "string")) {
+            std::string text;
+            if (!empty) {
+                size_t close = xml.find("</" + name + ">", pos);
+                if (close == std::string::npos)
+                    return "";
+                text = xmlText(xml.substr(pos, close - pos));
+                pos = close + name.size() + 3;
+            }
+            if (name == "string" && key_matched)
+                return text;
+            key_matched = name == "key" && text == key;
+            continue;
+        }
+        if (depth == 1 && key_matched)
+            return "";
+        if (!empty)
+            depth++;
+    }
+    return "";
+}
+
+class BinaryPlist {
+public:
+    explicit BinaryPlist(const std::vector<unsigned char>& data) : data(data)
+    {
+        // trailer: offset size, reference size, object count, top object and offset table position
+        if (data.size() < 8 + 32 || memcmp(data.data(), "bplist00", 8) != 0)
+            return;
+        const unsigned char* trailer = data.data() + data.size() - 32;
+        offset_size = trailer[6];
+        ref_size = trailer[7];
+        object_count = Uint(trailer + 8, 8);
+        top_object = Uint(trailer + 16, 8);
+        offset_table = Uint(trailer + 24, 8);
+        valid = offset_size != 0 && offset_size <= 8 && ref_size != 0 && ref_size <= 8
+             && offset_table <= data.size() && object_count <= (data.size() - offset_table) / offset_size;
+    }
+
+    [[nodiscard]] std::string String(const std::string& key) const
+    {
+        if (!valid)
+            return "";
+        uint64_t dict = ObjectOffset(top_object);
+        uint64_t count = 0;
+        uint64_t refs = 0;
+        if (!Header(dict, 0xd, count, refs) || count > (data.size() - refs) / (2 * ref_size))
+            return "";
+        for (uint64_t n=0; n<count; ++n) {
+            std::string name;
+            if (!StringObject(ObjectOffset(Uint(data.data() + refs + n * ref_size, ref_size)), name) || name != key)
+                continue;
+            std::string value;
+            StringObject(ObjectOffset(Uint(data.data() + refs + (count + n) * ref_size, ref_size)), value);
+            return value;
+        }
+        return "";
+    }
+
+private:
+    static uint64_t Uint(const unsigned char* bytes, size_t size)
+    {
+        uint64_t value = 0;
+        for (size_t n=0; n<size; ++n)
+            value = (value << 8) | bytes[n];
+        return value;
+    }
+
+    uint64_t ObjectOffset(uint64_t object) const
+    {
+        if (object >= object_count)
+            return data.size();
+        return Uint(data.data() + offset_table + object * offset_size, offset_size);
+    }
+
+    // type and length of the object at |offset|, |payload| is where its contents start
+    bool Header(uint64_t offset, unsigned type, uint64_t& count, uint64_t& payload) const
+    {
+        if (offset >= data.size() || (data[offset] >> 4) != type)
+            return false;
+        count = data[offset] & 0xf;
+        payload = offset + 1;
+        if (count != 0xf)
+            return true;
+        // longer lengths follow as an integer object
+        if (payload >= data.size() || (data[payload] >> 4) != 0x1)
+            return false;
+        size_t size = size_t(1) << (data[payload] & 0xf);
+        if (size > 8 || payload + 1 + size > data.size())
+            return false;
+        count = Uint(data.data() + payload + 1, size);
+        payload += 1 + size;
+        return true;
+    }
+
+    bool StringObject(uint64_t offset, std::string& out) const
+    {
+        uint64_t count = 0;
+        uint64_t payload = 0;
+        if (Header(offset, 0x5, count, payload)) {
+            if (count > data.size() - payload)
+                return false;
+            out.assign(reinterpret_cast<const char*>(data.data() + payload), count);
+            return true;
+        }
+        if (!Header(offset, 0x6, count, payload) || count > (data.size() - payload) / 2)
+            return false;
+        out.clear();
+        for (uint64_t n=0; n<count; ++n) {
+            uint32_t unit = static_cast<uint32_t>(Uint(data.data() + payload + 2 * n, 2));
+            if (unit >= 0xd800 && unit < 0xdc00 && n + 1 < count) {
+                uint32_t low = static_cast<uint32_t>(Uint(data.data() + payload + 2 * ++n, 2));
+                unit = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+            }
+            appendUtf8(unit, out);
+        }
+        return true;
+    }
+
+    const std::vector<unsigned char>& data;
+    bool valid = false;
+    size_t offset_size = 0;
+    size_t ref_size = 0;
+    uint64_t object_count = 0;
+    uint64_t top_object = 0;
+    uint64_t offset_table = 0;
+};
+
+} // namespace
+
+std::string plistString(const std::vector<unsigned char>& data, const std::string& key)
+{
+    if (data.size() >= 8 && memcmp(data.data(), "bplist00", 8) == 0)
+        return BinaryPlist(data).String(key);
+    return xmlPlistString(std::string(data.begin(), data.end()), key);
+}
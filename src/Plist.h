@@ -0,0 +1,14 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_PLIST_H
+#define DYLIBBUNDLER_PLIST_H
+
+#include <string>
+#include <vector>
+
+// Value of the string |key| in the top-level dictionary of the XML or binary (bplist00) property
+// list |data|, read without PlistBuddy. Empty if the key is missing, isn't a string or |data| isn't
+// a property list in one of these formats.
+std::string plistString(const std::vector<unsigned char>& data, const std::string& key);
+
+#endif
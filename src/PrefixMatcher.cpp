@@ -0,0 +1,141 @@
+#include "PrefixMatcher.h"
+
+#include <algorithm>
+
+namespace {
+
+// '*' matches any run of characters and '?' any single character, within one path segment
+bool globMatch(std::string_view pattern, std::string_view text)
+{
+    size_t p = 0;
+    size_t t = 0;
+    size_t star = std::string_view::npos;
+    size_t mark = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+            ++p;
+            ++t;
+        }
+        else if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            mark = t;
+        }
+        else if (star != std::string_view::npos) {
+            p = star + 1;
+            t = ++mark;
+        }
+        else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        ++p;
+    return p == pattern.size();
+}
+
+void addUnique(std::vector<int>& nodes, int node)
+{
+    if (std::find(nodes.begin(), nodes.end(), node) == nodes.end())
+        nodes.push_back(node);
+}
+
+} // namespace
+
+PrefixMatcher::PrefixMatcher() : nodes(1) {}
+
+int PrefixMatcher::AddChild(int node, const std::string& segment)
+{
+    if (segment == "**") {
+        // "**/**" is the same as "**"
+        if (nodes[node].is_any)
+            return node;
+        if (nodes[node].any_child < 0) {
+            nodes.emplace_back();
+            nodes.back().is_any = true;
+            nodes[node].any_child = static_cast<int>(nodes.size()) - 1;
+        }
+        return nodes[node].any_child;
+    }
+
+    if (segment.find_first_of("*?") != std::string::npos) {
+        for (const auto& glob_child : nodes[node].glob_children) {
+            if (glob_child.first == segment)
+                return glob_child.second;
+        }
+        nodes.emplace_back();
+        int child = static_cast<int>(nodes.size()) - 1;
+        nodes[node].glob_children.emplace_back(segment, child);
+        return child;
+    }
+
+    auto it = nodes[node].children.find(segment);
+    if (it != nodes[node].children.end())
+        return it->second;
+    nodes.emplace_back();
+    int child = static_cast<int>(nodes.size()) - 1;
+    nodes[node].children.emplace(segment, child);
+    return child;
+}
+
+void PrefixMatcher::AddPattern(const std::string& pattern, unsigned rules, bool match_subdirectories)
+{
+    int node = 0;
+    size_t pos = 0;
+    while (pos < pattern.size()) {
+        size_t end = pattern.find('/', pos);
+        if (end == std::string::npos)
+            end = pattern.size();
+        node = AddChild(node, pattern.substr(pos, end - pos));
+        pos = end + 1;
+    }
+
+    if (match_subdirectories)
+        nodes[node].subdirectory_rules |= rules;
+    else
+        nodes[node].directory_rules |= rules;
+}
+
+void PrefixMatcher::Step(int node, std::string_view segment, std::vector<int>& next) const
+{
+    const Node& current = nodes[node];
+    if (current.is_any)
+        addUnique(next, node);
+
+    auto it = current.children.find(segment);
+    if (it != current.children.end())
+        addUnique(next, it->second);
+    for (const auto& glob_child : current.glob_children) {
+        if (globMatch(glob_child.first, segment))
+            addUnique(next, glob_child.second);
+    }
+
+    // "**" may also match no directory at all
+    if (current.any_child >= 0)
+        Step(current.any_child, segment, next);
+}
+
+unsigned PrefixMatcher::Match(std::string_view path) const
+{
+    unsigned rules = kNone;
+    std::vector<int> active(1, 0);
+    std::vector<int> next;
+    size_t pos = 0;
+    while (!active.empty()) {
+        size_t end = path.find('/', pos);
+        if (end == std::string_view::npos) {
+            // only a file name (or nothing) is left: |path| is inside the directories reached so far
+            for (int node : active)
+                rules |= nodes[node].directory_rules;
+            break;
+        }
+
+        next.clear();
+        for (int node : active)
+            Step(node, path.substr(pos, end - pos), next);
+        for (int node : next)
+            rules |= nodes[node].subdirectory_rules;
+        active.swap(next);
+        pos = end + 1;
+    }
+    return rules;
+}
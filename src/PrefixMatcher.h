@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_PREFIXMATCHER_H
+#define DYLIBBUNDLER_PREFIXMATCHER_H
+
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Trie of path patterns, matched one segment at a time in a single pass over the path.
+// Pattern segments may use '*' and '?' wildcards, and a "**" segment matches any number of directories.
+class PrefixMatcher {
+public:
+    enum Rule : unsigned {
+        kNone = 0,
+        kIgnored = 1 << 0,
+        kSystem = 1 << 1,
+    };
+
+    PrefixMatcher();
+
+    // attach |rules| to |pattern| (a directory, ending with '/'). If |match_subdirectories| is false,
+    // only paths whose directory is exactly |pattern| match, otherwise anything below it does too.
+    void AddPattern(const std::string& pattern, unsigned rules, bool match_subdirectories);
+
+    // rules of all the patterns matching |path|, a directory ending with '/' or a file path
+    [[nodiscard]] unsigned Match(std::string_view path) const;
+
+private:
+    struct Node {
+        std::map<std::string, int, std::less<>> children;
+        std::vector<std::pair<std::string, int>> glob_children;
+        int any_child = -1;
+        bool is_any = false;
+        unsigned directory_rules = kNone;
+        unsigned subdirectory_rules = kNone;
+    };
+
+    int AddChild(int node, const std::string& segment);
+    void Step(int node, std::string_view segment, std::vector<int>& next) const;
+
+    std::vector<Node> nodes;
+};
+
+#endif
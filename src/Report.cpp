@@ -0,0 +1,324 @@
+#include "Report.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include "BundleContext.h"
+#include "DylibBundler.h"
+#include "FileSystem.h"
+#include "MachO.h"
+#include "Settings.h"
+#include "Sha256.h"
+#include "Utils.h"
+
+namespace {
+
+struct ReportEntry {
+    std::string path;
+    bool is_dependency = false;
+    uint64_t size = 0;
+    std::vector<std::string> archs;
+    uint32_t filetype = 0;
+    size_t load_commands = 0;
+    size_t rpath_depth = 0;
+    size_t transitive_dependencies = 0;
+    size_t transitive_depth = 0;
+    size_t libraries_loaded = 0;
+    size_t rpath_probes = 0;
+    uint64_t mapped_bytes = 0;
+    // bundled dependencies (report entries) and system libraries loaded directly
+    std::vector<size_t> children;
+    std::set<std::string> system_libraries;
+};
+
+struct Duplicate {
+    std::string reason;
+    std::vector<std::string> paths;
+};
+
+uint64_t fileSize(const std::string& path)
+{
+    return fileSystem().Status(path).size;
+}
+
+std::string contentDigest(const std::string& path)
+{
+    Sha256 sha;
+    if (!sha256File(fileSystem(), path, sha))
+        return "";
+    return Sha256::Hex(sha.Finish());
+}
+
+std::string formatBytes(uint64_t bytes)
+{
+    std::ostringstream out;
+    if (bytes >= 1024 * 1024)
+        out << std::fixed << std::setprecision(1) << bytes / (1024.0 * 1024.0) << " MB";
+    else if (bytes >= 1024)
+        out << std::fixed << std::setprecision(1) << bytes / 1024.0 << " KB";
+    else
+        out << bytes << " B";
+    return out.str();
+}
+
+size_t transitiveDepth(const std::vector<ReportEntry>& entries, size_t index, std::vector<int>& depths)
+{
+    // -1: not computed yet, -2: on the current path (cycles count as leaves)
+    if (depths[index] == -2)
+        return 0;
+    if (depths[index] >= 0)
+        return static_cast<size_t>(depths[index]);
+    depths[index] = -2;
+    size_t depth = 0;
+    for (size_t child : entries[index].children)
+        depth = std::max(depth, 1 + transitiveDepth(entries, child, depths));
+    depths[index] = static_cast<int>(depth);
+    return depth;
+}
+
+// libraries of the same name loaded from different places, or the same file under different names
+std::vector<Duplicate> findDuplicates(const std::vector<ReportEntry>& entries)
+{
+    std::vector<Duplicate> duplicates;
+    std::map<std::string, std::vector<std::string>> by_name;
+    std::map<uint64_t, std::vector<std::string>> by_size;
+    for (const auto& entry : entries) {
+        if (!entry.is_dependency)
+            continue;
+        by_name[std::string(stripPrefix(entry.path))].push_back(entry.path);
+        by_size[entry.size].push_back(entry.path);
+    }
+    for (const auto& [name, paths] : by_name) {
+        if (paths.size() > 1)
+            duplicates.push_back({"same_name", paths});
+    }
+    // only files of the same size are worth hashing
+    for (const auto& [size, paths] : by_size) {
+        if (paths.size() < 2 || size == 0)
+            continue;
+        std::map<std::string, std::vector<std::string>> by_digest;
+        for (const auto& path : paths) {
+            std::string digest = contentDigest(path);
+            if (!digest.empty())
+                by_digest[digest].push_back(path);
+        }
+        for (const auto& [digest, same] : by_digest) {
+            if (same.size() > 1)
+                duplicates.push_back({"same_content", same});
+        }
+    }
+    return duplicates;
+}
+
+// Mach-O files left in an existing output directory that no collected dependency maps to
+std::vector<std::string> findUnused()
+{
+    std::vector<std::string> unused;
+    std::vector<std::string> files;
+    listFilesRecursive(Settings::destFolder(), files);
+    std::sort(files.begin(), files.end());
+
+    // helpers inside a bundled framework belong to it
+    std::set<std::string> bundled;
+    std::set<std::string> bundled_frameworks;
+    for (const auto& dep : BundleContext::Current().bundler.deps) {
+        std::string install_path = dep.InstallPath();
+        bundled.insert(install_path);
+        size_t framework_end = install_path.find(".framework/");
+        if (framework_end != std::string::npos)
+            bundled_frameworks.insert(install_path.substr(0, framework_end + 11));
+    }
+    for (const auto& file : files) {
+        size_t framework_end = file.find(".framework/");
+        if (framework_end != std::string::npos && bundled_frameworks.count(file.substr(0, framework_end + 11)) > 0)
+            continue;
+        if (bundled.count(file) == 0 && isMachO(file))
+            unused.push_back(file);
+    }
+    return unused;
+}
+
+void printTable(const std::vector<ReportEntry>& entries)
+{
+    std::vector<const ReportEntry*> sorted;
+    for (const auto& entry : entries)
+        sorted.push_back(&entry);
+    std::sort(sorted.begin(), sorted.end(), [](const ReportEntry* a, const ReportEntry* b) {
+        return a->mapped_bytes != b->mapped_bytes ? a->mapped_bytes > b->mapped_bytes : a->path < b->path;
+    });
+
+    std::cout << "\n" << std::right
+              << std::setw(10) << "MAPPED" << std::setw(10) << "SIZE" << std::setw(7) << "LOADS"
+              << std::setw(7) << "DYLIBS" << std::setw(7) << "RPATHS" << std::setw(7) << "DEPTH"
+              << std::setw(7) << "PROBES" << "  FILE\n";
+    for (const ReportEntry* entry : sorted) {
+        std::cout << std::setw(10) << formatBytes(entry->mapped_bytes) << std::setw(10) << formatBytes(entry->size)
+                  << std::setw(7) << entry->libraries_loaded << std::setw(7) << entry->load_commands
+                  << std::setw(7) << entry->rpath_depth << std::setw(7) << entry->transitive_depth
+                  << std::setw(7) << entry->rpath_probes << "  " << entry->path << "\n";
+    }
+}
+
+void writeJson(const std::string& json_path, const std::vector<ReportEntry>& entries,
+               const std::vector<Duplicate>& duplicates, const std::vector<std::string>& unused)
+{
+    std::ostringstream out;
+    uint64_t total_bytes = 0;
+    for (const auto& entry : entries)
+        total_bytes += entry.size;
+
+    out << "{\n";
+    out << "  \"binaries\": " << entries.size() << ",\n";
+    out << "  \"total_bytes\": " << total_bytes << ",\n";
+    out << "  \"files\": [";
+    for (size_t n=0; n<entries.size(); ++n) {
+        const ReportEntry& entry = entries[n];
+        out << (n == 0 ? "\n" : ",\n")
+            << "    {\"path\": \"" << jsonEscape(entry.path) << "\""
+            << ", \"kind\": \"" << (entry.is_dependency ? "dependency" : "file") << "\""
+            << ", \"size\": " << entry.size
+            << ", \"archs\": [";
+        for (size_t a=0; a<entry.archs.size(); ++a)
+            out << (a == 0 ? "" : ", ") << "\"" << entry.archs[a] << "\"";
+        out << "]"
+            << ", \"dylib_load_commands\": " << entry.load_commands
+            << ", \"rpath_depth\": " << entry.rpath_depth
+            << ", \"transitive_dependencies\": " << entry.transitive_dependencies
+            << ", \"transitive_depth\": " << entry.transitive_depth
+            << ", \"dyld\": {\"libraries_loaded\": " << entry.libraries_loaded
+            << ", \"rpath_probes\": " << entry.rpath_probes
+            << ", \"mapped_bytes\": " << entry.mapped_bytes << "}}";
+    }
+    out << (entries.empty() ? "],\n" : "\n  ],\n");
+
+    out << "  \"duplicates\": [";
+    for (size_t n=0; n<duplicates.size(); ++n) {
+        out << (n == 0 ? "\n" : ",\n") << "    {\"reason\": \"" << duplicates[n].reason << "\", \"paths\": [";
+        for (size_t p=0; p<duplicates[n].paths.size(); ++p)
+            out << (p == 0 ? "" : ", ") << "\"" << jsonEscape(duplicates[n].paths[p]) << "\"";
+        out << "]}";
+    }
+    out << (duplicates.empty() ? "],\n" : "\n  ],\n");
+
+    out << "  \"unused\": [";
+    for (size_t n=0; n<unused.size(); ++n)
+        out << (n == 0 ? "\n" : ",\n") << "    \"" << jsonEscape(unused[n]) << "\"";
+    out << (unused.empty() ? "]\n" : "\n  ]\n") << "}\n";
+
+    std::string json = out.str();
+    if (!fileSystem().WriteFile(json_path, json.data(), json.size()))
+        throw BundleError("Cannot write report " + json_path);
+}
+
+} // namespace
+
+void writeReport(const std::string& json_path)
+{
+    std::cout << "Collecting dependencies...\n";
+    // nothing is copied, Qt plugins included
+    Settings::bundleLibs(false);
+    const std::vector<std::string> files_to_fix = Settings::filesToFix();
+    for (const auto& file_to_fix : files_to_fix)
+        collectDependenciesRpaths(file_to_fix);
+    collectSubDependencies();
+    while (resolveMissingDependencies())
+        collectSubDependencies();
+
+    // one entry per bundled dependency, followed by the files to fix
+    BundlerState& bundler = BundleContext::Current().bundler;
+    std::vector<ReportEntry> entries;
+    std::vector<PathId> entry_files;
+    std::unordered_map<uint32_t, size_t> entry_of_dependency;
+    for (uint32_t n=0; n<bundler.deps.size(); ++n) {
+        std::string original_path(bundler.deps[n].OriginalPath());
+        if (isRpath(original_path))
+            original_path = searchFilenameInRpaths(original_path);
+        entry_of_dependency[n] = entries.size();
+        entries.emplace_back();
+        entries.back().path = original_path;
+        entries.back().is_dependency = true;
+        entry_files.push_back(pathTable().Intern(original_path));
+    }
+    for (const auto& file : files_to_fix) {
+        entries.emplace_back();
+        entries.back().path = file;
+        entry_files.push_back(pathTable().Intern(file));
+    }
+
+    std::vector<std::string> executable_rpaths;
+    for (auto& entry : entries) {
+        entry.size = fileSize(entry.path);
+        std::vector<MachOSlice> slices;
+        if (!readMachO(entry.path, slices) || slices.empty())
+            continue;
+        for (const auto& slice : slices)
+            entry.archs.push_back(archName(slice.cputype, slice.cpusubtype));
+        entry.filetype = slices[0].filetype;
+        entry.load_commands = slices[0].dylibs.size();
+        for (const auto& dylib : slices[0].dylibs) {
+            if (!Settings::isPrefixBundled(filePrefix(dylib.name)))
+                entry.system_libraries.insert(dylib.name);
+        }
+        // dyld searches the rpaths of the main executable after those of the loading image
+        if (!entry.is_dependency && entry.filetype == MH_EXECUTE && executable_rpaths.empty())
+            executable_rpaths = slices[0].rpaths;
+    }
+
+    for (size_t n=0; n<entries.size(); ++n) {
+        ReportEntry& entry = entries[n];
+        for (uint32_t dependency : bundler.deps_per_file.Dependencies(entry_files[n]))
+            entry.children.push_back(entry_of_dependency[dependency]);
+
+        std::vector<std::string> rpath_dirs;
+        for (const auto& rpath : Settings::getRpathsForFile(entry.path))
+            rpath_dirs.push_back(resolveRpath(rpath, entry.path));
+        if (entry.filetype != MH_EXECUTE) {
+            for (const auto& rpath : executable_rpaths)
+                rpath_dirs.push_back(resolveRpath(rpath, files_to_fix.front()));
+        }
+        entry.rpath_depth = rpath_dirs.size();
+        entry.rpath_probes = countRpathProbes(bundler.dylibs_per_file[entry_files[n]], rpath_dirs);
+    }
+
+    std::vector<int> depths(entries.size(), -1);
+    for (size_t n=0; n<entries.size(); ++n) {
+        ReportEntry& entry = entries[n];
+        entry.transitive_depth = transitiveDepth(entries, n, depths);
+
+        // everything dyld maps to load this binary: itself, its bundled closure and the system libraries they use
+        std::vector<bool> reached(entries.size(), false);
+        std::vector<size_t> stack{n};
+        std::set<std::string> system_libraries;
+        reached[n] = true;
+        while (!stack.empty()) {
+            size_t current = stack.back();
+            stack.pop_back();
+            entry.mapped_bytes += entries[current].size;
+            system_libraries.insert(entries[current].system_libraries.begin(), entries[current].system_libraries.end());
+            for (size_t child : entries[current].children) {
+                if (!reached[child]) {
+                    reached[child] = true;
+                    stack.push_back(child);
+                    entry.transitive_dependencies++;
+                }
+            }
+        }
+        entry.libraries_loaded = entry.transitive_dependencies + system_libraries.size();
+    }
+
+    const std::vector<Duplicate> duplicates = findDuplicates(entries);
+    const std::vector<std::string> unused = findUnused();
+    printTable(entries);
+    if (!duplicates.empty())
+        std::cout << "\n" << duplicates.size() << " sets of duplicate libraries\n";
+    if (!unused.empty())
+        std::cout << "\n" << unused.size() << " unused libraries in " << Settings::destFolder() << "\n";
+    writeJson(json_path, entries, duplicates, unused);
+    std::cout << "\nReport written to " << json_path << "\n";
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_REPORT_H
+#define DYLIBBUNDLER_REPORT_H
+
+#include <string>
+
+// Collect the dependencies of the files to fix without bundling them, then print a table of the
+// binaries sorted by the bytes dyld maps when loading them, and write the same data with per-binary
+// load commands, rpath depth, transitive depth, duplicate and unused libraries to |json_path|.
+// Throws BundleError on failure.
+void writeReport(const std::string& json_path);
+
+#endif
@@ -0,0 +1,110 @@
+#include "Reproducible.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include "BundleContext.h"
+#include "FileSystem.h"
+#include "Sha256.h"
+
+namespace {
+
+constexpr int64_t kZipEpoch = 315532800;
+
+void normalizeEntry(FileSystem& file_system, const std::string& path, int64_t mtime)
+{
+    FileInfo info = file_system.LinkStatus(path);
+    if (info.type == FileType::Missing)
+        throw BundleError("Cannot normalize " + path);
+
+    if (info.type == FileType::Directory) {
+        std::vector<std::string> names;
+        if (!file_system.ListDirectory(path, names))
+            throw BundleError("Cannot list " + path);
+        std::sort(names.begin(), names.end());
+        for (const auto& name : names)
+            normalizeEntry(file_system, path + "/" + name, mtime);
+    }
+    // symlink permissions can't be changed portably and are ignored by the system anyway
+    if (info.type != FileType::Symlink) {
+        uint32_t mode = info.type == FileType::Directory || (info.mode & 0111) != 0 ? 0755 : 0644;
+        if (info.mode != mode && !file_system.SetMode(path, mode))
+            throw BundleError("Cannot change the permissions of " + path);
+    }
+    // children first, setting their times doesn't touch the directory's
+    if (!file_system.SetTimes(path, mtime, 0))
+        throw BundleError("Cannot change the modification time of " + path);
+}
+
+void hashField(Sha256& sha, const std::string& field)
+{
+    // fields are NUL terminated so that no two trees hash the same bytes
+    sha.Update(field.data(), field.size());
+    sha.Update("", 1);
+}
+
+void hashEntry(FileSystem& file_system, const std::string& path, const std::string& name, Sha256& sha)
+{
+    FileInfo info = file_system.LinkStatus(path);
+    if (info.type == FileType::Symlink) {
+        std::string target;
+        if (!file_system.ReadLink(path, target))
+            throw BundleError("Cannot read symlink " + path);
+        hashField(sha, "l " + name);
+        hashField(sha, target);
+        return;
+    }
+    if (info.type == FileType::Directory) {
+        hashField(sha, "d " + name);
+        hashField(sha, std::to_string(info.mode));
+        std::vector<std::string> names;
+        if (!file_system.ListDirectory(path, names))
+            throw BundleError("Cannot list " + path);
+        std::sort(names.begin(), names.end());
+        for (const auto& child : names)
+            hashEntry(file_system, path + "/" + child, name.empty() ? child : name + "/" + child, sha);
+        return;
+    }
+    if (info.type != FileType::Regular)
+        return;
+
+    hashField(sha, "f " + name);
+    hashField(sha, std::to_string(info.mode));
+    hashField(sha, std::to_string(info.size));
+    if (!sha256File(file_system, path, sha))
+        throw BundleError("Cannot read " + path);
+}
+
+std::string withoutTrailingSlash(std::string path)
+{
+    while (path.size() > 1 && path[path.size()-1] == '/')
+        path.erase(path.size()-1);
+    return path;
+}
+
+} // namespace
+
+int64_t reproducibleTime()
+{
+    const char* source_date_epoch = getenv("SOURCE_DATE_EPOCH");
+    if (source_date_epoch == nullptr || *source_date_epoch == '\0')
+        return kZipEpoch;
+    char* end = nullptr;
+    long long epoch = strtoll(source_date_epoch, &end, 10);
+    if (*end != '\0' || epoch < 0)
+        throw BundleError("SOURCE_DATE_EPOCH must be a number of seconds, not '" + std::string(source_date_epoch) + "'");
+    return epoch;
+}
+
+void normalizeTree(const std::string& root)
+{
+    normalizeEntry(fileSystem(), withoutTrailingSlash(root), reproducibleTime());
+}
+
+std::string treeDigest(const std::string& root)
+{
+    Sha256 sha;
+    hashEntry(fileSystem(), withoutTrailingSlash(root), "", sha);
+    return Sha256::Hex(sha.Finish());
+}
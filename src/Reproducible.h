@@ -0,0 +1,22 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_REPRODUCIBLE_H
+#define DYLIBBUNDLER_REPRODUCIBLE_H
+
+#include <cstdint>
+#include <string>
+
+// modification time given to reproducible bundles: $SOURCE_DATE_EPOCH, or 1980-01-01 UTC, the
+// earliest time zip archives can hold
+int64_t reproducibleTime();
+
+// Give every file, directory and symlink of the tree at |root| the reproducible time, and files and
+// directories canonical permissions: 0755 for directories and executables, 0644 for the rest.
+// Throws BundleError on failure.
+void normalizeTree(const std::string& root);
+
+// SHA-256 of the tree at |root|: the relative path, type, permissions and contents or link target
+// of every entry, in name order. Identical bundles have the same digest wherever they were built.
+std::string treeDigest(const std::string& root);
+
+#endif
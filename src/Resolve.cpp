@@ -0,0 +1,148 @@
+#include "Resolve.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+#include <unistd.h>
+
+#include "BundleContext.h"
+#include "FileSystem.h"
+#include "Settings.h"
+#include "Utils.h"
+
+namespace {
+
+std::string directoryPath(std::string directory)
+{
+    if (!directory.empty() && directory[directory.size()-1] != '/')
+        directory += "/";
+    return directory;
+}
+
+// "<name> <directory>" lines, where the name is the file name or the install name of a dependency
+// and the directory may also be the library itself
+void applyResolveMap(const std::vector<MissingDependency>& missing, std::map<std::string, std::string>& found)
+{
+    std::string map_path = Settings::resolveMap();
+    std::vector<unsigned char> data;
+    if (!fileSystem().ReadFile(map_path, data))
+        throw BundleError("Cannot read the resolve map " + map_path);
+
+    std::string_view text(reinterpret_cast<const char*>(data.data()), data.size());
+    std::string_view line;
+    while (nextToken(text, "\r\n", line)) {
+        std::string_view name;
+        if (!nextToken(line, " \t", name) || name[0] == '#')
+            continue;
+        std::string location(line.substr(std::min(line.find_first_not_of(" \t"), line.size())));
+        rtrim_in_place(location);
+
+        for (const auto& dependency : missing) {
+            if (found.count(dependency.filename) != 0
+                || (name != dependency.filename && name != dependency.install_name && name != stripPrefix(dependency.filename)))
+                continue;
+            std::string directory = directoryPath(location);
+            if (!fileExists(directory + dependency.filename))
+                directory = std::string(filePrefix(location));
+            if (!fileExists(directory + dependency.filename))
+                throw BundleError("The resolve map entry of " + std::string(name) + " points to " + location + ", which doesn't contain " + dependency.filename);
+            found[dependency.filename] = directory;
+        }
+    }
+}
+
+// the first of |directories| containing each of |missing|, every directory is searched by one thread
+void searchDirectories(const std::vector<MissingDependency>& missing, const std::vector<std::string>& directories,
+                       std::map<std::string, std::string>& found)
+{
+    std::vector<const MissingDependency*> pending;
+    for (const auto& dependency : missing) {
+        if (found.count(dependency.filename) == 0)
+            pending.push_back(&dependency);
+    }
+    if (pending.empty() || directories.empty())
+        return;
+
+    std::vector<std::vector<char>> hits(directories.size(), std::vector<char>(pending.size()));
+    parallelFor(directories.size(), [&](size_t d) {
+        for (size_t n=0; n<pending.size(); ++n)
+            hits[d][n] = fileExists(directories[d] + pending[n]->filename);
+    });
+
+    for (size_t n=0; n<pending.size(); ++n) {
+        for (size_t d=0; d<directories.size(); ++d) {
+            if (hits[d][n]) {
+                found[pending[n]->filename] = directories[d];
+                break;
+            }
+        }
+    }
+}
+
+std::string missingList(const std::vector<MissingDependency>& missing, const std::map<std::string, std::string>& found)
+{
+    std::string list;
+    for (const auto& dependency : missing) {
+        if (found.count(dependency.filename) != 0)
+            continue;
+        list += "  " + dependency.filename + " (" + dependency.install_name + ", loaded by ";
+        for (size_t n=0; n<dependency.dependents.size(); ++n)
+            list += (n == 0 ? "" : ", ") + dependency.dependents[n];
+        list += ")\n";
+    }
+    return list;
+}
+
+} // namespace
+
+std::map<std::string, std::string> resolveMissing(const std::vector<MissingDependency>& missing,
+                                                  const std::vector<std::string>& candidates)
+{
+    std::map<std::string, std::string> found;
+    if (!Settings::resolveMap().empty())
+        applyResolveMap(missing, found);
+
+    std::vector<std::string> directories;
+    for (const auto& candidate : candidates) {
+        std::string directory = directoryPath(candidate);
+        if (!directory.empty() && std::find(directories.begin(), directories.end(), directory) == directories.end())
+            directories.push_back(directory);
+    }
+    searchDirectories(missing, directories, found);
+
+    for (const auto& dependency : missing) {
+        auto directory = found.find(dependency.filename);
+        if (directory != found.end() && !Settings::quietOutput())
+            std::cout << "FOUND " << dependency.filename << " in " << directory->second << "\n";
+    }
+
+    while (found.size() < missing.size()) {
+        std::string list = missingList(missing, found);
+        if (!Settings::canPrompt() || !isatty(STDIN_FILENO)) {
+            throw BundleError("Dependencies not found:\n" + list
+                              + "Pass their directories with -s, or map them with --resolve-map");
+        }
+
+        std::cerr << "\n/!\\ WARNING: Dependencies not found:\n" << list;
+        std::cout << "\nPlease specify the directories where they are located, separated by spaces (or enter 'quit' to abort): ";
+        fflush(stdout);
+        std::string answer;
+        std::getline(std::cin, answer);
+        std::cout << std::endl;
+
+        std::vector<std::string> answers;
+        tokenize(answer, " \t", &answers);
+        const auto quits = [](const std::string& word) { return word == "quit" || word == "exit" || word == "abort"; };
+        if (!std::cin || std::any_of(answers.begin(), answers.end(), quits))
+            throw BundleError("Dependencies not found:\n" + list);
+
+        size_t found_before = found.size();
+        for (auto& directory : answers)
+            directory = directoryPath(directory);
+        searchDirectories(missing, answers, found);
+        if (found.size() == found_before)
+            std::cerr << "None of them is in these directories. Try again...\n";
+    }
+    return found;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_RESOLVE_H
+#define DYLIBBUNDLER_RESOLVE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+// A dependency that couldn't be found while dependencies were collected.
+struct MissingDependency {
+    // name searched for in directories, "Foo.framework/Versions/A/Foo" for frameworks
+    std::string filename;
+    // the name it is loaded with and the files loading it
+    std::string install_name;
+    std::vector<std::string> dependents;
+};
+
+// Find the directory of each of |missing| at once, so that collecting dependencies never waits
+// for the user: from the --resolve-map file, then by searching the |candidates| directories in
+// parallel, then by asking once for the directories of all the remaining ones. Returns the
+// directories (ending with '/') by file name. Throws BundleError listing the dependencies left
+// if it can't prompt (--non-interactive or stdin isn't a terminal), or if the user quits.
+std::map<std::string, std::string> resolveMissing(const std::vector<MissingDependency>& missing,
+                                                  const std::vector<std::string>& candidates);
+
+#endif
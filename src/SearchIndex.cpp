@@ -0,0 +1,104 @@
+#include "SearchIndex.h"
+
+#include <algorithm>
+
+#include "FileSystem.h"
+
+void SearchIndex::AddDirectory(std::string directory)
+{
+    if (directory.empty())
+        return;
+    if (directory[directory.size()-1] != '/')
+        directory += "/";
+    directories.push_back(directory);
+    // only the new directory is listed, the others keep their entries
+    if (built) {
+        listed_at.emplace_back();
+        listed_names.emplace_back();
+        List(static_cast<uint32_t>(directories.size() - 1));
+    }
+}
+
+SearchIndex::Timestamp SearchIndex::ModificationTime(const std::string& directory)
+{
+    Timestamp timestamp;
+    FileInfo info = fileSystem().Status(directory);
+    if (info.type == FileType::Missing)
+        return timestamp;
+    timestamp.sec = static_cast<time_t>(info.mtime_sec);
+    timestamp.nsec = static_cast<long>(info.mtime_nsec);
+    return timestamp;
+}
+
+void SearchIndex::List(uint32_t n)
+{
+    listed_at[n] = ModificationTime(directories[n]);
+    std::vector<std::string>& names = listed_names[n];
+    names.clear();
+    fileSystem().ListDirectory(directories[n], names);
+    for (const auto& name : names) {
+        // the owners stay sorted by priority
+        std::vector<uint32_t>& owners = entries[name];
+        auto position = std::lower_bound(owners.begin(), owners.end(), n);
+        if (position == owners.end() || *position != n)
+            owners.insert(position, n);
+    }
+}
+
+void SearchIndex::Unlist(uint32_t n)
+{
+    for (const auto& name : listed_names[n]) {
+        auto it = entries.find(name);
+        if (it == entries.end())
+            continue;
+        std::vector<uint32_t>& owners = it->second;
+        owners.erase(std::remove(owners.begin(), owners.end(), n), owners.end());
+        if (owners.empty())
+            entries.erase(it);
+    }
+    listed_names[n].clear();
+}
+
+void SearchIndex::Build()
+{
+    entries.clear();
+    listed_at.assign(directories.size(), Timestamp());
+    listed_names.assign(directories.size(), std::vector<std::string>());
+    for (uint32_t n=0; n<directories.size(); ++n)
+        List(n);
+    built = true;
+}
+
+void SearchIndex::Refresh()
+{
+    if (!built)
+        return;
+    for (uint32_t n=0; n<directories.size(); ++n) {
+        if (ModificationTime(directories[n]) != listed_at[n]) {
+            Unlist(n);
+            List(n);
+        }
+    }
+}
+
+size_t SearchIndex::Lookup(const std::string& filename) const
+{
+    size_t slash = filename.find('/');
+    auto it = entries.find(filename.substr(0, slash));
+    if (it == entries.end())
+        return directories.size();
+    for (uint32_t n : it->second) {
+        // only the first component is indexed, deeper paths still need to be checked
+        if (slash == std::string::npos || fileSystem().Exists(directories[n] + filename))
+            return n;
+    }
+    return directories.size();
+}
+
+std::string SearchIndex::Find(const std::string& filename)
+{
+    if (!built)
+        Build();
+    size_t n = Lookup(filename);
+    return n < directories.size() ? directories[n] : "";
+}
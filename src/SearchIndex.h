@@ -0,0 +1,54 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_SEARCHINDEX_H
+#define DYLIBBUNDLER_SEARCHINDEX_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Index of the entries of a list of search directories, built by listing each directory once.
+// Looking a file up is a hash probe instead of one access() call per directory. Lookups don't
+// check the directories for changes, Refresh() does that once per collection pass and lists again
+// only the directories that were modified.
+class SearchIndex {
+public:
+    // add |directory| after the existing ones (lowest priority)
+    void AddDirectory(std::string directory);
+
+    [[nodiscard]] const std::vector<std::string>& Directories() const { return directories; }
+
+    // list again the directories modified since they were listed, one stat() per directory
+    void Refresh();
+
+    // first directory (ending with '/') that contains |filename|, empty if there is none.
+    // |filename| may be a relative path such as "Foo.framework/Versions/A/Foo".
+    std::string Find(const std::string& filename);
+
+private:
+    struct Timestamp {
+        time_t sec = 0;
+        long nsec = 0;
+        bool operator!=(const Timestamp& other) const { return sec != other.sec || nsec != other.nsec; }
+    };
+
+    void Build();
+    // add the entries of directory |n| to the index, or take them out
+    void List(uint32_t n);
+    void Unlist(uint32_t n);
+    // index of the first directory containing |filename|, directories.size() if none
+    [[nodiscard]] size_t Lookup(const std::string& filename) const;
+    static Timestamp ModificationTime(const std::string& directory);
+
+    std::vector<std::string> directories;
+    std::vector<Timestamp> listed_at;
+    // the entries of each directory when it was listed
+    std::vector<std::vector<std::string>> listed_names;
+    // first path component -> indices of the directories containing it, by priority
+    std::unordered_map<std::string, std::vector<uint32_t>> entries;
+    bool built = false;
+};
+
+#endif
@@ -1,173 +1,267 @@
 #include "Settings.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <map>
 #include <utility>
 
-#include <sys/param.h>
-
+#include "BundleContext.h"
+#include "Elf.h"
+#include "FileSystem.h"
 #include "Utils.h"
 
 namespace Settings {
 
-bool overwrite_files = false;
-bool overwrite_dir = false;
-bool create_dir = false;
-bool quiet_output = false;
-bool verbose_output = false;
-bool bundle_libs = true;
-bool bundle_frameworks = false;
-
-std::string dest_folder_str = "./libs/";
-std::string dest_folder_str_app = "./Frameworks/";
-std::string dest_folder = dest_folder_str;
-std::string dest_path = dest_folder;
-
-std::string inside_path_str = "@executable_path/../libs/";
-std::string inside_path_str_app = "@executable_path/../Frameworks/";
-std::string inside_path = inside_path_str;
-
-std::string app_bundle;
-std::string appBundle() { return app_bundle; }
+const std::string dest_folder_str = "./libs/";
+const std::string dest_folder_str_app = "./Frameworks/";
+const std::string inside_path_str = "@executable_path/../libs/";
+const std::string inside_path_str_app = "@executable_path/../Frameworks/";
+
+namespace {
+
+State& state() { return BundleContext::Current().settings; }
+
+// |path| with its symlinks resolved, unchanged if it doesn't exist
+std::string resolvedPath(const std::string& path)
+{
+    std::string resolved = fileSystem().RealPath(path);
+    return resolved.empty() ? path : resolved;
+}
+
+PrefixMatcher compilePrefixRules(const State& settings)
+{
+    PrefixMatcher matcher;
+    matcher.AddPattern("**/@executable_path/", PrefixMatcher::kSystem, true);
+    matcher.AddPattern("/usr/lib/", PrefixMatcher::kSystem, true);
+    matcher.AddPattern("/usr/lib64/", PrefixMatcher::kSystem, true);
+    matcher.AddPattern("/lib/", PrefixMatcher::kSystem, true);
+    matcher.AddPattern("/lib64/", PrefixMatcher::kSystem, true);
+    matcher.AddPattern("**/System/Library/", PrefixMatcher::kSystem, true);
+    if (!settings.bundle_frameworks)
+        matcher.AddPattern("**/*.framework/", PrefixMatcher::kSystem, true);
+    for (const auto& prefix_to_ignore : settings.prefixes_to_ignore)
+        matcher.AddPattern(prefix_to_ignore, PrefixMatcher::kIgnored, false);
+    return matcher;
+}
+
+} // namespace
+
+State::State()
+    : dest_folder(dest_folder_str), dest_path(dest_folder_str), inside_path(inside_path_str)
+{
+    prefix_rules = compilePrefixRules(*this);
+}
+
+std::string appBundle() { return state().app_bundle; }
 void appBundle(std::string path)
 {
-    app_bundle = std::move(path);
-    char buffer[PATH_MAX];
-    if (realpath(app_bundle.c_str(), buffer))
-        app_bundle = buffer;
+    State& settings = state();
+    settings.app_bundle = resolvedPath(path);
 
-    if (app_bundle[app_bundle.size()-1] != '/')
-        app_bundle += "/"; // fix path if needed so it ends with '/'
+    if (settings.app_bundle[settings.app_bundle.size()-1] != '/')
+        settings.app_bundle += "/"; // fix path if needed so it ends with '/'
 
-    std::string bundle_executable_path = app_bundle + "Contents/MacOS/" + bundleExecutableName(app_bundle);
-    if (realpath(bundle_executable_path.c_str(), buffer))
-        bundle_executable_path = buffer;
+    std::string bundle_executable_path = resolvedPath(settings.app_bundle + "Contents/MacOS/" + bundleExecutableName(settings.app_bundle));
+    settings.bundle_executable = bundle_executable_path;
     addFileToFix(bundle_executable_path);
 
-    if (inside_path == inside_path_str)
-        inside_path = inside_path_str_app;
-    if (dest_folder == dest_folder_str)
-        dest_folder = dest_folder_str_app;
+    if (settings.inside_path == inside_path_str)
+        settings.inside_path = inside_path_str_app;
+    if (settings.dest_folder == dest_folder_str)
+        settings.dest_folder = dest_folder_str_app;
 
-    dest_path = app_bundle + "Contents/" + stripLSlash(dest_folder);
-    if (realpath(dest_path.c_str(), buffer))
-        dest_path = buffer;
-    if (dest_path[dest_path.size()-1] != '/')
-        dest_path += "/";
+    settings.dest_path = resolvedPath(settings.app_bundle + "Contents/" + std::string(stripLSlash(settings.dest_folder)));
+    if (settings.dest_path[settings.dest_path.size()-1] != '/')
+        settings.dest_path += "/";
 }
-bool appBundleProvided() { return !app_bundle.empty(); }
+bool appBundleProvided() { return !state().app_bundle.empty(); }
+std::string bundleExecutable() { return state().bundle_executable; }
 
-std::string destFolder() { return dest_path; }
+std::string destFolder()
+{
+    const State& settings = state();
+    return settings.staging_path.empty() ? settings.dest_path : settings.staging_path;
+}
 void destFolder(std::string path)
 {
-    dest_path = std::move(path);
+    State& settings = state();
+    settings.dest_path = std::move(path);
     if (appBundleProvided())
-        dest_path = app_bundle + "Contents/" + stripLSlash(dest_folder);
-    char buffer[PATH_MAX];
-    if (realpath(dest_path.c_str(), buffer))
-        dest_path = buffer;
-    if (dest_path[dest_path.size()-1] != '/')
-        dest_path += "/";
+        settings.dest_path = settings.app_bundle + "Contents/" + std::string(stripLSlash(settings.dest_folder));
+    settings.dest_path = resolvedPath(settings.dest_path);
+    if (settings.dest_path[settings.dest_path.size()-1] != '/')
+        settings.dest_path += "/";
 }
 
-std::string insideLibPath() { return inside_path; }
+std::string finalDestFolder() { return state().dest_path; }
+std::string stagingFolder() { return state().staging_path; }
+void stagingFolder(std::string path) { state().staging_path = std::move(path); }
+
+std::string insideLibPath() { return state().inside_path; }
 void insideLibPath(std::string p)
 {
-    inside_path = std::move(p);
-    if (inside_path[inside_path.size()-1] != '/')
-        inside_path += "/";
+    State& settings = state();
+    settings.inside_path = std::move(p);
+    if (settings.inside_path[settings.inside_path.size()-1] != '/')
+        settings.inside_path += "/";
 }
 
-std::string executableFolder() { return app_bundle + "Contents/MacOS/"; }
-std::string frameworksFolder() { return app_bundle + "Contents/Frameworks/"; }
-std::string pluginsFolder() { return app_bundle + "Contents/PlugIns/"; }
-std::string resourcesFolder() { return app_bundle + "Contents/Resources/"; }
+std::string executableFolder() { return state().app_bundle + "Contents/MacOS/"; }
+std::string frameworksFolder() { return state().app_bundle + "Contents/Frameworks/"; }
+std::string pluginsFolder() { return state().app_bundle + "Contents/PlugIns/"; }
+std::string resourcesFolder() { return state().app_bundle + "Contents/Resources/"; }
 
-std::vector<std::string> files;
 void addFileToFix(std::string path)
 {
-    char buffer[PATH_MAX];
-    if (realpath(path.c_str(), buffer))
-        path = buffer;
-    files.push_back(path);
+    state().files.push_back(resolvedPath(path));
 }
 
-std::vector<std::string> filesToFix() { return files; }
-size_t filesToFixCount() { return files.size(); }
+std::vector<std::string> filesToFix() { return state().files; }
+size_t filesToFixCount() { return state().files.size(); }
 
-std::vector<std::string> prefixes_to_ignore;
 void ignorePrefix(std::string prefix)
 {
     if (prefix[prefix.size()-1] != '/')
         prefix += "/";
-    prefixes_to_ignore.push_back(prefix);
+    State& settings = state();
+    settings.prefixes_to_ignore.push_back(prefix);
+    settings.prefix_rules = compilePrefixRules(settings);
 }
-bool isPrefixIgnored(const std::string& prefix)
+bool isPrefixIgnored(std::string_view prefix)
+{
+    return (state().prefix_rules.Match(prefix) & PrefixMatcher::kIgnored) != 0;
+}
+
+bool isPrefixBundled(std::string_view prefix)
+{
+    return state().prefix_rules.Match(prefix) == PrefixMatcher::kNone;
+}
+
+const std::vector<std::string>& searchPaths() { return state().search_paths.Directories(); }
+void addSearchPath(const std::string& path) { state().search_paths.AddDirectory(path); }
+std::string findInSearchPaths(const std::string& filename) { return state().search_paths.Find(filename); }
+void refreshSearchPaths()
 {
-    for (const auto& prefix_to_ignore : prefixes_to_ignore) {
-        if (prefix == prefix_to_ignore)
-            return true;
+    state().search_paths.Refresh();
+    state().user_search_paths.Refresh();
+}
+
+const std::vector<std::string>& systemLibraryDirs()
+{
+    State& settings = state();
+    if (!settings.system_library_dirs_read) {
+        settings.system_library_dirs = ldSoConfDirectories();
+        for (const char* directory : {"/lib64/", "/usr/lib64/", "/lib/", "/usr/lib/"}) {
+            auto& dirs = settings.system_library_dirs;
+            if (std::find(dirs.begin(), dirs.end(), directory) == dirs.end())
+                dirs.emplace_back(directory);
+        }
+        settings.system_library_dirs_read = true;
     }
-    return false;
+    return settings.system_library_dirs;
 }
 
-bool isPrefixBundled(const std::string& prefix)
+const std::vector<std::string>& userSearchPaths() { return state().user_search_paths.Directories(); }
+void addUserSearchPath(const std::string& path) { state().user_search_paths.AddDirectory(path); }
+std::string findInUserSearchPaths(const std::string& filename) { return state().user_search_paths.Find(filename); }
+
+bool canCreateDir() { return state().create_dir; }
+void canCreateDir(bool permission) { state().create_dir = permission; }
+
+bool canPrompt() { return state().can_prompt; }
+void canPrompt(bool permission) { state().can_prompt = permission; }
+
+std::string resolveMap() { return state().resolve_map; }
+void resolveMap(std::string path) { state().resolve_map = std::move(path); }
+
+std::string toolDirectory() { return state().tool_dir; }
+void toolDirectory(std::string path)
+{
+    if (!path.empty() && path[path.size()-1] != '/')
+        path += "/";
+    state().tool_dir = std::move(path);
+}
+
+bool canOverwriteDir() { return state().overwrite_dir; }
+void canOverwriteDir(bool permission) { state().overwrite_dir = permission; }
+
+bool canOverwriteFiles() { return state().overwrite_files; }
+void canOverwriteFiles(bool permission) { state().overwrite_files = permission; }
+
+bool bundleLibs() { return state().bundle_libs; }
+void bundleLibs(bool status) { state().bundle_libs = status; }
+
+bool bundleFrameworks() { return state().bundle_frameworks; }
+void bundleFrameworks(bool status)
 {
-    if (!bundle_frameworks && prefix.find(".framework") != std::string::npos)
-        return false;
-    if (prefix.find("@executable_path") != std::string::npos)
-        return false;
-    if (prefix.find("/usr/lib/") == 0)
-        return false;
-    if (prefix.find("/System/Library/") != std::string::npos)
-        return false;
-    if (isPrefixIgnored(prefix))
-        return false;
-    return true;
+    State& settings = state();
+    settings.bundle_frameworks = status;
+    settings.prefix_rules = compilePrefixRules(settings);
 }
 
-std::vector<std::string> search_paths;
-std::vector<std::string> searchPaths() { return search_paths; }
-void addSearchPath(const std::string& path) { search_paths.push_back(path); }
+bool quietOutput() { return state().quiet_output; }
+void quietOutput(bool status) { state().quiet_output = status; }
+
+bool verboseOutput() { return state().verbose_output; }
+void verboseOutput(bool status) { state().verbose_output = status; }
 
-std::vector<std::string> user_search_paths;
-std::vector<std::string> userSearchPaths() { return user_search_paths; }
-void addUserSearchPath(const std::string& path) { user_search_paths.push_back(path); }
+bool missingPrefixes() { return state().missing_prefixes; }
+void missingPrefixes(bool status) { state().missing_prefixes = status; }
 
-bool canCreateDir() { return create_dir; }
-void canCreateDir(bool permission) { create_dir = permission; }
+bool optimizeRpaths() { return state().optimize_rpaths; }
+void optimizeRpaths(bool status) { state().optimize_rpaths = status; }
 
-bool canOverwriteDir() { return overwrite_dir; }
-void canOverwriteDir(bool permission) { overwrite_dir = permission; }
+bool verifyOnly() { return state().verify_only; }
+void verifyOnly(bool status) { state().verify_only = status; }
 
-bool canOverwriteFiles() { return overwrite_files; }
-void canOverwriteFiles(bool permission) { overwrite_files = permission; }
+bool stripSymbols() { return state().strip_symbols; }
+void stripSymbols(bool status) { state().strip_symbols = status; }
 
-bool bundleLibs() { return bundle_libs; }
-void bundleLibs(bool status) { bundle_libs = status; }
+std::string outputArchive() { return state().output_archive; }
+void outputArchive(std::string path) { state().output_archive = std::move(path); }
+bool archiveStore() { return state().archive_store; }
+void archiveStore(bool status) { state().archive_store = status; }
 
-bool bundleFrameworks() { return bundle_frameworks; }
-void bundleFrameworks(bool status) { bundle_frameworks = status; }
+std::string reportPath() { return state().report_path; }
+void reportPath(std::string path) { state().report_path = std::move(path); }
+
+std::string cacheDir() { return state().cache_dir; }
+void cacheDir(std::string path)
+{
+    if (!path.empty() && path[path.size()-1] != '/')
+        path += "/";
+    state().cache_dir = std::move(path);
+}
 
-bool quietOutput() { return quiet_output; }
-void quietOutput(bool status) { quiet_output = status; }
+uint64_t cacheSizeLimit() { return state().cache_size_limit; }
+void cacheSizeLimit(uint64_t bytes) { state().cache_size_limit = bytes; }
 
-bool verboseOutput() { return verbose_output; }
-void verboseOutput(bool status) { verbose_output = status; }
+bool resume() { return state().resume; }
+void resume(bool status) { state().resume = status; }
 
-// if some libs are missing prefixes, then more stuff will be necessary to do
-bool missing_prefixes = false;
-bool missingPrefixes() { return missing_prefixes; }
-void missingPrefixes(bool status) { missing_prefixes = status; }
+bool minimalFrameworks() { return state().minimal_frameworks; }
+void minimalFrameworks(bool status) { state().minimal_frameworks = status; }
+
+const std::vector<std::string>& frameworkResources() { return state().framework_resources; }
+void addFrameworkResource(std::string path) { state().framework_resources.push_back(std::move(path)); }
+
+bool reproducible() { return state().reproducible; }
+void reproducible(bool status) { state().reproducible = status; }
+
+const std::vector<std::string>& targetArchs() { return state().target_archs; }
+void addTargetArch(std::string arch)
+{
+    State& settings = state();
+    if (std::find(settings.target_archs.begin(), settings.target_archs.end(), arch) == settings.target_archs.end())
+        settings.target_archs.push_back(std::move(arch));
+}
 
-std::map<std::string, std::string> rpath_to_fullpath;
-std::string getFullPath(const std::string& rpath) { return rpath_to_fullpath[rpath]; }
-void rpathToFullPath(const std::string& rpath, const std::string& fullpath) { rpath_to_fullpath[rpath] = fullpath; }
-bool rpathFound(const std::string& rpath) { return rpath_to_fullpath.find(rpath) != rpath_to_fullpath.end(); }
+std::string getFullPath(const std::string& rpath) { return state().rpath_to_fullpath[rpath]; }
+void rpathToFullPath(const std::string& rpath, const std::string& fullpath) { state().rpath_to_fullpath[rpath] = fullpath; }
+bool rpathFound(const std::string& rpath) { return state().rpath_to_fullpath.count(rpath) != 0; }
 
-std::map<std::string, std::vector<std::string>> rpaths_per_file;
-std::vector<std::string> getRpathsForFile(const std::string& file) { return rpaths_per_file[file]; }
-void addRpathForFile(const std::string& file, const std::string& rpath) { rpaths_per_file[file].push_back(rpath); }
-bool fileHasRpath(const std::string& file) { return rpaths_per_file.find(file) != rpaths_per_file.end(); }
+std::vector<std::string> getRpathsForFile(const std::string& file) { return state().rpaths_per_file[file]; }
+void addRpathForFile(const std::string& file, const std::string& rpath) { state().rpaths_per_file[file].push_back(rpath); }
+bool fileHasRpath(const std::string& file) { return state().rpaths_per_file.count(file) != 0; }
 
 } // namespace Settings
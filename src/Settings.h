@@ -3,25 +3,88 @@
 #ifndef DYLIBBUNDLER_SETTINGS_H
 #define DYLIBBUNDLER_SETTINGS_H
 
+#include <cstdint>
+#include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #ifndef __clang__
 #include <sys/types.h>
 #endif
 
+#include "PrefixMatcher.h"
+#include "SearchIndex.h"
+
 namespace Settings {
 
-bool isPrefixBundled(const std::string& prefix);
-bool isPrefixIgnored(const std::string& prefix);
+// Options of one bundle. Every BundleContext owns one, the functions below act on the
+// one of the context bound to the calling thread.
+struct State {
+    State();
+
+    bool overwrite_files = false;
+    bool overwrite_dir = false;
+    bool create_dir = false;
+    bool can_prompt = true;
+    bool quiet_output = false;
+    bool verbose_output = false;
+    bool bundle_libs = true;
+    bool bundle_frameworks = false;
+    bool optimize_rpaths = false;
+    bool verify_only = false;
+    bool strip_symbols = false;
+    bool minimal_frameworks = false;
+    bool reproducible = false;
+    bool resume = false;
+    bool archive_store = false;
+    // if some libs are missing prefixes, then more stuff will be necessary to do
+    bool missing_prefixes = false;
+
+    std::string dest_folder;
+    std::string dest_path;
+    std::string staging_path;
+    std::string inside_path;
+    std::string app_bundle;
+    std::string bundle_executable;
+    std::string output_archive;
+    std::string report_path;
+    std::string cache_dir;
+    std::string resolve_map;
+    std::string tool_dir;
+    uint64_t cache_size_limit = uint64_t(1) << 30;
+
+    std::vector<std::string> files;
+    std::vector<std::string> target_archs;
+    std::vector<std::string> framework_resources;
+    std::vector<std::string> prefixes_to_ignore;
+    PrefixMatcher prefix_rules;
+    SearchIndex search_paths;
+    SearchIndex user_search_paths;
+
+    std::map<std::string, std::string> rpath_to_fullpath;
+    std::map<std::string, std::vector<std::string>> rpaths_per_file;
+    // ld.so.conf and default directories of ld.so, read when first needed
+    std::vector<std::string> system_library_dirs;
+    bool system_library_dirs_read = false;
+};
+
+bool isPrefixBundled(std::string_view prefix);
+bool isPrefixIgnored(std::string_view prefix);
 void ignorePrefix(std::string prefix);
 
 std::string appBundle();
 void appBundle(std::string path);
 bool appBundleProvided();
+std::string bundleExecutable();
 
+// where dependencies are copied: the staging directory while one is being filled, see createDestDir()
 std::string destFolder();
 void destFolder(std::string path);
+// the output directory itself, whether it is staged or not
+std::string finalDestFolder();
+std::string stagingFolder();
+void stagingFolder(std::string path);
 
 std::string insideLibPath();
 void insideLibPath(std::string p);
@@ -35,14 +98,31 @@ std::vector<std::string> filesToFix();
 void addFileToFix(std::string path);
 size_t filesToFixCount();
 
-std::vector<std::string> searchPaths();
+// search paths are indexed, find*() return the first directory containing filename or ""
+const std::vector<std::string>& searchPaths();
 void addSearchPath(const std::string& path);
+std::string findInSearchPaths(const std::string& filename);
+// list again the search directories modified since the last collection pass
+void refreshSearchPaths();
+
+// directories ld.so searches after the rpaths and LD_LIBRARY_PATH
+const std::vector<std::string>& systemLibraryDirs();
 
-std::vector<std::string> userSearchPaths();
+const std::vector<std::string>& userSearchPaths();
 void addUserSearchPath(const std::string& path);
+std::string findInUserSearchPaths(const std::string& filename);
 
 bool canCreateDir();
 void canCreateDir(bool permission);
+// whether dependencies that can't be found may be asked for, see resolveMissing()
+bool canPrompt();
+void canPrompt(bool permission);
+// file mapping dependencies that can't be found to their directory
+std::string resolveMap();
+void resolveMap(std::string path);
+// directory otool, install_name_tool and PlistBuddy are run from instead of their own, empty for those
+std::string toolDirectory();
+void toolDirectory(std::string path);
 
 bool canOverwriteDir();
 void canOverwriteDir(bool permission);
@@ -65,6 +145,51 @@ void verboseOutput(bool status);
 bool missingPrefixes();
 void missingPrefixes(bool status);
 
+bool optimizeRpaths();
+void optimizeRpaths(bool status);
+
+bool verifyOnly();
+void verifyOnly(bool status);
+
+bool stripSymbols();
+void stripSymbols(bool status);
+
+// --output-archive: the bundle is built in memory and only written into this archive
+std::string outputArchive();
+void outputArchive(std::string path);
+// store the files of .zip archives without deflating them
+bool archiveStore();
+void archiveStore(bool status);
+
+// where --report writes its JSON, empty when bundling normally
+std::string reportPath();
+void reportPath(std::string path);
+
+// directory of the patched dependency cache, empty when it isn't used
+std::string cacheDir();
+void cacheDir(std::string path);
+// bytes the cache is trimmed to after each run
+uint64_t cacheSizeLimit();
+void cacheSizeLimit(uint64_t bytes);
+
+// continue the interrupted run that left its journal in the output directory
+bool resume();
+void resume(bool status);
+
+bool minimalFrameworks();
+void minimalFrameworks(bool status);
+// paths relative to a framework version directory, copied along with minimal frameworks
+const std::vector<std::string>& frameworkResources();
+void addFrameworkResource(std::string path);
+
+// sorted processing order, normalized times and permissions, and a digest of the finished bundle
+bool reproducible();
+void reproducible(bool status);
+
+// architectures to keep in bundled dependencies, empty to keep them all
+const std::vector<std::string>& targetArchs();
+void addTargetArch(std::string arch);
+
 std::string getFullPath(const std::string& rpath);
 void rpathToFullPath(const std::string& rpath, const std::string& fullpath);
 bool rpathFound(const std::string& rpath);
@@ -0,0 +1,132 @@
+#include "Sha256.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "FileSystem.h"
+
+namespace {
+
+constexpr uint32_t kRoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+} // namespace
+
+Sha256::Sha256()
+    : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+      buffer{}
+{
+}
+
+void Sha256::Transform(const unsigned char* block)
+{
+    uint32_t w[64];
+    for (int n=0; n<16; ++n)
+        w[n] = (uint32_t(block[n*4]) << 24) | (uint32_t(block[n*4+1]) << 16) | (uint32_t(block[n*4+2]) << 8) | block[n*4+3];
+    for (int n=16; n<64; ++n) {
+        uint32_t s0 = rotr(w[n-15], 7) ^ rotr(w[n-15], 18) ^ (w[n-15] >> 3);
+        uint32_t s1 = rotr(w[n-2], 17) ^ rotr(w[n-2], 19) ^ (w[n-2] >> 10);
+        w[n] = w[n-16] + s0 + w[n-7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int n=0; n<64; ++n) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kRoundConstants[n] + w[n];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void Sha256::Update(const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    total_size += size;
+    if (buffer_size > 0) {
+        size_t count = std::min(size, buffer.size() - buffer_size);
+        memcpy(buffer.data() + buffer_size, bytes, count);
+        buffer_size += count;
+        bytes += count;
+        size -= count;
+        if (buffer_size < buffer.size())
+            return;
+        Transform(buffer.data());
+        buffer_size = 0;
+    }
+    for (; size >= 64; bytes += 64, size -= 64)
+        Transform(bytes);
+    memcpy(buffer.data(), bytes, size);
+    buffer_size = size;
+}
+
+Sha256::Digest Sha256::Finish()
+{
+    uint64_t bit_size = total_size * 8;
+    static const unsigned char padding[64] = {0x80};
+    Update(padding, buffer_size < 56 ? 56 - buffer_size : 120 - buffer_size);
+    unsigned char length[8];
+    for (int n=0; n<8; ++n)
+        length[n] = static_cast<unsigned char>(bit_size >> (56 - 8 * n));
+    Update(length, sizeof(length));
+
+    Digest digest;
+    for (int n=0; n<8; ++n) {
+        digest[n*4] = static_cast<unsigned char>(state[n] >> 24);
+        digest[n*4+1] = static_cast<unsigned char>(state[n] >> 16);
+        digest[n*4+2] = static_cast<unsigned char>(state[n] >> 8);
+        digest[n*4+3] = static_cast<unsigned char>(state[n]);
+    }
+    return digest;
+}
+
+Sha256::Digest Sha256::Hash(const void* data, size_t size)
+{
+    Sha256 sha;
+    sha.Update(data, size);
+    return sha.Finish();
+}
+
+std::string Sha256::Hex(const Digest& digest)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned char byte : digest) {
+        hex += digits[byte >> 4];
+        hex += digits[byte & 0xf];
+    }
+    return hex;
+}
+
+bool sha256File(FileSystem& file_system, const std::string& path, Sha256& sha)
+{
+    std::unique_ptr<File> file = file_system.Open(path, OpenMode::Read);
+    if (!file)
+        return false;
+    std::vector<unsigned char> buffer(1 << 16);
+    uint64_t size = file->Size();
+    for (uint64_t offset=0; offset<size; offset+=buffer.size()) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size - offset, buffer.size()));
+        if (!file->Read(buffer.data(), chunk, offset))
+            return false;
+        sha.Update(buffer.data(), chunk);
+    }
+    return true;
+}
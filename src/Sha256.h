@@ -0,0 +1,36 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_SHA256_H
+#define DYLIBBUNDLER_SHA256_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class FileSystem;
+
+class Sha256 {
+public:
+    using Digest = std::array<unsigned char, 32>;
+
+    Sha256();
+    void Update(const void* data, size_t size);
+    Digest Finish();
+
+    static Digest Hash(const void* data, size_t size);
+    static std::string Hex(const Digest& digest);
+
+private:
+    void Transform(const unsigned char* block);
+
+    std::array<uint32_t, 8> state;
+    std::array<unsigned char, 64> buffer;
+    size_t buffer_size = 0;
+    uint64_t total_size = 0;
+};
+
+// feed the contents of |path| to |sha| in chunks, returns false if it can't be read
+bool sha256File(FileSystem& file_system, const std::string& path, Sha256& sha);
+
+#endif
@@ -0,0 +1,477 @@
+#include "Strip.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "CodeSignature.h"
+#include "FileSystem.h"
+#include "MachO.h"
+
+namespace {
+
+constexpr uint32_t INDIRECT_SYMBOL_LOCAL = 0x80000000;
+constexpr uint32_t INDIRECT_SYMBOL_ABS = 0x40000000;
+// second word of a (little endian) relocation_info
+constexpr uint32_t R_SYMBOLNUM_MASK = 0x00ffffff;
+constexpr uint32_t R_EXTERN = 0x08000000;
+// nlist n_type
+constexpr uint8_t N_STAB = 0xe0;
+constexpr uint8_t N_TYPE = 0x0e;
+constexpr uint8_t N_INDR = 0x0a;
+
+// a range of __LINKEDIT referenced by a load command
+struct LinkeditBlob {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    // position of the 32-bit offset field in the load commands
+    size_t offset_field = 0;
+    uint32_t alignment = 8;
+    // new contents if the blob is rewritten, nullptr to copy it as is
+    const std::vector<unsigned char>* contents = nullptr;
+    // the code signature, which is resized and rehashed for the new layout
+    bool signature = false;
+};
+
+// Strips one thin Mach-O image. The symbol and string tables are rebuilt without local symbols,
+// the indirect symbol table and external relocations are renumbered, and every __LINKEDIT blob
+// is laid out again back to back. An ad-hoc signature is rebuilt for the new layout, images
+// signed with a certificate are left alone.
+class SliceStripper {
+public:
+    SliceStripper(const unsigned char* data, size_t size) : data(data), size(size) {}
+
+    // the stripped image in |out|, false if it can't or doesn't need to be stripped
+    bool Strip(std::vector<unsigned char>& out);
+
+private:
+    bool ParseLoadCommands();
+    bool AddBlob(size_t offset_field, uint64_t offset, uint64_t blob_size, uint32_t alignment,
+                 const std::vector<unsigned char>* contents = nullptr);
+    bool StripSymbols();
+    bool Layout(std::vector<unsigned char>& out);
+
+    const unsigned char* data;
+    size_t size;
+    bool swap = false;
+    bool is64 = false;
+    uint32_t pointer_size = 8;
+
+    // positions of the interesting load commands, 0 if missing
+    size_t linkedit = 0;
+    size_t symtab = 0;
+    size_t dysymtab = 0;
+    size_t code_signature = 0;
+    std::vector<LinkeditBlob> blobs;
+
+    std::vector<unsigned char> symbols;
+    std::vector<unsigned char> strings;
+    std::vector<unsigned char> indirect_symbols;
+    std::vector<unsigned char> external_relocations;
+    std::vector<unsigned char> signature;
+    uint32_t kept_locals = 0;
+    uint32_t extdef_count = 0;
+};
+
+bool SliceStripper::AddBlob(size_t offset_field, uint64_t offset, uint64_t blob_size, uint32_t alignment,
+                            const std::vector<unsigned char>* contents)
+{
+    if (blob_size != 0 && (offset > size || blob_size > size - offset))
+        return false;
+    LinkeditBlob blob;
+    blob.offset = offset;
+    blob.size = blob_size;
+    blob.offset_field = offset_field;
+    blob.alignment = alignment;
+    blob.contents = contents;
+    blobs.push_back(blob);
+    return true;
+}
+
+bool SliceStripper::ParseLoadCommands()
+{
+    if (size < 28)
+        return false;
+    uint32_t magic;
+    memcpy(&magic, data, sizeof(magic));
+    swap = magic == MH_CIGAM || magic == MH_CIGAM_64;
+    is64 = magic == MH_MAGIC_64 || magic == MH_CIGAM_64;
+    if (!is64 && magic != MH_MAGIC && magic != MH_CIGAM)
+        return false;
+    pointer_size = is64 ? 8 : 4;
+
+    size_t header_size = is64 ? 32 : 28;
+    uint32_t ncmds = read32(data + 16, swap);
+    uint32_t sizeofcmds = read32(data + 20, swap);
+    if (header_size + sizeofcmds > size)
+        return false;
+
+    size_t end = header_size + sizeofcmds;
+    size_t pos = header_size;
+    for (uint32_t n=0; n<ncmds; ++n) {
+        if (pos + 8 > end)
+            return false;
+        const unsigned char* cmd = data + pos;
+        uint32_t type = read32(cmd, swap);
+        uint32_t cmdsize = read32(cmd + 4, swap);
+        if (cmdsize < 8 || pos + cmdsize > end)
+            return false;
+
+        bool ok = true;
+        switch (type) {
+        case LC_SEGMENT:
+        case LC_SEGMENT_64:
+            if (cmdsize >= (type == LC_SEGMENT_64 ? 72u : 56u) && strncmp(reinterpret_cast<const char*>(cmd + 8), "__LINKEDIT", 16) == 0)
+                linkedit = pos;
+            break;
+        case LC_SYMTAB:
+            ok = cmdsize >= 24;
+            symtab = pos;
+            break;
+        case LC_DYSYMTAB:
+            ok = cmdsize >= 80;
+            dysymtab = pos;
+            break;
+        case LC_DYLD_INFO:
+        case LC_DYLD_INFO_ONLY:
+            // rebase, bind, weak bind, lazy bind and export info
+            ok = cmdsize >= 48;
+            for (size_t field = 8; ok && field < 48; field += 8)
+                ok = AddBlob(pos + field, read32(cmd + field, swap), read32(cmd + field + 4, swap), pointer_size);
+            break;
+        case LC_CODE_SIGNATURE:
+            ok = cmdsize >= 16 && AddBlob(pos + 8, read32(cmd + 8, swap), read32(cmd + 12, swap), 16);
+            if (ok) {
+                blobs.back().signature = true;
+                code_signature = pos;
+            }
+            break;
+        case LC_SEGMENT_SPLIT_INFO:
+        case LC_FUNCTION_STARTS:
+        case LC_DATA_IN_CODE:
+        case LC_DYLIB_CODE_SIGN_DRS:
+        case LC_LINKER_OPTIMIZATION_HINT:
+        case LC_DYLD_EXPORTS_TRIE:
+        case LC_DYLD_CHAINED_FIXUPS:
+        case LC_ATOM_INFO:
+            ok = cmdsize >= 16 && AddBlob(pos + 8, read32(cmd + 8, swap), read32(cmd + 12, swap), pointer_size);
+            break;
+        case LC_TWOLEVEL_HINTS:
+            ok = cmdsize >= 16 && AddBlob(pos + 8, read32(cmd + 8, swap), uint64_t(read32(cmd + 12, swap)) * 4, pointer_size);
+            break;
+        default:
+            break;
+        }
+        if (!ok)
+            return false;
+        pos += cmdsize;
+    }
+    return linkedit != 0 && symtab != 0 && dysymtab != 0;
+}
+
+bool SliceStripper::StripSymbols()
+{
+    const unsigned char* symtab_cmd = data + symtab;
+    uint32_t symoff = read32(symtab_cmd + 8, swap);
+    uint32_t nsyms = read32(symtab_cmd + 12, swap);
+    uint32_t stroff = read32(symtab_cmd + 16, swap);
+    uint32_t strsize = read32(symtab_cmd + 20, swap);
+    size_t nlist_size = is64 ? 16 : 12;
+    if (symoff > size || uint64_t(nsyms) * nlist_size > size - symoff || stroff > size || strsize > size - stroff)
+        return false;
+
+    // the symbol table must be laid out as locals, defined externals, undefined externals,
+    // and nothing else may refer to symbol indices
+    const unsigned char* dysymtab_cmd = data + dysymtab;
+    uint32_t ilocalsym = read32(dysymtab_cmd + 8, swap);
+    uint32_t nlocalsym = read32(dysymtab_cmd + 12, swap);
+    uint32_t iextdefsym = read32(dysymtab_cmd + 16, swap);
+    uint32_t nextdefsym = read32(dysymtab_cmd + 20, swap);
+    uint32_t iundefsym = read32(dysymtab_cmd + 24, swap);
+    uint32_t nundefsym = read32(dysymtab_cmd + 28, swap);
+    uint32_t ntoc = read32(dysymtab_cmd + 36, swap);
+    uint32_t nmodtab = read32(dysymtab_cmd + 44, swap);
+    uint32_t nextrefsyms = read32(dysymtab_cmd + 52, swap);
+    uint32_t indirectsymoff = read32(dysymtab_cmd + 56, swap);
+    uint32_t nindirectsyms = read32(dysymtab_cmd + 60, swap);
+    uint32_t extreloff = read32(dysymtab_cmd + 64, swap);
+    uint32_t nextrel = read32(dysymtab_cmd + 68, swap);
+    uint32_t locreloff = read32(dysymtab_cmd + 72, swap);
+    uint32_t nlocrel = read32(dysymtab_cmd + 76, swap);
+    if (ilocalsym != 0 || iextdefsym != nlocalsym || iundefsym != iextdefsym + nextdefsym
+        || uint64_t(iundefsym) + nundefsym != nsyms)
+        return false;
+    if (ntoc != 0 || nmodtab != 0 || nextrefsyms != 0 || (nextrel != 0 && swap))
+        return false;
+    if (nlocalsym == 0)
+        return false;
+    if (indirectsymoff > size || uint64_t(nindirectsyms) * 4 > size - indirectsymoff
+        || extreloff > size || uint64_t(nextrel) * 8 > size - extreloff)
+        return false;
+
+    // locals still referenced by the indirect symbol table or relocations have to stay
+    std::vector<bool> keep(nlocalsym, false);
+    const unsigned char* indirect = data + indirectsymoff;
+    for (uint32_t n=0; n<nindirectsyms; ++n) {
+        uint32_t index = read32(indirect + n * 4, swap);
+        if ((index & (INDIRECT_SYMBOL_LOCAL | INDIRECT_SYMBOL_ABS)) == 0 && index < nlocalsym)
+            keep[index] = true;
+    }
+    const unsigned char* relocations = data + extreloff;
+    for (uint32_t n=0; n<nextrel; ++n) {
+        uint32_t info = read32(relocations + n * 8 + 4, swap);
+        if ((info & R_EXTERN) != 0 && (info & R_SYMBOLNUM_MASK) < nlocalsym)
+            keep[info & R_SYMBOLNUM_MASK] = true;
+    }
+
+    std::vector<uint32_t> new_index(nsyms, UINT32_MAX);
+    uint32_t next_index = 0;
+    for (uint32_t n=0; n<nsyms; ++n) {
+        if (n >= nlocalsym || keep[n])
+            new_index[n] = next_index++;
+    }
+    kept_locals = next_index - (nsyms - nlocalsym);
+    extdef_count = nextdefsym;
+    if (kept_locals == nlocalsym)
+        return false;
+
+    // the string table starts with " \0" so that index 0 is the empty string
+    strings = {' ', '\0'};
+    std::unordered_map<std::string_view, uint32_t> string_index;
+    const char* string_table = reinterpret_cast<const char*>(data + stroff);
+    const auto addString = [&](uint32_t strx, uint32_t& new_strx) {
+        if (strx == 0) {
+            new_strx = 0;
+            return true;
+        }
+        if (strx >= strsize)
+            return false;
+        std::string_view name(string_table + strx, strnlen(string_table + strx, strsize - strx));
+        auto it = string_index.find(name);
+        if (it == string_index.end()) {
+            it = string_index.emplace(name, static_cast<uint32_t>(strings.size())).first;
+            strings.insert(strings.end(), name.begin(), name.end());
+            strings.push_back('\0');
+        }
+        new_strx = it->second;
+        return true;
+    };
+
+    symbols.clear();
+    symbols.reserve(size_t(next_index) * nlist_size);
+    for (uint32_t n=0; n<nsyms; ++n) {
+        if (new_index[n] == UINT32_MAX)
+            continue;
+        const unsigned char* entry = data + symoff + size_t(n) * nlist_size;
+        size_t pos = symbols.size();
+        symbols.insert(symbols.end(), entry, entry + nlist_size);
+        uint32_t strx;
+        if (!addString(read32(entry, swap), strx))
+            return false;
+        write32(symbols.data() + pos, strx, swap);
+
+        // the value of an indirect symbol is the string index of the symbol it refers to
+        uint8_t type = entry[4];
+        if ((type & N_STAB) == 0 && (type & N_TYPE) == N_INDR) {
+            uint64_t value = is64 ? read64(entry + 8, swap) : read32(entry + 8, swap);
+            if (value > UINT32_MAX || !addString(static_cast<uint32_t>(value), strx))
+                return false;
+            if (is64)
+                write64(symbols.data() + pos + 8, strx, swap);
+            else
+                write32(symbols.data() + pos + 8, strx, swap);
+        }
+    }
+    while (strings.size() % pointer_size != 0)
+        strings.push_back('\0');
+
+    indirect_symbols.assign(indirect, indirect + size_t(nindirectsyms) * 4);
+    for (uint32_t n=0; n<nindirectsyms; ++n) {
+        uint32_t index = read32(indirect + n * 4, swap);
+        if ((index & (INDIRECT_SYMBOL_LOCAL | INDIRECT_SYMBOL_ABS)) != 0)
+            continue;
+        if (index >= nsyms)
+            return false;
+        write32(indirect_symbols.data() + n * 4, new_index[index], swap);
+    }
+    external_relocations.assign(relocations, relocations + size_t(nextrel) * 8);
+    for (uint32_t n=0; n<nextrel; ++n) {
+        uint32_t info = read32(relocations + n * 8 + 4, swap);
+        if ((info & R_EXTERN) == 0)
+            continue;
+        if ((info & R_SYMBOLNUM_MASK) >= nsyms)
+            return false;
+        info = (info & ~R_SYMBOLNUM_MASK) | new_index[info & R_SYMBOLNUM_MASK];
+        write32(external_relocations.data() + n * 8 + 4, info, swap);
+    }
+
+    return AddBlob(symtab + 8, symoff, uint64_t(nsyms) * nlist_size, pointer_size, &symbols)
+        && AddBlob(symtab + 16, stroff, strsize, pointer_size, &strings)
+        && AddBlob(dysymtab + 56, indirectsymoff, uint64_t(nindirectsyms) * 4, pointer_size, &indirect_symbols)
+        && AddBlob(dysymtab + 64, extreloff, uint64_t(nextrel) * 8, pointer_size, &external_relocations)
+        && AddBlob(dysymtab + 72, locreloff, uint64_t(nlocrel) * 8, pointer_size);
+}
+
+bool SliceStripper::Layout(std::vector<unsigned char>& out)
+{
+    const unsigned char* segment = data + linkedit;
+    uint64_t fileoff = is64 ? read64(segment + 40, swap) : read32(segment + 32, swap);
+    uint64_t filesize = is64 ? read64(segment + 48, swap) : read32(segment + 36, swap);
+    // __LINKEDIT has to be the end of the image for it to shrink
+    if (fileoff > size || fileoff + filesize != size)
+        return false;
+
+    // every byte of __LINKEDIT must belong to a known blob, give or take alignment padding
+    std::stable_sort(blobs.begin(), blobs.end(), [](const LinkeditBlob& a, const LinkeditBlob& b) {
+        return a.offset < b.offset;
+    });
+    uint64_t previous_end = fileoff;
+    bool after_signature = false;
+    for (const auto& blob : blobs) {
+        if (blob.size == 0)
+            continue;
+        if (blob.offset < previous_end || blob.offset - previous_end >= 16)
+            return false;
+        // the signature covers everything before it, so it has to come last
+        if (after_signature)
+            return false;
+        after_signature = blob.signature;
+        previous_end = blob.offset + blob.size;
+    }
+    if (size - previous_end >= 16)
+        return false;
+
+    out.assign(data, data + fileoff);
+    uint64_t signature_offset = 0;
+    for (const auto& blob : blobs) {
+        size_t blob_size = blob.contents != nullptr ? blob.contents->size() : blob.size;
+        if (blob_size == 0) {
+            write32(out.data() + blob.offset_field, 0, swap);
+            continue;
+        }
+        while (out.size() % blob.alignment != 0)
+            out.push_back(0);
+        if (out.size() > UINT32_MAX)
+            return false;
+        write32(out.data() + blob.offset_field, static_cast<uint32_t>(out.size()), swap);
+        if (blob.signature) {
+            signature_offset = out.size();
+            if (!resizeSignature(data + blob.offset, blob.size, signature_offset, signature))
+                return false;
+            out.insert(out.end(), signature.begin(), signature.end());
+        }
+        else if (blob.contents != nullptr)
+            out.insert(out.end(), blob.contents->begin(), blob.contents->end());
+        else
+            out.insert(out.end(), data + blob.offset, data + blob.offset + blob.size);
+    }
+
+    unsigned char* segment_out = out.data() + linkedit;
+    if (is64)
+        write64(segment_out + 48, out.size() - fileoff, swap);
+    else
+        write32(segment_out + 36, static_cast<uint32_t>(out.size() - fileoff), swap);
+
+    size_t nlist_size = is64 ? 16 : 12;
+    write32(out.data() + symtab + 12, static_cast<uint32_t>(symbols.size() / nlist_size), swap);
+    write32(out.data() + symtab + 20, static_cast<uint32_t>(strings.size()), swap);
+    write32(out.data() + dysymtab + 8, 0, swap);
+    write32(out.data() + dysymtab + 12, kept_locals, swap);
+    write32(out.data() + dysymtab + 16, kept_locals, swap);
+    write32(out.data() + dysymtab + 24, kept_locals + extdef_count, swap);
+
+    // the page hashes go in last, once the load commands are final
+    if (signature_offset != 0) {
+        write32(out.data() + code_signature + 12, static_cast<uint32_t>(signature.size()), swap);
+        if (!hashCodePages(out.data(), signature_offset, out.data() + signature_offset, signature.size()))
+            return false;
+    }
+    return out.size() < size;
+}
+
+bool SliceStripper::Strip(std::vector<unsigned char>& out)
+{
+    return ParseLoadCommands() && StripSymbols() && Layout(out);
+}
+
+bool stripFat(const std::vector<unsigned char>& file, std::vector<unsigned char>& out)
+{
+    uint32_t magic;
+    memcpy(&magic, file.data(), sizeof(magic));
+    bool swap = magic == FAT_CIGAM || magic == FAT_CIGAM_64;
+    bool is64 = magic == FAT_MAGIC_64 || magic == FAT_CIGAM_64;
+    uint32_t nfat_arch = read32(file.data() + 4, swap);
+    size_t arch_size = is64 ? 32 : 20;
+    if (nfat_arch == 0 || nfat_arch > MAX_FAT_ARCHS || 8 + nfat_arch * arch_size > file.size())
+        return false;
+
+    std::vector<std::vector<unsigned char>> slices(nfat_arch);
+    bool stripped = false;
+    uint64_t header_end = file.size();
+    for (uint32_t n=0; n<nfat_arch; ++n) {
+        const unsigned char* arch = file.data() + 8 + n * arch_size;
+        uint64_t offset = is64 ? read64(arch + 8, swap) : read32(arch + 8, swap);
+        uint64_t slice_size = is64 ? read64(arch + 16, swap) : read32(arch + 12, swap);
+        if (offset > file.size() || slice_size > file.size() - offset)
+            return false;
+        header_end = std::min(header_end, offset);
+        if (SliceStripper(file.data() + offset, slice_size).Strip(slices[n]))
+            stripped = true;
+        else
+            slices[n].assign(file.data() + offset, file.data() + offset + slice_size);
+    }
+    if (!stripped)
+        return false;
+
+    // slices keep their order and alignment, packed after the fat header
+    out.assign(file.data(), file.data() + header_end);
+    for (uint32_t n=0; n<nfat_arch; ++n) {
+        unsigned char* arch = out.data() + 8 + n * arch_size;
+        uint32_t align = std::min<uint32_t>(read32(arch + (is64 ? 24 : 16), swap), 16);
+        while (out.size() % (uint64_t(1) << align) != 0)
+            out.push_back(0);
+        arch = out.data() + 8 + n * arch_size;
+        if (is64) {
+            write64(arch + 8, out.size(), swap);
+            write64(arch + 16, slices[n].size(), swap);
+        }
+        else {
+            if (out.size() > UINT32_MAX)
+                return false;
+            write32(arch + 8, static_cast<uint32_t>(out.size()), swap);
+            write32(arch + 12, static_cast<uint32_t>(slices[n].size()), swap);
+        }
+        out.insert(out.end(), slices[n].begin(), slices[n].end());
+    }
+    return out.size() < file.size();
+}
+
+} // namespace
+
+bool stripMachO(const std::string& path, uint64_t& bytes_saved)
+{
+    bytes_saved = 0;
+    if (!isMachO(path))
+        return false;
+
+    FileSystem& file_system = fileSystem();
+    std::vector<unsigned char> file;
+    if (!file_system.ReadFile(path, file) || file.size() < 8)
+        return false;
+
+    uint32_t magic;
+    memcpy(&magic, file.data(), sizeof(magic));
+    std::vector<unsigned char> stripped;
+    bool is_fat = magic == FAT_MAGIC || magic == FAT_CIGAM || magic == FAT_MAGIC_64 || magic == FAT_CIGAM_64;
+    if (is_fat ? !stripFat(file, stripped) : !SliceStripper(file.data(), file.size()).Strip(stripped))
+        return false;
+
+    std::unique_ptr<File> out = file_system.Open(path, OpenMode::ReadWrite);
+    if (!out || !out->Write(stripped.data(), stripped.size(), 0) || !out->Truncate(stripped.size()))
+        return false;
+    bytes_saved = file.size() - stripped.size();
+    return true;
+}
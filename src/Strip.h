@@ -0,0 +1,14 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_STRIP_H
+#define DYLIBBUNDLER_STRIP_H
+
+#include <cstdint>
+#include <string>
+
+// Remove the local and debug (stab) symbols of every slice of the Mach-O file at |path| and
+// compact its __LINKEDIT segment. Returns false if the file was left untouched, because it isn't
+// a Mach-O file, has nothing to strip or has a layout that can't be rewritten safely.
+bool stripMachO(const std::string& path, uint64_t& bytes_saved);
+
+#endif
@@ -0,0 +1,437 @@
+#include "Symbols.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <tuple>
+
+#include "FileSystem.h"
+#include "Utils.h"
+
+namespace {
+
+constexpr uint8_t BIND_OPCODE_MASK = 0xf0;
+constexpr uint8_t BIND_IMMEDIATE_MASK = 0x0f;
+constexpr uint8_t BIND_OPCODE_DONE = 0x00;
+constexpr uint8_t BIND_OPCODE_SET_DYLIB_ORDINAL_IMM = 0x10;
+constexpr uint8_t BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB = 0x20;
+constexpr uint8_t BIND_OPCODE_SET_DYLIB_SPECIAL_IMM = 0x30;
+constexpr uint8_t BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM = 0x40;
+constexpr uint8_t BIND_OPCODE_SET_TYPE_IMM = 0x50;
+constexpr uint8_t BIND_OPCODE_SET_ADDEND_SLEB = 0x60;
+constexpr uint8_t BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB = 0x70;
+constexpr uint8_t BIND_OPCODE_ADD_ADDR_ULEB = 0x80;
+constexpr uint8_t BIND_OPCODE_DO_BIND = 0x90;
+constexpr uint8_t BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB = 0xa0;
+constexpr uint8_t BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED = 0xb0;
+constexpr uint8_t BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB = 0xc0;
+constexpr uint8_t BIND_OPCODE_THREADED = 0xd0;
+constexpr uint8_t BIND_SUBOPCODE_THREADED_SET_BIND_ORDINAL_TABLE_SIZE_ULEB = 0x00;
+constexpr uint8_t BIND_SYMBOL_FLAGS_WEAK_IMPORT = 0x1;
+
+constexpr uint32_t DYLD_CHAINED_IMPORT = 1;
+constexpr uint32_t DYLD_CHAINED_IMPORT_ADDEND = 2;
+constexpr uint32_t DYLD_CHAINED_IMPORT_ADDEND64 = 3;
+
+// an import while the tables are parsed, |name| points into the table
+struct RawImport {
+    std::string_view name;
+    int32_t ordinal;
+    bool weak;
+};
+
+// Reads the LEB128 numbers and C strings of a linkedit table, |failed| is set instead of reading past its end.
+class Reader {
+public:
+    Reader(const unsigned char* data, size_t size, size_t pos = 0) : data(data), size(size), pos(pos) {}
+
+    [[nodiscard]] bool AtEnd() const { return failed || pos >= size; }
+    [[nodiscard]] bool Failed() const { return failed; }
+    [[nodiscard]] size_t Position() const { return pos; }
+
+    uint8_t Byte()
+    {
+        if (pos >= size) {
+            failed = true;
+            return 0;
+        }
+        return data[pos++];
+    }
+
+    uint64_t Uleb()
+    {
+        uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = Byte();
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        failed = true;
+        return 0;
+    }
+
+    int64_t Sleb()
+    {
+        int64_t value = 0;
+        unsigned shift = 0;
+        uint8_t byte;
+        do {
+            byte = Byte();
+            if (shift < 64)
+                value |= int64_t(byte & 0x7f) << shift;
+            shift += 7;
+        } while ((byte & 0x80) && !failed);
+        if (shift < 64 && (byte & 0x40))
+            value |= -(int64_t(1) << shift);
+        return value;
+    }
+
+    std::string_view String()
+    {
+        const void* end = pos < size ? memchr(data + pos, 0, size - pos) : nullptr;
+        if (!end) {
+            failed = true;
+            return {};
+        }
+        std::string_view string(reinterpret_cast<const char*>(data + pos), static_cast<const unsigned char*>(end) - (data + pos));
+        pos += string.size() + 1;
+        return string;
+    }
+
+private:
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+    bool failed = false;
+};
+
+SymbolName addName(MachOSymbols& symbols, std::string_view name)
+{
+    SymbolName added{static_cast<uint32_t>(symbols.names.size()), static_cast<uint32_t>(name.size())};
+    symbols.names += name;
+    return added;
+}
+
+// walk the trie depth first, the name of a node is the concatenation of the edge labels leading to it
+void readExportTrie(const std::vector<unsigned char>& trie, MachOSymbols& symbols)
+{
+    struct Pending {
+        uint64_t node;
+        size_t prefix_offset;
+        size_t prefix_size;
+    };
+    // prefixes of the pending nodes, a child's is its parent's followed by its label
+    std::string prefixes;
+    std::vector<Pending> pending{{0, 0, 0}};
+    std::vector<bool> visited(trie.size());
+
+    while (!pending.empty()) {
+        Pending node = pending.back();
+        pending.pop_back();
+        // offsets only point forward in well-formed tries, don't loop on a malformed one
+        if (node.node >= trie.size() || visited[node.node])
+            continue;
+        visited[node.node] = true;
+
+        Reader reader(trie.data(), trie.size(), node.node);
+        uint64_t terminal_size = reader.Uleb();
+        size_t children = reader.Position() + terminal_size;
+        if (terminal_size > 0) {
+            uint8_t flags = static_cast<uint8_t>(reader.Uleb());
+            if (!reader.Failed())
+                symbols.exports.push_back({addName(symbols, std::string_view(prefixes).substr(node.prefix_offset, node.prefix_size)), flags});
+        }
+
+        Reader edges(trie.data(), trie.size(), children);
+        uint8_t child_count = edges.Byte();
+        for (uint8_t n=0; n<child_count && !edges.Failed(); ++n) {
+            std::string_view label = edges.String();
+            uint64_t child = edges.Uleb();
+            if (edges.Failed())
+                break;
+            size_t prefix_offset = prefixes.size();
+            prefixes.append(prefixes, node.prefix_offset, node.prefix_size);
+            prefixes += label;
+            pending.push_back({child, prefix_offset, node.prefix_size + label.size()});
+        }
+    }
+}
+
+void readBindOpcodes(const std::vector<unsigned char>& opcodes, std::vector<RawImport>& imports)
+{
+    Reader reader(opcodes.data(), opcodes.size());
+    int32_t ordinal = 0;
+    std::string_view name;
+    bool weak = false;
+    const auto bind = [&]() {
+        if (!name.empty())
+            imports.push_back({name, ordinal, weak});
+    };
+
+    // DONE ends each lazy binding, the whole table is read
+    while (!reader.AtEnd()) {
+        uint8_t byte = reader.Byte();
+        uint8_t immediate = byte & BIND_IMMEDIATE_MASK;
+        switch (byte & BIND_OPCODE_MASK) {
+        case BIND_OPCODE_DONE:
+        case BIND_OPCODE_SET_TYPE_IMM:
+            break;
+        case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+            ordinal = immediate;
+            break;
+        case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+            ordinal = static_cast<int32_t>(reader.Uleb());
+            break;
+        case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+            // negative ordinals are stored as the low bits of a sign extended byte
+            ordinal = immediate == 0 ? 0 : static_cast<int8_t>(BIND_OPCODE_MASK | immediate);
+            break;
+        case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+            name = reader.String();
+            weak = (immediate & BIND_SYMBOL_FLAGS_WEAK_IMPORT) != 0;
+            break;
+        case BIND_OPCODE_SET_ADDEND_SLEB:
+            reader.Sleb();
+            break;
+        case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+        case BIND_OPCODE_ADD_ADDR_ULEB:
+            reader.Uleb();
+            break;
+        case BIND_OPCODE_DO_BIND:
+        case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+            bind();
+            break;
+        case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+            bind();
+            reader.Uleb();
+            break;
+        case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB:
+            bind();
+            reader.Uleb();
+            reader.Uleb();
+            break;
+        case BIND_OPCODE_THREADED:
+            if (immediate == BIND_SUBOPCODE_THREADED_SET_BIND_ORDINAL_TABLE_SIZE_ULEB)
+                reader.Uleb();
+            break;
+        default:
+            // an unknown opcode, its operands can't be skipped
+            return;
+        }
+    }
+}
+
+void readChainedImports(const std::vector<unsigned char>& fixups, bool swap, std::vector<RawImport>& imports)
+{
+    if (fixups.size() < 28)
+        return;
+    uint32_t imports_offset = read32(fixups.data() + 8, swap);
+    uint32_t symbols_offset = read32(fixups.data() + 12, swap);
+    uint32_t imports_count = read32(fixups.data() + 16, swap);
+    uint32_t imports_format = read32(fixups.data() + 20, swap);
+    uint32_t symbols_format = read32(fixups.data() + 24, swap);
+    // compressed symbol names aren't supported
+    if (symbols_format != 0 || symbols_offset > fixups.size())
+        return;
+
+    size_t import_size = imports_format == DYLD_CHAINED_IMPORT ? 4 : imports_format == DYLD_CHAINED_IMPORT_ADDEND ? 8
+                       : imports_format == DYLD_CHAINED_IMPORT_ADDEND64 ? 16 : 0;
+    if (import_size == 0 || imports_offset > fixups.size() || (fixups.size() - imports_offset) / import_size < imports_count)
+        return;
+
+    Reader names(fixups.data(), fixups.size());
+    for (uint32_t n=0; n<imports_count; ++n) {
+        const unsigned char* import = fixups.data() + imports_offset + n * import_size;
+        int32_t ordinal;
+        bool weak;
+        uint64_t name_offset;
+        if (imports_format == DYLD_CHAINED_IMPORT_ADDEND64) {
+            uint64_t value = read64(import, swap);
+            uint16_t library = value & 0xffff;
+            ordinal = library > 0xfff0 ? static_cast<int16_t>(library) : library;
+            weak = (value >> 16) & 1;
+            name_offset = value >> 32;
+        }
+        else {
+            uint32_t value = read32(import, swap);
+            uint8_t library = value & 0xff;
+            ordinal = library > 0xf0 ? static_cast<int8_t>(library) : library;
+            weak = (value >> 8) & 1;
+            name_offset = value >> 9;
+        }
+        Reader name(fixups.data(), fixups.size(), symbols_offset + name_offset);
+        std::string_view symbol = name.String();
+        if (!name.Failed())
+            imports.push_back({symbol, ordinal, weak});
+    }
+}
+
+bool readRange(const File& file, const MachOSlice& slice, const LinkeditRange& range, std::vector<unsigned char>& data)
+{
+    data.resize(range.size);
+    return range.size > 0 && file.Read(data.data(), data.size(), slice.offset + range.offset);
+}
+
+} // namespace
+
+bool readSymbols(const std::string& path, const std::vector<MachOSlice>& slices, std::vector<MachOSymbols>& symbols)
+{
+    std::unique_ptr<File> file = fileSystem().Open(path, OpenMode::Read);
+    if (!file)
+        return false;
+
+    std::vector<unsigned char> data;
+    for (const auto& slice : slices) {
+        MachOSymbols& slice_symbols = symbols.emplace_back();
+        slice_symbols.cputype = slice.cputype;
+        slice_symbols.filetype = slice.filetype;
+
+        if (readRange(*file, slice, slice.export_trie, data))
+            readExportTrie(data, slice_symbols);
+        // a library without exports has an empty trie
+        slice_symbols.has_exports = slice.has_export_trie && (slice.export_trie.size == 0 || !data.empty());
+
+        // the names point into the tables, so they are all read before the names are copied
+        std::vector<std::vector<unsigned char>> tables;
+        tables.reserve(3);
+        std::vector<RawImport> imports;
+        if (readRange(*file, slice, slice.chained_fixups, tables.emplace_back()))
+            readChainedImports(tables.back(), slice.swap, imports);
+        if (readRange(*file, slice, slice.bind, tables.emplace_back()))
+            readBindOpcodes(tables.back(), imports);
+        if (readRange(*file, slice, slice.lazy_bind, tables.emplace_back()))
+            readBindOpcodes(tables.back(), imports);
+
+        // the same symbol is usually bound at several places, it must be there if one of them isn't weak
+        std::sort(imports.begin(), imports.end(), [](const RawImport& a, const RawImport& b) {
+            return std::tie(a.ordinal, a.name, a.weak) < std::tie(b.ordinal, b.name, b.weak);
+        });
+        for (size_t n=0; n<imports.size(); ++n) {
+            const RawImport& import = imports[n];
+            if (n > 0 && imports[n-1].ordinal == import.ordinal && imports[n-1].name == import.name)
+                continue;
+            slice_symbols.imports.push_back({addName(slice_symbols, import.name), import.ordinal, import.weak});
+        }
+    }
+    return true;
+}
+
+uint64_t SymbolIndex::Hash(std::string_view name)
+{
+    return std::hash<std::string_view>()(name);
+}
+
+void SymbolIndex::Build(const std::vector<const MachOSymbols*>& libraries)
+{
+    // hashes decide the shard of a name and its slot in it
+    std::vector<std::vector<uint64_t>> hashes(libraries.size());
+    parallelFor(libraries.size(), [&](size_t n) {
+        const MachOSymbols& library = *libraries[n];
+        hashes[n].reserve(library.exports.size());
+        for (const auto& symbol : library.exports)
+            hashes[n].push_back(Hash(library.Name(symbol.name)));
+    });
+
+    // one pass sorts the exports into the shards, in library order so the definitions keep it
+    struct Export {
+        uint64_t hash;
+        uint32_t owner;
+        uint32_t index;
+    };
+    size_t shard_count = 4 * std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::vector<Export>> buckets(shard_count);
+    for (uint32_t owner=0; owner<libraries.size(); ++owner) {
+        for (size_t n=0; n<hashes[owner].size(); ++n) {
+            uint64_t hash = hashes[owner][n];
+            buckets[hash % shard_count].push_back({hash, owner, static_cast<uint32_t>(n)});
+        }
+    }
+
+    shards.assign(shard_count, Shard());
+    parallelFor(shard_count, [&](size_t s) {
+        Shard& shard = shards[s];
+        const std::vector<Export>& bucket = buckets[s];
+        size_t slot_count = 16;
+        while (slot_count < 2 * bucket.size())
+            slot_count *= 2;
+        shard.slots.assign(slot_count, 0);
+
+        // collect the definitions of each entry, then lay them out next to each other
+        struct Pending {
+            uint32_t entry;
+            Definition definition;
+        };
+        std::vector<Pending> pending;
+        pending.reserve(bucket.size());
+        for (const auto& symbol : bucket) {
+            const MachOSymbols& library = *libraries[symbol.owner];
+            std::string_view name = library.Name(library.exports[symbol.index].name);
+            size_t slot = (symbol.hash / shard_count) & (slot_count - 1);
+            while (shard.slots[slot] != 0) {
+                const Entry& entry = shard.entries[shard.slots[slot] - 1];
+                if (entry.hash == symbol.hash && entry.name == name)
+                    break;
+                slot = (slot + 1) & (slot_count - 1);
+            }
+            if (shard.slots[slot] == 0) {
+                shard.entries.push_back({symbol.hash, name, 0, 0});
+                shard.slots[slot] = static_cast<uint32_t>(shard.entries.size());
+            }
+            uint32_t entry = shard.slots[slot] - 1;
+            ++shard.entries[entry].last;
+            pending.push_back({entry, {symbol.owner, library.exports[symbol.index].flags}});
+        }
+
+        uint32_t first = 0;
+        for (auto& entry : shard.entries) {
+            uint32_t size = entry.last;
+            entry.first = entry.last = first;
+            first += size;
+        }
+        shard.definitions.resize(pending.size());
+        for (const auto& definition : pending)
+            shard.definitions[shard.entries[definition.entry].last++] = definition.definition;
+    });
+}
+
+const SymbolIndex::Entry* SymbolIndex::FindEntry(const Shard& shard, std::string_view name, uint64_t hash) const
+{
+    size_t mask = shard.slots.size() - 1;
+    for (size_t slot = (hash / shards.size()) & mask; shard.slots[slot] != 0; slot = (slot + 1) & mask) {
+        const Entry& entry = shard.entries[shard.slots[slot] - 1];
+        if (entry.hash == hash && entry.name == name)
+            return &entry;
+    }
+    return nullptr;
+}
+
+SymbolIndex::Definitions SymbolIndex::Find(std::string_view name) const
+{
+    if (shards.empty())
+        return {};
+    uint64_t hash = Hash(name);
+    const Shard& shard = shards[hash % shards.size()];
+    const Entry* entry = FindEntry(shard, name, hash);
+    if (!entry)
+        return {};
+    return {shard.definitions.data() + entry->first, shard.definitions.data() + entry->last};
+}
+
+bool SymbolIndex::Exports(std::string_view name, uint32_t owner) const
+{
+    for (const auto& definition : Find(name)) {
+        if (definition.owner == owner)
+            return true;
+    }
+    return false;
+}
+
+size_t SymbolIndex::Size() const
+{
+    size_t size = 0;
+    for (const auto& shard : shards)
+        size += shard.entries.size();
+    return size;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_SYMBOLS_H
+#define DYLIBBUNDLER_SYMBOLS_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "MachO.h"
+
+// export trie flags
+constexpr uint8_t EXPORT_SYMBOL_FLAGS_WEAK_DEFINITION = 0x04;
+constexpr uint8_t EXPORT_SYMBOL_FLAGS_REEXPORT = 0x08;
+
+// special library ordinals of imports
+constexpr int32_t BIND_SPECIAL_DYLIB_SELF = 0;
+constexpr int32_t BIND_SPECIAL_DYLIB_MAIN_EXECUTABLE = -1;
+constexpr int32_t BIND_SPECIAL_DYLIB_FLAT_LOOKUP = -2;
+constexpr int32_t BIND_SPECIAL_DYLIB_WEAK_LOOKUP = -3;
+
+// a name in MachOSymbols::names
+struct SymbolName {
+    uint32_t offset = 0;
+    uint32_t size = 0;
+};
+
+struct MachOExport {
+    SymbolName name;
+    uint8_t flags = 0;
+};
+
+struct MachOImport {
+    SymbolName name;
+    // 1-based index of the dylib load command the symbol is bound to, or a BIND_SPECIAL_DYLIB_*
+    int32_t ordinal = 0;
+    // weak imports may be missing at runtime
+    bool weak = false;
+};
+
+// Exported and imported symbols of one slice of a Mach-O file.
+struct MachOSymbols {
+    uint32_t cputype = 0;
+    uint32_t filetype = 0;
+    // false if the slice has neither LC_DYLD_INFO nor LC_DYLD_EXPORTS_TRIE, what it exports is unknown
+    bool has_exports = false;
+    // names of the exports and imports, one after the other
+    std::string names;
+    std::vector<MachOExport> exports;
+    // one entry per symbol and library ordinal
+    std::vector<MachOImport> imports;
+
+    [[nodiscard]] std::string_view Name(SymbolName name) const { return std::string_view(names).substr(name.offset, name.size); }
+};
+
+// Parse the export trie and the imports (bind opcodes or chained fixups) of every slice of |path|, as
+// read by readMachO(). Returns false if |path| can't be read, malformed tables are skipped.
+bool readSymbols(const std::string& path, const std::vector<MachOSlice>& slices, std::vector<MachOSymbols>& symbols);
+
+// Exported symbol names of many libraries, to the libraries exporting them. Names aren't copied,
+// the libraries the index is built from must outlive it. Built for millions of symbols: the
+// table is split in shards filled in parallel, and each name has its definitions in one array.
+class SymbolIndex {
+public:
+    struct Definition {
+        uint32_t owner;
+        uint8_t flags;
+    };
+    struct Definitions {
+        const Definition* first = nullptr;
+        const Definition* last = nullptr;
+        [[nodiscard]] const Definition* begin() const { return first; }
+        [[nodiscard]] const Definition* end() const { return last; }
+        [[nodiscard]] size_t size() const { return last - first; }
+    };
+
+    // index the exports of |libraries|, owner n being libraries[n]
+    void Build(const std::vector<const MachOSymbols*>& libraries);
+
+    // libraries exporting |name|, empty if none does
+    [[nodiscard]] Definitions Find(std::string_view name) const;
+    [[nodiscard]] bool Exports(std::string_view name, uint32_t owner) const;
+
+    // call |visit(name, definitions)| for every name in the index
+    template <class Visit>
+    void ForEachSymbol(Visit visit) const
+    {
+        for (const auto& shard : shards) {
+            for (const auto& entry : shard.entries)
+                visit(entry.name, Definitions{shard.definitions.data() + entry.first, shard.definitions.data() + entry.last});
+        }
+    }
+
+    [[nodiscard]] size_t Size() const;
+
+private:
+    struct Entry {
+        uint64_t hash;
+        std::string_view name;
+        uint32_t first;
+        uint32_t last;
+    };
+    struct Shard {
+        // open addressing, a slot holds the index of its entry + 1, or 0 when free
+        std::vector<uint32_t> slots;
+        std::vector<Entry> entries;
+        std::vector<Definition> definitions;
+    };
+
+    [[nodiscard]] static uint64_t Hash(std::string_view name);
+    [[nodiscard]] const Entry* FindEntry(const Shard& shard, std::string_view name, uint64_t hash) const;
+
+    std::vector<Shard> shards;
+};
+
+#endif
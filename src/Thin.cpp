@@ -0,0 +1,142 @@
+#include "Thin.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "BundleContext.h"
+#include "FileSystem.h"
+#include "MachO.h"
+
+namespace {
+
+struct FatSlice {
+    std::vector<unsigned char> entry;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t align;
+};
+
+bool copyRange(const File& in, uint64_t offset, uint64_t size, File& out, uint64_t out_offset)
+{
+    std::vector<unsigned char> buffer(1 << 20);
+    while (size > 0) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, buffer.size()));
+        if (!in.Read(buffer.data(), chunk, offset) || !out.Write(buffer.data(), chunk, out_offset))
+            return false;
+        offset += chunk;
+        out_offset += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// write the kept slices of |in| into |out|, as a thin file or a smaller universal one
+bool writeSlices(const File& in, const unsigned char* header, bool swap, bool is64,
+                 const std::vector<FatSlice>& slices, File& out)
+{
+    if (slices.size() == 1)
+        return copyRange(in, slices[0].offset, slices[0].size, out, 0);
+
+    size_t arch_size = is64 ? 32 : 20;
+    std::vector<unsigned char> fat_header(header, header + 8);
+    write32(fat_header.data() + 4, static_cast<uint32_t>(slices.size()), swap);
+    for (const auto& slice : slices)
+        fat_header.insert(fat_header.end(), slice.entry.begin(), slice.entry.end());
+
+    // slices keep their order and alignment, packed after the new fat header
+    uint64_t offset = fat_header.size();
+    for (size_t n=0; n<slices.size(); ++n) {
+        uint64_t alignment = uint64_t(1) << std::min<uint32_t>(slices[n].align, 16);
+        offset = (offset + alignment - 1) / alignment * alignment;
+        unsigned char* entry = fat_header.data() + 8 + n * arch_size;
+        if (is64) {
+            write64(entry + 8, offset, swap);
+        }
+        else {
+            if (offset > UINT32_MAX)
+                return false;
+            write32(entry + 8, static_cast<uint32_t>(offset), swap);
+        }
+        if (!copyRange(in, slices[n].offset, slices[n].size, out, offset))
+            return false;
+        offset += slices[n].size;
+    }
+    return out.Write(fat_header.data(), fat_header.size(), 0);
+}
+
+} // namespace
+
+std::vector<std::string> machOArchs(const std::string& path)
+{
+    std::vector<std::string> archs;
+    std::vector<MachOSlice> slices;
+    if (readMachO(path, slices)) {
+        for (const auto& slice : slices)
+            archs.push_back(archName(slice.cputype, slice.cpusubtype));
+    }
+    return archs;
+}
+
+bool thinMachO(const std::string& from, const std::string& to, const std::vector<std::string>& archs)
+{
+    FileSystem& file_system = fileSystem();
+    FileInfo info = file_system.Status(from);
+    std::unique_ptr<File> in = file_system.Open(from, OpenMode::Read);
+    unsigned char header[8];
+    if (info.type != FileType::Regular || !in || !in->Read(header, sizeof(header), 0))
+        return false;
+
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+    if (magic != FAT_MAGIC && magic != FAT_CIGAM && magic != FAT_MAGIC_64 && magic != FAT_CIGAM_64)
+        return false;
+    bool swap = magic == FAT_CIGAM || magic == FAT_CIGAM_64;
+    bool is64 = magic == FAT_MAGIC_64 || magic == FAT_CIGAM_64;
+    uint32_t nfat_arch = read32(header + 4, swap);
+    if (nfat_arch == 0 || nfat_arch > MAX_FAT_ARCHS)
+        return false;
+
+    size_t arch_size = is64 ? 32 : 20;
+    std::vector<unsigned char> entries(arch_size * nfat_arch);
+    if (!in->Read(entries.data(), entries.size(), sizeof(header)))
+        return false;
+
+    std::vector<FatSlice> kept;
+    std::vector<std::string> found;
+    for (uint32_t n=0; n<nfat_arch; ++n) {
+        const unsigned char* entry = entries.data() + n * arch_size;
+        std::string arch = archName(read32(entry, swap), read32(entry + 4, swap));
+        found.push_back(arch);
+        if (std::find(archs.begin(), archs.end(), arch) == archs.end())
+            continue;
+        FatSlice slice;
+        slice.entry.assign(entry, entry + arch_size);
+        slice.offset = is64 ? read64(entry + 8, swap) : read32(entry + 8, swap);
+        slice.size = is64 ? read64(entry + 16, swap) : read32(entry + 12, swap);
+        slice.align = read32(entry + (is64 ? 24 : 16), swap);
+        if (slice.offset + slice.size > in->Size())
+            return false;
+        kept.push_back(slice);
+    }
+    for (const auto& arch : archs) {
+        if (std::find(found.begin(), found.end(), arch) == found.end())
+            throw BundleError(from + " lacks architecture " + arch);
+    }
+    if (kept.size() == nfat_arch)
+        return false;
+
+    // write next to the destination and rename, so that |from| may be |to|
+    std::string temp_path = to + ".thin";
+    bool written;
+    {
+        std::unique_ptr<File> out = file_system.Open(temp_path, OpenMode::Create, 0600);
+        written = out && writeSlices(*in, header, swap, is64, kept, *out);
+    }
+    written = written && file_system.SetMode(temp_path, info.mode | 0200);
+    if (!written || !file_system.Rename(temp_path, to)) {
+        file_system.Remove(temp_path);
+        throw BundleError("An error occured while trying to thin " + from + " into " + to);
+    }
+    return true;
+}
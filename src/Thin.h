@@ -0,0 +1,18 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_THIN_H
+#define DYLIBBUNDLER_THIN_H
+
+#include <string>
+#include <vector>
+
+// architectures of every slice of the Mach-O file at |path|, empty if it isn't one
+std::vector<std::string> machOArchs(const std::string& path);
+
+// Write the slices of the universal file |from| whose architecture is in |archs| to |to|, as a thin
+// file when a single one is left, streaming them without going through lipo. |from| and |to| may
+// be the same file. Returns false, writing nothing, if |from| isn't universal or has no slice to
+// drop, throws BundleError if it lacks one of |archs| or can't be written.
+bool thinMachO(const std::string& from, const std::string& to, const std::vector<std::string>& archs);
+
+#endif
@@ -1,44 +1,207 @@
 #include "Utils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
-#include <fstream>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <sstream>
+#include <thread>
 
-#include <sys/param.h>
-#ifndef __clang__
-#include <sys/types.h>
-#endif
+#include <sys/resource.h>
 #include <unistd.h>
 
+#include "BundleContext.h"
+#include "Elf.h"
+#include "FileSystem.h"
+#include "Journal.h"
+#include "MachO.h"
+#include "Plist.h"
 #include "Settings.h"
+#include "Thin.h"
+
+namespace {
+
+// install_name_tool only sees the host filesystem, in-memory trees must be editable natively
+void runInstallNameTool(const std::string& args, const std::string& binary_file, const std::string& error)
+{
+    if (!fileSystem().IsHost())
+        throw BundleError(error + " (it can't be edited in place)");
+    if (systemp("\"" + toolPath("install_name_tool", "install_name_tool") + "\"" + args + " \"" + binary_file + "\"") != 0)
+        throw BundleError(error);
+}
+
+// Edit |binary_file| in place if possible. ELF files can only be edited in place, there is no tool
+// to fall back to, so |error| is thrown for them when that fails.
+EditResult editBinary(const std::string& binary_file, const LoadCommandEdits& edits, const std::string& error)
+{
+    if (!isElf(binary_file))
+        return editLoadCommands(binary_file, edits);
+    EditResult result = editElf(binary_file, edits);
+    if (result == EditResult::Unsupported)
+        throw BundleError(error + " (its dynamic section can't take the new strings)");
+    return result;
+}
+
+std::string stripTrailingSlash(std::string path)
+{
+    while (path.size() > 1 && path[path.size()-1] == '/')
+        path.erase(path.size()-1);
+    return path;
+}
 
-std::string filePrefix(const std::string& in)
+// hidden entry next to the directory |path|: dir/name/ gives dir/.name<suffix>
+std::string siblingPath(const std::string& path, const std::string& suffix)
+{
+    std::string directory = stripTrailingSlash(path);
+    size_t slash = directory.rfind('/');
+    return directory.substr(0, slash + 1) + "." + directory.substr(slash + 1) + suffix;
+}
+
+// Reads the output of otool -l as it comes out of the pipe, in one pass: a "cmd LC_..." line
+// starts a load command, and the "name <value> (offset n)" or "path <value> (offset n)" line
+// that follows it is the value of the dylib and rpath commands. Only the first architecture of
+// universal files is kept, like when the file is read natively.
+class OtoolParser {
+public:
+    explicit OtoolParser(MachOSlice& commands) : commands(commands) {}
+
+    void Feed(std::string_view chunk)
+    {
+        size_t end;
+        if (!partial.empty()) {
+            end = chunk.find('\n');
+            partial.append(chunk.substr(0, end));
+            if (end == std::string_view::npos)
+                return;
+            Line(partial);
+            partial.clear();
+            chunk.remove_prefix(end + 1);
+        }
+        while ((end = chunk.find('\n')) != std::string_view::npos) {
+            Line(chunk.substr(0, end));
+            chunk.remove_prefix(end + 1);
+        }
+        partial.append(chunk);
+    }
+
+    // the last line may not end with a newline
+    void Finish()
+    {
+        if (!partial.empty())
+            Line(partial);
+        partial.clear();
+        if (pending != 0)
+            throw BundleError("Failed to find the value of the last load command listed by otool");
+    }
+
+    // otool couldn't read the file, or listed no load command
+    [[nodiscard]] bool Failed() const { return failed || load_commands == 0; }
+
+private:
+    void Line(std::string_view line)
+    {
+        if (line.find("can't open file") != std::string_view::npos
+            || line.find("No such file") != std::string_view::npos
+            || line.find("at least one file must be specified") != std::string_view::npos) {
+            failed = true;
+            return;
+        }
+        // "<file> (architecture <arch>):" before each slice of a universal file
+        if (line.find(" (architecture ") != std::string_view::npos && line.back() == ':') {
+            skipping = architectures++ > 0;
+            return;
+        }
+        if (skipping)
+            return;
+
+        line.remove_prefix(std::min(line.find_first_not_of(' '), line.size()));
+        if (line.compare(0, 4, "cmd ") == 0) {
+            if (pending != 0)
+                throw BundleError("Failed to find the value of a load command before the next one in the output of otool");
+            load_commands++;
+            pending = LoadCommand(line.substr(4));
+            return;
+        }
+        if (pending == 0)
+            return;
+        std::string_view label = pending == LC_RPATH ? "path " : "name ";
+        if (line.compare(0, label.size(), label) != 0)
+            return;
+        line.remove_prefix(label.size());
+        size_t offset = line.rfind(" (offset ");
+        if (offset == std::string_view::npos)
+            return;
+        std::string value(line.substr(0, offset));
+
+        if (pending == LC_ID_DYLIB)
+            commands.id = std::move(value);
+        else if (pending == LC_RPATH)
+            commands.rpaths.push_back(std::move(value));
+        else
+            commands.dylibs.push_back(MachODylib{pending, std::move(value)});
+        pending = 0;
+    }
+
+    // the load commands whose value is read, 0 for the others
+    static uint32_t LoadCommand(std::string_view name)
+    {
+        if (name == "LC_ID_DYLIB")
+            return LC_ID_DYLIB;
+        if (name == "LC_LOAD_DYLIB")
+            return LC_LOAD_DYLIB;
+        if (name == "LC_LOAD_WEAK_DYLIB")
+            return LC_LOAD_WEAK_DYLIB;
+        if (name == "LC_REEXPORT_DYLIB")
+            return LC_REEXPORT_DYLIB;
+        if (name == "LC_LOAD_UPWARD_DYLIB")
+            return LC_LOAD_UPWARD_DYLIB;
+        if (name == "LC_RPATH")
+            return LC_RPATH;
+        return 0;
+    }
+
+    MachOSlice& commands;
+    // the end of a line cut by the pipe buffer
+    std::string partial;
+    uint32_t pending = 0;
+    size_t load_commands = 0;
+    size_t architectures = 0;
+    bool skipping = false;
+    bool failed = false;
+};
+
+} // namespace
+
+std::string_view filePrefix(std::string_view in)
 {
     return in.substr(0, in.rfind('/')+1);
 }
 
-std::string stripPrefix(const std::string& in)
+std::string_view stripPrefix(std::string_view in)
 {
     return in.substr(in.rfind('/')+1);
 }
 
-std::string getFrameworkRoot(const std::string& in)
+std::string_view getFrameworkRoot(std::string_view in)
 {
     return in.substr(0, in.find(".framework")+10);
 }
 
-std::string getFrameworkPath(const std::string& in)
+std::string_view getFrameworkPath(std::string_view in)
 {
     return in.substr(in.rfind(".framework/")+11);
 }
 
-std::string stripLSlash(const std::string& in)
+std::string_view stripLSlash(std::string_view in)
 {
-    if (in[0] == '.' && in[1] == '/')
-        return in.substr(2, in.size());
+    if (in.size() >= 2 && in[0] == '.' && in[1] == '/')
+        return in.substr(2);
     return in;
 }
 
@@ -55,88 +218,150 @@ std::string rtrim(std::string s)
     return s;
 }
 
+bool streamOutput(const std::string& cmd, const std::function<void(std::string_view)>& consume)
+{
+    BundleContext::Current().bundler.processes_spawned++;
+    // closed and the child reaped even if |consume| throws
+    const auto close = [](FILE* file) { pclose(file); };
+    std::unique_ptr<FILE, decltype(close)> command_output(popen(cmd.c_str(), "r"), close);
+    if (!command_output) {
+        std::cerr << "An error occured while executing command " << cmd << std::endl;
+        return false;
+    }
+
+    char output[64 * 1024];
+    size_t amount_read;
+    while ((amount_read = fread(output, 1, sizeof(output), command_output.get())) > 0)
+        consume(std::string_view(output, amount_read));
+    return pclose(command_output.release()) == 0;
+}
+
 std::string systemOutput(const std::string& cmd)
 {
-    FILE *command_output = nullptr;
-    char output[128];
-    int amount_read = 1;
     std::string full_output;
+    if (!streamOutput(cmd, [&](std::string_view chunk) { full_output += chunk; }))
+        return "";
+    return full_output;
+}
 
-    try {
-        command_output = popen(cmd.c_str(), "r");
-        if (command_output == nullptr)
-            throw;
+uint64_t peakMemoryUsage()
+{
+    struct rusage usage {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    // kilobytes everywhere else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
 
-        while (amount_read > 0) {
-            amount_read = fread(output, 1, 127, command_output);
-            if (amount_read <= 0) {
-                break;
+void parallelFor(size_t count, const std::function<void(size_t)>& task)
+{
+    std::atomic<size_t> next(0);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    BundleContext& context = BundleContext::Current();
+    const auto worker = [&]() {
+        BundleContext::Scope scope(context);
+        for (size_t n = next++; n < count; n = next++) {
+            try {
+                task(n);
             }
-            else {
-                output[amount_read] = '\0';
-                full_output += output;
+            catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                next = count;
             }
         }
-    }
-    catch (...) {
-        std::cerr << "An error occured while executing command " << cmd << std::endl;
-        pclose(command_output);
-        return "";
-    }
-
-    int return_value = pclose(command_output);
-    if (return_value != 0)
-        return "";
+    };
+    size_t thread_count = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count);
+    std::vector<std::thread> threads;
+    for (size_t n=1; n<thread_count; ++n)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
 
-    return full_output;
+std::string toolPath(const std::string& name, const std::string& default_path)
+{
+    std::string directory = Settings::toolDirectory();
+    return directory.empty() ? default_path : directory + name;
 }
 
 int systemp(const std::string& cmd)
 {
     if (!Settings::quietOutput())
         std::cout << "    " << cmd << "\n";
+    BundleContext::Current().bundler.processes_spawned++;
     return system(cmd.c_str());
 }
 
-void tokenize(const std::string& str, const char* delim, std::vector<std::string>* vectorarg)
+bool nextToken(std::string_view& text, std::string_view delimiters, std::string_view& token)
 {
-    std::vector<std::string>& tokens = *vectorarg;
-    std::string delimiters(delim);
-
     // skip delimiters at beginning
-    std::string::size_type lastPos = str.find_first_not_of(delimiters, 0);
-    // find first non-delimiter
-    std::string::size_type pos = str.find_first_of(delimiters, lastPos);
-
-    while (pos != std::string::npos || lastPos != std::string::npos) {
-        // found a token, add it to the vector
-        tokens.push_back(str.substr(lastPos, pos - lastPos));
-        // skip delimiters
-        lastPos = str.find_first_not_of(delimiters, pos);
-        // find next non-delimiter
-        pos = str.find_first_of(delimiters, lastPos);
+    size_t start = text.find_first_not_of(delimiters);
+    if (start == std::string_view::npos) {
+        text = text.substr(text.size());
+        return false;
     }
+    size_t end = text.find_first_of(delimiters, start);
+    token = text.substr(start, end == std::string_view::npos ? std::string_view::npos : end - start);
+    text = text.substr(end == std::string_view::npos ? text.size() : end);
+    return true;
+}
+
+void tokenize(const std::string& str, const char* delim, std::vector<std::string>* vectorarg)
+{
+    std::string_view text = str;
+    std::string_view token;
+    while (nextToken(text, delim, token))
+        vectorarg->emplace_back(token);
 }
 
 std::vector<std::string> lsDir(const std::string& path)
 {
-    std::string cmd = "ls " + path;
-    std::string output = systemOutput(cmd);
     std::vector<std::string> files;
-    tokenize(output, "\n", &files);
+    fileSystem().ListDirectory(path, files);
+    std::sort(files.begin(), files.end());
     return files;
 }
 
+void listFilesRecursive(const std::string& path, std::vector<std::string>& files)
+{
+    FileSystem& file_system = fileSystem();
+    std::vector<std::string> names;
+    if (!file_system.ListDirectory(path, names))
+        return;
+    std::string prefix = path;
+    if (prefix[prefix.size()-1] != '/')
+        prefix += "/";
+
+    for (const auto& name : names) {
+        FileType type = file_system.LinkStatus(prefix + name).type;
+        if (type == FileType::Directory)
+            listFilesRecursive(prefix + name, files);
+        else if (type == FileType::Regular)
+            files.push_back(prefix + name);
+    }
+}
+
 bool fileExists(const std::string& filename)
 {
-    if (access(filename.c_str(), F_OK) != -1)
+    if (fileSystem().Exists(filename))
         return true;
-    std::string delims = " \f\n\r\t\v";
-    std::string rtrimmed = filename.substr(0, filename.find_last_not_of(delims)+1);
-    std::string ftrimmed = rtrimmed.substr(rtrimmed.find_first_not_of(delims));
-    if (access(ftrimmed.c_str(), F_OK) != -1)
-        return true;
-    return false;
+    const char* delims = " \f\n\r\t\v";
+    std::string_view trimmed = filename;
+    trimmed = trimmed.substr(0, trimmed.find_last_not_of(delims)+1);
+    size_t start = trimmed.find_first_not_of(delims);
+    if (start == std::string_view::npos || (start == 0 && trimmed.size() == filename.size()))
+        return false;
+    return fileSystem().Exists(std::string(trimmed.substr(start)));
 }
 
 bool isRpath(const std::string& path)
@@ -150,60 +375,137 @@ bool isRpath(const std::string& path)
 
 std::string bundleExecutableName(const std::string& app_bundle_path)
 {
-    std::string cmd = "/usr/libexec/PlistBuddy -c 'Print :CFBundleExecutable' " + app_bundle_path + "Contents/Info.plist";
-    return rtrim(systemOutput(cmd));
+    std::string plist_path = app_bundle_path + "Contents/Info.plist";
+    std::vector<unsigned char> plist;
+    std::string name;
+    if (fileSystem().ReadFile(plist_path, plist))
+        name = plistString(plist, "CFBundleExecutable");
+    // PlistBuddy also reads the old formats, where it exists
+    static const bool plist_buddy_installed = access("/usr/libexec/PlistBuddy", X_OK) == 0;
+    bool plist_buddy_available = plist_buddy_installed || !Settings::toolDirectory().empty();
+    if (name.empty() && plist_buddy_available && fileSystem().IsHost())
+        name = rtrim(systemOutput("\"" + toolPath("PlistBuddy", "/usr/libexec/PlistBuddy") + "\" -c 'Print :CFBundleExecutable' \"" + plist_path + "\""));
+    return name;
 }
 
-void changeId(const std::string& binary_file, const std::string& new_id)
+bool changeId(const std::string& binary_file, const std::string& new_id)
 {
-    std::string command = std::string("install_name_tool -id \"") + new_id + "\" \"" + binary_file + "\"";
-    if (systemp(command) != 0) {
-        std::cerr << "\n\nError: An error occured while trying to change identity of library " << binary_file << std::endl;
-        exit(1);
-    }
+    LoadCommandEdits edits;
+    edits.id = new_id;
+    std::string error = "An error occured while trying to change identity of library " + binary_file;
+    EditResult result = editBinary(binary_file, edits, error);
+    if (result != EditResult::Unsupported)
+        return result == EditResult::Edited;
+
+    runInstallNameTool(" -id \"" + new_id + "\"", binary_file, error);
+    return true;
 }
 
-void changeInstallName(const std::string& binary_file, const std::string& old_name, const std::string& new_name)
+bool changeInstallName(const std::string& binary_file, const std::string& old_name, const std::string& new_name)
 {
-    std::string command = std::string("install_name_tool -change \"") + old_name + "\" \"" + new_name + "\" \"" + binary_file + "\"";
-    if (systemp(command) != 0) {
-        std::cerr << "\n\nError: An error occured while trying to fix dependencies of " << binary_file << std::endl;
-        exit(1);
-    }
+    LoadCommandEdits edits;
+    edits.install_names.emplace_back(old_name, new_name);
+    std::string error = "An error occured while trying to fix dependencies of " + binary_file;
+    EditResult result = editBinary(binary_file, edits, error);
+    if (result != EditResult::Unsupported)
+        return result == EditResult::Edited;
+
+    runInstallNameTool(" -change \"" + old_name + "\" \"" + new_name + "\"", binary_file, error);
+    return true;
 }
 
-void copyFile(const std::string& from, const std::string& to)
+bool changeLoadCommands(const std::string& binary_file, const LoadCommandEdits& edits)
 {
-    bool overwrite = Settings::canOverwriteFiles();
-    if (fileExists(to) && !overwrite) {
-        std::cerr << "\n\nError: File " << to << " already exists. Remove it or enable overwriting (-of)\n";
-        exit(1);
+    std::string error = "An error occured while trying to change the load commands of " + binary_file;
+    EditResult result = editBinary(binary_file, edits, error);
+    if (result != EditResult::Unsupported)
+        return result == EditResult::Edited;
+
+    // fall back to a single install_name_tool run when the file can't be edited in place
+    runInstallNameTool(edits.InstallNameToolArgs(), binary_file, error);
+    return true;
+}
+
+bool copyFile(const std::string& from, const std::string& to)
+{
+    // nothing to do when bundling a copy that is already in place, as happens on re-runs
+    FileSystem& file_system = fileSystem();
+    FileInfo from_info = file_system.Status(from);
+    const auto is_from = [&](const std::string& path) {
+        FileInfo info = file_system.Status(path);
+        return from_info.type != FileType::Missing && info.type != FileType::Missing
+            && from_info.device == info.device && from_info.inode == info.inode && file_system.IsWritable(path);
+    };
+    if (is_from(to))
+        return false;
+
+    // like cp, what is copied to a directory goes inside it
+    std::string target = to;
+    if (file_system.Status(to).type == FileType::Directory) {
+        std::string_view name = from;
+        while (name.size() > 1 && name.back() == '/')
+            name.remove_suffix(1);
+        target = (to.back() == '/' ? to : to + "/") + std::string(stripPrefix(name));
+        if (is_from(target))
+            return false;
     }
 
+    bool overwrite = Settings::canOverwriteFiles();
+    if (fileExists(target) && !overwrite)
+        throw BundleError("File " + target + " already exists. Remove it or enable overwriting (-of)");
+
+    // universal files are thinned while copying when only some architectures are wanted
+    const std::vector<std::string>& archs = Settings::targetArchs();
+    if (!archs.empty() && from_info.type == FileType::Regular && thinMachO(from, target, archs))
+        return true;
+
     // copy file/directory
-    std::string overwrite_permission = std::string(overwrite ? "-f " : "-n ");
-    std::string command = std::string("cp -R ") + overwrite_permission + from + std::string(" \"") + to + "\"";
-    if (from != to && systemp(command) != 0) {
-        std::cerr << "\n\nError: An error occured while trying to copy file " << from << " to " << to << std::endl;
-        exit(1);
-    }
+    if (Settings::verboseOutput())
+        std::cout << "    copying " << from << " to " << target << "\n";
+    if (from != to && !file_system.Copy(from, to, overwrite))
+        throw BundleError("An error occured while trying to copy file " + from + " to " + to);
 
     // give file/directory write permission
-    std::string command2 = std::string("chmod -R +w \"") + to + "\"";
-    if (systemp(command2) != 0) {
-        std::cerr << "\n\nError: An error occured while trying to set write permissions on file " << to << std::endl;
-        exit(1);
+    if (!file_system.MakeWritable(target))
+        throw BundleError("An error occured while trying to set write permissions on file " + target);
+
+    // the universal files of a copied directory (plug-ins, whole frameworks) are thinned in place
+    if (!archs.empty() && from_info.type == FileType::Directory) {
+        std::vector<std::string> files;
+        listFilesRecursive(target, files);
+        for (const auto& file : files)
+            thinMachO(file, file, archs);
     }
+    return true;
 }
 
-void deleteFile(const std::string& path, bool overwrite)
+bool createSymlink(const std::string& target, const std::string& link)
 {
-    std::string overwrite_permission = std::string(overwrite ? "-f \"" : " \"");
-    std::string command = std::string("rm -r ") + overwrite_permission + path +"\"";;
-    if (systemp(command) != 0) {
-        std::cerr << "\n\nError: An error occured while trying to delete " << path << std::endl;
-        exit(1);
+    FileSystem& file_system = fileSystem();
+    std::string current_target;
+    if (file_system.ReadLink(link, current_target) && current_target == target)
+        return false;
+
+    if (file_system.LinkStatus(link).type != FileType::Missing) {
+        if (!Settings::canOverwriteFiles())
+            throw BundleError("File " + link + " already exists. Remove it or enable overwriting (-of)");
+        deleteFile(link, true);
     }
+    if (!file_system.CreateSymlink(target, link))
+        throw BundleError("An error occured while trying to create symlink " + link + " -> " + target);
+    return true;
+}
+
+void deleteFile(const std::string& path, bool overwrite)
+{
+    // like rm -r, a missing file is only an error without |overwrite| (rm -f)
+    FileSystem& file_system = fileSystem();
+    if (file_system.LinkStatus(path).type == FileType::Missing && overwrite)
+        return;
+    if (Settings::verboseOutput())
+        std::cout << "    deleting " << path << "\n";
+    if (!file_system.RemoveAll(path))
+        throw BundleError("An error occured while trying to delete " + path);
 }
 
 void deleteFile(const std::string& path)
@@ -216,8 +518,7 @@ bool mkdir(const std::string& path)
 {
     if (Settings::verboseOutput())
         std::cout << "Creating directory " << path << std::endl;
-    std::string command = std::string("mkdir -p \"") + path + "\"";
-    if (systemp(command) != 0) {
+    if (!fileSystem().CreateDirectories(path)) {
         std::cerr << "\n/!\\ ERROR: An error occured while creating " << path << std::endl;
         return false;
     }
@@ -231,129 +532,138 @@ void createDestDir()
         std::cout << "Checking output directory " << dest_folder << "\n";
 
     bool dest_exists = fileExists(dest_folder);
-
-    if (dest_exists && Settings::canOverwriteDir()) {
-        std::cout << "Erasing old output directory " << dest_folder << "\n";
-        std::string command = std::string("rm -r \"") + dest_folder + "\"";
-        if (systemp(command) != 0) {
-            std::cerr << "\n\n/!\\ ERROR: An error occured while attempting to overwrite destination folder\n";
-            exit(1);
+    std::string staging_folder = siblingPath(dest_folder, ".staging") + "/";
+    if (Settings::resume()) {
+        // go on filling the directory the interrupted run left, staged or already swapped in
+        if (fileExists(staging_folder + Journal::kFileName)) {
+            std::cout << "Resuming in staged output directory " << staging_folder << "\n\n";
+            Settings::stagingFolder(staging_folder);
+            return;
         }
-        dest_exists = false;
+        if (fileExists(dest_folder + Journal::kFileName))
+            return;
     }
-
-    if (!dest_exists) {
-        if (Settings::canCreateDir()) {
-            std::cout << "Creating output directory " << dest_folder << "\n\n";
-            if (!mkdir(dest_folder)) {
-                std::cerr << "\n/!\\ ERROR: An error occured while creating " << dest_folder << std::endl;
-                exit(1);
-            }
-        }
-        else {
-            std::cerr << "\n\n/!\\ ERROR: Destination folder does not exist. Create it or pass the '-cd' or '-od' flag\n";
-            exit(1);
-        }
+    if (dest_exists && !Settings::canOverwriteDir())
+        return;
+    if (!dest_exists && !Settings::canCreateDir())
+        throw BundleError("Destination folder does not exist. Create it or pass the '-cd' or '-od' flag");
+
+    // a bundle built in memory for the archive can't be left half-written on disk, so it isn't staged
+    if (!Settings::outputArchive().empty()) {
+        deleteFile(dest_folder, true);
+        std::cout << "Creating output directory " << dest_folder << " in memory\n\n";
+        if (!mkdir(dest_folder))
+            throw BundleError("An error occured while creating " + dest_folder);
+        return;
     }
+
+    // fill a new directory next to the output one and swap it in once everything is copied, so
+    // that a failed run never leaves a half-written bundle behind
+    deleteFile(staging_folder, true);
+    std::cout << (dest_exists ? "Staging new output directory " : "Creating output directory ") << dest_folder << "\n\n";
+    if (!mkdir(staging_folder))
+        throw BundleError("An error occured while creating " + staging_folder);
+    Settings::stagingFolder(staging_folder);
 }
 
-std::string getUserInputDirForFile(const std::string& filename, const std::string& dependent_file)
+void commitDestDir()
 {
-    std::vector<std::string> search_paths = Settings::userSearchPaths();
-    for (auto& search_path : search_paths) {
-        if (!search_path.empty() && search_path[search_path.size() - 1] != '/')
-            search_path += "/";
-        if (fileExists(search_path + filename)) {
-            if (!Settings::quietOutput()) {
-                std::cerr << (search_path + filename) << " was found\n"
-                          << "/!\\ WARNING: dylibbundler MAY NOT CORRECTLY HANDLE THIS DEPENDENCY: Check the executable with 'otool -L'\n";
-            }
-            return search_path;
-        }
+    std::string staging_folder = stripTrailingSlash(Settings::stagingFolder());
+    if (staging_folder.empty())
+        return;
+    std::string dest_folder = stripTrailingSlash(Settings::finalDestFolder());
+    FileSystem& file_system = fileSystem();
+
+    // the old tree ends up at |old_folder| and is deleted in the background
+    std::string old_folder = staging_folder;
+    if (!file_system.Exists(dest_folder)) {
+        if (!file_system.Rename(staging_folder, dest_folder))
+            throw BundleError("An error occured while moving " + staging_folder + " to " + dest_folder);
+        old_folder.clear();
     }
+    else if (!file_system.Exchange(staging_folder, dest_folder)) {
+        // without an atomic swap the output directory is briefly missing
+        old_folder = siblingPath(dest_folder, ".old");
+        deleteFile(old_folder, true);
+        if (!file_system.Rename(dest_folder, old_folder) || !file_system.Rename(staging_folder, dest_folder))
+            throw BundleError("An error occured while replacing " + dest_folder + " with " + staging_folder);
+    }
+    Settings::stagingFolder("");
+    if (Settings::verboseOutput())
+        std::cout << "Swapped the staged output directory into " << dest_folder << "\n";
 
-    while (true) {
-        if (Settings::quietOutput())
-            std::cerr << "\n/!\\ WARNING: Dependency " << filename << " of " << dependent_file << " not found\n";
-        std::cout << "\nPlease specify the directory where this file is located (or enter 'quit' to abort): ";
-        fflush(stdout);
-
-        std::string prefix;
-        std::cin >> prefix;
-        std::cout << std::endl;
-
-        if (prefix == "quit" || prefix == "exit" || prefix == "abort")
-            exit(1);
-
-        if (!prefix.empty() && prefix[prefix.size()-1] != '/')
-            prefix += "/";
-
-        if (!fileExists(prefix+filename)) {
-            std::cerr << (prefix+filename) << " does not exist. Try again...\n";
-            continue;
-        }
-        else {
-            std::cerr << (prefix+filename) << " was found\n"
-                      << "/!\\ WARNING: dylibbundler MAY NOT CORRECTLY HANDLE THIS DEPENDENCY: Check the executable with 'otool -L'\n";
-            Settings::addUserSearchPath(prefix);
-            return prefix;
-        }
+    if (!old_folder.empty()) {
+        std::shared_ptr<FileSystem> owner = BundleContext::Current().file_system;
+        BundleContext::Current().bundler.old_dest_removal = std::async(std::launch::async, [owner, old_folder] {
+            return owner->RemoveAll(old_folder);
+        });
     }
 }
 
-void otool(const std::string& flags, const std::string& file, std::vector<std::string>& lines)
+void discardDestDir()
 {
-    std::string command = "/usr/bin/otool " + flags + " \"" + file + "\"";
-    std::string output = systemOutput(command);
-
-    if (output.find("can't open file") != std::string::npos
-        || output.find("No such file") != std::string::npos
-        || output.find("at least one file must be specified") != std::string::npos
-        || output.empty()) {
-        std::cerr << "\n\n/!\\ ERROR: Cannot find file " << file << " to read its load commands\n";
-        exit(1);
+    std::string staging_folder = Settings::stagingFolder();
+    if (staging_folder.empty())
+        return;
+    Settings::stagingFolder("");
+    // keep what was completed for --resume
+    if (!BundleContext::Current().bundler.journal.Empty()) {
+        std::cerr << "\nThe staged output directory was kept in " << staging_folder << ", run again with --resume to continue\n";
+        return;
     }
+    fileSystem().RemoveAll(staging_folder);
+}
 
-    tokenize(output, "\n", &lines);
+void waitForOldDestDir()
+{
+    std::future<bool>& removal = BundleContext::Current().bundler.old_dest_removal;
+    if (removal.valid() && !removal.get())
+        std::cerr << "\n/!\\ WARNING: Cannot delete the previous output directory, it was left next to the new one\n";
 }
 
-void parseLoadCommands(const std::string& file, const std::map<std::string,std::string>& cmds_values, std::map<std::string,std::vector<std::string>>& cmds_results)
+void readLoadCommands(const std::string& file, MachOSlice& commands)
 {
-    std::vector<std::string> raw_lines;
-    otool("-l", file, raw_lines);
+    commands = MachOSlice();
+
+    // ELF files are read natively everywhere, their dynamic section maps onto the same commands
+    if (isElf(file)) {
+        ElfInfo elf;
+        if (!readElf(file, elf))
+            throw BundleError("Cannot read the dynamic section of " + file + ", it may be statically linked");
+        commands.id = elf.soname;
+        for (auto& needed : elf.needed)
+            commands.dylibs.push_back(MachODylib{LC_LOAD_DYLIB, std::move(needed)});
+        commands.rpaths = std::move(elf.rpaths);
+        return;
+    }
 
-    for (const auto& cmd_value : cmds_values) {
-        std::vector<std::string> lines;
-        std::string cmd = cmd_value.first;
-        std::string value = cmd_value.second;
-        std::string cmd_line = std::string("cmd ") + cmd;
-        std::string value_line = std::string(value) + std::string(" ");
-        bool searching = false;
-        for (const auto& raw_line : raw_lines) {
-            if (raw_line.find(cmd_line) != std::string::npos) {
-                if (searching) {
-                    std::cerr << "\n\n/!\\ ERROR: Failed to find " << value << " before next cmd\n";
-                    exit(1);
-                }
-                searching = true;
-            } else if (searching) {
-                size_t start_pos = raw_line.find(value_line);
-                if (start_pos == std::string::npos)
-                    continue;
-                size_t start = start_pos + value.size() + 1; // exclude data label "|value| "
-                size_t end = std::string::npos;
-                if (value == "name" || value == "path") {
-                    size_t end_pos = raw_line.find(" (");
-                    if (end_pos == std::string::npos)
-                        continue;
-                    end = end_pos - start;
-                }
-                lines.push_back(raw_line.substr(start, end));
-                searching = false;
-            }
-        }
-        cmds_results[cmd] = lines;
+    // otool can't see files outside the host filesystem and only ships with macOS, read the first
+    // slice natively instead
+    static const bool otool_installed = access("/usr/bin/otool", X_OK) == 0;
+    bool otool_available = otool_installed || !Settings::toolDirectory().empty();
+    if (!otool_available || !fileSystem().IsHost()) {
+        std::vector<MachOSlice> slices;
+        if (!readMachO(file, slices) || slices.empty())
+            throw BundleError("Cannot find file " + file + " to read its load commands");
+        commands.id = std::move(slices[0].id);
+        commands.dylibs = std::move(slices[0].dylibs);
+        commands.rpaths = std::move(slices[0].rpaths);
+        return;
     }
+
+    OtoolParser parser(commands);
+    bool succeeded = streamOutput("\"" + toolPath("otool", "/usr/bin/otool") + "\" -l \"" + file + "\"", [&](std::string_view chunk) { parser.Feed(chunk); });
+    parser.Finish();
+    if (!succeeded || parser.Failed())
+        throw BundleError("Cannot find file " + file + " to read its load commands");
+}
+
+bool parseOtoolOutput(std::string_view output, MachOSlice& commands)
+{
+    OtoolParser parser(commands);
+    parser.Feed(output);
+    parser.Finish();
+    return !parser.Failed();
 }
 
 std::string searchFilenameInRpaths(const std::string& rpath_file, const std::string& dependent_file)
@@ -366,11 +676,10 @@ std::string searchFilenameInRpaths(const std::string& rpath_file, const std::str
 
     std::string fullpath;
     std::string suffix = rpath_file.substr(rpath_file.rfind('/')+1);
-    char fullpath_buffer[PATH_MAX];
+    FileSystem& file_system = fileSystem();
 
     const auto check_path = [&](std::string path) {
-        char buffer[PATH_MAX];
-        std::string file_prefix = filePrefix(dependent_file);
+        std::string file_prefix(filePrefix(dependent_file));
         if (path.find("@executable_path") != std::string::npos || path.find("@loader_path") != std::string::npos) {
             if (path.find("@executable_path") != std::string::npos) {
                 if (Settings::appBundleProvided())
@@ -382,8 +691,9 @@ std::string searchFilenameInRpaths(const std::string& rpath_file, const std::str
             }
             if (Settings::verboseOutput())
                 std::cout << "    path to search: " << path << std::endl;
-            if (realpath(path.c_str(), buffer)) {
-                fullpath = buffer;
+            std::string resolved = file_system.RealPath(path);
+            if (!resolved.empty()) {
+                fullpath = resolved;
                 Settings::rpathToFullPath(rpath_file, fullpath);
                 return true;
             }
@@ -393,8 +703,9 @@ std::string searchFilenameInRpaths(const std::string& rpath_file, const std::str
                 std::string pathE = std::regex_replace(path, std::regex("@rpath/"), Settings::executableFolder());
                 if (Settings::verboseOutput())
                     std::cout << "    path to search: " << pathE << std::endl;
-                if (realpath(pathE.c_str(), buffer)) {
-                    fullpath = buffer;
+                std::string resolved = file_system.RealPath(pathE);
+                if (!resolved.empty()) {
+                    fullpath = resolved;
                     Settings::rpathToFullPath(rpath_file, fullpath);
                     return true;
                 }
@@ -403,8 +714,9 @@ std::string searchFilenameInRpaths(const std::string& rpath_file, const std::str
                 std::string pathL = std::regex_replace(path, std::regex("@rpath/"), file_prefix);
                 if (Settings::verboseOutput())
                     std::cout << "    path to search: " << pathL << std::endl;
-                if (realpath(pathL.c_str(), buffer)) {
-                    fullpath = buffer;
+                std::string resolved = file_system.RealPath(pathL);
+                if (!resolved.empty()) {
+                    fullpath = resolved;
                     Settings::rpathToFullPath(rpath_file, fullpath);
                     return true;
                 }
@@ -431,25 +743,18 @@ std::string searchFilenameInRpaths(const std::string& rpath_file, const std::str
     }
 
     if (fullpath.empty()) {
-        std::vector<std::string> search_paths = Settings::searchPaths();
-        for (const auto& search_path : search_paths) {
-            if (fileExists(search_path+suffix)) {
-                if (Settings::verboseOutput())
-                    std::cout << "FOUND " << suffix << " in " << search_path << std::endl;
-                fullpath = search_path + suffix;
-                break;
-            }
+        std::string search_path = Settings::findInSearchPaths(suffix);
+        if (!search_path.empty()) {
+            if (Settings::verboseOutput())
+                std::cout << "FOUND " << suffix << " in " << search_path << std::endl;
+            fullpath = search_path + suffix;
         }
         if (fullpath.empty()) {
             if (Settings::verboseOutput())
                 std::cout << "  ** rpath fullpath: not found" << std::endl;
+            // looked for with the other missing dependencies, see resolveMissing()
             if (!Settings::quietOutput())
                 std::cerr << "\n/!\\ WARNING: Can't get path for '" << rpath_file << "'\n";
-            fullpath = getUserInputDirForFile(suffix, dependent_file) + suffix;
-            if (Settings::quietOutput() && fullpath.empty())
-                std::cerr << "\n/!\\ WARNING: Can't get path for '" << rpath_file << "'\n";
-            if (realpath(fullpath.c_str(), fullpath_buffer))
-                fullpath = fullpath_buffer;
         }
         else if (Settings::verboseOutput()) {
             std::cout << "  ** rpath fullpath: " << fullpath << std::endl;
@@ -467,6 +772,127 @@ std::string searchFilenameInRpaths(const std::string& rpath_file)
     return searchFilenameInRpaths(rpath_file, rpath_file);
 }
 
+std::string searchElfLibrary(const std::string& name, const std::string& dependent_file)
+{
+    ElfInfo dependent;
+    readElf(dependent_file, dependent);
+    std::string origin(filePrefix(dependent_file));
+    origin = stripTrailingSlash(origin);
+    const auto expand = [&](std::string path) {
+        for (const std::string variable : {"${ORIGIN}", "$ORIGIN"}) {
+            for (size_t pos = path.find(variable); pos != std::string::npos; pos = path.find(variable, pos + origin.size()))
+                path.replace(pos, variable.size(), origin);
+        }
+        std::string lib = dependent.is64 ? "lib64" : "lib";
+        for (const std::string variable : {"${LIB}", "$LIB"}) {
+            for (size_t pos = path.find(variable); pos != std::string::npos; pos = path.find(variable, pos + lib.size()))
+                path.replace(pos, variable.size(), lib);
+        }
+        return path;
+    };
+
+    FileSystem& file_system = fileSystem();
+    // names with a slash are paths, relative ones to the working directory
+    if (name.find('/') != std::string::npos)
+        return file_system.RealPath(expand(name));
+
+    // DT_RPATH, LD_LIBRARY_PATH, DT_RUNPATH, then the system directories, like ld.so
+    std::vector<std::string> directories;
+    if (!dependent.has_runpath) {
+        for (const auto& rpath : dependent.rpaths)
+            directories.push_back(expand(rpath));
+    }
+    if (const char* library_path = std::getenv("LD_LIBRARY_PATH")) {
+        std::string_view text = library_path;
+        std::string_view token;
+        while (nextToken(text, ":", token))
+            directories.emplace_back(token);
+    }
+    if (dependent.has_runpath) {
+        for (const auto& rpath : dependent.rpaths)
+            directories.push_back(expand(rpath));
+    }
+    const std::vector<std::string>& system_dirs = Settings::systemLibraryDirs();
+    directories.insert(directories.end(), system_dirs.begin(), system_dirs.end());
+
+    for (auto& directory : directories) {
+        // $PLATFORM and other variables depend on the machine running the program
+        if (directory.empty() || directory.find('$') != std::string::npos)
+            continue;
+        if (directory[directory.size()-1] != '/')
+            directory += "/";
+        if (Settings::verboseOutput())
+            std::cout << "    path to search: " << directory << name << std::endl;
+        std::string resolved = file_system.RealPath(directory + name);
+        // ld.so skips libraries built for another architecture
+        ElfInfo library;
+        if (resolved.empty() || !readElf(resolved, library) || library.is64 != dependent.is64 || library.machine != dependent.machine)
+            continue;
+        return resolved;
+    }
+    return "";
+}
+
+std::string relativePath(const std::string& from_dir, const std::string& to_dir)
+{
+    const auto components = [](const std::string& path) {
+        std::string absolute = path;
+        if (absolute.empty() || absolute[0] != '/') {
+            char cwd[PATH_MAX];
+            if (getcwd(cwd, sizeof(cwd)) != nullptr)
+                absolute = std::string(cwd) + "/" + absolute;
+        }
+        std::vector<std::string_view> parts;
+        std::string_view text = absolute;
+        std::string_view token;
+        while (nextToken(text, "/", token)) {
+            if (token == "..") {
+                if (!parts.empty())
+                    parts.pop_back();
+            }
+            else if (token != ".") {
+                parts.push_back(token);
+            }
+        }
+        return std::vector<std::string>(parts.begin(), parts.end());
+    };
+    const std::vector<std::string> from = components(from_dir);
+    const std::vector<std::string> to = components(to_dir);
+
+    size_t common = 0;
+    while (common < from.size() && common < to.size() && from[common] == to[common])
+        ++common;
+    std::string relative;
+    for (size_t n=common; n<from.size(); ++n)
+        relative += "../";
+    for (size_t n=common; n<to.size(); ++n)
+        relative += to[n] + "/";
+    return relative;
+}
+
+std::string resolveRpath(const std::string& rpath, const std::string& file)
+{
+    std::string path = rpath;
+    if (path.find("@loader_path") == 0) {
+        path.replace(0, std::string("@loader_path").size(), filePrefix(file));
+    }
+    else if (path.find("$ORIGIN") == 0 || path.find("${ORIGIN}") == 0) {
+        path.replace(0, path[1] == '{' ? 9 : 7, filePrefix(file));
+    }
+    else if (path.find("@executable_path") == 0) {
+        if (!Settings::appBundleProvided())
+            return "";
+        path = Settings::executableFolder() + path.substr(std::string("@executable_path").size());
+    }
+
+    path = fileSystem().RealPath(path);
+    if (path.empty())
+        return "";
+    if (path[path.size()-1] != '/')
+        path += "/";
+    return path;
+}
+
 void initSearchPaths()
 {
     std::string searchPaths;
@@ -504,7 +930,31 @@ void createQtConf(std::string directory)
                            "Qml2Imports = Resources/qml\n";
     if (directory[directory.size()-1] != '/')
         directory += "/";
-    std::ofstream out(directory + "qt.conf");
-    out << contents;
-    out.close();
+    if (!fileSystem().WriteFile(directory + "qt.conf", contents.data(), contents.size()))
+        throw BundleError("An error occured while writing " + directory + "qt.conf");
+}
+
+std::string jsonEscape(const std::string& str)
+{
+    std::string escaped;
+    escaped.reserve(str.size());
+    for (char c : str) {
+        switch (c) {
+        case '"': escaped += "\\\""; break;
+        case '\\': escaped += "\\\\"; break;
+        case '\n': escaped += "\\n"; break;
+        case '\r': escaped += "\\r"; break;
+        case '\t': escaped += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                escaped += buffer;
+            }
+            else {
+                escaped += c;
+            }
+        }
+    }
+    return escaped;
 }
@@ -3,57 +3,112 @@
 #ifndef DYLIBBUNDLER_UTILS_H
 #define DYLIBBUNDLER_UTILS_H
 
-#include <map>
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 
-std::string filePrefix(const std::string& in);
-std::string stripPrefix(const std::string& in);
+#include "MachO.h"
+#include "MachOEdit.h"
 
-std::string getFrameworkRoot(const std::string& in);
-std::string getFrameworkPath(const std::string& in);
+// The path helpers return views into |in| without allocating, |in| must outlive them.
+// directory of a path, with its trailing '/'
+std::string_view filePrefix(std::string_view in);
+// last component of a path
+std::string_view stripPrefix(std::string_view in);
 
-std::string stripLSlash(const std::string& in);
+std::string_view getFrameworkRoot(std::string_view in);
+std::string_view getFrameworkPath(std::string_view in);
+
+std::string_view stripLSlash(std::string_view in);
 
 // trim from end (in place)
 void rtrim_in_place(std::string& s);
 // trim from end (copying)
 std::string rtrim(std::string s);
 
+// execute a command in the native shell and pass its output to |consume| as it is read, returns
+// false if it can't be run or fails
+bool streamOutput(const std::string& cmd, const std::function<void(std::string_view)>& consume);
 // execute a command in the native shell and return output in string
 std::string systemOutput(const std::string& cmd);
 // run a command in the system shell (like 'system') but also print the command to stdout
 int systemp(const std::string& cmd);
+// where the external tool |name| is run from: Settings::toolDirectory() if set, else |default_path|
+std::string toolPath(const std::string& name, const std::string& default_path);
+
+// peak resident memory of the process in bytes, 0 if unknown
+uint64_t peakMemoryUsage();
 
+// Run |task(n)| for every n below |count| on all cores, each thread bound to the current
+// BundleContext. The first exception thrown by a task is rethrown once every thread is done.
+void parallelFor(size_t count, const std::function<void(size_t)>& task);
+
+// Split |text| at any of |delimiters| lazily: store the next non-empty piece in |token| and move
+// |text| past it, returns false when nothing is left. Pieces are views into the original text.
+bool nextToken(std::string_view& text, std::string_view delimiters, std::string_view& token);
 void tokenize(const std::string& str, const char* delimiters, std::vector<std::string>*);
 
 std::vector<std::string> lsDir(const std::string& path);
+// list the regular files below |path| recursively, without following symlinks
+void listFilesRecursive(const std::string& path, std::vector<std::string>& files);
 bool fileExists(const std::string& filename);
 bool isRpath(const std::string& path);
 
 std::string bundleExecutableName(const std::string& app_bundle_path);
 
-void changeId(const std::string& binary_file, const std::string& new_id);
-void changeInstallName(const std::string& binary_file, const std::string& old_name, const std::string& new_name);
+// the change* functions return false if |binary_file| already had the requested load commands
+bool changeId(const std::string& binary_file, const std::string& new_id);
+bool changeInstallName(const std::string& binary_file, const std::string& old_name, const std::string& new_name);
+// apply all of |edits| to |binary_file| at once, in place when possible, with install_name_tool otherwise
+bool changeLoadCommands(const std::string& binary_file, const LoadCommandEdits& edits);
 
-void copyFile(const std::string& from, const std::string& to);
+// returns false if |to| already is |from|
+bool copyFile(const std::string& from, const std::string& to);
+// make |link| a symlink to |target|, returns false if it already was one
+bool createSymlink(const std::string& target, const std::string& link);
 void deleteFile(const std::string& path, bool overwrite);
 void deleteFile(const std::string& path);
 bool mkdir(const std::string& path);
 
+// Prepare the output directory. Unless an existing one is used as is (without -od), a new one is
+// staged next to it, filled by the copies and swapped in by commitDestDir(), and the previous tree
+// is deleted in the background.
 void createDestDir();
+void commitDestDir();
+// delete the staging directory of a failed run, the output directory is left as it was
+void discardDestDir();
+// wait for the previous output directory to be deleted
+void waitForOldDestDir();
+
+// The id, dylib (LC_LOAD_DYLIB, LC_LOAD_WEAK_DYLIB, LC_REEXPORT_DYLIB, LC_LOAD_UPWARD_DYLIB) and
+// LC_RPATH load commands of |file| in file order, from the dynamic section of ELF files, from one
+// pass over the output of otool -l, or read natively where otool can't be used. Only the first
+// architecture of universal files is listed. Throws BundleError if |file| can't be read.
+void readLoadCommands(const std::string& file, MachOSlice& commands);
+// the same from |output| of otool -l already read, returns false if it lists no load command
+bool parseOtoolOutput(std::string_view output, MachOSlice& commands);
+
+// full path of the @rpath, @loader_path or @executable_path install name |rpath_file|, empty if it can't be found
+std::string searchFilenameInRpaths(const std::string& rpath_file, const std::string& dependent_file);
+std::string searchFilenameInRpaths(const std::string& rpath_file);
 
-std::string getUserInputDirForFile(const std::string& filename, const std::string& dependent_file);
+// Find the library ld.so would load for the DT_NEEDED entry |name| of the ELF file
+// |dependent_file|, empty if there is none.
+std::string searchElfLibrary(const std::string& name, const std::string& dependent_file);
 
-void otool(const std::string& flags, const std::string& file, std::vector<std::string>& lines);
-void parseLoadCommands(const std::string& file, const std::map<std::string,std::string>& cmds_values, std::map<std::string,std::vector<std::string>>& cmds_results);
+// path of the directory |to_dir| relative to |from_dir|, ending with '/' unless it is empty
+std::string relativePath(const std::string& from_dir, const std::string& to_dir);
 
-std::string searchFilenameInRpaths(const std::string& rpath_file, const std::string& dependent_file);
-std::string searchFilenameInRpaths(const std::string& rpath_file);
+// resolve an LC_RPATH or DT_RUNPATH entry of |file| to an absolute directory ending with '/' (empty if it doesn't exist)
+std::string resolveRpath(const std::string& rpath, const std::string& file);
 
 // check the same paths the system would search for dylibs
 void initSearchPaths();
 
 void createQtConf(std::string directory);
 
+std::string jsonEscape(const std::string& str);
+
 #endif
@@ -0,0 +1,359 @@
+#include "Verify.h"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "BundleContext.h"
+#include "FileSystem.h"
+#include "MachO.h"
+#include "Settings.h"
+#include "Symbols.h"
+#include "Utils.h"
+
+namespace {
+
+struct VerifyIssue {
+    std::string type;
+    std::string file;
+    std::string dependency;
+    std::string detail;
+};
+
+struct VerifiedFile {
+    std::string path;
+    bool is_macho = false;
+    std::vector<MachOSlice> slices;
+    // resolved path of every dylib load command of every slice (empty if it couldn't be resolved)
+    std::vector<std::vector<std::string>> resolved;
+    // exports and imports of every slice, empty if they couldn't be read
+    std::vector<MachOSymbols> symbols;
+    std::vector<VerifyIssue> issues;
+};
+
+using RpathStack = std::vector<std::pair<std::string,std::string>>;
+
+std::string resolveInstallName(const std::string& install_name, const std::string& loader, const RpathStack& rpath_stack)
+{
+    const auto resolve = [](const std::string& dir, std::string_view file) -> std::string {
+        if (dir.empty())
+            return "";
+        std::string path = dir;
+        path += file;
+        return fileSystem().RealPath(path);
+    };
+
+    if (install_name.find("@rpath/") == 0) {
+        for (const auto& [rpath, rpath_owner] : rpath_stack) {
+            std::string resolved = resolve(resolveRpath(rpath, rpath_owner), std::string_view(install_name).substr(7));
+            if (!resolved.empty())
+                return resolved;
+        }
+        return "";
+    }
+    return resolve(resolveRpath(std::string(filePrefix(install_name)), loader), stripPrefix(install_name));
+}
+
+class Verifier {
+public:
+    Verifier(std::string root, std::set<std::string> extra_files, std::string executable)
+        : bundle_root(std::move(root)), files_to_fix(std::move(extra_files)), executable_path(std::move(executable))
+    {
+        if (!executable_path.empty())
+            readMachO(executable_path, executable_slices);
+    }
+
+    void VerifyFile(VerifiedFile& file) const
+    {
+        if (!isMachO(file.path))
+            return;
+        file.is_macho = true;
+        if (!readMachO(file.path, file.slices)) {
+            file.issues.push_back({"unreadable", file.path, "", "malformed Mach-O header or load commands"});
+            return;
+        }
+        if (!readSymbols(file.path, file.slices, file.symbols))
+            file.symbols.clear();
+
+        std::set<std::pair<std::string,std::string>> reported;
+        const auto report = [&](const std::string& type, const std::string& dependency, const std::string& detail) {
+            if (reported.insert({type, dependency}).second)
+                file.issues.push_back({type, file.path, dependency, detail});
+        };
+
+        for (size_t n=0; n<file.slices.size(); ++n) {
+            const MachOSlice& slice = file.slices[n];
+
+            // dyld looks at the rpaths of the loading image first, then at those of the main executable
+            RpathStack rpath_stack;
+            for (const auto& rpath : slice.rpaths)
+                rpath_stack.emplace_back(rpath, file.path);
+            for (const auto& executable_slice : executable_slices) {
+                if (executable_slice.cputype != slice.cputype)
+                    continue;
+                for (const auto& rpath : executable_slice.rpaths)
+                    rpath_stack.emplace_back(rpath, executable_path);
+            }
+
+            std::vector<std::string> resolved;
+            for (const auto& dylib : slice.dylibs) {
+                std::string path = resolveInstallName(dylib.name, file.path, rpath_stack);
+                resolved.push_back(path);
+                if (path.empty()) {
+                    // weak dependencies are allowed to be absent, system libraries may live in the shared cache
+                    bool is_system = dylib.name[0] != '@' && !Settings::isPrefixBundled(filePrefix(dylib.name));
+                    if (dylib.cmd != LC_LOAD_WEAK_DYLIB && !is_system)
+                        report("missing", dylib.name, "not found in the bundle or its rpaths");
+                }
+                else if (!IsInsideBundle(path) && Settings::isPrefixBundled(filePrefix(path))) {
+                    report("outside_bundle", dylib.name, "resolves to " + path);
+                }
+            }
+            file.resolved.push_back(resolved);
+        }
+    }
+
+    [[nodiscard]] const std::string& ExecutablePath() const { return executable_path; }
+
+    [[nodiscard]] bool IsInsideBundle(const std::string& path) const
+    {
+        return path.find(bundle_root) == 0 || files_to_fix.find(path) != files_to_fix.end();
+    }
+
+private:
+    std::string bundle_root;
+    std::set<std::string> files_to_fix;
+    std::string executable_path;
+    std::vector<MachOSlice> executable_slices;
+};
+
+void checkArchitectures(std::vector<VerifiedFile>& files, const Verifier& verifier)
+{
+    std::map<std::string, std::set<uint32_t>> cputypes;
+    for (const auto& file : files) {
+        for (const auto& slice : file.slices)
+            cputypes[file.path].insert(slice.cputype);
+    }
+
+    for (auto& file : files) {
+        std::set<std::pair<std::string,std::string>> reported;
+        for (size_t n=0; n<file.resolved.size(); ++n) {
+            const MachOSlice& slice = file.slices[n];
+            for (size_t d=0; d<file.resolved[n].size(); ++d) {
+                const std::string& path = file.resolved[n][d];
+                if (path.empty() || !verifier.IsInsideBundle(path) || cputypes.find(path) == cputypes.end())
+                    continue;
+                if (cputypes[path].count(slice.cputype) != 0)
+                    continue;
+                std::string arch = archName(slice.cputype, slice.cpusubtype);
+                if (reported.insert({slice.dylibs[d].name, arch}).second)
+                    file.issues.push_back({"arch_mismatch", file.path, slice.dylibs[d].name, path + " has no " + arch + " slice"});
+            }
+        }
+    }
+}
+
+void checkDuplicateIds(std::vector<VerifiedFile>& files)
+{
+    std::map<std::string, std::string> id_owners;
+    for (auto& file : files) {
+        std::set<std::string> ids;
+        for (const auto& slice : file.slices) {
+            if (!slice.id.empty())
+                ids.insert(slice.id);
+        }
+        for (const auto& id : ids) {
+            auto owner = id_owners.emplace(id, file.path);
+            if (!owner.second)
+                file.issues.push_back({"duplicate_id", file.path, id, "also the install id of " + owner.first->second});
+        }
+    }
+}
+
+// Exported symbols defined by more than one bundled library, which the app may bind to the wrong
+// one of, and imported symbols the bundled library they are bound to doesn't export. Libraries
+// outside the bundle, in the dyld shared cache for system ones, are assumed to export everything.
+void checkSymbols(std::vector<VerifiedFile>& files, const Verifier& verifier)
+{
+    constexpr uint32_t kNone = UINT32_MAX;
+    std::vector<const MachOSymbols*> libraries;
+    // file and slice of each library of the index, and the libraries of each file
+    std::vector<std::pair<uint32_t,uint32_t>> library_slices;
+    std::vector<std::vector<uint32_t>> file_libraries(files.size());
+    std::unordered_map<std::string, uint32_t> file_ids;
+    for (uint32_t f=0; f<files.size(); ++f) {
+        if (files[f].symbols.size() != files[f].slices.size())
+            continue;
+        for (uint32_t s=0; s<files[f].symbols.size(); ++s) {
+            file_libraries[f].push_back(static_cast<uint32_t>(libraries.size()));
+            libraries.push_back(&files[f].symbols[s]);
+            library_slices.emplace_back(f, s);
+        }
+        file_ids[files[f].path] = f;
+        file_ids[fileSystem().RealPath(files[f].path)] = f;
+    }
+    SymbolIndex index;
+    index.Build(libraries);
+
+    const auto find_library = [&](const std::string& path, uint32_t cputype) -> uint32_t {
+        auto file = file_ids.find(path);
+        if (file == file_ids.end())
+            return kNone;
+        for (uint32_t library : file_libraries[file->second]) {
+            if (libraries[library]->cputype == cputype)
+                return library;
+        }
+        return kNone;
+    };
+
+    // true if |library|, or one it re-exports, exports |name|, or if that can't be told
+    std::function<bool(uint32_t, std::string_view, int)> exports = [&](uint32_t library, std::string_view name, int depth) {
+        if (library == kNone || !libraries[library]->has_exports || index.Exports(name, library))
+            return true;
+        if (depth == 8)
+            return false;
+        auto [f, s] = library_slices[library];
+        const MachOSlice& slice = files[f].slices[s];
+        for (size_t d=0; d<slice.dylibs.size(); ++d) {
+            if (slice.dylibs[d].cmd == LC_REEXPORT_DYLIB && exports(find_library(files[f].resolved[s][d], slice.cputype), name, depth + 1))
+                return true;
+        }
+        return false;
+    };
+
+    // each pair of libraries is reported once, with the number of symbols they both define
+    std::map<std::pair<uint32_t,uint32_t>, std::pair<size_t,std::string>> duplicates;
+    std::vector<std::pair<uint32_t,uint32_t>> symbol_duplicates;
+    index.ForEachSymbol([&](std::string_view name, SymbolIndex::Definitions definitions) {
+        if (definitions.size() < 2)
+            return;
+        symbol_duplicates.clear();
+        // weak definitions are coalesced by dyld, re-exports are the same definition
+        const auto is_strong = [&](const SymbolIndex::Definition& definition) {
+            return !(definition.flags & (EXPORT_SYMBOL_FLAGS_WEAK_DEFINITION | EXPORT_SYMBOL_FLAGS_REEXPORT))
+                && libraries[definition.owner]->filetype == MH_DYLIB;
+        };
+        for (auto later = definitions.begin(); later != definitions.end(); ++later) {
+            if (!is_strong(*later))
+                continue;
+            for (auto earlier = definitions.begin(); earlier != later; ++earlier) {
+                uint32_t later_file = library_slices[later->owner].first;
+                uint32_t earlier_file = library_slices[earlier->owner].first;
+                if (!is_strong(*earlier) || later_file == earlier_file || libraries[later->owner]->cputype != libraries[earlier->owner]->cputype)
+                    continue;
+                std::pair<uint32_t,uint32_t> pair(later_file, earlier_file);
+                if (std::find(symbol_duplicates.begin(), symbol_duplicates.end(), pair) == symbol_duplicates.end())
+                    symbol_duplicates.push_back(pair);
+                break;
+            }
+        }
+        for (const auto& pair : symbol_duplicates) {
+            auto& duplicate = duplicates[pair];
+            if (duplicate.first++ == 0 || name < duplicate.second)
+                duplicate.second = name;
+        }
+    });
+    for (const auto& [pair, duplicate] : duplicates) {
+        files[pair.first].issues.push_back({"duplicate_symbols", files[pair.first].path, files[pair.second].path,
+            std::to_string(duplicate.first) + " exported symbols are also exported by it, e.g. " + duplicate.second});
+    }
+
+    for (uint32_t f=0; f<files.size(); ++f) {
+        VerifiedFile& file = files[f];
+        // missing symbols by dependency, the slices of a universal file usually miss the same ones
+        std::map<std::string, std::set<std::string>> missing;
+        for (uint32_t s=0; s<file.symbols.size(); ++s) {
+            const MachOSymbols& symbols = file.symbols[s];
+            const MachOSlice& slice = file.slices[s];
+            bool all_indexed = std::all_of(file.resolved[s].begin(), file.resolved[s].end(), [&](const std::string& path) {
+                return find_library(path, slice.cputype) != kNone;
+            });
+            for (const auto& import : symbols.imports) {
+                std::string_view name = symbols.Name(import.name);
+                if (import.weak)
+                    continue;
+                if (import.ordinal > 0 && static_cast<size_t>(import.ordinal) <= slice.dylibs.size()) {
+                    const std::string& path = file.resolved[s][import.ordinal - 1];
+                    if (!exports(find_library(path, slice.cputype), name, 0))
+                        missing[path].emplace(name);
+                }
+                else if (import.ordinal == BIND_SPECIAL_DYLIB_MAIN_EXECUTABLE) {
+                    if (!exports(find_library(verifier.ExecutablePath(), slice.cputype), name, 0))
+                        missing[verifier.ExecutablePath()].emplace(name);
+                }
+                else if (import.ordinal == BIND_SPECIAL_DYLIB_FLAT_LOOKUP && all_indexed) {
+                    // any loaded image may define it
+                    const auto defines = [&](const SymbolIndex::Definition& definition) { return libraries[definition.owner]->cputype == slice.cputype; };
+                    SymbolIndex::Definitions definitions = index.Find(name);
+                    if (!std::any_of(definitions.begin(), definitions.end(), defines))
+                        missing["flat namespace"].emplace(name);
+                }
+            }
+        }
+        for (const auto& [dependency, names] : missing) {
+            std::string examples;
+            for (auto name = names.begin(); name != names.end() && std::distance(names.begin(), name) < 3; ++name)
+                examples += (examples.empty() ? "" : ", ") + *name;
+            file.issues.push_back({"unresolved_symbols", file.path, dependency,
+                std::to_string(names.size()) + " imported symbols are not exported by it: " + examples + (names.size() > 3 ? ", ..." : "")});
+        }
+    }
+}
+
+} // namespace
+
+bool verifyBundle()
+{
+    std::string bundle_root = Settings::appBundleProvided() ? Settings::appBundle() : Settings::destFolder();
+    std::vector<std::string> paths;
+    listFilesRecursive(bundle_root, paths);
+    std::sort(paths.begin(), paths.end());
+
+    std::set<std::string> files_to_fix;
+    for (const auto& file : Settings::filesToFix()) {
+        files_to_fix.insert(file);
+        if (file.find(bundle_root) != 0)
+            paths.push_back(file);
+    }
+
+    std::vector<VerifiedFile> files(paths.size());
+    for (size_t n=0; n<paths.size(); ++n)
+        files[n].path = paths[n];
+
+    Verifier verifier(bundle_root, files_to_fix, Settings::bundleExecutable());
+    parallelFor(files.size(), [&](size_t n) { verifier.VerifyFile(files[n]); });
+
+    checkArchitectures(files, verifier);
+    checkDuplicateIds(files);
+    checkSymbols(files, verifier);
+
+    size_t files_checked = 0;
+    std::vector<VerifyIssue> issues;
+    for (const auto& file : files) {
+        if (file.is_macho)
+            files_checked++;
+        issues.insert(issues.end(), file.issues.begin(), file.issues.end());
+    }
+
+    std::cout << "{\n";
+    std::cout << "  \"bundle\": \"" << jsonEscape(bundle_root) << "\",\n";
+    std::cout << "  \"files_checked\": " << files_checked << ",\n";
+    std::cout << "  \"issues\": [";
+    for (size_t n=0; n<issues.size(); ++n) {
+        const VerifyIssue& issue = issues[n];
+        std::cout << (n == 0 ? "\n" : ",\n")
+                  << "    {\"type\": \"" << issue.type << "\""
+                  << ", \"file\": \"" << jsonEscape(issue.file) << "\""
+                  << ", \"dependency\": \"" << jsonEscape(issue.dependency) << "\""
+                  << ", \"detail\": \"" << jsonEscape(issue.detail) << "\"}";
+    }
+    std::cout << (issues.empty() ? "]\n" : "\n  ]\n") << "}" << std::endl;
+
+    return issues.empty();
+}
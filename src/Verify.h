@@ -0,0 +1,9 @@
+#pragma once
+
+#ifndef DYLIBBUNDLER_VERIFY_H
+#define DYLIBBUNDLER_VERIFY_H
+
+// check every Mach-O file of the finished bundle and print a JSON report, returns false if issues were found
+bool verifyBundle();
+
+#endif
@@ -8,8 +8,12 @@
 #include <sys/types.h>
 #endif
 
+#include "BundleContext.h"
 #include "DylibBundler.h"
+#include "Report.h"
 #include "Settings.h"
+#include "Utils.h"
+#include "Verify.h"
 
 const std::string VERSION = "2.1.0 (2020-01-04)";
 
@@ -23,10 +27,26 @@ void showHelp()
     std::cout << "  -d,  --dest-dir              Directory to copy dependencies, relative to <app>/Contents (default: ./Frameworks)" << std::endl;
     std::cout << "  -p,  --install-path          Inner path (@rpath) of bundled dependencies (default: @executable_path/../Frameworks/)" << std::endl;
     std::cout << "  -s,  --search-path           Add directory to search path" << std::endl;
-    std::cout << "  -i,  --ignore                Ignore dependencies in this directory (default: /usr/lib & /System/Library)" << std::endl;
+    std::cout << "  -i,  --ignore                Ignore dependencies in this directory, '*' and '**' globs allowed (default: /usr/lib & /System/Library)" << std::endl;
     std::cout << "  -of, --overwrite-files       Allow overwriting files in output directory" << std::endl;
     std::cout << "  -cd, --create-dir            Create output directory if needed" << std::endl;
     std::cout << "  -od, --overwrite-dir         Overwrite (delete) output directory if it exists (implies --create-dir)" << std::endl;
+    std::cout << "  -or, --optimize-rpaths       Keep only the rpaths each binary needs and drop those outside the bundle" << std::endl;
+    std::cout << "  -st, --strip                 Strip local and debug symbols from the bundled dependencies" << std::endl;
+    std::cout << "  -oa, --output-archive        Build the bundle in memory and write it into this .zip or .tar archive only" << std::endl;
+    std::cout << "  -as, --archive-store         Store the files of a .zip archive without compressing them" << std::endl;
+    std::cout << "  -mf, --minimal-frameworks    Copy only the referenced version of frameworks, its Info.plist and --framework-resource paths" << std::endl;
+    std::cout << "  -fr, --framework-resource    Also copy this path, relative to the framework version directory, with minimal frameworks" << std::endl;
+    std::cout << "  -ar, --arch                  Thin bundled dependencies to these architectures (comma separated, e.g. arm64,x86_64)" << std::endl;
+    std::cout << "  -rd, --reproducible          Sort processing order, normalize times and permissions, and print a digest of the bundle" << std::endl;
+    std::cout << "  -cc, --cache-dir             Reuse dependencies patched by earlier runs from this directory, and add new ones" << std::endl;
+    std::cout << "  -cs, --cache-size            Size in MB the cache directory is trimmed to after a run (default: 1024)" << std::endl;
+    std::cout << "  -rs, --resume                Continue an interrupted run from the journal it left in the output directory" << std::endl;
+    std::cout << "  -rm, --resolve-map           File of '<library> <directory>' lines locating dependencies that can't be found" << std::endl;
+    std::cout << "  -ni, --non-interactive       Fail instead of asking for the directories of dependencies that can't be found" << std::endl;
+    std::cout << "  -td, --tool-dir              Run otool, install_name_tool and PlistBuddy from this directory (e.g. stand-ins)" << std::endl;
+    std::cout << "  -rp, --report                Instead of bundling, write a JSON report of sizes, load commands and estimated dyld work" << std::endl;
+    std::cout << "  -vf, --verify                Check the finished bundle and print a JSON report (exits 1 on issues)" << std::endl;
     std::cout << "  -n,  --just-print            Print the dependencies found (without copying into app bundle)" << std::endl;
     std::cout << "  -q,  --quiet                 Less verbose output" << std::endl;
     std::cout << "  -v,  --verbose               More verbose output" << std::endl;
@@ -36,6 +56,9 @@ void showHelp()
 
 int main(int argc, const char* argv[])
 {
+    BundleContext context;
+    BundleContext::Scope scope(context);
+
     // parse arguments
     for (int i=0; i<argc; i++) {
         if (strcmp(argv[i],"-a") == 0 || strcmp(argv[i],"--app") == 0) {
@@ -85,6 +108,81 @@ int main(int argc, const char* argv[])
             Settings::canCreateDir(true);
             continue;
         }
+        else if (strcmp(argv[i],"-or") == 0 || strcmp(argv[i],"--optimize-rpaths") == 0) {
+            Settings::optimizeRpaths(true);
+            continue;
+        }
+        else if (strcmp(argv[i],"-st") == 0 || strcmp(argv[i],"--strip") == 0) {
+            Settings::stripSymbols(true);
+            continue;
+        }
+        else if (strcmp(argv[i],"-oa") == 0 || strcmp(argv[i],"--output-archive") == 0) {
+            i++;
+            Settings::outputArchive(argv[i]);
+            continue;
+        }
+        else if (strcmp(argv[i],"-as") == 0 || strcmp(argv[i],"--archive-store") == 0) {
+            Settings::archiveStore(true);
+            continue;
+        }
+        else if (strcmp(argv[i],"-mf") == 0 || strcmp(argv[i],"--minimal-frameworks") == 0) {
+            Settings::minimalFrameworks(true);
+            continue;
+        }
+        else if (strcmp(argv[i],"-fr") == 0 || strcmp(argv[i],"--framework-resource") == 0) {
+            i++;
+            Settings::addFrameworkResource(argv[i]);
+            continue;
+        }
+        else if (strcmp(argv[i],"-ar") == 0 || strcmp(argv[i],"--arch") == 0) {
+            i++;
+            std::vector<std::string> archs;
+            tokenize(argv[i], ",", &archs);
+            for (auto& arch : archs)
+                Settings::addTargetArch(arch);
+            continue;
+        }
+        else if (strcmp(argv[i],"-rd") == 0 || strcmp(argv[i],"--reproducible") == 0) {
+            Settings::reproducible(true);
+            continue;
+        }
+        else if (strcmp(argv[i],"-cc") == 0 || strcmp(argv[i],"--cache-dir") == 0) {
+            i++;
+            Settings::cacheDir(argv[i]);
+            continue;
+        }
+        else if (strcmp(argv[i],"-cs") == 0 || strcmp(argv[i],"--cache-size") == 0) {
+            i++;
+            Settings::cacheSizeLimit(strtoull(argv[i], nullptr, 10) << 20);
+            continue;
+        }
+        else if (strcmp(argv[i],"-rs") == 0 || strcmp(argv[i],"--resume") == 0) {
+            Settings::resume(true);
+            continue;
+        }
+        else if (strcmp(argv[i],"-rm") == 0 || strcmp(argv[i],"--resolve-map") == 0) {
+            i++;
+            Settings::resolveMap(argv[i]);
+            continue;
+        }
+        else if (strcmp(argv[i],"-ni") == 0 || strcmp(argv[i],"--non-interactive") == 0) {
+            Settings::canPrompt(false);
+            continue;
+        }
+        else if (strcmp(argv[i],"-td") == 0 || strcmp(argv[i],"--tool-dir") == 0) {
+            i++;
+            Settings::toolDirectory(argv[i]);
+            continue;
+        }
+        else if (strcmp(argv[i],"-rp") == 0 || strcmp(argv[i],"--report") == 0) {
+            i++;
+            Settings::reportPath(argv[i]);
+            continue;
+        }
+        else if (strcmp(argv[i],"-vf") == 0 || strcmp(argv[i],"--verify") == 0) {
+            Settings::verifyOnly(true);
+            continue;
+        }
         else if (strcmp(argv[i],"-n") == 0 || strcmp(argv[i],"--just-print") == 0) {
             Settings::bundleLibs(false);
             continue;
@@ -122,13 +220,19 @@ int main(int argc, const char* argv[])
         exit(0);
     }
 
-    std::cout << "Collecting dependencies...\n";
-
-    const std::vector<std::string> files_to_fix = Settings::filesToFix();
-    for (const auto& file_to_fix : files_to_fix)
-        collectDependenciesRpaths(file_to_fix);
-    collectSubDependencies();
-    bundleDependencies();
+    try {
+        if (Settings::verifyOnly())
+            return verifyBundle() ? 0 : 1;
+        if (!Settings::reportPath().empty()) {
+            writeReport(Settings::reportPath());
+            return 0;
+        }
+        bundle();
+    }
+    catch (const BundleError& error) {
+        std::cerr << "\n\n/!\\ ERROR: " << error.what() << std::endl;
+        return 1;
+    }
 
     return 0;
 }